@@ -8,6 +8,7 @@
 #ifndef CONFIG_H__
 #define CONFIG_H__
 
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <sstream>
@@ -104,6 +105,20 @@ public:
     }
 };
 
+/**
+ * @brief 类型转换模板类特化(YAML String 转换成 bool)
+ * @details stringstream 只认 0/1，这里同时支持 YAML 里常见的 true/false 写法
+ */
+template <>
+class LexicalCast<std::string, bool> {
+public:
+    bool operator()(const std::string &v) {
+        std::string s = v;
+        std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+        return s == "true" || s == "yes" || s == "on" || s == "1";
+    }
+};
+
 /**
  * @brief 类型转换模板类偏特化(YAML String 转换成 std::vector<T>)
  */
@@ -9,15 +9,75 @@
 #define HTTP_SERVER_H__
 
 #include <string>
+#include <atomic>
+#include <memory>
 
 #include "tcp_server.h"
 #include "address.h"
 #include "socket.h"
+#include "noncopyable.h"
 #include "http/httpconn.h"
 #include "log.h"
 
 const int MAX_FD = 65536;
 
+/**
+ * @brief 以 fd 为下标的连接槽位表
+ * @details 启动时一次性分配 capacity 个按缓存行对齐的槽位，查找就是数组下标，
+ *          没有哈希也没有 rehash。槽位里的 HttpConn 在该 fd 第一次出现时创建，
+ *          之后随 fd 复用一直保留，稳定运行后 accept 路径上不再有内存分配。
+ *          槽位只由占用它的连接协程访问，不提供按 fd 查找的接口。每个槽位带一个
+ *          代数，占用和释放时各加一（奇数表示正在使用），释放时用占用时的代数
+ *          比较，fd 已经被新连接复用时不会误释放新连接的槽位。
+ */
+class HttpConnSlab : Noncopyable {
+public:
+    /**
+     * @brief 构造函数
+     * @param[in] capacity 槽位数量，即支持的最大 fd
+     */
+    HttpConnSlab(size_t capacity = MAX_FD);
+
+    /**
+     * @brief 析构函数
+     */
+    ~HttpConnSlab();
+
+    /**
+     * @brief 占用 fd 对应的槽位
+     * @param[in] fd 连接句柄
+     * @param[out] generation 本次占用的代数
+     * @return HttpConn* 槽位中的连接对象，fd 越界返回 nullptr
+     */
+    HttpConn *acquire(int fd, uint32_t &generation);
+
+    /**
+     * @brief 释放槽位，需要在关闭 fd 之前调用，保证 fd 被复用前槽位已经空闲
+     * @param[in] fd 连接句柄
+     * @param[in] generation 占用时拿到的代数
+     */
+    void release(int fd, uint32_t generation);
+
+    /**
+     * @brief 槽位数量
+     */
+    size_t capacity() const { return m_capacity; }
+
+private:
+    // 槽位，对齐到缓存行，避免相邻 fd 的连接在不同线程上产生伪共享
+    struct alignas(64) Slot {
+        // 槽位代数，奇数表示正在使用
+        std::atomic<uint32_t> generation{0};
+        // 连接对象，首次使用时创建，之后复用
+        std::unique_ptr<HttpConn> conn;
+    };
+
+    // 槽位数组
+    Slot *m_slots;
+    // 槽位数量
+    size_t m_capacity;
+};
+
 /**
  * @brief HTTP服务器类
  */
@@ -49,14 +109,15 @@ public:
     void handleClient(Socket::ptr client) override;
 
     /**
-     * @brief 开始接受连接
-     * @param[in] sock 服务器Socket
+     * @brief 停止服务，同时停止静态文件缓存的 inotify 监视
      */
-    void startAccept(Socket::ptr sock) override;
+    void stop() override;
 
 private:
     // 是否保持连接
     bool m_isKeepalive;
+    // 连接槽位表
+    HttpConnSlab m_conns;
 };
 
 #endif
@@ -187,6 +187,14 @@ public:
      */
     virtual bool listen(int backlog = SOMAXCONN);
 
+    /**
+     * @brief 开启 SO_REUSEPORT，需要在 bind 之前调用
+     * @details 多个开启了 SO_REUSEPORT 的 socket 可以绑定同一个地址，
+     *          由内核把新连接分散到各个监听 socket 上
+     * @return bool 是否成功
+     */
+    bool setReusePort();
+
     /**
      * @brief 接受连接
      * @return Socket::ptr
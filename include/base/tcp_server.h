@@ -48,6 +48,9 @@ public:
 
     /**
      * @brief 绑定地址数组
+     * @details 开启 server.reuse_port 时，每个地址为 accept_worker 的每个工作线程各绑定
+     *          一个 SO_REUSEPORT 的监听socket，由内核分发新连接，各线程只在本线程
+     *          accept 和处理自己的连接
      * @param[in] addrs 需要绑定的地址数组
      * @param[out] fails 绑定失败的地址
      * @return bool 是否绑定成功
@@ -111,6 +114,8 @@ public:
 protected:
     // 监听socket数组
     std::vector<Socket::ptr> m_socks;
+    // 每个监听socket的accept协程绑定的线程，-1 表示不绑定
+    std::vector<int> m_acceptThreads;
     // 新连接的socket工作的调度器
     IOManager *m_ioWorker;
     // 服务器socket接收连接的调度器
@@ -123,6 +128,8 @@ protected:
     std::string m_type;
     // 服务是否停止
     bool m_isStop;
+    // 是否为每个调度线程绑定一个 SO_REUSEPORT 的监听socket
+    bool m_reusePort;
 };
 
 #endif
@@ -3,13 +3,20 @@
 
 #include <memory>
 #include <vector>
-#include <set>
+#include <functional>
 
 #include "mutex.h"
 
 class TimerManager;
 
-class Timer : public std::enable_shared_from_this<Timer> {
+// 时间轮槽里的侵入式双向链表节点，每个槽有一个哨兵节点，
+// 挂入、摘除都不需要额外分配内存。
+struct TimerNode {
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+};
+
+class Timer : public std::enable_shared_from_this<Timer>, private TimerNode {
     friend class TimerManager;
 public:
     typedef std::shared_ptr<Timer> ptr;
@@ -31,15 +38,6 @@ private:
     Timer(uint64_t ms, std::function<void()> cb,
           bool recurring, TimerManager *manager);
 
-    // 直接用具体的执行时间作为参数进行构造
-    Timer(uint64_t next);
-
-    // 定时器比较仿函数, 因为这是给小根堆比较用的，
-    // 自然是lhs < rhs 时返回true
-    struct Comparator {
-        bool operator()(const Timer::ptr& lhs, const Timer::ptr& rhs) const;
-    };
-
 private:
     // 是否循环定时器
     bool m_recurring = false;
@@ -51,14 +49,20 @@ private:
     std::function<void()> m_cb;
     // 定时器管理器
     TimerManager *m_manager = nullptr;
+    // 挂在时间轮上时持有自己，保证槽里的裸指针有效，摘下时释放
+    Timer::ptr m_self;
 };
 
 // 定时器管理器
+// 定时器按到期时间挂在分层时间轮上(1ms 一格)：第 0 层 256 格，之后
+// 每层 64 格，每一格的跨度是下一层转一圈的时间，共 5 层覆盖 2^32ms。
+// 添加、取消、刷新都只是链表的挂入摘除，是 O(1) 的；时间推进到低层
+// 转完一圈时，把高层对应格子里的定时器重新分配到低层(cascade)。
 class TimerManager {
     friend class Timer;
 public:
-    // 读写锁类型
-    typedef RWMutex RWMutexType;
+    // 锁类型, 时间轮上的操作都很短，用普通互斥锁即可
+    typedef Mutex MutexType;
 
     TimerManager();
     virtual ~TimerManager();
@@ -78,6 +82,8 @@ public:
                         ,bool recurring = false);
 
     // 到最近一个定时器执行的时间间隔(毫秒)
+    // 超过第 0 层范围的定时器只能给出它所在格子开始 cascade 的时间，
+    // 这个值不会晚于真正的到期时间，到时再重新计算即可。
     uint64_t getNextTimer();
     // 获取需要执行的定时器的回调函数列表, cbs 回调函数数组
     void listExpiredCb(std::vector<std::function<void()> >& cbs);
@@ -88,9 +94,32 @@ protected:
     // 当有新的定时器插入到定时器的首部,执行该函数
     virtual void onTimerInsertedAtFront() = 0;
     // 将定时器添加到管理器中，被public成员中的addTimer调用
-    void addTimer(Timer::ptr val, RWMutexType::WriteLock& lock);
+    void addTimer(Timer::ptr val, MutexType::Lock& lock);
 
 private:
+    // 第 0 层格子数的位数
+    static const int ROOT_BITS = 8;
+    // 其余各层格子数的位数
+    static const int LEVEL_BITS = 6;
+    // 层数
+    static const int LEVELS = 5;
+    static const uint64_t ROOT_SIZE = 1ull << ROOT_BITS;
+    static const uint64_t LEVEL_SIZE = 1ull << LEVEL_BITS;
+
+    // 第 level 层每一格的跨度(位数)
+    static int LevelShift(int level) {
+        return level == 0 ? 0 : ROOT_BITS + (level - 1) * LEVEL_BITS;
+    }
+    // 第 level 层第 index 格的哨兵
+    TimerNode *slot(int level, uint64_t index);
+    // 按到期时间把定时器挂到对应的格子
+    void link(Timer *timer);
+    // 把定时器从所在的格子摘下
+    void unlink(Timer *timer);
+    // 把第 level 层第 index 格的定时器重新分配到低层, 返回 index
+    uint64_t cascade(int level, uint64_t index);
+    // 把一个格子里的定时器全部摘下放入 out
+    void drainSlot(TimerNode *head, std::vector<Timer::ptr>& out);
     // 检测服务器时间是否被调后了
     bool detectClockRollover(uint64_t now_ms);
     static uint64_t GetElapsed() {
@@ -100,15 +129,21 @@ private:
     }
 
 private:
-    RWMutexType m_mutex;
-    // 因为set里的元素总是排序过的，所以总是可以很方便地获取到
-    // 当前的最小定时器，至于怎么比较，就由Comparator类来决定。
-    std::set<Timer::ptr, Timer::Comparator> m_timers;
+    MutexType m_mutex;
+    // 时间轮, 第 0 层 ROOT_SIZE 格，其余每层 LEVEL_SIZE 格，依次排开
+    TimerNode m_wheel[ROOT_SIZE + (LEVELS - 1) * LEVEL_SIZE];
+    // 时间轮当前的刻度, 小于它的时间都已经处理过了
+    uint64_t m_currentTick = 0;
+    // 时间轮上的定时器个数
+    size_t m_count = 0;
+    // 空闲线程当前等待到的时间点，新定时器比它还早到期时需要
+    // 通知 IOManager 重新计算 epoll_wait 的超时
+    uint64_t m_nextExpire = ~0ull;
     // 是否触发onTimerInsertedAtFront函数，这是一个虚函数，
-    // 由IOManager继承时实现，当新的定时器插入到Timer集合的首
-    // 部时，TimerManager通过该方法来通知IOManager立刻更新当前
-    // 的epoll_wait超时，onTimerInsertedAtFront函数内部tick一下
-    // epoll_wait 就会立即退出，并重新设置超时时间。
+    // 由IOManager继承时实现，当新的定时器比空闲线程等待的时间
+    // 还早到期时，TimerManager通过该方法来通知IOManager立刻更新
+    // 当前的epoll_wait超时，onTimerInsertedAtFront函数内部tick
+    // 一下 epoll_wait 就会立即退出，并重新设置超时时间。
     bool m_tickled = false;
     // 上次执行时间
     uint64_t m_previouseTime = 0;
@@ -0,0 +1,47 @@
+/**
+ * @file context.h
+ * @brief 协程上下文切换
+ * @details x86-64 和 aarch64 上用汇编实现上下文切换，只保存调用约定里被调用者保存的
+ *          寄存器，不像 swapcontext 那样每次切换都要 rt_sigprocmask 进一次内核。其它
+ *          平台，或者编译时打开 FIBER_USE_UCONTEXT 选项，仍然使用 ucontext。
+ * @author zch
+ * @date 2026-10-16
+ */
+
+#ifndef CONTEXT_H__
+#define CONTEXT_H__
+
+#include <stddef.h>
+
+#if !defined(FIBER_USE_UCONTEXT) && !defined(__x86_64__) && !defined(__aarch64__)
+#define FIBER_USE_UCONTEXT
+#endif
+
+#ifdef FIBER_USE_UCONTEXT
+#include <ucontext.h>
+#else
+
+extern "C" {
+
+/**
+ * @brief 把被调用者保存的寄存器压到当前栈上，栈指针存入 *from_sp，再切换到 to_sp
+ *        指向的栈，弹出那里保存的寄存器后返回
+ * @param[out] from_sp 保存当前上下文的栈指针
+ * @param[in] to_sp 要切换到的上下文的栈指针
+ */
+void fiber_switch_context(void **from_sp, void *to_sp);
+
+}
+
+/**
+ * @brief 在一块新栈的顶部构造初始上下文，第一次切换过去时从 entry 开始执行
+ * @param[in] stack 栈的起始(低)地址
+ * @param[in] size 栈大小
+ * @param[in] entry 入口函数，不能返回
+ * @return void* 初始上下文的栈指针，作为 fiber_switch_context 的 to_sp
+ */
+void *fiber_make_context(void *stack, size_t size, void (*entry)());
+
+#endif
+
+#endif
@@ -10,13 +10,16 @@
 #ifndef FIBER_H__
 #define FIBER_H__
 
+#include <atomic>
 #include <functional>
 #include <memory>
-#include <ucontext.h>
 
+#include "context.h"
 #include "base/thread.h"
 #include "base/log.h"
 
+struct SharedStack;
+
 /**
  * @brief 协程类
  */
@@ -30,11 +33,13 @@ public:
     /**
      * @brief 构造函数
      * @param[in] cb 协程入口函数
-     * @param[in] stacksize 栈大小
+     * @param[in] stacksize 栈大小，使用共享栈时忽略
      * @param[in] run_in_scheduler 本协程是否参与调度器调度
+     * @param[in] shared_stack 是否运行在当前线程的共享栈上，共享栈没有开启时忽略
      @ @author zch
      */ 
-    Fiber(std::function<void()> cb, size_t stacksize = 0, bool run_in_scheduler = true);
+    Fiber(std::function<void()> cb, size_t stacksize = 0, bool run_in_scheduler = true,
+          bool shared_stack = false);
 
     /**
      * @brief 析构函数，线程的主协程析构时需要特殊处理，因为主协程没有分配栈和 cb
@@ -71,6 +76,23 @@ public:
 
     State getState() const { return m_state; }
 
+    uint32_t getStackSize() const { return m_stacksize; }
+
+    /**
+     * @brief 是否参与调度器调度，即 resume/yield 时和调度协程切换
+     */
+    bool isRunInScheduler() const { return m_runInScheduler; }
+
+    /**
+     * @brief 是否运行在共享栈上，共享栈协程只能在创建它的线程上 resume
+     */
+    bool isSharedStack() const { return m_sharedStack != nullptr; }
+
+    /**
+     * @brief 共享栈协程所属的线程 id，独立栈的协程返回 -1
+     */
+    int getThread() const { return m_thread; }
+
     /**
      * @brief 协程入口函数，所有协程都是从这里开始执行的
      @ @author zch
@@ -84,6 +106,18 @@ public:
      */
     static void SetThis(Fiber *f);
 
+    /**
+     * @brief 获取默认的协程栈大小，即配置项 fiber.stack_size
+     @ @author zch
+     */
+    static uint32_t GetDefaultStackSize();
+
+    /**
+     * @brief 是否开启了共享栈，即配置项 fiber.shared_stack，ucontext 实现不支持共享栈
+     @ @author zch
+     */
+    static bool SharedStackEnabled();
+
     /**
     * @brief 获取当前协程 id
     @ @author zch
@@ -98,19 +132,50 @@ private:
      */
     Fiber();
 
+    /**
+     * @brief 在协程栈上构造初始上下文，切换过来时从 MainFunc 开始执行
+     */
+    void initContext();
+
+    /**
+     * @brief 保存当前上下文到 from，切换到 to
+     * @return bool 是否成功
+     */
+    static bool SwapContext(Fiber *from, Fiber *to);
+
+    /**
+     * @brief resume 之前让本协程占用共享栈：把上一个占用者用到的部分拷出去，
+     *        再把本协程之前保存的部分拷回来
+     */
+    void switchSharedStack();
+
 private:
     uint64_t m_id = 0;
     // 协程栈大小
     uint32_t m_stacksize = 0;
-    State m_state = READY;
+    // 其它线程取任务时会读这个状态，挂起的协程要等上下文保存好之后才变回 READY
+    std::atomic<State> m_state{READY};
     // 协程上下文
+#ifdef FIBER_USE_UCONTEXT
     ucontext_t m_ctx;
+#else
+    // 切换出去时保存的栈指针
+    void *m_ctx = nullptr;
+#endif
     // 协程栈地址
     void *m_stack = nullptr;
     // 协程入口函数
     std::function<void()> m_cb;
     // 本协程是否参与调度器调度
     bool m_runInScheduler;
+    // 运行所在的共享栈，独立栈的协程为 nullptr
+    SharedStack *m_sharedStack = nullptr;
+    // 共享栈协程所属的线程
+    int m_thread = -1;
+    // 被挤出共享栈时保存栈内容的缓冲区
+    char *m_saveBuf = nullptr;
+    size_t m_saveSize = 0;
+    size_t m_saveCap = 0;
 };
 
 #endif
@@ -0,0 +1,347 @@
+/**
+ * @file fiber_sync.h
+ * @brief 协程同步原语
+ * @details Mutex/Semaphore 等线程锁在协程里等待时会把整个调度线程阻塞住。这里的锁、
+ *          信号量、条件变量和 Channel 在等不到时只挂起当前协程，释放方把等待的协程重新
+ *          交给它的调度器(仍回到原来绑定的线程)，调度线程可以继续跑别的协程。在非协程
+ *          的普通线程里调用时退化为用条件变量阻塞线程，所以后台线程也可以一起使用。
+ * @author zch
+ * @date 2026-10-16
+ */
+
+#ifndef FIBER_SYNC_H__
+#define FIBER_SYNC_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+#include "fiber.h"
+#include "base/mutex.h"
+#include "base/noncopyable.h"
+
+class Scheduler;
+
+/**
+ * @brief 一次等待
+ * @details 记录等待的协程和它的调度器，或者等待的普通线程。notify 和超时都通过 CAS
+ *          抢占状态，只有抢到的一方负责唤醒，被超时放弃的等待者留在队列里由下一次
+ *          notify 或者等待者自己清理掉
+ */
+class FiberWaiter : public std::enable_shared_from_this<FiberWaiter>, Noncopyable {
+public:
+    typedef std::shared_ptr<FiberWaiter> ptr;
+
+    /**
+     * @brief 构造函数，记录当前协程(或线程)
+     */
+    FiberWaiter();
+
+    /**
+     * @brief 唤醒等待者
+     * @return bool 等待者已经超时返回 false，调用方应该继续唤醒下一个
+     */
+    bool notify();
+
+    /**
+     * @brief 挂起当前协程(或线程)，直到 notify 或者超时
+     * @details 必须由 make_shared 创建，超时的定时器需要持有等待者
+     * @param[in] timeout_ms 超时时间(毫秒)，~0ull 表示不超时
+     * @return bool 被 notify 唤醒返回 true，超时返回 false
+     */
+    bool wait(uint64_t timeout_ms = ~0ull);
+
+private:
+    /**
+     * @brief 超时，和 notify 互斥
+     */
+    void timeout();
+
+    /**
+     * @brief 把等待的协程放回调度器，或者唤醒等待的线程
+     */
+    void wake();
+
+private:
+    enum State {
+        WAITING = 0,
+        NOTIFIED,
+        TIMEDOUT
+    };
+
+    std::atomic<int> m_state;
+    // 协程等待时的调度器、协程和绑定的线程
+    Scheduler *m_scheduler;
+    Fiber::ptr m_fiber;
+    int m_thread;
+    // 普通线程等待时使用
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_woken;
+};
+
+/**
+ * @brief 协程互斥锁
+ * @details 解锁时如果有等待者，锁直接交给队头的等待者，不会被刚到的协程插队
+ */
+class FiberMutex : Noncopyable {
+public:
+    typedef ScopedLockImpl<FiberMutex> Lock;
+
+    FiberMutex();
+
+    /**
+     * @brief 加锁，锁被占用时挂起当前协程
+     */
+    void lock();
+
+    /**
+     * @brief 尝试加锁，不等待
+     */
+    bool tryLock();
+
+    /**
+     * @brief 解锁，有等待者时把锁交给队头的等待者
+     */
+    void unlock();
+
+private:
+    // 保护 m_locked 和 m_waiters
+    Spinlock m_guard;
+    bool m_locked;
+    std::deque<FiberWaiter::ptr> m_waiters;
+};
+
+/**
+ * @brief 协程信号量
+ * @details notify 时有等待者则把这一个计数直接交给队头的等待者
+ */
+class FiberSemaphore : Noncopyable {
+public:
+    /**
+     * @brief 构造函数
+     * @param[in] count 初始计数
+     */
+    FiberSemaphore(uint32_t count = 0);
+
+    /**
+     * @brief 获取信号量，计数为 0 时挂起当前协程
+     */
+    void wait();
+
+    /**
+     * @brief 带超时的获取
+     * @param[in] timeout_ms 超时时间(毫秒)
+     * @return bool 超时返回 false
+     */
+    bool waitFor(uint64_t timeout_ms);
+
+    /**
+     * @brief 尝试获取，不等待
+     */
+    bool tryWait();
+
+    /**
+     * @brief 释放信号量
+     */
+    void notify();
+
+    /**
+     * @brief 当前可用的计数
+     */
+    uint32_t getCount();
+
+private:
+    // 保护 m_count 和 m_waiters
+    Spinlock m_guard;
+    uint32_t m_count;
+    std::deque<FiberWaiter::ptr> m_waiters;
+};
+
+/**
+ * @brief 协程条件变量，与 FiberMutex 配合使用
+ */
+class FiberCondition : Noncopyable {
+public:
+    /**
+     * @brief 释放锁并挂起当前协程，被唤醒后重新加锁
+     * @param[in] lock 已经加锁的 FiberMutex::Lock
+     */
+    void wait(FiberMutex::Lock &lock);
+
+    /**
+     * @brief 带超时的等待，返回前总会重新加锁
+     * @param[in] lock 已经加锁的 FiberMutex::Lock
+     * @param[in] timeout_ms 超时时间(毫秒)
+     * @return bool 超时返回 false
+     */
+    bool waitFor(FiberMutex::Lock &lock, uint64_t timeout_ms);
+
+    /**
+     * @brief 唤醒一个等待者
+     */
+    void notifyOne();
+
+    /**
+     * @brief 唤醒所有等待者
+     */
+    void notifyAll();
+
+private:
+    Spinlock m_guard;
+    std::deque<FiberWaiter::ptr> m_waiters;
+};
+
+/**
+ * @brief 有界的多生产者多消费者队列
+ * @details 队列满时 push 挂起生产者，队列空时 pop 挂起消费者。close 之后 push 失败，
+ *          pop 取完剩余的元素后返回 false，所有等待者都会被唤醒
+ */
+template <class T>
+class Channel : Noncopyable {
+public:
+    typedef std::shared_ptr<Channel> ptr;
+
+    /**
+     * @brief 构造函数
+     * @param[in] capacity 容量，至少为 1
+     */
+    Channel(size_t capacity)
+        : m_capacity(capacity ? capacity : 1)
+        , m_closed(false) {
+    }
+
+    /**
+     * @brief 放入元素，队列满时等待
+     * @return bool 已经 close 返回 false
+     */
+    bool push(const T &v) {
+        FiberMutex::Lock lock(m_mutex);
+        while(!m_closed && m_queue.size() >= m_capacity) {
+            m_notFull.wait(lock);
+        }
+        if(m_closed) {
+            return false;
+        }
+        m_queue.push_back(v);
+        m_notEmpty.notifyOne();
+        return true;
+    }
+
+    bool push(T &&v) {
+        FiberMutex::Lock lock(m_mutex);
+        while(!m_closed && m_queue.size() >= m_capacity) {
+            m_notFull.wait(lock);
+        }
+        if(m_closed) {
+            return false;
+        }
+        m_queue.push_back(std::move(v));
+        m_notEmpty.notifyOne();
+        return true;
+    }
+
+    /**
+     * @brief 尝试放入元素，队列满或已经 close 时返回 false
+     */
+    bool tryPush(const T &v) {
+        FiberMutex::Lock lock(m_mutex);
+        if(m_closed || m_queue.size() >= m_capacity) {
+            return false;
+        }
+        m_queue.push_back(v);
+        m_notEmpty.notifyOne();
+        return true;
+    }
+
+    /**
+     * @brief 取出元素，队列空时等待
+     * @param[out] v 取出的元素
+     * @return bool 已经 close 并且取空返回 false
+     */
+    bool pop(T &v) {
+        FiberMutex::Lock lock(m_mutex);
+        while(!m_closed && m_queue.empty()) {
+            m_notEmpty.wait(lock);
+        }
+        if(m_queue.empty()) {
+            return false;
+        }
+        v = std::move(m_queue.front());
+        m_queue.pop_front();
+        m_notFull.notifyOne();
+        return true;
+    }
+
+    /**
+     * @brief 带超时的取出
+     * @param[out] v 取出的元素
+     * @param[in] timeout_ms 超时时间(毫秒)
+     * @return bool 超时或者已经 close 并且取空返回 false
+     */
+    bool popFor(T &v, uint64_t timeout_ms) {
+        FiberMutex::Lock lock(m_mutex);
+        if(!m_closed && m_queue.empty()) {
+            // 被唤醒后元素可能已经被别的消费者取走，这里只等一次，不重复计时
+            m_notEmpty.waitFor(lock, timeout_ms);
+        }
+        if(m_queue.empty()) {
+            return false;
+        }
+        v = std::move(m_queue.front());
+        m_queue.pop_front();
+        m_notFull.notifyOne();
+        return true;
+    }
+
+    /**
+     * @brief 尝试取出元素，队列空时返回 false
+     */
+    bool tryPop(T &v) {
+        FiberMutex::Lock lock(m_mutex);
+        if(m_queue.empty()) {
+            return false;
+        }
+        v = std::move(m_queue.front());
+        m_queue.pop_front();
+        m_notFull.notifyOne();
+        return true;
+    }
+
+    /**
+     * @brief 关闭队列，唤醒所有等待者
+     */
+    void close() {
+        FiberMutex::Lock lock(m_mutex);
+        m_closed = true;
+        m_notFull.notifyAll();
+        m_notEmpty.notifyAll();
+    }
+
+    bool isClosed() {
+        FiberMutex::Lock lock(m_mutex);
+        return m_closed;
+    }
+
+    size_t size() {
+        FiberMutex::Lock lock(m_mutex);
+        return m_queue.size();
+    }
+
+    size_t getCapacity() const { return m_capacity; }
+
+private:
+    const size_t m_capacity;
+    bool m_closed;
+    std::deque<T> m_queue;
+    FiberMutex m_mutex;
+    // 队列不满，等待的是生产者
+    FiberCondition m_notFull;
+    // 队列不空，等待的是消费者
+    FiberCondition m_notEmpty;
+};
+
+#endif
@@ -1,7 +1,10 @@
 #ifndef IOMANAGER_H__
 #define IOMANAGER_H__
 
+#include <sys/socket.h>
+
 #include "scheduler.h"
+#include "uring.h"
 #include "base/timer.h"
 #include "base/mutex.h"
 #include "base/log.h"
@@ -21,13 +24,23 @@ public:
         WRITE = 0x4,
     };
 
+    // IO 多路复用后端
+    enum Backend {
+        /// epoll，默认
+        EPOLL = 0,
+        /// io_uring，内核不支持时自动退回 epoll
+        IO_URING = 1,
+    };
+
     /**
      * @brief Construct a new IOManager object
      * @param[in] threads 线程数
      * @param[in] use_caller 是否将当前线程也作为调度线程
      * @param[in] name 调度器名字
+     * @param[in] backend IO 多路复用后端
      */
-    IOManager(size_t threads = 1, bool use_caller = true, const std::string &name = "IOManager");
+    IOManager(size_t threads = 1, bool use_caller = true, const std::string &name = "IOManager",
+              Backend backend = EPOLL);
 
     ~IOManager();
 
@@ -66,12 +79,73 @@ public:
      */
     bool cancelAll(int fd);
 
+    /**
+     * @brief fd 关闭前调用，常驻注册模式下把 fd 从 epoll 中删除并清空记录的就绪状态
+     * @details 常驻注册模式下 fd 只在第一次 addEvent 时注册，之后不再 epoll_ctl，fd 号被
+     *          复用前必须调用这里，hook 的 close 会自动调用
+     * @param[in] fd 描述符
+     */
+    void delFd(int fd);
+
     /**
      * @brief 返回当前的IOManager
      * @return IOManager* 
      */
     static IOManager *GetThis();
 
+    /**
+     * @brief 获取实际使用的 IO 后端
+     * @return Backend 
+     */
+    Backend getBackend() const { return m_backend; }
+
+    /**
+     * @brief 是否为 epoll 常驻注册模式
+     * @details 由 server.epoll_persistent 开启：socket fd 在整个生命周期内只以
+     *          EPOLLIN|EPOLLOUT|EPOLLET|EPOLLRDHUP 注册一次，就绪但没有协程等待的事件
+     *          记录在 FdContext 中，之后 addEvent 发现已就绪直接唤醒，省去每次等待前后的
+     *          EPOLL_CTL_MOD/DEL
+     * @return bool 
+     */
+    bool isPersistent() const { return m_persistent; }
+
+    /**
+     * @brief 以完成方式接收数据(IORING_OP_RECV)，当前协程挂起直到完成或超时
+     * @details 以下 submitXxx 只在 IO_URING 后端下可用，否则返回 -1，errno 为 ENOTSUP；
+     *          同一个 fd 同一方向同时只能有一个操作，否则返回 -1，errno 为 EBUSY
+     * @param[in] fd 句柄
+     * @param[out] buf 缓冲区
+     * @param[in] len 缓冲区长度
+     * @param[in] flags recv 标志
+     * @param[in] timeout_ms 超时时间(毫秒)，-1 表示不超时，超时 errno 为 ETIMEDOUT
+     * @return ssize_t 同 recv
+     */
+    ssize_t submitRecv(int fd, void *buf, size_t len, int flags, uint64_t timeout_ms = -1);
+
+    /**
+     * @brief 以完成方式发送数据(IORING_OP_SEND)
+     * @return ssize_t 同 send
+     */
+    ssize_t submitSend(int fd, const void *buf, size_t len, int flags, uint64_t timeout_ms = -1);
+
+    /**
+     * @brief 以完成方式接收数据到 msghdr(IORING_OP_RECVMSG)，用于 readv/recvmsg
+     * @return ssize_t 同 recvmsg
+     */
+    ssize_t submitRecvmsg(int fd, msghdr *msg, int flags, uint64_t timeout_ms = -1);
+
+    /**
+     * @brief 以完成方式发送 msghdr 中的数据(IORING_OP_SENDMSG)，用于 writev/sendmsg
+     * @return ssize_t 同 sendmsg
+     */
+    ssize_t submitSendmsg(int fd, const msghdr *msg, int flags, uint64_t timeout_ms = -1);
+
+    /**
+     * @brief 以完成方式接受连接(IORING_OP_ACCEPT)
+     * @return int 同 accept4
+     */
+    int submitAccept(int fd, sockaddr *addr, socklen_t *addrlen, int flags, uint64_t timeout_ms = -1);
+
     /**
      * @brief 设置描述符为非阻塞状态
      * @param[in] fd 描述符
@@ -120,6 +194,49 @@ protected:
      */
     void contextResize(size_t size);
 
+private:
+    /**
+     * @brief epoll 后端的 idle
+     */
+    void idleEpoll();
+
+    /**
+     * @brief io_uring 后端的 idle，一次 io_uring_enter 同时提交本轮积攒的 sqe 并等待完成
+     */
+    void idleUring();
+
+    /**
+     * @brief 向 io_uring 提交一个 sqe
+     * @details 有空闲线程阻塞在 io_uring_enter 里，或者不是在本调度器的线程中提交时
+     *          立即提交；否则留到本线程下一次进入 idle 时和其它 sqe 一起批量提交
+     * @param[in] sqes sqe 数组
+     * @param[in] count sqe 个数
+     * @param[in] flush 是否必须立即提交
+     * @return bool 是否成功
+     */
+    bool submitSqe(const io_uring_sqe *sqes, unsigned count, bool flush = false);
+
+    /**
+     * @brief 提交一个完成式 IO 操作并挂起当前协程，完成后返回结果
+     * @param[in] fd 句柄
+     * @param[in] event 操作的方向，READ 或 WRITE
+     * @param[in] sqe 已经填好操作的 sqe，user_data 在这里设置
+     * @param[in] timeout_ms 超时时间(毫秒)，-1 表示不超时
+     * @return ssize_t 操作结果，失败返回 -1 并设置 errno
+     */
+    ssize_t submitOp(int fd, Event event, io_uring_sqe &sqe, uint64_t timeout_ms);
+
+    /**
+     * @brief 处理一个 io_uring 完成事件
+     * @param[in] cqe 完成事件
+     */
+    void onCompletion(const io_uring_cqe &cqe);
+
+    /**
+     * @brief 重新注册 tickle 管道的 POLL_ADD
+     */
+    void armTickle();
+
 private:
     // socket fd上下文类，每个socket fd都对应一个FdContext，
     // 包括fd的值，fd上的事件，以及回调函数
@@ -133,6 +250,30 @@ private:
             Fiber::ptr fiber;
             // 事件回调函数
             std::function<void()> cb;
+            // 唤醒时调度到的线程，-1 表示任意线程
+            int thread = -1;
+            // io_uring 后端每次注册递增，用来识别已经被删除的 POLL_ADD 迟到的完成事件
+            uint16_t seq = 0;
+        };
+
+        // io_uring 后端正在进行的完成式 IO 操作，保存在发起操作的协程栈上
+        struct IoOp {
+            // 操作所属的 fd 上下文
+            FdContext *fd_ctx = nullptr;
+            // 操作方向
+            Event event = NONE;
+            // 完成后调度协程的调度器
+            Scheduler *scheduler = nullptr;
+            // 等待完成的协程
+            Fiber::ptr fiber;
+            // 唤醒时调度到的线程
+            int thread = -1;
+            // 是否被 cancelEvent/cancelAll 主动取消
+            bool cancelled = false;
+            // 操作结果，同 cqe.res
+            int res = 0;
+            // IORING_OP_LINK_TIMEOUT 的超时时间，内核在提交时读取
+            __kernel_timespec timeout;
         };
 
         /**
@@ -160,17 +301,46 @@ private:
         EventContext read;
         // 写事件上下文
         EventContext write;
+        // io_uring 后端正在进行的读/写完成式操作
+        IoOp *readOp = nullptr;
+        IoOp *writeOp = nullptr;
         // 事件关联的句柄
         int fd = 0;
         // 该fd添加了哪些事件的回调函数，或者说该fd关心哪些事件
         Event events = NONE;
+        // 常驻注册模式下，已经就绪但还没有协程等待的事件
+        int ready = NONE;
+        // 常驻注册模式下，是否已经注册到 epoll
+        bool registered = false;
         // 事件的Mutex
         MutexType mutex;
     };
 
+    /**
+     * @brief io_uring 后端删除一个 fd 上已注册的 POLL_ADD，调用时需持有 fd_ctx->mutex
+     * @param[in] fd_ctx fd 上下文
+     * @param[in] event 事件
+     * @return bool 是否成功
+     */
+    bool removePoll(FdContext *fd_ctx, Event event);
+
+    /**
+     * @brief io_uring 后端取消一个 fd 上正在进行的完成式操作，调用时需持有 fd_ctx->mutex
+     * @param[in] fd_ctx fd 上下文
+     * @param[in] event 操作方向
+     * @return bool 是否有操作被取消
+     */
+    bool cancelOp(FdContext *fd_ctx, Event event);
+
 private:
+    // 实际使用的 IO 后端
+    Backend m_backend;
+    // 是否为 epoll 常驻注册模式
+    bool m_persistent = false;
     // epoll 文件句柄
     int m_epfd = 0;
+    // io_uring 后端的环形队列
+    std::unique_ptr<IoUring> m_uring;
     // pipe 文件句柄，fd[0]读端，fd[1]写端
     int m_tickleFds[2];
     // 当前等待执行的IO事件数量
@@ -2,7 +2,9 @@
 #define SCHEDULER_H__
 
 #include <functional>
+#include <deque>
 #include <list>
+#include <map>
 #include <memory>
 #include <string>
 
@@ -30,13 +32,11 @@ public:
      */
     template <class FiberOrCb>
     void schedule(FiberOrCb fc, int thread = -1) {
-        bool need_tickle = false;
-        {
-            MutexType::Lock lock(m_mutex);
-            need_tickle = scheduleNoLock(fc, thread);
+        ScheduleTask task(fc, thread);
+        if (!task.fiber && !task.cb) {
+            return;
         }
-
-        if (need_tickle) {
+        if (pushTask(task)) {
             tickle(); // 唤醒idle协程
         }
     }
@@ -53,6 +53,14 @@ public:
 
     const std::string &getName() const { return m_name; }
 
+    /**
+     * @brief 获取调度器创建的工作线程 id
+     * @details 不包含 use_caller 时的主线程，主线程只有在 stop() 之后才开始调度任务，
+     *          需要长期绑定在某个线程上的任务不应该放到主线程上。
+     * @return std::vector<int> 线程 id 数组，调度器未 start 时为空
+     */
+    std::vector<int> getWorkerThreadIds();
+
     /**
      * @brief Get the This object
      * @details 在执行调度任务时，还可以通过调度器的GetThis()方法获取到当前调度器， 
@@ -67,6 +75,14 @@ public:
      */
     static Fiber *GetMainFiber();
 
+    /**
+     * @brief 获取当前正在执行的任务所绑定的线程
+     * @details 绑定了线程的任务在 IO 未就绪 yield 后，唤醒时仍调度回同一个线程，
+     *          这样 SO_REUSEPORT 模式下每个线程接受的连接可以一直在本线程处理
+     * @return int 线程 id，-1 表示任务没有绑定线程
+     */
+    static int GetTaskThread();
+
     /**
      * @brief 启动调度器, 对调度器进行一些列的初始化（初始化线程池）。
      */
@@ -77,6 +93,16 @@ public:
      */
     void stop();
 
+    /**
+     * @brief 协程挂起等待唤醒(FiberWaiter)，重新加入调度之前调度器不会停止
+     */
+    void addParkedFiber() { ++m_parkedFiberCount; }
+
+    /**
+     * @brief 挂起的协程已经重新加入调度，在 schedule 之后调用
+     */
+    void removeParkedFiber();
+
 protected:
     /**
      * @brief 通知协程调度器有任务了
@@ -111,6 +137,13 @@ protected:
      */
     bool hasIdleThreads() { return m_idleThreadCount > 0; }
 
+    /**
+     * @brief 设置回调任务的协程是否使用共享栈
+     * @details 默认取配置项 fiber.shared_stack，IO 由内核异步写入协程栈上缓冲区的后端
+     *          (io_uring)不能使用共享栈
+     */
+    void setSharedStack(bool v) { m_sharedStack = v; }
+
 private:
     // 调度任务，协程/函数二选一，可指定在哪个线程上调度
     struct ScheduleTask {
@@ -140,23 +173,79 @@ private:
     };
 
     /**
-     * @brief 添加调度任务，无锁
-     * @tparam FiberOrCb 调度任务类型，可以是协程对象或函数指针
-     * @param[] fc 协程对象或指针
-     * @param[] thread 指定运行该任务的线程号，-1表示任意线程
+     * @brief 每个调度线程的任务队列
+     * @details tasks 是未指定线程的任务，本线程从队头取，空闲的线程可以从队头窃取
+     *          一半；mailbox 是指定在本线程执行的任务，只有本线程会取。计数用原子变量
+     *          保存，空闲检查时不需要加锁。
      */
-    template <class FiberOrCb>
-    bool scheduleNoLock(FiberOrCb fc, int thread) {
-        //在本来调度器中没有任务（停止状态），然后添加了一个任务后，
-        //要通知调度器开启了。如果调度器本来就有任务（运行状态），
-        //本来就运行状态，不需要通知它启动。
-        bool need_tickle = m_tasks.empty();
-        ScheduleTask task(fc, thread);
-        if (task.fiber || task.cb) {
-            m_tasks.push_back(task);
-        }
-        return need_tickle;
-    }
+    struct WorkQueue {
+        typedef Spinlock MutexType;
+
+        MutexType mutex;
+        std::deque<ScheduleTask> tasks;
+        std::atomic<size_t> taskCount = {0};
+
+        MutexType mailboxMutex;
+        std::deque<ScheduleTask> mailbox;
+        std::atomic<size_t> mailboxCount = {0};
+
+        // 本线程是否处于 idle
+        std::atomic<bool> idle = {false};
+    };
+
+    /**
+     * @brief 添加调度任务
+     * @details 指定了线程的任务放进该线程的 mailbox；调度线程自己添加的任务放进
+     *          本线程的队列；其它线程添加的任务放进全局队列
+     * @param[in] task 调度任务，调用后被移走
+     * @return bool 是否需要 tickle
+     */
+    bool pushTask(ScheduleTask &task);
+
+    /**
+     * @brief 为当前线程取一个任务
+     * @details 依次查看本线程的 mailbox、本线程的队列、全局队列，最后从其它线程窃取
+     * @param[out] task 取到的任务
+     * @return bool 是否取到
+     */
+    bool popTask(ScheduleTask &task);
+
+    /**
+     * @brief 从队列中取出第一个可以执行的任务，跳过仍处于 RUNNING 状态的协程
+     */
+    static bool TakeRunnable(std::deque<ScheduleTask> &queue, ScheduleTask &task);
+
+    /**
+     * @brief 从全局队列取一个任务，跳过指定给其它线程的任务
+     */
+    bool popGlobalTask(ScheduleTask &task);
+
+    /**
+     * @brief 从其它线程的队列窃取一半任务，第一个返回，其余放进本线程的队列
+     */
+    bool stealTask(ScheduleTask &task);
+
+    /**
+     * @brief 当前线程是否还有可以执行的任务，进入 idle 前再检查一次
+     */
+    bool hasWork();
+
+    /**
+     * @brief 是否有处于 idle 的线程的 mailbox 里有任务，需要继续 tickle 把它唤醒
+     */
+    bool hasIdleMail();
+
+    /**
+     * @brief 把执行完的协程放回本线程的协程池
+     * @param[in] fiber 刚刚 resume 返回的协程，放回池中时被移走
+     * @param[in] pool 本线程的协程池
+     */
+    void RecycleFiber(Fiber::ptr &fiber, std::vector<Fiber::ptr> &pool) const;
+
+    /**
+     * @brief 根据线程 id 找到该线程的任务队列，找不到返回 nullptr
+     */
+    WorkQueue *getWorkQueue(int thread);
 
 private:
     // 协程调度器名称
@@ -165,8 +254,14 @@ private:
     MutexType m_mutex;
     // 线程池
     std::vector<Thread::ptr> m_threads;
-    // 任务队列
+    // 全局任务队列，存放调度线程之外添加的任务
     std::list<ScheduleTask> m_tasks;
+    // 每个调度线程的任务队列，use_caller 时最后一个属于主线程
+    std::vector<std::unique_ptr<WorkQueue>> m_workQueues;
+    // 线程 id 到 m_workQueues 下标，只在构造和 start() 中写入
+    std::map<int, size_t> m_workerIndex;
+    // 所有队列中的任务总数
+    std::atomic<size_t> m_taskCount = {0};
     // 线程池的线程ID数组
     std::vector<int> m_threadIds;
     // 工作线程数量，不包含use_caller的主线程
@@ -175,6 +270,8 @@ private:
     std::atomic<size_t> m_activeThreadCount = {0};
     // idle线程数
     std::atomic<size_t> m_idleThreadCount = {0};
+    // 挂起等待唤醒的协程数，唤醒可能在挂起之前发生，计数会短暂地绕回
+    std::atomic<size_t> m_parkedFiberCount = {0};
     // 是否使用调度器所在线程作为调度协程
     bool m_useCaller;
     // use_caller为 true 时，调度协程指针
@@ -183,6 +280,10 @@ private:
     int m_rootThread = 0;
     // 是否正在停止
     bool m_stopping = false;
+    // 回调任务的协程是否使用共享栈
+    bool m_sharedStack = false;
+    // 每个调度线程最多缓存的执行完的回调协程数(fiber.task_pool_size)
+    size_t m_fiberPoolSize = 0;
 };
 
 #endif
@@ -0,0 +1,108 @@
+/**
+ * @file uring.h
+ * @brief io_uring 环形队列的封装
+ * @details 不依赖 liburing，直接使用 io_uring_setup/io_uring_enter 系统调用和 mmap
+ *          出来的 SQ/CQ 环形队列。提交和收割各用一把锁保护，多个调度线程可以共用
+ *          同一个 ring：提交只是把 sqe 写进 SQ，等到调用 flush() 或 wait() 时再一次性
+ *          交给内核，这样一轮调度里的多个请求只需要一次系统调用。
+ * @author zch
+ * @date 2026-10-16
+ */
+
+#ifndef URING_H__
+#define URING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+#include "base/mutex.h"
+#include "base/noncopyable.h"
+
+class IoUring : Noncopyable {
+public:
+    typedef Spinlock MutexType;
+
+    IoUring();
+
+    ~IoUring();
+
+    /**
+     * @brief 创建 ring 并映射 SQ/CQ
+     * @details 内核不支持 io_uring，或者缺少 IORING_FEAT_EXT_ARG(带超时等待) 时返回 false
+     * @param[in] entries SQ 大小，会被内核向上取整为 2 的幂
+     * @return bool 是否成功
+     */
+    bool init(unsigned entries);
+
+    /**
+     * @brief 是否已经成功初始化
+     */
+    bool isValid() const { return m_fd >= 0; }
+
+    /**
+     * @brief 把 sqe 放进 SQ
+     * @details 多个 sqe 会连续放入，可以用 IOSQE_IO_LINK 组成链。SQ 放不下时先把已有的
+     *          sqe 提交给内核
+     * @param[in] sqes 待提交的 sqe 数组
+     * @param[in] count sqe 个数
+     * @param[in] flush 是否立即调用 io_uring_enter 提交
+     * @return bool 是否成功
+     */
+    bool push(const io_uring_sqe *sqes, unsigned count, bool flush);
+
+    /**
+     * @brief 把 SQ 中还未提交的 sqe 全部交给内核，不等待完成
+     * @return int 提交的个数，失败返回 -1
+     */
+    int flush();
+
+    /**
+     * @brief 提交未提交的 sqe，并等待至少一个 cqe 或者超时
+     * @param[in] timeout_ms 超时时间(毫秒)
+     * @return int 成功返回 0，超时或被信号打断返回 -1 并设置 errno
+     */
+    int wait(uint64_t timeout_ms);
+
+    /**
+     * @brief 从 CQ 中取出已完成的 cqe
+     * @param[out] cqes 保存 cqe 的数组
+     * @param[in] max 最多取出的个数
+     * @return size_t 取出的个数
+     */
+    size_t reap(io_uring_cqe *cqes, size_t max);
+
+private:
+    /**
+     * @brief 调用 io_uring_enter 提交 SQ 中所有已发布的 sqe
+     */
+    int enter(unsigned min_complete, unsigned flags, void *arg, size_t argsz);
+
+private:
+    // ring 文件句柄
+    int m_fd;
+    // SQ 环形队列映射的内存与长度
+    void *m_sqRing;
+    size_t m_sqRingSize;
+    // CQ 环形队列映射的内存与长度，IORING_FEAT_SINGLE_MMAP 时与 SQ 相同
+    void *m_cqRing;
+    size_t m_cqRingSize;
+    // sqe 数组
+    io_uring_sqe *m_sqes;
+    // SQ 的 head/tail/mask/数组
+    unsigned *m_sqHead;
+    unsigned *m_sqTail;
+    unsigned m_sqMask;
+    unsigned m_sqEntries;
+    // CQ 的 head/tail/mask/数组
+    unsigned *m_cqHead;
+    unsigned *m_cqTail;
+    unsigned m_cqMask;
+    io_uring_cqe *m_cqes;
+    // 提交锁，保护 SQ 的 tail
+    MutexType m_sqMutex;
+    // 收割锁，保护 CQ 的 head
+    MutexType m_cqMutex;
+};
+
+#endif
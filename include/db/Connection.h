@@ -3,6 +3,7 @@
 // - 连接管理：连接建立（Connect）、析构时自动关闭（RAII）
 // - 数据写操作：执行增删改语句（Update）
 // - 数据读操作：执行查询并返回结果集指针（Query）
+// - 预处理语句：按 SQL 文本缓存在连接上，同一条 SQL 只在服务器上预处理一次（Prepare）
 // - 存活时间：配合连接池计算连接空闲时长（RefreshAliveTime / GetAliveTime）
 //
 // 设计要点：
@@ -11,6 +12,8 @@
 // - 编码设置：构造函数中设置连接编码为 UTF-8，确保中文等字符正确处理
 // - 结果集管理：Query 返回 MYSQL_RES*，使用方需在读取完数据后调用 mysql_free_result 释放
 // - 与连接池协作：aliveTime 用于池内回收策略（超时空闲连接）
+// - 协程友好：连接的 socket 登记到 FdManager，在 IOManager 的协程里执行 SQL 时，
+//   客户端库内部的 recv/send 走 hook，数据未就绪时通过 addEvent 挂起当前协程，不阻塞调度线程
 //
 
 #ifndef CONNECTION_H__
@@ -19,7 +22,9 @@
 #include <mysql/mysql.h>
 #include <chrono>
 #include <string>
+#include <unordered_map>
 
+#include "db/PreparedStatement.h"
 #include "base/log.h"
 
 class Connection {
@@ -70,6 +75,15 @@ public:
      */
     MYSQL_RES *Query(const std::string &sql);
 
+    /**
+     * @brief 获取预处理语句，按 SQL 文本缓存，同一条 SQL 在这条连接上只预处理一次
+     * @param[in] sql 带 ? 占位符的 SQL，应为固定文本，参数通过 Bind 传入
+     * @return    失败返回 nullptr（并打印错误日志）
+     *
+     * 使用注意：返回的语句属于这条连接，连接归还连接池后不要继续持有
+     */
+    PreparedStatement::ptr Prepare(const std::string &sql);
+
     /**
      * @brief 刷新连接的存活时间戳为当前时间
      * 调用方用完连接后，通过智能指针的自定义析构把连接
@@ -85,9 +99,20 @@ public:
      */
     long long GetAliveTime() const;
 
+    /**
+     * @brief 连接归还连接池前调用，把 socket 从当前 IOManager 中注销
+     * @details 常驻注册模式下 socket 等过一次事件后会一直留在 epoll 中，而空闲连接可能
+     *          在扫描线程里被关闭，那里的 close 不经过 hook，fd 复用时会读到旧的注册状态
+     */
+    void ReleaseEvents();
+
 private:
     // MySQL C API 的连接句柄；通过 mysql_init / mysql_real_connect 获得
     MYSQL *m_conn;
+    // 连接的 socket，未连接时为 -1
+    int m_fd;
+    // 预处理语句缓存，key 为 SQL 文本
+    std::unordered_map<std::string, PreparedStatement::ptr> m_stmts;
     // 最近一次活跃时间；用于连接池空闲连接的扫描与回收
     // 用来衡量这条连接在连接池里已经闲置了多久
     std::chrono::time_point<std::chrono::steady_clock> m_aliveTime;
@@ -2,31 +2,76 @@
 // 连接池用于复用 MySQL 连接，降低频繁创建/销毁连接的开销，并实现多线程下的高效数据库访问。
 // 主要能力：
 // - 单例访问：提供唯一的 ConnectionPool 实例（线程安全的静态局部初始化）
-// - 获取连接：阻塞等待空闲连接，返回带自定义析构的智能指针，析构时归还队列
-// - 生产连接：独立线程在连接不足时按需创建新连接（不超过最大值）
+// - 获取连接：等待空闲连接，返回带自定义析构的智能指针，析构时归还队列；在协程里等待时
+//   只挂起当前协程，不阻塞调度线程；等待有期限，超时返回空指针，由调用方快速失败
+// - 直接移交：归还的连接直接交给等待最久的调用方，不会被后来者插队，也不会惊醒所有等待者
+// - 统计：等待时间分布、使用中的连接数、没有空闲连接的次数、超时次数和建立连接失败的次数
+// - 分片：可以按调度线程把连接池分成多个分片，线程只从自己的分片取连接，本分片空了才去
+//   邻居分片偷，取连接的热路径上没有线程间的锁竞争
+// - 预热：启动时并发建立最小数量的连接，前 database.warmup_size 个建好就可以开始服务，
+//   其余的在后台继续建立，进度通过统计里的 warming 查看
+// - 生产连接：独立线程在连接不足时按需创建新连接（不超过最大值），建立失败时退避重试，
+//   建立失败的连接不会进入连接池
 // - 回收连接：独立线程定期扫描并回收超过最大空闲时间的连接，保持资源占用可控
 // - 配置加载：从 JSON 配置文件读取数据库与池参数
 //
 // 线程安全：
-// - 使用 std::mutex + std::condition_variable 保护连接队列与协调生产/消费
-// - m_connectionCount 记录当前创建的连接总数，配合队列与扫描维护池规模
+// - 每个分片用自己的 FiberMutex 保护连接队列，取连接的等待者在分片内按先后排队
+// - 分片的 count 记录分片创建的连接总数，配合队列与扫描维护分片规模
+// - 生产者线程用 FiberSemaphore 等待补充请求，扫描线程用 FiberCondition 定时等待
 //
 
 #ifndef CONNECTIONPOOL_H__
 #define CONNECTIONPOOL_H__
 
+#include <stdint.h>
+#include <deque>
 #include <memory>
 #include <queue>
-#include <mutex>
+#include <string>
+#include <vector>
 #include <atomic>
 #include <thread>
-#include <condition_variable>
 
 #include "db/Connection.h"
+#include "coroutine/fiber_sync.h"
 #include "base/noncopyable.h"
 
 class ConnectionPool : private Noncopyable {
 public:
+    // 等待时间分布的桶数
+    static const size_t WAIT_BUCKETS = 10;
+    // 每个桶的上限(毫秒，不含)，最后一个桶没有上限
+    static const uint64_t WAIT_BUCKET_LIMITS[WAIT_BUCKETS - 1];
+
+    /**
+     * @brief 连接池统计
+     */
+    struct Stats {
+        // 空闲、使用中、总连接数
+        size_t idle;
+        size_t inUse;
+        size_t total;
+        // 成功取到连接的次数
+        uint64_t acquired;
+        // 取连接时没有空闲连接、需要等待的次数
+        uint64_t exhausted;
+        // 等待超时、取连接失败的次数
+        uint64_t timeouts;
+        // 本分片为空、从其它分片取到连接的次数
+        uint64_t stolen;
+        // 建立连接失败的次数（预热和生产者）
+        uint64_t connectFailures;
+        // 分片数
+        size_t shards;
+        // 预热中还没有建立的连接数
+        size_t warming;
+        // 取连接的等待时间分布，按 WAIT_BUCKET_LIMITS 分桶
+        uint64_t waitHistogram[WAIT_BUCKETS];
+
+        std::string toString() const;
+    };
+
     /**
      * @brief 获取连接池单例
      * 说明：C++11 之后静态局部变量初始化是线程安全的
@@ -34,26 +79,41 @@ public:
     static ConnectionPool& GetConnectionPool();
     
     /**
-     * @brief 获取一个可用连接（阻塞式）
-     * - 当队列为空时，等待 m_connectionTimeout 时间；若超时仍为空则继续等待（重试）
+     * @brief 获取一个可用连接，最多等待配置的 database.timeout 毫秒
      * - 返回值为 shared_ptr，析构时通过自定义删除器归还连接到队列，并刷新活跃时间
+     * - 超时返回 nullptr
      */
     std::shared_ptr<Connection> GetConnection();
 
+    /**
+     * @brief 获取一个可用连接
+     * - 当队列为空时唤醒生产者并排队等待，在协程里调用时只挂起当前协程
+     * - 排在前面的等待者先拿到归还的连接
+     * @param[in] timeout_ms 最长等待时间(毫秒)，0 表示不等待，~0ull 表示一直等待
+     * @return 超时返回 nullptr
+     */
+    std::shared_ptr<Connection> GetConnection(uint64_t timeout_ms);
+
+    /**
+     * @brief 获取统计信息
+     */
+    Stats GetStats();
+
     ~ConnectionPool();
 
 private:
     /**
      * @brief 构造函数
-     * - 加载配置，初始化最小数量的连接
+     * - 加载配置，并发预热最小数量的连接，前 m_warmupSize 个建好后返回
      * - 启动生产者线程与扫描回收线程（均为守护线程）
      */
     ConnectionPool();
 
     /**
      * @brief 连接生产者任务（独立线程）
-     * - 当队列大小小于 m_minSize 且总连接数未达到 m_maxSize 时创建新连接
-     * - 与消费者通过条件变量协作，避免忙等
+     * - 分片的空闲连接少于 m_shardMinSize 或者有等待者，并且分片连接数未达到 m_shardMaxSize 时创建新连接
+     * - 创建连接时不持有锁，没有需要补充的分片时等待补充请求，避免忙等
+     * - 建立连接失败时退还占位，等待一段时间后重试，连续失败时等待时间加倍
      */
     void ProduceConnectionTask();
 
@@ -67,10 +127,75 @@ private:
     void ScannerConnectionTask();
 
     /**
-     * @brief 创建并入队一个新连接
-     * - 连接成功后刷新活跃时间并推入队列，增加 m_connectionCount
+     * @brief 创建一个新连接并刷新活跃时间，不入队
+     * @return 建立连接失败时返回 nullptr，并计入 m_connectFailures
+     */
+    Connection *CreateConnection();
+
+    /**
+     * @brief 分片
+     */
+    struct Shard;
+
+    /**
+     * @brief 取连接的等待者，GetConnection 在堆上创建，出队和移交连接都在所在分片的锁内完成
+     */
+    struct AcquireWaiter {
+        typedef std::shared_ptr<AcquireWaiter> ptr;
+        FiberWaiter::ptr waiter;
+        Connection *conn;
+        // 交过来的连接所属的分片
+        size_t shard;
+    };
+
+    /**
+     * @brief 当前线程使用的分片，线程第一次取连接时轮流分配
+     */
+    size_t GetShardIndex();
+
+    /**
+     * @brief 本分片为空时从其它分片取一个空闲连接，只 tryLock，不等待繁忙的分片
+     * @param[in] self 当前线程的分片
+     * @param[out] shard 取到的连接所属的分片
      */
-    void AddConnection();
+    Connection *StealConnection(size_t self, size_t &shard);
+
+    /**
+     * @brief 归还连接，由 GetConnection 返回的智能指针析构时调用
+     * @param[in] conn 连接
+     * @param[in] shard 连接所属的分片
+     */
+    void ReleaseConnection(Connection *conn, size_t shard);
+
+    /**
+     * @brief 把连接交给等待最久的等待者，本分片没有等待者时交给其它分片的等待者，
+     *        都没有时放回所属分片的队列
+     * @param[in] conn 连接
+     * @param[in] shard 连接所属的分片
+     */
+    void PutConnection(Connection *conn, size_t shard);
+
+    /**
+     * @brief 把连接交给 s 上等待最久的等待者，调用时需持有 s->mtx
+     * @return bool 没有等待者(或者都已经超时)返回 false
+     */
+    bool HandOff(Shard *s, Connection *conn, size_t shard);
+
+    /**
+     * @brief 用归还时调用 ReleaseConnection 的智能指针包装连接
+     */
+    std::shared_ptr<Connection> WrapConnection(Connection *conn, size_t shard);
+
+    /**
+     * @brief 唤醒生产者补充连接
+     */
+    void RequestProduce();
+
+    /**
+     * @brief 预热任务，领取预热名额逐个建立连接放入对应的分片，名额领完退出
+     * @details 在 IOManager 里时同时调度 m_warmupConcurrency 个，连接时只挂起所在协程
+     */
+    void WarmUpTask();
 
 private:
     // 数据库连接信息
@@ -84,17 +209,37 @@ private:
     size_t m_minSize;             // 最小连接数量（保持的基础容量，生产者维持不低于该值）
     size_t m_maxSize;             // 最大连接数量（连接总数上限）
     size_t m_maxIdleTime;         // 最大空闲时间（秒，扫描线程的休眠周期与阈值依据）
-    size_t m_connectionTimeout;   // 获取连接的阻塞等待时长（微秒）
-
-    // 存储连接的队列（原始指针）；归还时入队，回收/析构时逐一删除
-    std::queue<Connection *> m_connectionQueue;
-    // 连接队列的并发保护
-    std::mutex m_mtx;
-    // 当前创建的连接总数（随创建/回收变化）
-    std::atomic_int m_connectionCount;
-    // 条件变量：用于连接生产与消费线程的通信协调
-    std::condition_variable m_cv;
-    
+    size_t m_connectionTimeout;   // 获取连接的最长等待时间（毫秒）
+    size_t m_shardMinSize;        // 每个分片的最小连接数量
+    size_t m_shardMaxSize;        // 每个分片的最大连接数量
+    size_t m_warmupSize;          // 预热时建好多少个连接后开始服务
+    size_t m_warmupConcurrency;   // 预热时同时建立的连接数
+
+    // 分片，不分片时只有一个
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    // 下一个线程分到的分片
+    std::atomic<size_t> m_nextShard;
+    // 所有分片上的等待者总数，为 0 时归还连接不用去看其它分片
+    std::atomic_int m_waiterCount;
+
+    // 预热：下一个领取的名额、还没处理完的名额数、成功建好的连接数
+    std::atomic<size_t> m_warmupNext;
+    std::atomic<size_t> m_warmupPending;
+    std::atomic<size_t> m_warmupReady;
+    // 预热开始时间(毫秒)
+    uint64_t m_warmupBegin;
+    // 建好 m_warmupSize 个连接或者名额都处理完时通知构造函数返回
+    FiberSemaphore m_warmupSem;
+    // 建立连接失败的次数
+    std::atomic<uint64_t> m_connectFailures;
+
+    // 生产者等待补充请求；m_produceRequested 保证请求没被处理之前只 notify 一次
+    FiberSemaphore m_produceSem;
+    std::atomic_bool m_produceRequested;
+    // 扫描线程的定时等待和生产者的失败退避，析构时唤醒
+    FiberMutex m_mtx;
+    FiberCondition m_scanCond;
+
     // 线程控制
     std::atomic_bool m_isShutdown;
     std::thread m_produceThread;
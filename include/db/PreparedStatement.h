@@ -0,0 +1,142 @@
+// 说明：
+// 本类封装 MySQL 的预处理语句（mysql_stmt_* 二进制协议），负责：
+// - 预处理：SQL 只在服务器上解析、规划一次，之后每次执行只传参数
+// - 参数绑定：参数以 ? 占位，值通过 MYSQL_BIND 按二进制协议发送，不做字符串拼接，没有注入问题
+// - 结果读取：执行后把结果集缓存到客户端，按列的最大长度准备缓冲区，逐行取出
+//
+// 设计要点：
+// - 由 Connection::Prepare 创建并按 SQL 文本缓存在连接上，生命周期不超过所属连接；
+//   连接归还连接池后不要继续持有
+// - 与 Connection 一样不保证跨线程安全，同一时刻只能有一个使用方
+// - 所有列都按字符串取出，由服务器负责类型转换
+//
+
+#ifndef PREPAREDSTATEMENT_H__
+#define PREPAREDSTATEMENT_H__
+
+#include <mysql/mysql.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "base/noncopyable.h"
+
+class PreparedStatement : private Noncopyable {
+public:
+    typedef std::shared_ptr<PreparedStatement> ptr;
+
+    /**
+     * @brief 在连接上预处理一条 SQL
+     * @param[in] conn MySQL 连接句柄
+     * @param[in] sql 带 ? 占位符的 SQL
+     * @return 失败返回 nullptr（并打印错误日志）
+     */
+    static ptr Create(MYSQL *conn, const std::string &sql);
+
+    ~PreparedStatement();
+
+    /**
+     * @brief 绑定字符串参数，值会被复制，调用后可以释放 v
+     * @param[in] idx 参数下标，从 0 开始
+     * @param[in] v 参数值
+     * @return 下标越界返回 false
+     */
+    bool BindString(size_t idx, const std::string &v);
+
+    /**
+     * @brief 绑定整数参数
+     * @param[in] idx 参数下标，从 0 开始
+     * @param[in] v 参数值
+     */
+    bool BindInt64(size_t idx, int64_t v);
+
+    /**
+     * @brief 绑定 NULL 参数
+     * @param[in] idx 参数下标，从 0 开始
+     */
+    bool BindNull(size_t idx);
+
+    /**
+     * @brief 执行写操作（INSERT/UPDATE/DELETE 等）
+     * @return 成功返回 true，失败返回 false（并打印错误日志）
+     */
+    bool Execute();
+
+    /**
+     * @brief 执行查询，并把结果集缓存到客户端
+     * @return 成功返回 true，之后用 Fetch 逐行读取
+     */
+    bool Query();
+
+    /**
+     * @brief 取下一行
+     * @return 没有更多行或者出错返回 false
+     */
+    bool Fetch();
+
+    /**
+     * @brief 当前行第 idx 列的值，NULL 返回空字符串
+     */
+    std::string GetString(size_t idx) const;
+
+    /**
+     * @brief 当前行第 idx 列是否为 NULL
+     */
+    bool IsNull(size_t idx) const;
+
+    /**
+     * @brief 上一次 Execute 影响的行数
+     */
+    uint64_t GetAffectedRows();
+
+    /**
+     * @brief 上一次失败的错误码，比如主键、唯一索引冲突为 ER_DUP_ENTRY(1062)
+     */
+    unsigned int GetErrno();
+
+    /**
+     * @brief 参数个数
+     */
+    size_t GetParamCount() const { return m_params.size(); }
+
+    /**
+     * @brief 结果集的列数，不返回结果集的语句为 0
+     */
+    size_t GetFieldCount() const { return m_results.size(); }
+
+    const std::string &GetSql() const { return m_sql; }
+
+private:
+    // MYSQL_BIND::is_null 等布尔字段在 MySQL 8 的头文件里是 bool，在 MySQL 5.7 和
+    // MariaDB Connector/C 里是 my_bool(char)，直接取字段本身的类型，两边都能编译
+    typedef std::remove_pointer<decltype(MYSQL_BIND::is_null)>::type BindBool;
+
+    PreparedStatement(MYSQL_STMT *stmt, const std::string &sql);
+
+    /**
+     * @brief 绑定参数并执行
+     */
+    bool DoExecute();
+
+private:
+    MYSQL_STMT *m_stmt;
+    std::string m_sql;
+    // 结果集的列信息，不返回结果集的语句为 nullptr
+    MYSQL_RES *m_meta;
+
+    // 参数绑定，m_paramStrs/m_paramInts/m_paramLens 保存绑定值，Bind 时不会再扩容
+    std::vector<MYSQL_BIND> m_params;
+    std::vector<std::string> m_paramStrs;
+    std::vector<int64_t> m_paramInts;
+    std::vector<unsigned long> m_paramLens;
+
+    // 结果绑定，每列一个缓冲区，按结果集中该列的最大长度扩容
+    std::vector<MYSQL_BIND> m_results;
+    std::vector<std::vector<char>> m_buffers;
+    std::vector<unsigned long> m_lengths;
+    std::unique_ptr<BindBool[]> m_nulls;
+};
+
+#endif
@@ -0,0 +1,116 @@
+// 说明：
+// 注册的批量写入（group commit）：注册请求先排队，凑满一批或者等待窗口到期后，
+// 用一个事务写入整批用户，一次提交的开销由一批请求分摊：
+// - 查重：批内重名的只保留第一个；可能已存在的用户名用 SELECT ... IN (...) FOR UPDATE 查出，
+//   Bloom 过滤器（UserCache）判定一定不存在的用户名不参与查询
+// - 写入：剩下的用户用多行 INSERT 写入，与查重在同一个事务里提交；批量 SQL 只按 1/4/16/32
+//   几档行数生成，每条连接上缓存的预处理语句数量有上限
+// - 回退：多行 INSERT 或者提交失败时（比如其它实例同时注册了同名用户）回滚，逐条重新插入，
+//   每个请求仍能拿到自己的结果
+// - 唤醒：写完后逐个唤醒等待的协程，各自返回成功、重名或失败
+//
+// 使用注意：
+// - 需要在 IOManager 的协程里调用 Register，等待期间只挂起当前协程；不在 IOManager 里或者
+//   批大小配置为 1 时在调用方直接写入，不做合并
+// - 调用方在 Register 期间不应持有连接池的连接，批量写入会自己从连接池取连接
+//
+
+#ifndef REGISTERBATCHER_H__
+#define REGISTERBATCHER_H__
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "coroutine/fiber_sync.h"
+#include "db/Connection.h"
+#include "base/mutex.h"
+#include "base/noncopyable.h"
+#include "base/singleton.h"
+#include "base/timer.h"
+
+class RegisterBatcher : private Noncopyable {
+public:
+    typedef Mutex MutexType;
+
+    /**
+     * @brief 注册结果
+     */
+    enum Result {
+        // 注册成功
+        SUCCESS = 0,
+        // 用户名已被占用
+        DUPLICATE,
+        // 写入失败
+        FAILED,
+        // 数据库繁忙，取不到连接
+        UNAVAILABLE
+    };
+
+    RegisterBatcher();
+
+    /**
+     * @brief 注册用户，等到所在的批写入完成后返回
+     * @param[in] name 用户名
+     * @param[in] pwd 密码
+     */
+    Result Register(const std::string &name, const std::string &pwd);
+
+private:
+    /**
+     * @brief 一个排队的注册请求，由 Register 和排队、写入它的批共同持有
+     */
+    struct Request {
+        typedef std::shared_ptr<Request> ptr;
+        std::string name;
+        std::string password;
+        Result result;
+        FiberWaiter::ptr waiter;
+    };
+
+    /**
+     * @brief 等待窗口到期，写入当前排队的请求
+     */
+    void OnTimer();
+
+    /**
+     * @brief 写入一批请求
+     * @param[in] batch 请求
+     * @param[in] notify 写完后是否唤醒请求的等待者，调用方直接写入时为 false
+     */
+    void Commit(std::vector<Request::ptr> batch, bool notify);
+
+    /**
+     * @brief 在事务里查重并用多行 INSERT 写入，成功时设置每个请求的结果
+     * @param[in,out] rows 批内已经去重的请求，返回 false 时只留下需要逐条插入的请求
+     * @return 需要回退到逐条插入时返回 false
+     */
+    bool InsertBatch(Connection *conn, std::vector<Request::ptr> &rows);
+
+    /**
+     * @brief 查重之后写入失败，rows 中的请求先判定为重名，再换成 inserts 中需要逐条插入的请求
+     */
+    static void KeepInserts(std::vector<Request::ptr> &rows, std::vector<Request::ptr> &inserts);
+
+    /**
+     * @brief 逐条插入，根据错误码区分重名和失败
+     */
+    void InsertOneByOne(Connection *conn, std::vector<Request::ptr> &rows);
+
+private:
+    // 一批最多的请求数
+    size_t m_maxBatch;
+    // 收集一批的等待窗口(毫秒)
+    uint64_t m_window;
+
+    MutexType m_mutex;
+    // 排队中的请求
+    std::vector<Request::ptr> m_pending;
+    // 当前批的窗口定时器
+    Timer::ptr m_timer;
+};
+
+typedef Singleton<RegisterBatcher> RegisterBatcherMgr;
+
+#endif
@@ -0,0 +1,172 @@
+// 说明：
+// 用户表（user）前面的进程内缓存，登录、注册先查缓存，命中时不访问数据库：
+// - 正向条目：数据库中存在的用户及其密码，登录时直接比对密码，注册时直接判定用户名已被占用
+// - 负向条目：数据库中不存在的用户名，反复用不存在的用户登录不会每次都查库
+// - Bloom 过滤器：启动后在后台加载所有用户名，注册时过滤器判定不存在的用户名一定没被占用，
+//   跳过查重的 SELECT 直接 INSERT；加载完成前总是判定“可能存在”
+//
+// 设计要点：
+// - 分片：按用户名哈希分成多个分片，每个分片一把锁、一个 LRU 链表，总条目数有上限
+// - 过期：条目按 TTL 过期，在 IOManager 里时通过 TimerManager 的定时器删除，不在时查询时检查
+// - 失效：注册成功后删除该用户名的条目（负向条目不再有效），并加入 Bloom 过滤器
+// - 多实例：其它实例注册、修改的用户在 TTL 内可能看不到，TTL 决定了可以接受的不一致时间
+//
+
+#ifndef USERCACHE_H__
+#define USERCACHE_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "base/mutex.h"
+#include "base/noncopyable.h"
+#include "base/singleton.h"
+#include "base/timer.h"
+
+class UserCache : private Noncopyable {
+public:
+    typedef Mutex MutexType;
+
+    /**
+     * @brief 查询结果
+     */
+    enum LookupResult {
+        // 缓存中没有，需要查数据库
+        MISS = 0,
+        // 用户存在
+        FOUND,
+        // 用户不存在
+        NOT_FOUND
+    };
+
+    UserCache();
+
+    /**
+     * @brief 取消所有条目的过期定时器，定时器的回调绑定了 this
+     */
+    ~UserCache();
+
+    /**
+     * @brief 查询用户
+     * @param[in] name 用户名
+     * @param[out] password FOUND 时为用户的密码
+     */
+    LookupResult Lookup(const std::string &name, std::string &password);
+
+    /**
+     * @brief 缓存数据库中查到的用户
+     */
+    void PutUser(const std::string &name, const std::string &password);
+
+    /**
+     * @brief 缓存数据库中不存在的用户名
+     */
+    void PutMissing(const std::string &name);
+
+    /**
+     * @brief 注册成功，删除该用户名的条目并加入 Bloom 过滤器
+     */
+    void OnRegistered(const std::string &name);
+
+    /**
+     * @brief 用户名是否可能已被占用
+     * @return 返回 false 时一定没被占用；Bloom 过滤器未启用或者没加载完时总是返回 true
+     */
+    bool MayExist(const std::string &name);
+
+    /**
+     * @brief 从数据库加载所有用户名到 Bloom 过滤器，加载完成后 MayExist 才会返回 false
+     * @details 需要在 IOManager 的协程里调用，查询走 hook，不阻塞调度线程
+     * @return 加载失败返回 false
+     */
+    bool LoadBloom();
+
+    /**
+     * @brief 是否启用了缓存
+     */
+    bool IsEnabled() const { return m_enabled; }
+
+    /**
+     * @brief 是否启用了 Bloom 过滤器
+     */
+    bool IsBloomEnabled() const { return !m_bloom.empty(); }
+
+private:
+    /**
+     * @brief 缓存条目
+     */
+    struct Entry {
+        // 用户是否存在，不存在时 password 为空
+        bool exists;
+        std::string password;
+        // 过期时间(毫秒)
+        uint64_t expire;
+        // 在 LRU 链表中的位置
+        std::list<std::string>::iterator lru;
+        // 过期定时器，不在 IOManager 里时为空
+        Timer::ptr timer;
+    };
+
+    /**
+     * @brief 分片，最近使用的用户名在 LRU 链表的头部
+     */
+    struct Shard {
+        MutexType mutex;
+        std::unordered_map<std::string, Entry> entries;
+        std::list<std::string> lru;
+    };
+
+    /**
+     * @brief 写入条目，分片满了时淘汰最久没有使用的条目
+     */
+    void Put(const std::string &name, bool exists, const std::string &password, uint64_t ttl);
+
+    /**
+     * @brief 定时器到期时删除条目，条目已经被刷新过时不删除
+     */
+    void Expire(size_t shard, const std::string &name, uint64_t expire);
+
+    /**
+     * @brief 删除条目，调用时需持有分片的锁
+     */
+    static void Erase(Shard &shard, std::unordered_map<std::string, Entry>::iterator it);
+
+    /**
+     * @brief 用户名所在的分片
+     */
+    size_t GetShardIndex(const std::string &name) const;
+
+    /**
+     * @brief 把用户名加入 Bloom 过滤器
+     */
+    void BloomAdd(const std::string &name);
+
+    /**
+     * @brief 用户名在 Bloom 过滤器中是否可能存在
+     */
+    bool BloomTest(const std::string &name) const;
+
+private:
+    bool m_enabled;
+    // 每个分片的条目上限
+    size_t m_shardCapacity;
+    // 正向、负向条目的存活时间(毫秒)
+    uint64_t m_ttl;
+    uint64_t m_negativeTtl;
+    std::vector<std::unique_ptr<Shard>> m_shards;
+
+    // Bloom 过滤器的位图和哈希函数个数，位图为空表示未启用
+    std::vector<std::atomic<uint64_t>> m_bloom;
+    size_t m_bloomHashes;
+    // 所有用户名是否已经加载到 Bloom 过滤器
+    std::atomic_bool m_bloomReady;
+};
+
+typedef Singleton<UserCache> UserCacheMgr;
+
+#endif
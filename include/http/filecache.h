@@ -0,0 +1,165 @@
+// 说明：
+// 资源目录下静态文件的进程内缓存，命中时不再 stat/open/mmap，直接用缓存的文件内容和
+// 提前生成好的响应头回复：
+// - 条目：文件内容、MIME 类型、200 的完整响应头（保持连接和不保持连接各一份）、mtime 和大小
+// - 分片：按路径哈希分成多个分片，每个分片一把读写锁，命中只加读锁
+// - 容量：缓存的总字节数有上限，超过时按 CLOCK 淘汰（命中时只设置引用位，不用加写锁调整链表）；
+//   大于 file_cache.max_file_size 的文件不缓存
+// - 失效：在 IOManager 里 Init 时用 inotify 监视资源目录（包括子目录），文件修改、删除、移动时
+//   删除对应条目；inotify 不可用时每次命中用 stat 比较 mtime 和大小
+//
+// 使用注意：
+// - 路径是请求路径（如 /index.html），先规范化（合并多余的 / 和 /./），含有 .. 的路径不缓存
+// - Get 返回的条目是只读的，失效后仍然可以继续使用，直到最后一个引用释放
+//
+
+#ifndef HTTP_FILECACHE_H
+#define HTTP_FILECACHE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "base/mutex.h"
+#include "base/noncopyable.h"
+#include "base/singleton.h"
+
+class IOManager;
+
+class FileCache : private Noncopyable {
+public:
+    typedef RWMutex RWMutexType;
+
+    /**
+     * @brief 缓存的文件
+     */
+    struct Entry {
+        typedef std::shared_ptr<Entry> ptr;
+
+        // 文件内容
+        std::string content;
+        // MIME 类型
+        std::string type;
+        // 200 的完整响应头（状态行 + 响应头 + 空行），下标为是否保持连接
+        std::string headers[2];
+        // 加载时文件的修改时间和大小
+        struct timespec mtime;
+        off_t size;
+        // CLOCK 淘汰的引用位，命中时设置
+        std::atomic_bool referenced;
+    };
+
+    FileCache();
+    ~FileCache();
+
+    /**
+     * @brief 设置资源目录，在 IOManager 里调用时开始用 inotify 监视目录
+     * @param[in] root 资源目录
+     */
+    void Init(const std::string& root);
+
+    /**
+     * @brief 停止 inotify 监视，之后命中时用 stat 检查
+     * @details 注册着的 inotify 读事件会让 IOManager 一直不能停止，停止前调用，可以在任意线程调用
+     */
+    void Unwatch();
+
+    /**
+     * @brief 查询文件，没缓存时加载
+     * @param[in] path 请求路径，如 /index.html
+     * @return 文件不存在、不是普通文件、没有读权限、太大或者缓存未启用时返回 nullptr
+     */
+    Entry::ptr Get(const std::string& path);
+
+    /**
+     * @brief 删除一个路径的条目
+     */
+    void Invalidate(const std::string& path);
+
+    /**
+     * @brief 删除所有条目
+     */
+    void Clear();
+
+    bool IsEnabled() const { return enabled_; }
+
+private:
+    /**
+     * @brief 分片，clock 按加入的顺序保存路径，淘汰时从头部开始找没有被引用的条目
+     */
+    struct Shard {
+        RWMutexType mutex;
+        std::unordered_map<std::string, Entry::ptr> entries;
+        std::deque<std::string> clock;
+        size_t bytes = 0;
+        // 每次删除条目加一，加载期间有删除时不加入加载的旧内容
+        uint64_t version = 0;
+    };
+
+    /**
+     * @brief 规范化请求路径
+     * @param[out] key 规范化后的路径
+     * @return 路径不以 / 开头或者含有 .. 时返回 false
+     */
+    static bool Normalize_(const std::string& path, std::string& key);
+
+    /**
+     * @brief 从磁盘加载文件
+     */
+    Entry::ptr Load_(const std::string& key);
+
+    /**
+     * @brief 加入条目，分片超过容量时淘汰
+     * @param[in] version 开始加载前分片的版本，不一致时不加入
+     */
+    void Insert_(const std::string& key, Entry::ptr entry, uint64_t version);
+
+    /**
+     * @brief 淘汰条目直到分片能放下 size 字节，调用时需持有分片的写锁
+     */
+    void Evict_(Shard& shard, size_t size);
+
+    Shard& GetShard_(const std::string& key);
+
+    /**
+     * @brief 监视目录及其子目录
+     * @param[in] dir 相对资源目录的路径，资源目录本身为空字符串
+     */
+    void AddWatch_(const std::string& dir);
+
+    /**
+     * @brief inotify 可读，处理所有事件后重新等待；期间被 Unwatch 时关闭描述符
+     */
+    void OnInotify_();
+
+    /**
+     * @brief 关闭 inotify 描述符，调用时需持有 watchMutex_
+     */
+    void CloseInotify_();
+
+private:
+    bool enabled_;
+    // 每个分片缓存的字节数上限
+    size_t shardCapacity_;
+    size_t maxFileSize_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+
+    std::string root_;
+    // inotify 描述符，监视的目录（watch descriptor -> 相对路径）
+    int inotifyFd_;
+    std::unordered_map<int, std::string> watches_;
+    IOManager* iom_;
+    // 是否已经在用 inotify 监视，没有时命中要用 stat 检查
+    std::atomic<bool> watching_;
+    // 保护 inotify 描述符的注册和关闭，Unwatch 可能和 inotify 的回调同时执行
+    Mutex watchMutex_;
+};
+
+typedef Singleton<FileCache> FileCacheMgr;
+
+#endif
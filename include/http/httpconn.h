@@ -6,6 +6,7 @@
 #include <arpa/inet.h>   // sockaddr_in
 #include <stdlib.h>      // atoi()
 #include <errno.h>      
+#include <vector>
 
 #include "base/buffer.h"
 #include "httprequest.h"
@@ -70,25 +71,26 @@ public:
     sockaddr_in GetAddr() const;
     
     /**
-     * @brief 处理 HTTP 请求
-     * @return bool 处理是否成功
+     * @brief 处理读缓冲区中所有完整的 HTTP 请求（流水线），响应按请求的顺序排队，
+     *        由下一次 write 一起发出
+     * @details 一批最多处理 MAX_PIPELINE 个请求，剩下的请求在 write 之后再调用处理；
+     *          遇到不保持连接的请求时，后面的请求不再处理
+     * @return bool 是否生成了响应，没有完整的请求时返回 false，需要继续读
      */
     bool process();
 
     /**
      * @brief 获取待写入的总长度
-     * @return int 待写入的总长度
+     * @return size_t 待写入的总长度
      */
-    int ToWriteBytes() { 
-        return iov_[0].iov_len + iov_[1].iov_len; 
-    }
+    size_t ToWriteBytes() const;
 
     /**
-     * @brief 判断是否保持连接
+     * @brief 判断是否保持连接，即最后一个响应之后是否继续处理这个连接
      * @return bool 是否保持连接
      */
     bool IsKeepAlive() const {
-        return isServerKeepAlive_ && request_.IsKeepAlive();
+        return isKeepAlive_;
     }
 
     static bool isET;
@@ -107,9 +109,56 @@ private:
 
     // 服务器配置的是否保持连接
     bool isServerKeepAlive_;
-    // 用于 writev 系统调用的 iovec 数组
-    int iovCnt_;
-    struct iovec iov_[2];
+    // 最后一个响应是否保持连接
+    bool isKeepAlive_;
+
+    /**
+     * @brief 排队中的一个响应，响应头依次存放在 writeBuff_ 中
+     */
+    struct Pending {
+        size_t headLen;
+        // 文件内容：命中静态文件缓存时在 entry 里，否则是文件的映射，由本对象解除映射；
+        // 大文件没有映射，fd 为打开的文件，用 sendfile 发送，由本对象关闭
+        char* file;
+        size_t fileLen;
+        FileCache::Entry::ptr entry;
+        int fd;
+    };
+
+    /**
+     * @brief iov_ 中的一段用 sendfile 发送时的文件和当前偏移，内存中的数据 fd 为 -1
+     */
+    struct FileSegment {
+        int fd;
+        off_t offset;
+    };
+
+    /**
+     * @brief 解除排队响应的文件映射，关闭 sendfile 的文件，清空待发送的数据
+     */
+    void ClearPending_();
+
+    /**
+     * @brief 写 iov_ 中从 iovIdx_ 开始、到下一个文件段之前的内存数据
+     * @return ssize_t 写入的字节数
+     */
+    ssize_t WriteIov_();
+
+    /**
+     * @brief 用 sendfile 写 iovIdx_ 处的文件段
+     * @return ssize_t 写入的字节数，文件被截短时返回 -1，errno 为 EIO
+     */
+    ssize_t SendFile_();
+
+    // 一批最多处理的流水线请求数
+    static const size_t MAX_PIPELINE = 32;
+    std::vector<Pending> pending_;
+    // 用于 writev 系统调用的 iovec 数组，依次为各响应的响应头和文件，iovIdx_ 之前的已经写完；
+    // 用 sendfile 发送的文件 iov_base 为空，iov_len 为剩下的长度
+    std::vector<struct iovec> iov_;
+    // 与 iov_ 一一对应
+    std::vector<FileSegment> segs_;
+    size_t iovIdx_;
     
     // 下面两个缓冲区是和 client 端交互的。
     // 存从浏览器发来的数据，要解析的请求报文就从这个缓冲区中读取
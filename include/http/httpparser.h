@@ -0,0 +1,199 @@
+// 说明：
+// 基于 http-parser（http_parser.c）的增量 HTTP/1.1 请求解析器，负责：
+// - 增量解析：请求可以分多次读到，每次只把新读到的字节交给 http-parser，不会从头重新解析
+// - 零拷贝：请求行、请求头、请求体都记录为相对请求开头的偏移（Slice），不复制到 std::string
+// - 请求体：按 Content-Length 或者 Transfer-Encoding: chunked 确定长度，跨多次读取累积；
+//   chunked 的请求体解码后放在解析器自己的缓冲区里；设置了 BodyCallback 时请求体分段交给
+//   回调，不在内存里累积
+// - 限制：请求行和请求头的总大小、请求头个数、请求体大小超过上限时解析失败；chunked 的
+//   分块长度行、扩展和 trailer 不算请求体，另外限制请求的原始字节数，防止它们无限增长
+//
+// 使用注意：
+// - Execute 每次都要传入从请求开头到目前读到的全部数据（Buffer::Peek()），解析完成之前
+//   不能从缓冲区取走数据；缓冲区扩容、整理时数据会移动，但偏移不变，Slice 仍然有效
+// - 解析完一个请求后停在请求的末尾，Length() 之后的数据属于下一个请求，需要 Init 后再解析
+// - 流式处理请求体时，请求头解析完之后可以用 Consume 丢掉已经解析的数据，之后请求行、
+//   请求头的 Slice 不再有效，需要的内容要在 HeadersCallback 里取出
+// - 不支持 CONNECT 请求，按解析失败处理
+//
+
+#ifndef HTTP_HTTPPARSER_H
+#define HTTP_HTTPPARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <string>
+
+#include "http/http-parser/http_parser.h"
+
+class HttpParser {
+public:
+    /**
+     * @brief 解析结果
+     */
+    enum PARSE_RESULT {
+        // 请求还不完整，需要继续读
+        PARSE_AGAIN,
+        // 解析完一个完整的请求
+        PARSE_DONE,
+        // 请求格式错误或者超过限制
+        PARSE_ERROR,
+    };
+
+    /**
+     * @brief 请求中的一段数据，off 为相对请求开头的偏移
+     */
+    struct Slice {
+        size_t off;
+        size_t len;
+    };
+
+    /**
+     * @brief 请求头解析完时的回调，data 为请求的开头，可以用 GetHeader 等读取请求头
+     * @return 返回 false 时解析失败
+     */
+    typedef std::function<bool(const char* data)> HeadersCallback;
+
+    /**
+     * @brief 流式处理请求体的回调，每解析出一段请求体（chunked 时已经解码）调用一次
+     * @return 返回 false 时解析失败
+     */
+    typedef std::function<bool(const char* at, size_t length)> BodyCallback;
+
+    // 请求头个数上限
+    static const size_t MAX_HEADERS = 64;
+    // 请求原始字节数的上限在请求头、请求体上限之外，给 chunked 分块长度行和 trailer 留的余量
+    static const size_t MAX_FRAMING = 16 * 1024;
+
+    HttpParser();
+
+    /**
+     * @brief 重置解析状态，准备解析下一个请求，HeadersCallback 保留，BodyCallback 清除
+     */
+    void Init();
+
+    /**
+     * @brief 设置请求头解析完时的回调，对之后的所有请求有效
+     */
+    void SetHeadersCallback(HeadersCallback cb) { headersCb_ = cb; }
+
+    /**
+     * @brief 流式处理当前请求的请求体，需要在 HeadersCallback 里设置；不受请求体大小、
+     *        请求原始字节数上限的限制
+     */
+    void SetBodyCallback(BodyCallback cb) { bodyCb_ = cb; }
+
+    /**
+     * @brief 调用方已经从缓冲区开头取走了 n 字节，只能在请求头解析完之后流式处理请求体时调用
+     * @param[in] n 取走的字节数，不超过 Length()
+     */
+    void Consume(size_t n);
+
+    /**
+     * @brief 继续解析请求
+     * @param[in] data 请求的开头
+     * @param[in] len 目前读到的数据长度，不能比上一次调用时短
+     * @return PARSE_RESULT 解析结果
+     */
+    PARSE_RESULT Execute(const char* data, size_t len);
+
+    /**
+     * @brief 是否已经解析完一个完整的请求
+     */
+    bool IsDone() const { return done_; }
+
+    /**
+     * @brief 请求头是否已经解析完
+     */
+    bool IsHeadersDone() const { return headersDone_; }
+
+    /**
+     * @brief 已经解析、还留在缓冲区里的长度，解析完成时为请求的总长度（请求行 + 请求头 + 请求体），
+     *        Consume 过的部分不算在内
+     */
+    size_t Length() const { return parsed_; }
+
+    /**
+     * @brief 请求方法，如 "GET"，指向静态字符串
+     */
+    const char* Method() const;
+
+    Slice Url() const { return url_; }
+
+    /**
+     * @brief 请求体，chunked 时指向解码后的数据，流式处理时为空
+     * @param[in] data 请求的开头
+     */
+    const char* BodyData(const char* data) const;
+    size_t BodyLength() const;
+    unsigned short VersionMajor() const { return parser_.http_major; }
+    unsigned short VersionMinor() const { return parser_.http_minor; }
+
+    /**
+     * @brief 按 HTTP 的规则判断是否保持连接
+     */
+    bool IsKeepAlive() const;
+
+    /**
+     * @brief 查找请求头，名字不区分大小写
+     * @param[in] data 请求的开头
+     * @param[in] name 请求头名字
+     * @param[out] value 请求头的值
+     * @return 没有该请求头时返回 false
+     */
+    bool GetHeader(const char* data, const char* name, Slice& value) const;
+
+    /**
+     * @brief 解析失败的原因
+     */
+    const char* GetError() const { return error_; }
+
+private:
+    struct Header {
+        Slice name;
+        Slice value;
+    };
+
+    /**
+     * @brief 把一个片段并入 slice，同一段数据分几次回调时各片段在缓冲区里是连续的
+     */
+    void Append(Slice& slice, const char* at, size_t length);
+
+    static int OnUrl(http_parser* parser, const char* at, size_t length);
+    static int OnHeaderField(http_parser* parser, const char* at, size_t length);
+    static int OnHeaderValue(http_parser* parser, const char* at, size_t length);
+    static int OnHeadersComplete(http_parser* parser);
+    static int OnBody(http_parser* parser, const char* at, size_t length);
+    static int OnMessageComplete(http_parser* parser);
+
+    static const http_parser_settings SETTINGS;
+
+private:
+    http_parser parser_;
+    // 本次 Execute 传入的请求开头，回调里据此换算偏移
+    const char* base_;
+    // 已经交给 http-parser 的字节数
+    size_t parsed_;
+    bool done_;
+    const char* error_;
+    bool headersDone_;
+    // 请求体上限
+    uint64_t maxBody_;
+    // 请求原始字节数上限：请求头上限 + 请求体上限 + MAX_FRAMING
+    uint64_t maxRequest_;
+
+    HeadersCallback headersCb_;
+    BodyCallback bodyCb_;
+
+    Slice url_;
+    Slice body_;
+    // 解码后的 chunked 请求体
+    std::string chunkedBody_;
+    Header headers_[MAX_HEADERS];
+    size_t headerCount_;
+    // 上一个回调是否为请求头的值，据此判断 OnHeaderField 是不是新的请求头
+    bool inValue_;
+};
+
+#endif
@@ -4,38 +4,90 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <string>
-#include <regex>
+#include <algorithm>
+#include <functional>
+#include <memory>
 #include <errno.h>     
 #include <mysql/mysql.h> 
 
 #include "base/buffer.h"
+#include "http/httpparser.h"
 #include "db/ConnectionPool.h"
 #include "db/Connection.h"
+#include "db/UserCache.h"
+#include "db/RegisterBatcher.h"
 #include "base/log.h"
 
 class HttpRequest {
 public:
-    enum PARSE_STATE {
-        REQUEST_LINE,
-        HEADERS,
-        BODY,
-        FINISH,        
+    // 解析结果
+    enum HTTP_CODE {
+        // 请求还不完整，需要继续读
+        NO_REQUEST,
+        // 解析完一个完整的请求
+        GET_REQUEST,
+        // 请求格式错误
+        BAD_REQUEST,
+    };
+
+    // 用户验证结果
+    enum VERIFY_RESULT {
+        VERIFY_SUCCESS,
+        VERIFY_FAILED,
+        // 数据库连接池繁忙，没能在期限内取到连接
+        VERIFY_UNAVAILABLE,
     };
     
-    HttpRequest() { Init(); }
+    /**
+     * @brief 流式处理请求体：请求体不放进 body_，解析时分段交给 OnData，
+     *        内存占用不随请求体的大小增长，适合大的上传
+     */
+    class BodyConsumer {
+    public:
+        typedef std::shared_ptr<BodyConsumer> ptr;
+        virtual ~BodyConsumer() {}
+
+        /**
+         * @brief 收到一段请求体（chunked 时已经解码）
+         * @return 返回 false 时按请求格式错误处理，回复 400
+         */
+        virtual bool OnData(const char* data, size_t len) = 0;
+
+        /**
+         * @brief 请求体收完，可以修改 req.path() 决定回复的页面
+         * @return 返回 false 时回复 400
+         */
+        virtual bool OnFinish(HttpRequest& req) { return true; }
+    };
+
+    /**
+     * @brief 请求头解析完后为请求创建 BodyConsumer，返回 nullptr 时请求体照常放进 body_
+     */
+    typedef std::function<BodyConsumer::ptr(const HttpRequest& req)> BodyConsumerFactory;
+
+    HttpRequest();
     ~HttpRequest() = default;
 
+    /**
+     * @brief 注册流式处理请求体的路径，需要在服务器启动前注册
+     * @param[in] path 请求路径，和 path() 一致，如 "/upload"
+     * @param[in] factory 为每个请求创建 BodyConsumer
+     */
+    static void RegisterBodyConsumer(const std::string& path, BodyConsumerFactory factory);
+
     /**
      * @brief 初始化 HttpRequest 对象
      */
     void Init();
 
     /**
-     * @brief 解析 HTTP 请求
+     * @brief 解析 HTTP 请求，请求可以分多次读到，每次读到新数据后再调用
+     * @details 解析完成时从 buff 中取走这个请求的数据，后面的数据留给下一个请求；
+     *          上一个请求解析完成后再调用会先重置，开始解析下一个请求
      * @param[in] buff 读缓冲区
-     * @return bool 解析是否成功
+     * @return HTTP_CODE 解析结果
      */
-    bool parse(Buffer& buff);   
+    HTTP_CODE parse(Buffer& buff);
 
     /**
      * @brief 获取请求路径
@@ -70,25 +122,17 @@ public:
      */
     bool IsKeepAlive() const;
 
-private:
-    /**
-     * @brief 解析请求行
-     * @param[in] line 请求行字符串
-     * @return bool 解析是否成功
-     */
-    bool ParseRequestLine_(const std::string& line);
-
     /**
-     * @brief 解析请求头
-     * @param[in] line 请求头字符串
+     * @brief 处理请求时依赖的服务(数据库)是否繁忙，繁忙时应该直接回复 503
      */
-    void ParseHeader_(const std::string& line);
+    bool IsUnavailable() const { return unavailable_; }
 
+private:
     /**
-     * @brief 解析请求体
-     * @param[in] line 请求体字符串
+     * @brief 请求头解析完，取出请求行和后面还要用的请求头，选择请求体的处理方式
+     * @param[in] data 请求的开头
      */
-    void ParseBody_(const std::string& line);
+    bool OnHeaders_(const char* data);
 
     /**
      * @brief 处理请求路径
@@ -110,18 +154,22 @@ private:
      * @param[in] name 用户名
      * @param[in] pwd 密码
      * @param[in] isLogin 是否为登录操作
-     * @return bool 验证是否通过
+     * @return VERIFY_RESULT 验证结果
      */
-    static bool UserVerify(const std::string& name, const std::string& pwd, bool isLogin);
+    static VERIFY_RESULT UserVerify(const std::string& name, const std::string& pwd, bool isLogin);
 
 private:
     static const std::unordered_set<std::string> DEFAULT_HTML;              // 默认网页
     static const std::unordered_map<std::string, int> DEFAULT_HTML_TAG;     // 默认网页标签
+    static std::unordered_map<std::string, BodyConsumerFactory> s_bodyConsumers;  // 流式处理请求体的路径
 
-    PARSE_STATE state_;                                         // 解析状态
-    std::string method_, path_, version_, body_;                // 请求方法，路径，版本，请求体
-    std::unordered_map<std::string, std::string> header_;       // 请求头
+    HttpParser parser_;                                         // 增量解析器，请求头在读缓冲区里不复制
+    std::string method_, path_, version_, body_;                // 请求方法，路径，版本，请求体(只有 POST 会复制)
+    bool keepAlive_;                                            // 是否保持连接
+    bool isUrlencoded_;                                         // 请求体是否为 application/x-www-form-urlencoded
+    BodyConsumer::ptr consumer_;                                // 流式处理请求体，为空时请求体放进 body_
     std::unordered_map<std::string, std::string> post_;         // POST 请求参数
+    bool unavailable_;                                          // 数据库繁忙，需要回复 503
 
     /**
      * @brief 16进制转换为10进制
@@ -9,6 +9,7 @@
 
 #include "base/buffer.h"
 #include "base/log.h"
+#include "http/filecache.h"
 
 class HttpResponse {
 public:
@@ -31,7 +32,7 @@ public:
     void MakeResponse(Buffer& buff);
 
     /**
-     * @brief 解除文件映射
+     * @brief 解除文件映射，关闭 sendfile 用的文件描述符
      */
     void UnmapFile();
 
@@ -41,6 +42,26 @@ public:
      */
     char* File();
 
+    /**
+     * @brief 交出缓存的文件，命中静态文件缓存时文件内容在条目里，没有文件映射
+     * @return FileCache::Entry::ptr 没有命中时返回 nullptr
+     */
+    FileCache::Entry::ptr DetachEntry();
+
+    /**
+     * @brief 交出文件映射，之后由调用方负责 munmap(File(), FileLen())，本对象不再解除映射
+     * @return char* 映射内存的起始地址，没有映射时返回 nullptr
+     */
+    char* DetachFile();
+
+    /**
+     * @brief 交出用 sendfile 发送的文件描述符，之后由调用方负责 close，本对象不再关闭
+     * @details 文件不小于 http.sendfile_threshold 时不做映射，响应体由调用方从这个描述符
+     *          sendfile 到套接字
+     * @return int 文件描述符，没有时返回 -1
+     */
+    int DetachFd();
+
     /**
      * @brief 获取文件长度
      * @return size_t 文件长度
@@ -60,7 +81,30 @@ public:
      */
     int Code() const { return code_; }
 
+    /**
+     * @brief 按文件后缀取 MIME 类型
+     * @param[in] path 文件路径
+     * @return std::string MIME 类型，不认识的后缀为 text/plain
+     */
+    static std::string GetFileType(const std::string& path);
+
+    /**
+     * @brief 生成完整的响应头（状态行 + 响应头 + 空行），静态文件缓存用来提前生成响应头
+     * @param[in] code 状态码
+     * @param[in] isKeepAlive 是否保持连接
+     * @param[in] type MIME 类型
+     * @param[in] len 响应体长度
+     */
+    static std::string MakeHeader(int code, bool isKeepAlive, const std::string& type, size_t len);
+
 private:
+    /**
+     * @brief 用静态文件缓存生成响应，命中时不访问文件系统
+     * @param[in] buff 写入缓冲区
+     * @return 没有命中时返回 false，按原来的方式生成
+     */
+    bool MakeCachedResponse_(Buffer& buff);
+
     /**
      * @brief 添加状态行
      * @param[in] buff 写入缓冲区
@@ -99,8 +143,12 @@ private:
     
     // 映射区的内存起始地址
     char* mmFile_;
+    // 大文件不映射，保留打开的描述符用 sendfile 发送
+    int fileFd_;
     // 存储文件的属性
     struct stat mmFileStat_;
+    // 命中静态文件缓存时的条目，响应体为条目中的文件内容
+    FileCache::Entry::ptr entry_;
 
     static const std::unordered_map<std::string, std::string> SUFFIX_TYPE;  // 后缀类型集
     static const std::unordered_map<int, std::string> CODE_STATUS;          // 编码状态集
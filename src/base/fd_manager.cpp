@@ -3,7 +3,7 @@
 #include <sys/stat.h>
 
 #include "base/fd_manager.h"
-// #include "hook.h"
+#include "base/hook.h"
 
 bool FdCtx::init() {
     if(m_isInit) {
@@ -26,11 +26,11 @@ bool FdCtx::init() {
     }
 
     if(m_isSocket) {
-        // int flags = fcntl_f(m_fd, F_GETFL, 0);
-        // if(!(flags & O_NONBLOCK)) {
-        //     fcntl_f(m_fd, F_SETFL, flags | O_NONBLOCK);
-        // }
-        // m_sysNonblock = true;
+        int flags = fcntl_f(m_fd, F_GETFL, 0);
+        if(!(flags & O_NONBLOCK)) {
+            fcntl_f(m_fd, F_SETFL, flags | O_NONBLOCK);
+        }
+        m_sysNonblock = true;
     }
     else {
         m_sysNonblock = false;
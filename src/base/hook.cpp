@@ -0,0 +1,594 @@
+#include <dlfcn.h>
+#include <stdarg.h>
+
+#include "base/hook.h"
+#include "base/fd_manager.h"
+#include "base/config.h"
+#include "coroutine/iomanager.h"
+
+static zch::Logger::ptr g_logger = LOG_NAME("system");
+
+static zch::ConfigVar<int>::ptr g_tcp_connect_timeout =
+    zch::Config::Lookup("server.connect_timeout", 5000, "tcp connect timeout");
+
+// 当前线程是否启用了 hook，只有调度器的线程才会开启
+static thread_local bool t_hook_enable = false;
+
+#define HOOK_FUN(XX) \
+    XX(sleep) \
+    XX(usleep) \
+    XX(nanosleep) \
+    XX(socket) \
+    XX(connect) \
+    XX(accept) \
+    XX(accept4) \
+    XX(read) \
+    XX(readv) \
+    XX(recv) \
+    XX(recvfrom) \
+    XX(recvmsg) \
+    XX(write) \
+    XX(writev) \
+    XX(send) \
+    XX(sendto) \
+    XX(sendmsg) \
+    XX(sendfile) \
+    XX(close) \
+    XX(fcntl) \
+    XX(ioctl) \
+    XX(getsockopt) \
+    XX(setsockopt)
+
+/**
+ * @brief 通过 dlsym(RTLD_NEXT) 取出被 hook 的原始函数地址，保存到 xxx_f 中
+ * @note 用 constructor 属性保证比本库中其它静态变量更早初始化，避免静态初始化
+ *       期间（比如日志模块打开文件）调用到还是空指针的原始函数
+ */
+__attribute__((constructor(101))) static void hook_init() {
+    static bool is_inited = false;
+    if(is_inited) {
+        return;
+    }
+#define XX(name) name ## _f = (name ## _fun)dlsym(RTLD_NEXT, #name);
+    HOOK_FUN(XX);
+#undef XX
+    is_inited = true;
+}
+
+static uint64_t s_connect_timeout = -1;
+
+struct _HookIniter {
+    _HookIniter() {
+        hook_init();
+        s_connect_timeout = g_tcp_connect_timeout->GetValue();
+
+        g_tcp_connect_timeout->AddListener([](const int &old_value, const int &new_value) {
+            LOG_INFO(g_logger) << "tcp connect timeout changed from " << old_value << " to " << new_value;
+            s_connect_timeout = new_value;
+        });
+    }
+};
+
+static _HookIniter s_hook_initer;
+
+bool is_hook_enable() {
+    return t_hook_enable;
+}
+
+void set_hook_enable(bool flag) {
+    t_hook_enable = flag;
+}
+
+// 定时器条件，超时时记录 errno，IO 协程 resume 后据此判断是否超时
+struct timer_info {
+    int cancelled = 0;
+};
+
+/**
+ * @brief 睡眠、超时用的定时器时长
+ * @details 时间轮按截断到毫秒的时钟走，起点可能在当前这一毫秒的末尾，ms 毫秒的定时器
+ *          实际可能只等了 ms - 1 毫秒多一点。多等一个刻度，保证不早于要求的时间返回
+ */
+static uint64_t wait_ms(uint64_t ms) {
+    return ms + 1;
+}
+
+/**
+ * @brief IO 类 hook 函数的统一实现
+ * @details 先直接调用原始函数，返回 EAGAIN 时说明 IO 未就绪，这时向 IOManager 注册
+ *          对应事件（有超时时间的话再加一个条件定时器），然后 yield 当前协程；事件
+ *          就绪或者定时器超时 cancelEvent 后协程被重新调度，超时返回 -1，否则重试
+ * @param[in] fd 句柄
+ * @param[in] fun 原始函数
+ * @param[in] hook_fun_name 函数名，用于日志
+ * @param[in] event 要等待的事件
+ * @param[in] timeout_so 超时类型，SO_RCVTIMEO 或 SO_SNDTIMEO
+ * @param[in] args 原始函数的剩余参数
+ */
+template <typename OriginFun, typename... Args>
+static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name, uint32_t event, int timeout_so,
+                     Args &&...args) {
+    if(!t_hook_enable) {
+        return fun(fd, std::forward<Args>(args)...);
+    }
+
+    FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd, false);
+    if(!ctx) {
+        return fun(fd, std::forward<Args>(args)...);
+    }
+
+    if(ctx->isClose()) {
+        errno = EBADF;
+        return -1;
+    }
+
+    // 不是 socket，或者用户自己设置了非阻塞，都按原样调用
+    if(!ctx->isSocket() || ctx->getUserNonblock()) {
+        return fun(fd, std::forward<Args>(args)...);
+    }
+
+    IOManager *iom = IOManager::GetThis();
+    if(!iom) {
+        return fun(fd, std::forward<Args>(args)...);
+    }
+
+    uint64_t to = ctx->getTimeout(timeout_so);
+    std::shared_ptr<timer_info> tinfo(new timer_info);
+
+retry:
+    ssize_t n = fun(fd, args...);
+    while(n == -1 && errno == EINTR) {
+        n = fun(fd, args...);
+    }
+    if(n == -1 && errno == EAGAIN) {
+        Timer::ptr timer;
+        std::weak_ptr<timer_info> winfo(tinfo);
+
+        if(to != (uint64_t)-1) {
+            timer = iom->addConditionTimer(wait_ms(to), [winfo, fd, iom, event]() {
+                auto t = winfo.lock();
+                if(!t || t->cancelled) {
+                    return;
+                }
+                t->cancelled = ETIMEDOUT;
+                iom->cancelEvent(fd, (IOManager::Event)(event));
+            }, winfo);
+        }
+
+        int rt = iom->addEvent(fd, (IOManager::Event)(event));
+        if(rt) {
+            LOG_ERROR(g_logger) << hook_fun_name << " addEvent(" << fd << ", " << event << ")";
+            if(timer) {
+                timer->cancel();
+            }
+            return -1;
+        }
+
+        Fiber::GetThis()->yield();
+        if(timer) {
+            timer->cancel();
+        }
+        if(tinfo->cancelled) {
+            errno = tinfo->cancelled;
+            return -1;
+        }
+        goto retry;
+    }
+
+    return n;
+}
+
+/**
+ * @brief io_uring 后端下 IO 类 hook 函数的实现
+ * @details 先直接调用一次原始函数，数据已经就绪时和 epoll 后端一样只有一次系统调用；
+ *          返回 EAGAIN 时不再注册可读写事件等通知后重试，而是把整个操作作为完成式
+ *          操作交给 io_uring，完成时结果直接随 cqe 返回。不满足条件时退回 do_io
+ * @param[in] fd 句柄
+ * @param[in] fun 原始函数
+ * @param[in] uring_fun 提交完成式操作的函数，参数为 IOManager 和超时时间
+ * @param[in] hook_fun_name 函数名，用于日志
+ * @param[in] event 要等待的事件
+ * @param[in] timeout_so 超时类型，SO_RCVTIMEO 或 SO_SNDTIMEO
+ * @param[in] args 原始函数的剩余参数
+ */
+template <typename OriginFun, typename UringFun, typename... Args>
+static ssize_t do_uring_io(int fd, OriginFun fun, UringFun uring_fun, const char *hook_fun_name, uint32_t event,
+                           int timeout_so, Args &&...args) {
+    IOManager *iom = IOManager::GetThis();
+    if(!t_hook_enable || !iom || iom->getBackend() != IOManager::IO_URING) {
+        return do_io(fd, fun, hook_fun_name, event, timeout_so, std::forward<Args>(args)...);
+    }
+
+    FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd, false);
+    if(!ctx || ctx->isClose() || !ctx->isSocket() || ctx->getUserNonblock()) {
+        return do_io(fd, fun, hook_fun_name, event, timeout_so, std::forward<Args>(args)...);
+    }
+
+    ssize_t n = fun(fd, args...);
+    while(n == -1 && errno == EINTR) {
+        n = fun(fd, args...);
+    }
+    if(n == -1 && errno == EAGAIN) {
+        n = uring_fun(iom, ctx->getTimeout(timeout_so));
+        // 同一方向已经有完成式操作在进行，退回等待事件的方式
+        if(n == -1 && errno == EBUSY) {
+            return do_io(fd, fun, hook_fun_name, event, timeout_so, std::forward<Args>(args)...);
+        }
+        // 等待期间被别的协程 close：hook 的 close 取消了操作，内核返回 ECANCELED，
+        // epoll 后端此时重试会得到 EBADF，这里保持一致
+        if(n == -1 && errno == ECANCELED && FdMgr::GetInstance()->get(fd, false) != ctx) {
+            errno = EBADF;
+        }
+    }
+    return n;
+}
+
+extern "C" {
+#define XX(name) name ## _fun name ## _f = nullptr;
+    HOOK_FUN(XX);
+#undef XX
+
+unsigned int sleep(unsigned int seconds) {
+    IOManager *iom = IOManager::GetThis();
+    if(!t_hook_enable || !iom) {
+        return sleep_f(seconds);
+    }
+
+    Fiber::ptr fiber = Fiber::GetThis();
+    int thread = Scheduler::GetTaskThread();
+    iom->addTimer(wait_ms((uint64_t)seconds * 1000), [iom, fiber, thread]() {
+        iom->schedule(fiber, thread);
+    });
+    Fiber::GetThis()->yield();
+    return 0;
+}
+
+int usleep(useconds_t usec) {
+    IOManager *iom = IOManager::GetThis();
+    if(!t_hook_enable || !iom) {
+        return usleep_f(usec);
+    }
+
+    Fiber::ptr fiber = Fiber::GetThis();
+    int thread = Scheduler::GetTaskThread();
+    // 向上取整到毫秒，不足 1ms 的睡眠不能变成 0ms 定时器，否则协程会被立即重新调度
+    iom->addTimer(wait_ms((usec + 999) / 1000), [iom, fiber, thread]() {
+        iom->schedule(fiber, thread);
+    });
+    Fiber::GetThis()->yield();
+    return 0;
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+    IOManager *iom = IOManager::GetThis();
+    if(!t_hook_enable || !iom) {
+        return nanosleep_f(req, rem);
+    }
+
+    // 与 usleep 一样向上取整到毫秒
+    uint64_t timeout_ms = (uint64_t)req->tv_sec * 1000 + (req->tv_nsec + 999999) / 1000000;
+    Fiber::ptr fiber = Fiber::GetThis();
+    int thread = Scheduler::GetTaskThread();
+    iom->addTimer(wait_ms(timeout_ms), [iom, fiber, thread]() {
+        iom->schedule(fiber, thread);
+    });
+    Fiber::GetThis()->yield();
+    return 0;
+}
+
+int socket(int domain, int type, int protocol) {
+    if(!t_hook_enable) {
+        return socket_f(domain, type, protocol);
+    }
+    int fd = socket_f(domain, type, protocol);
+    if(fd == -1) {
+        return fd;
+    }
+    // 创建 FdCtx 时会把 socket 设置成系统层面的非阻塞
+    FdMgr::GetInstance()->get(fd, true);
+    return fd;
+}
+
+int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen, uint64_t timeout_ms) {
+    if(!t_hook_enable) {
+        return connect_f(fd, addr, addrlen);
+    }
+    FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd, false);
+    if(!ctx || ctx->isClose()) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(!ctx->isSocket() || ctx->getUserNonblock()) {
+        return connect_f(fd, addr, addrlen);
+    }
+
+    IOManager *iom = IOManager::GetThis();
+    if(!iom) {
+        return connect_f(fd, addr, addrlen);
+    }
+
+    int n = connect_f(fd, addr, addrlen);
+    if(n == 0) {
+        return 0;
+    } else if(n != -1 || errno != EINPROGRESS) {
+        return n;
+    }
+
+    // 非阻塞 connect 返回 EINPROGRESS，等待 socket 可写即表示连接有结果了
+    Timer::ptr timer;
+    std::shared_ptr<timer_info> tinfo(new timer_info);
+    std::weak_ptr<timer_info> winfo(tinfo);
+
+    if(timeout_ms != (uint64_t)-1) {
+        timer = iom->addConditionTimer(wait_ms(timeout_ms), [winfo, fd, iom]() {
+            auto t = winfo.lock();
+            if(!t || t->cancelled) {
+                return;
+            }
+            t->cancelled = ETIMEDOUT;
+            iom->cancelEvent(fd, IOManager::WRITE);
+        }, winfo);
+    }
+
+    int rt = iom->addEvent(fd, IOManager::WRITE);
+    if(rt == 0) {
+        Fiber::GetThis()->yield();
+        if(timer) {
+            timer->cancel();
+        }
+        if(tinfo->cancelled) {
+            errno = tinfo->cancelled;
+            return -1;
+        }
+    } else {
+        if(timer) {
+            timer->cancel();
+        }
+        LOG_ERROR(g_logger) << "connect addEvent(" << fd << ", WRITE) error";
+    }
+
+    int error = 0;
+    socklen_t len = sizeof(int);
+    if(-1 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len)) {
+        return -1;
+    }
+    if(!error) {
+        return 0;
+    } else {
+        errno = error;
+        return -1;
+    }
+}
+
+int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+    return connect_with_timeout(sockfd, addr, addrlen, s_connect_timeout);
+}
+
+int accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
+    int fd = do_uring_io(s, accept_f, [=](IOManager *iom, uint64_t to) {
+        return iom->submitAccept(s, addr, addrlen, 0, to);
+    }, "accept", IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    if(fd >= 0) {
+        FdMgr::GetInstance()->get(fd, true);
+    }
+    return fd;
+}
+
+int accept4(int s, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+    int fd = do_uring_io(s, accept4_f, [=](IOManager *iom, uint64_t to) {
+        return iom->submitAccept(s, addr, addrlen, flags, to);
+    }, "accept4", IOManager::READ, SO_RCVTIMEO, addr, addrlen, flags);
+    if(fd >= 0) {
+        FdMgr::GetInstance()->get(fd, true);
+    }
+    return fd;
+}
+
+ssize_t read(int fd, void *buf, size_t count) {
+    return do_uring_io(fd, read_f, [=](IOManager *iom, uint64_t to) {
+        return iom->submitRecv(fd, buf, count, 0, to);
+    }, "read", IOManager::READ, SO_RCVTIMEO, buf, count);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
+    return do_uring_io(fd, readv_f, [=](IOManager *iom, uint64_t to) {
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec *)iov;
+        msg.msg_iovlen = iovcnt;
+        return iom->submitRecvmsg(fd, &msg, 0, to);
+    }, "readv", IOManager::READ, SO_RCVTIMEO, iov, iovcnt);
+}
+
+ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
+    return do_uring_io(sockfd, recv_f, [=](IOManager *iom, uint64_t to) {
+        return iom->submitRecv(sockfd, buf, len, flags, to);
+    }, "recv", IOManager::READ, SO_RCVTIMEO, buf, len, flags);
+}
+
+ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen) {
+    return do_io(sockfd, recvfrom_f, "recvfrom", IOManager::READ, SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);
+}
+
+ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
+    return do_io(sockfd, recvmsg_f, "recvmsg", IOManager::READ, SO_RCVTIMEO, msg, flags);
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+    return do_uring_io(fd, write_f, [=](IOManager *iom, uint64_t to) {
+        return iom->submitSend(fd, buf, count, 0, to);
+    }, "write", IOManager::WRITE, SO_SNDTIMEO, buf, count);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+    return do_uring_io(fd, writev_f, [=](IOManager *iom, uint64_t to) {
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec *)iov;
+        msg.msg_iovlen = iovcnt;
+        return iom->submitSendmsg(fd, &msg, 0, to);
+    }, "writev", IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);
+}
+
+ssize_t send(int s, const void *msg, size_t len, int flags) {
+    return do_uring_io(s, send_f, [=](IOManager *iom, uint64_t to) {
+        return iom->submitSend(s, msg, len, flags, to);
+    }, "send", IOManager::WRITE, SO_SNDTIMEO, msg, len, flags);
+}
+
+ssize_t sendto(int s, const void *msg, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) {
+    return do_io(s, sendto_f, "sendto", IOManager::WRITE, SO_SNDTIMEO, msg, len, flags, to, tolen);
+}
+
+ssize_t sendmsg(int s, const struct msghdr *msg, int flags) {
+    return do_io(s, sendmsg_f, "sendmsg", IOManager::WRITE, SO_SNDTIMEO, msg, flags);
+}
+
+// io_uring 没有对应的完成式操作，两种后端都等可写事件后重试
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    return do_io(out_fd, sendfile_f, "sendfile", IOManager::WRITE, SO_SNDTIMEO, in_fd, offset, count);
+}
+
+int close(int fd) {
+    if(!t_hook_enable) {
+        return close_f(fd);
+    }
+
+    FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd, false);
+    if(ctx) {
+        // 关闭前先把挂在这个 fd 上的协程都唤醒，否则它们永远等不到事件
+        IOManager *iom = IOManager::GetThis();
+        if(iom) {
+            iom->cancelAll(fd);
+            iom->delFd(fd);
+        }
+        FdMgr::GetInstance()->del(fd);
+    }
+    return close_f(fd);
+}
+
+int fcntl(int fd, int cmd, ... /* arg */) {
+    va_list va;
+    va_start(va, cmd);
+    switch(cmd) {
+        case F_SETFL: {
+            int arg = va_arg(va, int);
+            va_end(va);
+            FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd, false);
+            if(!ctx || ctx->isClose() || !ctx->isSocket()) {
+                return fcntl_f(fd, cmd, arg);
+            }
+            // 记录用户是否想要非阻塞，系统层面的非阻塞标志始终由 hook 决定
+            ctx->setUserNonblock(arg & O_NONBLOCK);
+            if(ctx->getSysNonblock()) {
+                arg |= O_NONBLOCK;
+            } else {
+                arg &= ~O_NONBLOCK;
+            }
+            return fcntl_f(fd, cmd, arg);
+        }
+        break;
+        case F_GETFL: {
+            va_end(va);
+            int arg = fcntl_f(fd, cmd);
+            FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd, false);
+            if(!ctx || ctx->isClose() || !ctx->isSocket()) {
+                return arg;
+            }
+            // 对用户隐藏 hook 设置的非阻塞标志
+            if(ctx->getUserNonblock()) {
+                return arg | O_NONBLOCK;
+            } else {
+                return arg & ~O_NONBLOCK;
+            }
+        }
+        break;
+        case F_DUPFD:
+        case F_DUPFD_CLOEXEC:
+        case F_SETFD:
+        case F_SETOWN:
+        case F_SETSIG:
+        case F_SETLEASE:
+        case F_NOTIFY:
+#ifdef F_SETPIPE_SZ
+        case F_SETPIPE_SZ:
+#endif
+        {
+            int arg = va_arg(va, int);
+            va_end(va);
+            return fcntl_f(fd, cmd, arg);
+        }
+        break;
+        case F_GETFD:
+        case F_GETOWN:
+        case F_GETSIG:
+        case F_GETLEASE:
+#ifdef F_GETPIPE_SZ
+        case F_GETPIPE_SZ:
+#endif
+        {
+            va_end(va);
+            return fcntl_f(fd, cmd);
+        }
+        break;
+        case F_SETLK:
+        case F_SETLKW:
+        case F_GETLK: {
+            struct flock *arg = va_arg(va, struct flock *);
+            va_end(va);
+            return fcntl_f(fd, cmd, arg);
+        }
+        break;
+        case F_GETOWN_EX:
+        case F_SETOWN_EX: {
+            struct f_owner_exlock *arg = va_arg(va, struct f_owner_exlock *);
+            va_end(va);
+            return fcntl_f(fd, cmd, arg);
+        }
+        break;
+        default:
+            va_end(va);
+            return fcntl_f(fd, cmd);
+    }
+}
+
+int ioctl(int d, unsigned long int request, ...) {
+    va_list va;
+    va_start(va, request);
+    void *arg = va_arg(va, void *);
+    va_end(va);
+
+    if(FIONBIO == request) {
+        bool user_nonblock = !!*(int *)arg;
+        FdCtx::ptr ctx = FdMgr::GetInstance()->get(d, false);
+        if(!ctx || ctx->isClose() || !ctx->isSocket()) {
+            return ioctl_f(d, request, arg);
+        }
+        ctx->setUserNonblock(user_nonblock);
+    }
+    return ioctl_f(d, request, arg);
+}
+
+int getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen) {
+    return getsockopt_f(sockfd, level, optname, optval, optlen);
+}
+
+int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen) {
+    if(!t_hook_enable) {
+        return setsockopt_f(sockfd, level, optname, optval, optlen);
+    }
+    if(level == SOL_SOCKET) {
+        if(optname == SO_RCVTIMEO || optname == SO_SNDTIMEO) {
+            // 读写超时由 hook 的定时器实现，这里只记录到 FdCtx 中
+            FdCtx::ptr ctx = FdMgr::GetInstance()->get(sockfd, false);
+            if(ctx) {
+                const timeval *v = (const timeval *)optval;
+                ctx->setTimeout(optname, v->tv_sec * 1000 + v->tv_usec / 1000);
+            }
+        }
+    }
+    return setsockopt_f(sockfd, level, optname, optval, optlen);
+}
+
+}
@@ -4,8 +4,7 @@
 
 #include "base/http_server.h"
 #include "base/tcp_server.h"
-
-std::unordered_map<int, HttpConn> users_;
+#include "http/filecache.h"
 
 static zch::Logger::ptr g_logger = LOG_NAME("system");
 
@@ -13,6 +12,78 @@ static zch::ConfigVar<std::string>::ptr g_tcp_server_resource_dir =
     zch::Config::Lookup("server.resources_dir", std::string("/home/zch/Project/TinyWebserver/resources"),
             "http server resources dir");
 
+/**
+ * @brief 构造函数
+ * @param[in] capacity 槽位数量，即支持的最大 fd
+ */
+HttpConnSlab::HttpConnSlab(size_t capacity)
+    : m_slots(nullptr)
+    , m_capacity(capacity) {
+    // C++17 之前 new 不保证超过 16 字节的对齐，这里手动按缓存行分配
+    void *mem = nullptr;
+    if(posix_memalign(&mem, alignof(Slot), sizeof(Slot) * m_capacity)) {
+        LOG_ERROR(g_logger) << "HttpConnSlab alloc " << m_capacity << " slots failed";
+        throw std::bad_alloc();
+    }
+    m_slots = static_cast<Slot *>(mem);
+    for(size_t i = 0; i < m_capacity; ++i) {
+        new (&m_slots[i]) Slot();
+    }
+}
+
+/**
+ * @brief 析构函数
+ */
+HttpConnSlab::~HttpConnSlab() {
+    for(size_t i = 0; i < m_capacity; ++i) {
+        m_slots[i].~Slot();
+    }
+    free(m_slots);
+}
+
+/**
+ * @brief 占用 fd 对应的槽位
+ * @param[in] fd 连接句柄
+ * @param[out] generation 本次占用的代数
+ * @return HttpConn* 槽位中的连接对象，fd 越界返回 nullptr
+ */
+HttpConn *HttpConnSlab::acquire(int fd, uint32_t &generation) {
+    if(fd < 0 || (size_t)fd >= m_capacity) {
+        LOG_ERROR(g_logger) << "HttpConnSlab fd out of range: " << fd << ", capacity=" << m_capacity;
+        return nullptr;
+    }
+    Slot &slot = m_slots[fd];
+    uint32_t gen = slot.generation.load(std::memory_order_acquire);
+    if(gen & 1) {
+        // 上一个使用者没有释放就被复用了，说明 fd 在释放前就被关闭，属于使用错误
+        LOG_WARN(g_logger) << "HttpConnSlab slot " << fd << " reused before release, generation=" << gen;
+        ++gen;
+    }
+    if(!slot.conn) {
+        slot.conn.reset(new HttpConn);
+    }
+    generation = gen + 1;
+    slot.generation.store(generation, std::memory_order_release);
+    return slot.conn.get();
+}
+
+/**
+ * @brief 释放槽位，需要在关闭 fd 之前调用，保证 fd 被复用前槽位已经空闲
+ * @param[in] fd 连接句柄
+ * @param[in] generation 占用时拿到的代数
+ */
+void HttpConnSlab::release(int fd, uint32_t generation) {
+    if(fd < 0 || (size_t)fd >= m_capacity) {
+        return;
+    }
+    Slot &slot = m_slots[fd];
+    uint32_t expected = generation;
+    if(!slot.generation.compare_exchange_strong(expected, generation + 1, std::memory_order_acq_rel)) {
+        LOG_WARN(g_logger) << "HttpConnSlab release stale slot " << fd << ", generation=" << generation
+                           << ", current=" << expected;
+    }
+}
+
 /**
  * @brief 构造函数
  * @param[in] keepalive 是否保持连接
@@ -39,6 +110,9 @@ HttpServer::HttpServer(bool keepalive
     LOG_INFO(g_logger) << "srcDir: " << staticSrcDir;
     HttpConn::userCount = 0;
     HttpConn::srcDir = staticSrcDir.c_str();
+
+    // 静态文件缓存，在 IOManager 里时用 inotify 监视资源目录
+    FileCacheMgr::GetInstance()->Init(staticSrcDir);
 }
 
 /**
@@ -48,61 +122,93 @@ HttpServer::~HttpServer() {
     
 }
 
+/**
+ * @brief 停止服务
+ * @details 构造函数里 FileCache 注册的 inotify 读事件会让 IOManager 一直不能停止，这里一并注销
+ */
+void HttpServer::stop() {
+    TcpServer::stop();
+    FileCacheMgr::GetInstance()->Unwatch();
+}
+
 /**
  * @brief 处理客户端连接
+ * @details 每个连接在自己的协程里循环：读请求 -> 解析 -> 响应，然后继续等待同一连接
+ *          上的下一个请求。读操作经过 hook，数据未到达时只挂起本协程，等待时长受
+ *          recv 超时(server.read_timeout)限制，超时即视为空闲连接并关闭；客户端要求
+ *          Connection: close 或者服务器未开启 keep-alive 时，发送完本次响应就关闭。
  * @param[in] client 客户端Socket
  */
 void HttpServer::handleClient(Socket::ptr client) {
     LOG_DEBUG(g_logger) << "handleClient " << client->getSocket();
-    // 简单实现：读取数据，处理请求，发送响应
-    // 实际项目中这里应该是状态机循环
     int client_socket = client->getSocket();
     if(!client->isValid()) {
         client->close();
         return;
     }
 
-    // 确保HttpConn已初始化（通常在accept时初始化）
-    // 这里假设users_已经在startAccept中被正确初始化
-    
-    int errnoNum = 0;
-    // 1. 读取请求
-    ssize_t readLen = users_[client_socket].read(&errnoNum);
-    if(readLen <= 0 && errnoNum != EAGAIN) {
-        LOG_ERROR(g_logger) << "read error, close client: " << client_socket << " errno=" << errnoNum << " errstr=" << strerror(errnoNum);
-        users_[client_socket].Close();
+    // 在连接自己的协程里占用槽位并初始化，槽位从头到尾只被这一个协程访问
+    uint32_t generation = 0;
+    HttpConn *slot_conn = m_conns.acquire(client_socket, generation);
+    if(!slot_conn) {
+        client->close();
         return;
     }
+    HttpConn &conn = *slot_conn;
+    sockaddr_in *addr = (sockaddr_in *)(client->getRemoteAddress()->getAddr());
+    conn.init(client_socket, *addr, m_isKeepalive);
 
-    // 2. 处理请求
-    if(users_[client_socket].process()) {
-        // 3. 准备响应
-        // process() 返回 true 表示有数据要写
-        // 4. 发送响应
-        users_[client_socket].write(&errnoNum);
-    }
-    
-    // 短连接或处理完成后关闭
-    // 如果是长连接，可能需要重新注册读事件
-    // 目前简单处理：一次请求后关闭
-    // client->close();
-}
-
-/**
- * @brief 开始接受连接
- * @param[in] sock 服务器Socket
- */
-void HttpServer::startAccept(Socket::ptr sock) {
     while(!m_isStop) {
-        Socket::ptr client = sock->accept();
-        if(client) {
-            client->setRecvTimeout(m_recvTimeout);
-            // 初始化 HttpConn
-            int client_socket = client->getSocket();
-            sockaddr_in *addr = (sockaddr_in *)(client->getRemoteAddress()->getAddr());
-            users_[client_socket].init(client_socket, *addr, m_isKeepalive);
-            
-            m_ioWorker->schedule(std::bind(&HttpServer::handleClient, std::dynamic_pointer_cast<HttpServer>(shared_from_this()), client));
+        int errnoNum = 0;
+        ssize_t readLen = 1;
+        if(Fiber::GetThis()->isSharedStack()) {
+            // 共享栈模式下先用很小的栈帧等到有数据，挂起时要拷出去的栈只有几 KB，
+            // 否则 ReadFd 里 64KB 的栈上缓冲区也要跟着拷出去
+            char c;
+            readLen = recv(client_socket, &c, 1, MSG_PEEK);
+            if(readLen < 0) {
+                errnoNum = errno;
+            }
+        }
+        // 1. 读取请求，hook 后这里会挂起协程直到有数据、对端关闭或超时
+        if(readLen > 0) {
+            readLen = conn.read(&errnoNum);
+        }
+        if(readLen == 0) {
+            LOG_DEBUG(g_logger) << "client closed: " << client_socket;
+            break;
+        } else if(readLen < 0) {
+            if(errnoNum == ETIMEDOUT) {
+                LOG_DEBUG(g_logger) << "client idle timeout, close: " << client_socket;
+            } else {
+                LOG_ERROR(g_logger) << "read error, close client: " << client_socket << " errno=" << errnoNum << " errstr=" << strerror(errnoNum);
+            }
+            break;
+        }
+
+        // 2. 处理缓冲区里所有完整的请求（流水线），返回 false 表示没有完整的请求了，继续读
+        bool closing = false;
+        while(conn.process()) {
+            // 3. 一批响应用一次 writev 发出
+            if(conn.write(&errnoNum) < 0) {
+                LOG_ERROR(g_logger) << "write error, close client: " << client_socket << " errno=" << errnoNum << " errstr=" << strerror(errnoNum);
+                closing = true;
+                break;
+            }
+
+            // 4. 短连接发送完就结束，长连接继续处理剩下的请求，没有了再等待下一个请求
+            if(!conn.IsKeepAlive()) {
+                closing = true;
+                break;
+            }
+        }
+        if(closing) {
+            break;
         }
     }
+
+    conn.Close();
+    // 先释放槽位再关闭 fd，fd 关闭后才可能被新连接复用
+    m_conns.release(client_socket, generation);
+    client->close();
 }
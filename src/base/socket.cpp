@@ -1,7 +1,7 @@
 #include "base/socket.h"
 #include "coroutine/iomanager.h"
 #include "base/fd_manager.h"
-// #include "hook.h"
+#include "base/hook.h"
 
 static zch::Logger::ptr g_logger = LOG_NAME("system");
 
@@ -259,11 +259,12 @@ bool Socket::connect(const Address::ptr addr, uint64_t timeout_ms) {
         }
     }
     else {
-        // if(::connect_with_timeout(m_sock, addr->getAddr(), addr->getAddrLen(), timeout_ms)) {
-        //     LOG_ERROR("connect timeout: %c!!!", strerror(errno));
-        //     close();
-        //     return false;
-        // }
+        if(::connect_with_timeout(m_sock, addr->getAddr(), addr->getAddrLen(), timeout_ms)) {
+            LOG_ERROR(g_logger) << "connect error: " << strerror(errno) << " addr=" << addr->toString()
+                                << " timeout=" << timeout_ms;
+            close();
+            return false;
+        }
     }
     m_isConnected = true;
     getRemoteAddress();
@@ -302,13 +303,30 @@ bool Socket::listen(int backlog) {
     return true;
 }
 
+/**
+ * @brief 开启 SO_REUSEPORT，需要在 bind 之前调用
+ * @return bool 是否成功
+ */
+bool Socket::setReusePort() {
+    if(!isValid()) {
+        newSock();
+        if(!isValid()) {
+            return false;
+        }
+    }
+    int val = 1;
+    return setOption(SOL_SOCKET, SO_REUSEPORT, val);
+}
+
 /**
  * @brief 接受连接
+ * @details 用 accept4 直接拿到非阻塞、close-on-exec 的 fd，
+ *          省去 FdCtx 初始化时再 fcntl 设置 O_NONBLOCK
  * @return Socket::ptr
  */
 Socket::ptr Socket::accept() {
     Socket::ptr sock(new Socket(m_family, m_type, m_protocol));
-    int newsock = ::accept(m_sock, nullptr, nullptr);
+    int newsock = ::accept4(m_sock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
     if(newsock == -1) {
         if(errno != EAGAIN && errno != EWOULDBLOCK) {
             LOG_ERROR(g_logger) << "accept error: " << strerror(errno) << " m_sock=" << m_sock;
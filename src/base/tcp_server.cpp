@@ -8,6 +8,10 @@ static zch::ConfigVar<uint64_t>::ptr g_tcp_server_read_timeout =
     zch::Config::Lookup("server.read_timeout", (uint64_t)(60 * 1000 * 2),
             "tcp server read timeout");
 
+static zch::ConfigVar<bool>::ptr g_tcp_server_reuse_port =
+    zch::Config::Lookup("server.reuse_port", false,
+            "tcp server bind one SO_REUSEPORT socket per thread");
+
 /**
  * @brief 构造函数
  * @param[in] io_worker socket工作的调度器
@@ -19,7 +23,8 @@ TcpServer::TcpServer(IOManager *io_worker, IOManager *accept_worker)
     , m_recvTimeout(g_tcp_server_read_timeout->GetValue())
     , m_name("zch/1.0.0")
     , m_type("tcp")
-    , m_isStop(true) {
+    , m_isStop(true)
+    , m_reusePort(g_tcp_server_reuse_port->GetValue()) {
 }
 
 /**
@@ -30,6 +35,7 @@ TcpServer::~TcpServer() {
         i->close();
     }
     m_socks.clear();
+    m_acceptThreads.clear();
 }
 
 /**
@@ -52,24 +58,46 @@ bool TcpServer::bind(Address::ptr addr) {
  */
 bool TcpServer::bind(const std::vector<Address::ptr> &addrs
                         , std::vector<Address::ptr> &fails) {
-    for(auto &addr : addrs) {
-        Socket::ptr sock = Socket::CreateTCP(addr);
-        if(!sock->bind(addr)) {
-            LOG_ERROR(g_logger) << "bind fail errno = " << errno << ", errstr = " << strerror(errno);
-            fails.push_back(addr);
-            continue;
+    // 每个地址需要绑定的监听socket对应的线程，不开启 reuse_port 时只有一个不绑定线程的socket
+    std::vector<int> threads;
+    if(m_reusePort) {
+        threads = m_acceptWorker->getWorkerThreadIds();
+        if(threads.empty()) {
+            LOG_WARN(g_logger) << "reuse_port enabled but accept worker has no worker thread, fallback";
         }
+    }
+    if(threads.empty()) {
+        threads.push_back(-1);
+    }
+
+    for(auto &addr : addrs) {
+        for(int thread : threads) {
+            Socket::ptr sock = Socket::CreateTCP(addr);
+            if(m_reusePort && !sock->setReusePort()) {
+                LOG_ERROR(g_logger) << "set SO_REUSEPORT fail errno = " << errno << ", errstr = " << strerror(errno);
+                fails.push_back(addr);
+                break;
+            }
+
+            if(!sock->bind(addr)) {
+                LOG_ERROR(g_logger) << "bind fail errno = " << errno << ", errstr = " << strerror(errno);
+                fails.push_back(addr);
+                break;
+            }
 
-        if(!sock->listen()) {
-            LOG_ERROR(g_logger) << "listen fail errno = " << errno << ", errstr = " << strerror(errno);
-            fails.push_back(addr);
-            continue;
+            if(!sock->listen()) {
+                LOG_ERROR(g_logger) << "listen fail errno = " << errno << ", errstr = " << strerror(errno);
+                fails.push_back(addr);
+                break;
+            }
+            m_socks.push_back(sock);
+            m_acceptThreads.push_back(thread);
         }
-        m_socks.push_back(sock);
     }
 
     if(!fails.empty()) {
         m_socks.clear();
+        m_acceptThreads.clear();
         return false;
     }
 
@@ -89,8 +117,9 @@ bool TcpServer::start() {
     }
 
     m_isStop = false;
-    for(auto &sock : m_socks) {
-        m_acceptWorker->schedule(std::bind(&TcpServer::startAccept, shared_from_this(), sock));
+    for(size_t i = 0; i < m_socks.size(); ++i) {
+        m_acceptWorker->schedule(std::bind(&TcpServer::startAccept, shared_from_this(), m_socks[i])
+                                 , m_acceptThreads[i]);
     }
 
     return true;
@@ -108,6 +137,7 @@ void TcpServer::stop() {
             sock->close();
         }
         m_socks.clear();
+        m_acceptThreads.clear();
     });
 }
 
@@ -124,11 +154,13 @@ void TcpServer::handleClient(Socket::ptr client) {
  * @param[in] sock 服务器socket
  */
 void TcpServer::startAccept(Socket::ptr sock) {
+    // reuse_port 模式下 accept 协程绑定在某个线程上，新连接也留在本线程处理
+    int thread = (m_reusePort && m_ioWorker == m_acceptWorker) ? Scheduler::GetTaskThread() : -1;
     while(!m_isStop) {
         Socket::ptr client = sock->accept();
         if(client) {
             client->setRecvTimeout(m_recvTimeout);
-            m_ioWorker->schedule(std::bind(&TcpServer::handleClient, shared_from_this(), client));
+            m_ioWorker->schedule(std::bind(&TcpServer::handleClient, shared_from_this(), client), thread);
         }
     }
 }
@@ -2,30 +2,30 @@
 #include "base/util.h"
 
 bool Timer::cancel() {
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
+    // 时间轮释放的引用要放到解锁之后再析构
+    Timer::ptr self;
+    TimerManager::MutexType::Lock lock(m_manager->m_mutex);
     if(m_cb) {
         m_cb = nullptr;
-        // 从小根堆中删除这个节点。
-        auto it = m_manager->m_timers.find(shared_from_this());
-        m_manager->m_timers.erase(it);
+        // 从时间轮的格子中摘下这个节点(next 为空说明已经不在时间轮上)。
+        if(next) {
+            m_manager->unlink(this);
+            self.swap(m_self);
+        }
         return true;
     }
     return false;
 }
 
 bool Timer::refresh() {
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-    if(!m_cb) {
-        return false;
-    }
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if(it == m_manager->m_timers.end()) {
+    TimerManager::MutexType::Lock lock(m_manager->m_mutex);
+    if(!m_cb || !next) {
         return false;
     }
-    m_manager->m_timers.erase(it);
-    // 删除要刷新的节点后，设置好时间后重新插入到小根堆中
+    // 摘下要刷新的节点，设置好时间后重新挂到时间轮上
+    m_manager->unlink(this);
     m_next = GetElapsedMS() + m_ms;
-    m_manager->m_timers.insert(shared_from_this());
+    m_manager->link(this);
     return true;
 }
 
@@ -33,23 +33,17 @@ bool Timer::reset(uint64_t ms, bool from_now) {
     if(ms == m_ms && !from_now) {
         return true;
     }
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-    if(!m_cb) {
+    TimerManager::MutexType::Lock lock(m_manager->m_mutex);
+    if(!m_cb || !next) {
         return false;
     }
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if(it == m_manager->m_timers.end()) {
-        return false;
-    }
-    m_manager->m_timers.erase(it);
+    m_manager->unlink(this);
     uint64_t start = 0;
     if(from_now) {
         start = GetElapsedMS();
     } else {
-        // 这里可能是因为有一个构造函数是直接以最终执行时间
-        // m_next 为参数直接构造的，所以这里需要判断是否是
-        // 从当前时间开始计算的，是的话就start等于当前时间，
-        // 不是时 start 等于最终执行时间减去 m_ms 才开始计算。
+        // 不是从当前时间开始计算时，start 等于最终执行时间
+        // 减去 m_ms，即上一次开始计时的时间。
         start = m_next - m_ms;
     }
     m_ms = ms;
@@ -68,42 +62,28 @@ Timer::Timer(uint64_t ms, std::function<void()> cb,
     m_next = GetElapsedMS() + m_ms;
 }
 
-Timer::Timer(uint64_t next)
-    :m_next(next) {
-}
-
-bool Timer::Comparator::operator()(const Timer::ptr& lhs
-            , const Timer::ptr& rhs) const {
-
-    if(!lhs && !rhs) {
-        return false;
-    }
-    if(!lhs) {
-        return true;
-    }
-    if(!rhs) {
-        return false;
-    }
-    if(lhs->m_next < rhs->m_next) {
-        return true;
-    }
-    if(rhs->m_next < lhs->m_next) {
-        return false;
-    }
-        return lhs.get() < rhs.get();
-    }
-
 TimerManager::TimerManager() {
     m_previouseTime = GetElapsedMS();
+    m_currentTick = m_previouseTime;
+    // 每个格子的哨兵都指向自己，表示空链表
+    for(auto& head : m_wheel) {
+        head.prev = head.next = &head;
+    }
 }
 
 TimerManager::~TimerManager() {
+    // 挂在时间轮上的定时器持有自己，这里统一释放
+    std::vector<Timer::ptr> timers;
+    MutexType::Lock lock(m_mutex);
+    for(auto& head : m_wheel) {
+        drainSlot(&head, timers);
+    }
 }
 
 Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb
                                   ,bool recurring) {
     Timer::ptr timer(new Timer(ms, cb, recurring, this));
-    RWMutexType::WriteLock lock(m_mutex);
+    MutexType::Lock lock(m_mutex);
     addTimer(timer, lock);
     return timer;
 }
@@ -122,62 +102,83 @@ Timer::ptr TimerManager::addConditionTimer(uint64_t ms, std::function<void()> cb
 }
 
 uint64_t TimerManager::getNextTimer() {
-    RWMutexType::ReadLock lock(m_mutex);
+    MutexType::Lock lock(m_mutex);
     m_tickled = false;
-    if(m_timers.empty()) {
+    if(m_count == 0) {
+        m_nextExpire = ~0ull;
         return ~0ull;
     }
 
-    const Timer::ptr& next = *m_timers.begin();
+    uint64_t next = ~0ull;
+    // 第 0 层的定时器都在 [m_currentTick, m_currentTick + ROOT_SIZE) 内
+    // 到期，第一个非空的格子就是第 0 层最早的到期时间
+    for(uint64_t i = 0; i < ROOT_SIZE; ++i) {
+        TimerNode *head = slot(0, m_currentTick + i);
+        if(head->next != head) {
+            next = m_currentTick + i;
+            break;
+        }
+    }
+    // 高层的定时器不知道精确的到期时间，取它所在格子 cascade 的时间，
+    // 高层的格子可能比第 0 层的定时器更早 cascade，所以每层都要看
+    for(int level = 1; level < LEVELS; ++level) {
+        int shift = LevelShift(level);
+        uint64_t base = m_currentTick >> shift;
+        // 当前刻度正好落在这一层的格子边界上时，当前这一格还没有 cascade；
+        // 否则当前这一格已经 cascade 过了，挂在里面的是下一圈的定时器
+        uint64_t first = (m_currentTick & ((1ull << shift) - 1)) == 0 ? 0 : 1;
+        for(uint64_t i = first; i < first + LEVEL_SIZE; ++i) {
+            TimerNode *head = slot(level, base + i);
+            if(head->next != head) {
+                next = std::min(next, (base + i) << shift);
+                break;
+            }
+        }
+    }
+    m_nextExpire = next;
+
     uint64_t now_ms = GetElapsedMS();
-    if(now_ms >= next->m_next) {
+    if(now_ms >= next) {
         return 0;
     } else {
-        return next->m_next - now_ms;
+        return next - now_ms;
     }
 }
 
 void TimerManager::listExpiredCb(std::vector<std::function<void()> >& cbs) {
     uint64_t now_ms = GetElapsedMS();
+    // 在锁外析构，回调里捕获的对象析构时可能又会操作定时器
     std::vector<Timer::ptr> expired;
-    {
-        RWMutexType::ReadLock lock(m_mutex);
-        if(m_timers.empty()) {
-            return;
+    MutexType::Lock lock(m_mutex);
+    if(detectClockRollover(now_ms)) {
+        // 使用clock_gettime(CLOCK_MONOTONIC_RAW)，应该不可能出现时间回退的问题，
+        // 真的回退了就把所有定时器都当作超时
+        for(auto& head : m_wheel) {
+            drainSlot(&head, expired);
         }
+        m_currentTick = now_ms;
     }
-    RWMutexType::WriteLock lock(m_mutex);
-    if(m_timers.empty()) {
-        return;
+    // 一格一格推进到当前时间，每到第 0 层转完一圈就从高层 cascade 下来，
+    // 到期的整个格子一次摘下。时间轮空了就不必再一格一格地走。
+    while(m_currentTick <= now_ms && m_count > 0) {
+        if((m_currentTick & (ROOT_SIZE - 1)) == 0) {
+            for(int level = 1; level < LEVELS; ++level) {
+                if(cascade(level, m_currentTick >> LevelShift(level)) != 0) {
+                    break;
+                }
+            }
+        }
+        drainSlot(slot(0, m_currentTick), expired);
+        ++m_currentTick;
     }
-    bool rollover = false;
-    if(detectClockRollover(now_ms)) {
-        // 使用clock_gettime(CLOCK_MONOTONIC_RAW)，应该不可能出现时间回退的问题
-        rollover = true;
+    if(m_currentTick <= now_ms) {
+        m_currentTick = now_ms + 1;
     }
-    if(!rollover && ((*m_timers.begin())->m_next > now_ms)) {
-        // 全部都没超时，所以不需要处理
+    if(expired.empty()) {
         return;
     }
 
-    Timer::ptr now_timer(new Timer(now_ms));
-    // 将it 指向第一个没超时的下标节点，即第一个 next_timer->m_next >= now_ms
-    auto it = rollover ? m_timers.end() : m_timers.lower_bound(now_timer);
-    // 而其实next_timer == now_timer 也算是超时了的，而且它只是指向了第一个相等
-    // 的节点，后面可能还有多个，所以如果后面还有相等的，也要包括进去。
-    while(it != m_timers.end() && (*it)->m_next == now_ms) {
-        ++it;
-    }
-    // 将m_timers到it之间的节点加入到expired中。
-    expired.insert(expired.begin(), m_timers.begin(), it);
-    m_timers.erase(m_timers.begin(), it);
-
-    // 上面已经将超时的节点已经找出来了，下面只需将回调函数提取
-    // 出来。
-    // 传过来接收的cbs是一个指针，所以要为它分配空间，大小即为
-    // expired.size()。
-    cbs.reserve(expired.size());
-
+    cbs.reserve(cbs.size() + expired.size());
     for(auto& timer : expired) {
         cbs.push_back(timer->m_cb);
         if(timer->m_recurring) {
@@ -185,7 +186,8 @@ void TimerManager::listExpiredCb(std::vector<std::function<void()> >& cbs) {
             // 需要重新设置超时时间
             timer->m_next = now_ms + timer->m_ms;
             // 重复利用这个Timer，而不是直接销毁。
-            m_timers.insert(timer);
+            timer->m_self = timer;
+            link(timer.get());
         } else {
             timer->m_cb = nullptr;
         }
@@ -193,20 +195,17 @@ void TimerManager::listExpiredCb(std::vector<std::function<void()> >& cbs) {
 }
 
 bool TimerManager::hasTimer() {
-    RWMutexType::ReadLock lock(m_mutex);
-    return !m_timers.empty();
-}
-
-void TimerManager::addTimer(Timer::ptr val, RWMutexType::WriteLock& lock) {
-    // 这句话的意思是将 val 插入到 m_timers 中，插入完后，
-    // 因为这时是属于一个整体，即 m_timers，而 it 是要获取
-    // 定时器节点，而它处于 set 的first 位置，所以要 .first
-    // 取出。
-    auto it = m_timers.insert(val).first;
-    // 因为插入前第一个节点（最小的超时时间）还没过期，从 !m_tickled 
-    // 可知还没过期，但是现在你插入后，比最小的还小，说明要更新定时器，
-    // 因为你比它还早过期。所以at_front = true。
-    bool at_front = (it == m_timers.begin()) && !m_tickled;
+    MutexType::Lock lock(m_mutex);
+    return m_count > 0;
+}
+
+void TimerManager::addTimer(Timer::ptr val, MutexType::Lock& lock) {
+    val->m_self = val;
+    link(val.get());
+    // 空闲线程会一直等到 m_nextExpire，新定时器比它还早到期就要
+    // 通知 IOManager 重新计算超时。m_tickled 保证在空闲线程重新
+    // 调用 getNextTimer 之前只通知一次。
+    bool at_front = (val->m_next < m_nextExpire) && !m_tickled;
     if(at_front) {
         m_tickled = true;
     }
@@ -217,6 +216,69 @@ void TimerManager::addTimer(Timer::ptr val, RWMutexType::WriteLock& lock) {
     }
 }
 
+TimerNode *TimerManager::slot(int level, uint64_t index) {
+    if(level == 0) {
+        return &m_wheel[index & (ROOT_SIZE - 1)];
+    }
+    return &m_wheel[ROOT_SIZE + (level - 1) * LEVEL_SIZE + (index & (LEVEL_SIZE - 1))];
+}
+
+void TimerManager::link(Timer *timer) {
+    // 已经过期的定时器放到当前刻度，下一次推进时立即触发
+    uint64_t expires = std::max(timer->m_next, m_currentTick);
+    uint64_t delta = expires - m_currentTick;
+    int level = 0;
+    while(level < LEVELS - 1 && delta >= (1ull << LevelShift(level + 1))) {
+        ++level;
+    }
+    if(level == LEVELS - 1 && delta >= (1ull << (LevelShift(level) + LEVEL_BITS))) {
+        // 超出时间轮的范围，先挂在最远的位置，cascade 时会重新计算
+        expires = m_currentTick + (1ull << (LevelShift(level) + LEVEL_BITS)) - 1;
+    }
+
+    TimerNode *head = slot(level, expires >> LevelShift(level));
+    TimerNode *node = timer;
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+    ++m_count;
+}
+
+void TimerManager::unlink(Timer *timer) {
+    TimerNode *node = timer;
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = nullptr;
+    --m_count;
+}
+
+uint64_t TimerManager::cascade(int level, uint64_t index) {
+    TimerNode *head = slot(level, index);
+    if(head->next == head) {
+        return index & (LEVEL_SIZE - 1);
+    }
+    // 先把整条链表拿下来，再逐个按到期时间挂到低层
+    TimerNode *node = head->next;
+    head->prev->next = nullptr;
+    head->prev = head->next = head;
+    while(node) {
+        TimerNode *next = node->next;
+        --m_count;
+        link(static_cast<Timer *>(node));
+        node = next;
+    }
+    return index & (LEVEL_SIZE - 1);
+}
+
+void TimerManager::drainSlot(TimerNode *head, std::vector<Timer::ptr>& out) {
+    while(head->next != head) {
+        Timer *timer = static_cast<Timer *>(head->next);
+        unlink(timer);
+        out.push_back(std::move(timer->m_self));
+    }
+}
+
 bool TimerManager::detectClockRollover(uint64_t now_ms) {
     bool rollover = false;
     if(now_ms < m_previouseTime &&
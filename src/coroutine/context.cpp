@@ -0,0 +1,106 @@
+#include <stdint.h>
+
+#include "coroutine/context.h"
+
+#ifndef FIBER_USE_UCONTEXT
+
+#if defined(__x86_64__)
+
+// 栈上依次保存 mxcsr/x87 控制字、r12-r15、rbx、rbp，最后 ret 到返回地址
+asm(R"(
+    .text
+    .globl fiber_switch_context
+    .type fiber_switch_context, @function
+    .p2align 4
+fiber_switch_context:
+    pushq %rbp
+    pushq %rbx
+    pushq %r15
+    pushq %r14
+    pushq %r13
+    pushq %r12
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r12
+    popq %r13
+    popq %r14
+    popq %r15
+    popq %rbx
+    popq %rbp
+    ret
+    .size fiber_switch_context, .-fiber_switch_context
+)");
+
+void *fiber_make_context(void *stack, size_t size, void (*entry)()) {
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+    uint64_t *sp = (uint64_t *)top;
+    // entry 被 ret 进入，进入时 rsp 要和 call 之后一样是 16n+8，[rsp] 是一个假的返回地址
+    *--sp = 0;
+    *--sp = (uint64_t)(uintptr_t)entry;
+    // rbp、rbx、r15、r14、r13、r12
+    for (int i = 0; i < 6; ++i) {
+        *--sp = 0;
+    }
+    // 默认的 mxcsr 和 x87 控制字
+    *--sp = 0x1f80ull | (0x037full << 32);
+    return sp;
+}
+
+#elif defined(__aarch64__)
+
+// 栈上保存 d8-d15、x19-x28、x29(fp)、x30(lr)，最后 ret 到 x30
+asm(R"(
+    .text
+    .globl fiber_switch_context
+    .type fiber_switch_context, %function
+    .p2align 4
+fiber_switch_context:
+    sub sp, sp, #0xb0
+    stp d8, d9, [sp, #0x00]
+    stp d10, d11, [sp, #0x10]
+    stp d12, d13, [sp, #0x20]
+    stp d14, d15, [sp, #0x30]
+    stp x19, x20, [sp, #0x40]
+    stp x21, x22, [sp, #0x50]
+    stp x23, x24, [sp, #0x60]
+    stp x25, x26, [sp, #0x70]
+    stp x27, x28, [sp, #0x80]
+    stp x29, x30, [sp, #0x90]
+    mov x9, sp
+    str x9, [x0]
+    mov sp, x1
+    ldp d8, d9, [sp, #0x00]
+    ldp d10, d11, [sp, #0x10]
+    ldp d12, d13, [sp, #0x20]
+    ldp d14, d15, [sp, #0x30]
+    ldp x19, x20, [sp, #0x40]
+    ldp x21, x22, [sp, #0x50]
+    ldp x23, x24, [sp, #0x60]
+    ldp x25, x26, [sp, #0x70]
+    ldp x27, x28, [sp, #0x80]
+    ldp x29, x30, [sp, #0x90]
+    add sp, sp, #0xb0
+    ret
+    .size fiber_switch_context, .-fiber_switch_context
+)");
+
+void *fiber_make_context(void *stack, size_t size, void (*entry)()) {
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+    uint64_t *sp = (uint64_t *)(top - 0xb0);
+    for (int i = 0; i < 0xb0 / 8; ++i) {
+        sp[i] = 0;
+    }
+    // x30(lr) 为入口函数，x29(fp) 为 0 作为栈回溯的终点
+    sp[0x98 / 8] = (uint64_t)(uintptr_t)entry;
+    return sp;
+}
+
+#endif
+
+#endif
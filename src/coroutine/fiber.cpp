@@ -1,8 +1,14 @@
+#include <algorithm>
 #include <atomic>
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "coroutine/fiber.h"
 #include "coroutine/scheduler.h"
+#include "base/config.h"
 
 static zch::Logger::ptr g_logger = LOG_NAME("system");
 
@@ -17,17 +23,142 @@ static thread_local Fiber *t_fiber = nullptr;
 // 中运行，智能指针形式
 static thread_local Fiber::ptr t_thread_fiber = nullptr;
 
-// 协程栈默认大小 128k
-static uint32_t fiber_stack_size = 128 * 1024;
+static zch::ConfigVar<uint32_t>::ptr g_fiber_stack_size =
+    zch::Config::Lookup("fiber.stack_size", (uint32_t)(128 * 1024), "fiber stack size");
 
-// malloc 栈内存分配器
-class MallocStackAllocator {
+static zch::ConfigVar<uint32_t>::ptr g_fiber_stack_pool_size =
+    zch::Config::Lookup("fiber.stack_pool_size", (uint32_t)64, "max cached fiber stacks per thread");
+
+// 每个线程缓存的空闲栈，用栈内存本身的第一个字保存下一个空闲栈，组成单链表。
+// 这几个线程局部变量都是平凡类型，线程退出时其它线程局部对象析构还可以安全使用
+static thread_local void *t_free_stacks = nullptr;
+static thread_local size_t t_free_stack_count = 0;
+// 缓存的栈的大小，只缓存同一种大小的栈
+static thread_local size_t t_free_stack_size = 0;
+// 线程正在退出，缓存已经释放，之后释放的栈直接归还系统
+static thread_local bool t_stack_cache_closed = false;
+
+// mmap 栈内存分配器，栈底(低地址)留一页 PROT_NONE 的保护页，栈溢出时直接段错误，
+// 而不是悄悄写坏别的内存。释放的栈先放进本线程的缓存，下次创建协程时直接复用。
+class MmapStackAllocator {
 public:
-    static void *Alloc(size_t size) { return malloc(size); }
-    static void Dealloc(void *vp, size_t size) { return free(vp); }
+    static void *Alloc(size_t size) {
+        size = RoundUp(size);
+        if (t_free_stacks && size == t_free_stack_size) {
+            void *vp = t_free_stacks;
+            t_free_stacks = *(void **)vp;
+            --t_free_stack_count;
+            return vp;
+        }
+
+        size_t page = PageSize();
+        void *base = mmap(nullptr, size + page, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (base == MAP_FAILED) {
+            LOG_ERROR(g_logger) << "mmap fiber stack error, size = " << size << ", error = " << strerror(errno);
+            return nullptr;
+        }
+        if (mprotect(base, page, PROT_NONE)) {
+            LOG_ERROR(g_logger) << "mprotect fiber stack guard page error: " << strerror(errno);
+        }
+        return (char *)base + page;
+    }
+
+    static void Dealloc(void *vp, size_t size) {
+        size = RoundUp(size);
+        if (!t_stack_cache_closed) {
+            if (!t_free_stacks) {
+                // 缓存为空时以这次释放的栈大小为准，fiber.stack_size 修改之后也能继续缓存
+                t_free_stack_size = size;
+            }
+            if (size == t_free_stack_size && t_free_stack_count < g_fiber_stack_pool_size->GetValue()) {
+                // 第一次缓存栈时构造，线程退出时析构，把缓存的栈归还系统
+                static thread_local StackCacheCleaner s_cleaner;
+                (void)s_cleaner;
+                *(void **)vp = t_free_stacks;
+                t_free_stacks = vp;
+                ++t_free_stack_count;
+                return;
+            }
+        }
+        Unmap(vp, size);
+    }
+
+    // 把本线程缓存的栈全部归还系统，之后不再缓存
+    static void Clear() {
+        while (t_free_stacks) {
+            void *vp = t_free_stacks;
+            t_free_stacks = *(void **)vp;
+            Unmap(vp, t_free_stack_size);
+        }
+        t_free_stack_count = 0;
+        t_stack_cache_closed = true;
+    }
+
+private:
+    struct StackCacheCleaner {
+        ~StackCacheCleaner() { Clear(); }
+    };
+
+    static size_t PageSize() {
+        static size_t s_page_size = sysconf(_SC_PAGESIZE);
+        return s_page_size;
+    }
+
+    static size_t RoundUp(size_t size) {
+        size_t page = PageSize();
+        return (size + page - 1) / page * page;
+    }
+
+    static void Unmap(void *vp, size_t size) {
+        size_t page = PageSize();
+        if (munmap((char *)vp - page, size + page)) {
+            LOG_ERROR(g_logger) << "munmap fiber stack error: " << strerror(errno);
+        }
+    }
 };
 
-using StackAllocator = MallocStackAllocator;
+using StackAllocator = MmapStackAllocator;
+
+static zch::ConfigVar<bool>::ptr g_fiber_shared_stack =
+    zch::Config::Lookup("fiber.shared_stack", false, "run scheduler callback fibers on per-thread shared stacks");
+
+static zch::ConfigVar<uint32_t>::ptr g_fiber_shared_stack_count =
+    zch::Config::Lookup("fiber.shared_stack_count", (uint32_t)4, "shared stacks per thread");
+
+// 共享栈，同一时刻只有一个协程(occupant)的栈内容真正放在上面，
+// 其它协程被挤出去时把用到的部分拷到自己的缓冲区里
+struct SharedStack {
+    void *stack = nullptr;
+    size_t size = 0;
+    Fiber *occupant = nullptr;
+};
+
+// 每个线程的共享栈，协程创建时轮流分配。挂起的协程一直指向它们，
+// 所以线程退出时也不回收
+static thread_local SharedStack *t_shared_stacks = nullptr;
+static thread_local size_t t_shared_stack_count = 0;
+static thread_local size_t t_shared_stack_next = 0;
+
+/**
+* @brief 为当前线程新建的协程分配一个共享栈
+*/
+static SharedStack *AcquireSharedStack() {
+    if (!t_shared_stacks) {
+        size_t count = std::max<size_t>(1, g_fiber_shared_stack_count->GetValue());
+        t_shared_stacks = new SharedStack[count];
+        for (size_t i = 0; i < count; ++i) {
+            t_shared_stacks[i].size  = Fiber::GetDefaultStackSize();
+            t_shared_stacks[i].stack = StackAllocator::Alloc(t_shared_stacks[i].size);
+            if (!t_shared_stacks[i].stack) {
+                LOG_ERROR(g_logger) << "alloc shared stack fail!";
+                assert(false);
+            }
+        }
+        t_shared_stack_count = count;
+    }
+    return &t_shared_stacks[t_shared_stack_next++ % t_shared_stack_count];
+}
 
 /**
 * @brief 无参构造函数，只用于创建线程的第一个协程，也就是线程主函数对应的协程
@@ -37,11 +168,13 @@ using StackAllocator = MallocStackAllocator;
 Fiber::Fiber() {
     SetThis(this); // 设置 t_fiber
     m_state = RUNNING;
+#ifdef FIBER_USE_UCONTEXT
     // 获取主协程的上下文
     if (getcontext(&m_ctx)) {
         LOG_ERROR(g_logger) << "getcontext error!";
         assert(false);
     }
+#endif
 
     ++s_fiber_count;
     m_id = s_fiber_id++;  // 协程 id 从 0 开始，用完加 1
@@ -54,25 +187,29 @@ Fiber::Fiber() {
 * @param[in] cb 协程入口函数
 * @param[in] stacksize 栈大小
 * @param[in] run_in_scheduler 本协程是否参与调度器调度
+* @param[in] shared_stack 是否运行在当前线程的共享栈上
 @ @author zch
 */ 
-Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool run_in_scheduler)
+Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool run_in_scheduler, bool shared_stack)
     : m_id(s_fiber_id++)
     , m_cb(cb)
     , m_runInScheduler(run_in_scheduler) {
     ++s_fiber_count;
-    m_stacksize = stacksize ? stacksize : fiber_stack_size;
-    m_stack     = StackAllocator::Alloc(m_stacksize);
-
-    if (getcontext(&m_ctx)) {
-        LOG_ERROR(g_logger) << "getcontext error!";
-        assert(false);
+    if (shared_stack && SharedStackEnabled()) {
+        // 共享栈上的地址只在本线程有效，协程只能在本线程 resume
+        m_sharedStack = AcquireSharedStack();
+        m_thread      = GetThreadId();
+        m_stacksize   = m_sharedStack->size;
+        m_stack       = m_sharedStack->stack;
+    } else {
+        m_stacksize = stacksize ? stacksize : GetDefaultStackSize();
+        m_stack     = StackAllocator::Alloc(m_stacksize);
+        if (!m_stack) {
+            LOG_ERROR(g_logger) << "Fiber " << m_id << " alloc stack fail!";
+            assert(false);
+        }
     }
 
-    m_ctx.uc_link          = nullptr;
-    m_ctx.uc_stack.ss_sp   = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
-
     // 将此上下文 m_ctx 与 MainFunc 函数绑定，当调度器让此上下文的协程
     // 运行时，就执行 MainFunc 函数，就会执行绑定在协程里面的 cb。在
     // 前面列表初始化中已经为 cb 初始化。
@@ -80,7 +217,7 @@ Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool run_in_scheduler)
     // 因为运行到该协程时，不单单就只是执行函数那么简单，你还要为
     // 执行完函数后的一系列处理，如状态变化，yield 等操作，都要协程
     // 执行完后自动管理，而不是后面通过用户管理。
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
+    initContext();
 
     LOG_DEBUG(g_logger) << "Task fiber " << m_id << " created!";
 }
@@ -98,7 +235,15 @@ Fiber::~Fiber() {
             LOG_ERROR(g_logger) << "Fiber " << m_id << " not TERM state, can't destroy!";
             assert(false);
         }
-        StackAllocator::Dealloc(m_stack, m_stacksize);
+        if (m_sharedStack) {
+            // 共享栈属于线程，不归还，只释放保存栈内容的缓冲区
+            if (m_sharedStack->occupant == this) {
+                m_sharedStack->occupant = nullptr;
+            }
+            free(m_saveBuf);
+        } else {
+            StackAllocator::Dealloc(m_stack, m_stacksize);
+        }
     } else {
         // 没有栈，说明是线程的主协程
         // 主协程没有cb
@@ -115,6 +260,84 @@ Fiber::~Fiber() {
     }
 }
 
+/**
+* @brief 在协程栈上构造初始上下文，切换过来时从 MainFunc 开始执行
+@ @author zch
+*/
+void Fiber::initContext() {
+#ifdef FIBER_USE_UCONTEXT
+    if (getcontext(&m_ctx)) {
+        LOG_ERROR(g_logger) << "getcontext error!";
+        assert(false);
+    }
+
+    m_ctx.uc_link          = nullptr;
+    m_ctx.uc_stack.ss_sp   = m_stack;
+    m_ctx.uc_stack.ss_size = m_stacksize;
+
+    makecontext(&m_ctx, &Fiber::MainFunc, 0);
+#else
+    if (m_sharedStack) {
+        // 共享栈上可能还放着别的协程，等到 resume 占用共享栈时再构造初始上下文
+        m_ctx      = nullptr;
+        m_saveSize = 0;
+        return;
+    }
+    m_ctx = fiber_make_context(m_stack, m_stacksize, &Fiber::MainFunc);
+#endif
+}
+
+/**
+* @brief resume 之前让本协程占用共享栈
+@ @author zch
+*/
+void Fiber::switchSharedStack() {
+#ifndef FIBER_USE_UCONTEXT
+    assert(m_thread == GetThreadId());
+    SharedStack *stack = m_sharedStack;
+    if (stack->occupant == this) {
+        // 上次挂起之后没有别的协程用过这块栈，内容还在
+        return;
+    }
+    char *top = (char *)(((uintptr_t)stack->stack + stack->size) & ~(uintptr_t)15);
+    Fiber *prev = stack->occupant;
+    if (prev) {
+        // 只拷贝上一个占用者从保存的栈指针到栈顶实际用到的部分，缓冲区按需要的大小分配
+        size_t used = top - (char *)prev->m_ctx;
+        if (prev->m_saveCap < used || prev->m_saveCap > used * 2) {
+            free(prev->m_saveBuf);
+            prev->m_saveBuf = (char *)malloc(used);
+            if (!prev->m_saveBuf) {
+                LOG_ERROR(g_logger) << "Fiber " << prev->m_id << " alloc stack save buffer fail!";
+                assert(false);
+            }
+            prev->m_saveCap = used;
+        }
+        memcpy(prev->m_saveBuf, prev->m_ctx, used);
+        prev->m_saveSize = used;
+    }
+    stack->occupant = this;
+    if (!m_ctx) {
+        m_ctx = fiber_make_context(stack->stack, stack->size, &Fiber::MainFunc);
+    } else {
+        memcpy(top - m_saveSize, m_saveBuf, m_saveSize);
+    }
+#endif
+}
+
+/**
+* @brief 保存当前上下文到 from，切换到 to
+@ @author zch
+*/
+bool Fiber::SwapContext(Fiber *from, Fiber *to) {
+#ifdef FIBER_USE_UCONTEXT
+    return swapcontext(&from->m_ctx, &to->m_ctx) == 0;
+#else
+    fiber_switch_context(&from->m_ctx, to->m_ctx);
+    return true;
+#endif
+}
+
 /**
 * @brief 获取当前协程，同时充当初始化当前线程主协程的作用，这个函数在使用协程之前要调用一下
 @ @author zch
@@ -150,16 +373,7 @@ void Fiber::reset(std::function<void()> cb) {
     }
 
     m_cb = cb;
-    if (getcontext(&m_ctx)) {
-        LOG_ERROR(g_logger) << "getcontext error!";
-        assert(false);
-    }
-
-    m_ctx.uc_link          = nullptr;
-    m_ctx.uc_stack.ss_sp   = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
-
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
+    initContext();
     m_state = READY;
 }
 
@@ -174,24 +388,44 @@ void Fiber::resume() {
         assert(false);
     }
 
+    if (m_sharedStack) {
+        switchSharedStack();
+    }
+
     // 设置 t_fiber
     SetThis(this);
     m_state = RUNNING;
 
     // 如果协程参与调度器调度，那么应该和调度器的主协程进行swap，而不是线程主协程
     if (m_runInScheduler) {
-        // 第一个参数为获取调度器协程,m_ctx为调用者的上下文，即调用 resume() 的协程。
-        // 使用 swapcontext() 后就切换到调用者的上下文了。
-        if (swapcontext(&(Scheduler::GetMainFiber()->m_ctx), &m_ctx)) {
+        // 当前上下文保存到调度器协程中，然后切换到本协程的上下文。
+        if (!SwapContext(Scheduler::GetMainFiber(), this)) {
             LOG_WARN(g_logger) << "Fiber " << GetFiberId() << " and schedule main fiber swap fail!";
             assert(false);
         }
     } else {
-        if (swapcontext(&(t_thread_fiber->m_ctx), &m_ctx)) {
+        if (!SwapContext(t_thread_fiber.get(), this)) {
             LOG_WARN(g_logger) << "Fiber " << GetFiberId() << " and main fiber swap fail!";
             assert(false);
         }
     }
+
+    // 切回这里时协程的上下文已经保存好了，半路让出的协程现在才可以被再次 resume
+    if (m_state == RUNNING) {
+        m_state = READY;
+    }
+
+    // 共享栈协程只在本线程运行，这里读状态是安全的。执行完了就让出共享栈，
+    // 之后别的协程占用时不用再把它拷出去
+    if (m_sharedStack && m_state == TERM) {
+        if (m_sharedStack->occupant == this) {
+            m_sharedStack->occupant = nullptr;
+        }
+        free(m_saveBuf);
+        m_saveBuf  = nullptr;
+        m_saveSize = 0;
+        m_saveCap  = 0;
+    }
 }
 
 /**
@@ -208,19 +442,18 @@ void Fiber::yield() {
 
     SetThis(t_thread_fiber.get());
 
-    if (m_state != TERM) {
-        //说明是函数执行到一半被切换掉的。
-        m_state = READY;
-    }
+    // 执行到一半被切换掉的协程，这里还不能置为 READY：状态一变，其它线程就可能从任务队列
+    // 里取走它并 resume，而这时上下文还没有保存，会接着上一次让出时的栈指针运行。
+    // 等切回 resume 之后再由 resume 置为 READY
 
     // 如果协程参与调度器调度，那么应该和调度器的主协程进行swap，而不是线程主协程
     if (m_runInScheduler) {
-        if (swapcontext(&m_ctx, &(Scheduler::GetMainFiber()->m_ctx))) {
+        if (!SwapContext(this, Scheduler::GetMainFiber())) {
             LOG_WARN(g_logger) << "Fiber " << GetFiberId() << " and schedule main fiber swap fail!";
             assert(false);
         }
     } else {
-        if (swapcontext(&m_ctx, &(t_thread_fiber->m_ctx))) {
+        if (!SwapContext(this, t_thread_fiber.get())) {
             LOG_WARN(g_logger) << "Fiber " << GetFiberId() << " and main fiber swap fail!";
             assert(false);
         }
@@ -249,6 +482,26 @@ void Fiber::MainFunc() {
     raw_ptr->yield();
 }
 
+/**
+* @brief 获取默认的协程栈大小
+@ @author zch
+*/
+uint32_t Fiber::GetDefaultStackSize() {
+    return g_fiber_stack_size->GetValue();
+}
+
+/**
+* @brief 是否开启了共享栈
+@ @author zch
+*/
+bool Fiber::SharedStackEnabled() {
+#ifdef FIBER_USE_UCONTEXT
+    return false;
+#else
+    return g_fiber_shared_stack->GetValue();
+#endif
+}
+
 /**
 * @brief 获取当前协程 id
 @ @author zch
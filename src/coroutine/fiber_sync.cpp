@@ -0,0 +1,269 @@
+#include <chrono>
+
+#include "coroutine/fiber_sync.h"
+#include "coroutine/iomanager.h"
+#include "base/log.h"
+
+static zch::Logger::ptr g_logger = LOG_NAME("system");
+
+FiberWaiter::FiberWaiter()
+    : m_state(WAITING)
+    , m_scheduler(nullptr)
+    , m_thread(-1)
+    , m_woken(false) {
+    Scheduler *sched = Scheduler::GetThis();
+    Fiber::ptr cur = Fiber::GetThis();
+    // 调度线程上的主协程(调度协程)不能挂起，只有调度任务才按协程等待
+    if(sched && cur.get() != Scheduler::GetMainFiber()) {
+        m_scheduler = sched;
+        m_fiber = cur;
+        m_thread = Scheduler::GetTaskThread();
+    }
+}
+
+/**
+ * @brief 唤醒等待者
+ * @return bool 等待者已经超时返回 false
+ */
+bool FiberWaiter::notify() {
+    int expect = WAITING;
+    if(!m_state.compare_exchange_strong(expect, NOTIFIED)) {
+        return false;
+    }
+    wake();
+    return true;
+}
+
+void FiberWaiter::timeout() {
+    int expect = WAITING;
+    if(m_state.compare_exchange_strong(expect, TIMEDOUT)) {
+        wake();
+    }
+}
+
+/**
+ * @brief 把等待的协程放回调度器，或者唤醒等待的线程
+ * @details 协程可能还没来得及 yield 就被唤醒，调度器取任务时会跳过还在 RUNNING 的
+ *          协程，等它 yield 之后再执行
+ */
+void FiberWaiter::wake() {
+    if(m_scheduler) {
+        // 先加入调度再减挂起计数，stopping() 不会看到两者同时为 0
+        m_scheduler->schedule(m_fiber, m_thread);
+        m_scheduler->removeParkedFiber();
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_woken = true;
+    m_cond.notify_one();
+}
+
+/**
+ * @brief 挂起当前协程(或线程)，直到 notify 或者超时
+ * @param[in] timeout_ms 超时时间(毫秒)，~0ull 表示不超时
+ * @return bool 被 notify 唤醒返回 true
+ */
+bool FiberWaiter::wait(uint64_t timeout_ms) {
+    if(m_scheduler) {
+        Timer::ptr timer;
+        if(timeout_ms != ~0ull) {
+            IOManager *iom = IOManager::GetThis();
+            if(iom) {
+                // 定时器回调持有等待者，回调已经取出排队时等待者先返回了也不会访问到野指针
+                FiberWaiter::ptr self = shared_from_this();
+                timer = iom->addTimer(timeout_ms, [self]() { self->timeout(); });
+            } else {
+                LOG_WARN(g_logger) << "FiberWaiter timeout ignored, not in IOManager";
+            }
+        }
+        // 挂起期间不算活跃线程也不在任务队列里，要单独计数，否则调度器停止时会把它丢下
+        m_scheduler->addParkedFiber();
+        m_fiber->yield();
+        if(timer) {
+            timer->cancel();
+        }
+        m_fiber.reset();
+        return m_state == NOTIFIED;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if(timeout_ms == ~0ull) {
+        m_cond.wait(lock, [this]() { return m_woken; });
+    } else if(!m_cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this]() { return m_woken; })) {
+        int expect = WAITING;
+        if(m_state.compare_exchange_strong(expect, TIMEDOUT)) {
+            return false;
+        }
+        // 超时的同时被 notify 抢到了，等 notify 把 m_woken 置上
+        m_cond.wait(lock, [this]() { return m_woken; });
+    }
+    return m_state == NOTIFIED;
+}
+
+/**
+ * @brief 把超时的等待者从队列里删掉，已经被 notify 取走时什么也不做
+ */
+static void RemoveWaiter(Spinlock &guard, std::deque<FiberWaiter::ptr> &waiters,
+                         const FiberWaiter::ptr &waiter) {
+    Spinlock::Lock lock(guard);
+    for(auto it = waiters.begin(); it != waiters.end(); ++it) {
+        if(*it == waiter) {
+            waiters.erase(it);
+            break;
+        }
+    }
+}
+
+FiberMutex::FiberMutex()
+    : m_locked(false) {
+}
+
+void FiberMutex::lock() {
+    Spinlock::Lock lock(m_guard);
+    if(!m_locked) {
+        m_locked = true;
+        return;
+    }
+    FiberWaiter::ptr waiter = std::make_shared<FiberWaiter>();
+    m_waiters.push_back(waiter);
+    lock.unlock();
+    // 被唤醒时锁已经交到了手上，m_locked 一直是 true
+    waiter->wait();
+}
+
+bool FiberMutex::tryLock() {
+    Spinlock::Lock lock(m_guard);
+    if(m_locked) {
+        return false;
+    }
+    m_locked = true;
+    return true;
+}
+
+void FiberMutex::unlock() {
+    Spinlock::Lock lock(m_guard);
+    if(m_waiters.empty()) {
+        m_locked = false;
+        return;
+    }
+    FiberWaiter::ptr waiter = m_waiters.front();
+    m_waiters.pop_front();
+    lock.unlock();
+    // 加锁不会超时，notify 一定成功
+    waiter->notify();
+}
+
+FiberSemaphore::FiberSemaphore(uint32_t count)
+    : m_count(count) {
+}
+
+void FiberSemaphore::wait() {
+    waitFor(~0ull);
+}
+
+/**
+ * @brief 带超时的获取
+ * @param[in] timeout_ms 超时时间(毫秒)，~0ull 表示不超时
+ * @return bool 超时返回 false
+ */
+bool FiberSemaphore::waitFor(uint64_t timeout_ms) {
+    Spinlock::Lock lock(m_guard);
+    if(m_count > 0) {
+        --m_count;
+        return true;
+    }
+    if(timeout_ms == 0) {
+        return false;
+    }
+    FiberWaiter::ptr waiter = std::make_shared<FiberWaiter>();
+    m_waiters.push_back(waiter);
+    lock.unlock();
+    if(waiter->wait(timeout_ms)) {
+        return true;
+    }
+    RemoveWaiter(m_guard, m_waiters, waiter);
+    return false;
+}
+
+bool FiberSemaphore::tryWait() {
+    Spinlock::Lock lock(m_guard);
+    if(m_count == 0) {
+        return false;
+    }
+    --m_count;
+    return true;
+}
+
+/**
+ * @brief 释放信号量
+ * @details 有等待者时计数直接交给它，唤醒放在锁外面做；等待者恰好超时的话再交给下一个
+ */
+void FiberSemaphore::notify() {
+    while(true) {
+        Spinlock::Lock lock(m_guard);
+        if(m_waiters.empty()) {
+            ++m_count;
+            return;
+        }
+        FiberWaiter::ptr waiter = m_waiters.front();
+        m_waiters.pop_front();
+        lock.unlock();
+        if(waiter->notify()) {
+            return;
+        }
+    }
+}
+
+uint32_t FiberSemaphore::getCount() {
+    Spinlock::Lock lock(m_guard);
+    return m_count;
+}
+
+void FiberCondition::wait(FiberMutex::Lock &lock) {
+    waitFor(lock, ~0ull);
+}
+
+/**
+ * @brief 带超时的等待
+ * @details 先登记等待者再释放锁，释放锁之后的 notify 一定能看到这个等待者
+ */
+bool FiberCondition::waitFor(FiberMutex::Lock &lock, uint64_t timeout_ms) {
+    FiberWaiter::ptr waiter = std::make_shared<FiberWaiter>();
+    {
+        Spinlock::Lock guard(m_guard);
+        m_waiters.push_back(waiter);
+    }
+    lock.unlock();
+    bool rt = waiter->wait(timeout_ms);
+    if(!rt) {
+        RemoveWaiter(m_guard, m_waiters, waiter);
+    }
+    lock.lock();
+    return rt;
+}
+
+void FiberCondition::notifyOne() {
+    while(true) {
+        Spinlock::Lock guard(m_guard);
+        if(m_waiters.empty()) {
+            return;
+        }
+        FiberWaiter::ptr waiter = m_waiters.front();
+        m_waiters.pop_front();
+        guard.unlock();
+        if(waiter->notify()) {
+            return;
+        }
+    }
+}
+
+void FiberCondition::notifyAll() {
+    std::deque<FiberWaiter::ptr> waiters;
+    {
+        Spinlock::Lock guard(m_guard);
+        waiters.swap(m_waiters);
+    }
+    for(auto &i : waiters) {
+        i->notify();
+    }
+}
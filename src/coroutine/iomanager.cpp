@@ -2,43 +2,101 @@
 #include <assert.h>
 #include <sys/epoll.h> // for epoll_xxx()
 #include <fcntl.h>     // for fcntl()
+#include <poll.h>      // for POLLIN/POLLOUT
 
 #include "coroutine/iomanager.h"
+#include "base/config.h"
 
 enum EpollCtlOp {
 };
 
 static zch::Logger::ptr g_logger = LOG_NAME("system");
 
+static zch::ConfigVar<bool>::ptr g_epoll_persistent =
+    zch::Config::Lookup("server.epoll_persistent", false,
+            "register socket fd to epoll once with EPOLLIN|EPOLLOUT|EPOLLET|EPOLLRDHUP");
+
+// io_uring 后端 SQ 的大小
+static const unsigned URING_ENTRIES = 1024;
+
+// io_uring 的 user_data 低 3 位标记完成事件的类型，指针至少 8 字节对齐，低 3 位可以借用
+enum UringTag {
+    // 完成式 IO 操作，user_data 为 IoOp 指针
+    TAG_OP     = 0,
+    // 读/写事件的 POLL_ADD，user_data 为 FdContext 指针 | seq << 48 | tag
+    TAG_READ   = 1,
+    TAG_WRITE  = 2,
+    // tickle 管道的 POLL_ADD
+    TAG_TICKLE = 3,
+    // POLL_REMOVE、ASYNC_CANCEL、LINK_TIMEOUT 本身的完成事件，直接忽略
+    TAG_IGNORE = 4,
+};
+static const uint64_t TAG_MASK = 0x7;
+// 用户态地址只用到低 48 位，高 16 位放注册序号
+static const uint64_t PTR_MASK = ((1ull << 48) - 1) & ~TAG_MASK;
+
+/**
+* @brief 生成 POLL_ADD 的 user_data
+* @param[in] fd_ctx fd 上下文
+* @param[in] tag TAG_READ 或 TAG_WRITE
+* @param[in] seq 注册序号
+* @return uint64_t 
+*/
+static uint64_t make_poll_data(void *fd_ctx, UringTag tag, uint16_t seq) {
+    return ((uint64_t)(uintptr_t)fd_ctx & PTR_MASK) | ((uint64_t)seq << 48) | tag;
+}
+
 /**
 * @brief Construct a new IOManager object
 * @param[in] threads 线程数
 * @param[in] use_caller 是否将当前线程也作为调度线程
 * @param[in] name 调度器名字
 */
-IOManager::IOManager(size_t threads, bool use_caller, const std::string &name)
-    : Scheduler(threads, use_caller, name) {
+IOManager::IOManager(size_t threads, bool use_caller, const std::string &name, Backend backend)
+    : Scheduler(threads, use_caller, name)
+    , m_backend(backend) {
+
+    if (m_backend == IO_URING) {
+        m_uring.reset(new IoUring);
+        if (!m_uring->init(URING_ENTRIES)) {
+            LOG_WARN(g_logger) << "IOManager io_uring not supported, fallback to epoll";
+            m_uring.reset();
+            m_backend = EPOLL;
+        }
+    }
 
-    m_epfd = epoll_create(5000);
-    assert(m_epfd > 0);
+    m_persistent = (m_backend == EPOLL && g_epoll_persistent->GetValue());
+    if (m_backend == IO_URING && Fiber::SharedStackEnabled()) {
+        // 完成式 IO 在协程挂起期间由内核写入栈上的缓冲区，共享栈被别的协程占用时会被写坏
+        LOG_WARN(g_logger) << "IOManager io_uring backend does not support fiber.shared_stack, disabled";
+        setSharedStack(false);
+    }
 
     // m_tickleFds[0]为读端，m_tickleFds[1]为写端
     int rt = pipe(m_tickleFds);
     assert(!rt);
 
-    // 关注pipe读句柄的可读事件，用于tickle协程
-    epoll_event event;
-    memset(&event, 0, sizeof(epoll_event));
-    //增加读事件和 ET 触发
-    event.events  = EPOLLIN | EPOLLET;
-    event.data.fd = m_tickleFds[0];
-
     // 非阻塞方式，配合边缘触发
     rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
     assert(!rt);
 
-    rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
-    assert(!rt);
+    if (m_backend == IO_URING) {
+        // 关注pipe读句柄的可读事件，用于tickle协程
+        armTickle();
+    } else {
+        m_epfd = epoll_create(5000);
+        assert(m_epfd > 0);
+
+        // 关注pipe读句柄的可读事件，用于tickle协程
+        epoll_event event;
+        memset(&event, 0, sizeof(epoll_event));
+        //增加读事件和 ET 触发
+        event.events  = EPOLLIN | EPOLLET;
+        event.data.fd = m_tickleFds[0];
+
+        rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
+        assert(!rt);
+    }
 
     // 因为 m_fdContexts 是一个 vector，里面保存的是指针形式，所以这里
     // 初始化时要分配空间给它们（确定大小后）。
@@ -46,14 +104,17 @@ IOManager::IOManager(size_t threads, bool use_caller, const std::string &name)
 
     // 这里直接开启了Schedluer，也就是说IOManager创建即可调度协程
     start();
-    LOG_DEBUG(g_logger) << "iom_ create end";
+    LOG_DEBUG(g_logger) << "iom_ create end, backend = " << (m_backend == IO_URING ? "io_uring" : "epoll");
 }
 
 IOManager::~IOManager() {
     LOG_DEBUG(g_logger) << "~IOManager";
 
     stop();
-    close(m_epfd);
+    m_uring.reset();
+    if (m_epfd > 0) {
+        close(m_epfd);
+    }
     close(m_tickleFds[0]);
     close(m_tickleFds[1]);
 
@@ -94,18 +155,52 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
         assert(!(fd_ctx->events & event));
     }
 
-    // 将新的事件加入epoll_wait，使用epoll_event的私有指针存储FdContext的位置
-    // 如果该 fd 此前没有感兴趣的事件，则直接增加就可以，如果此前 events 中有
-    // 其它事件，是修改，而不是增加。
-    int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-    epoll_event epevent;
-    epevent.events   = EPOLLET | fd_ctx->events | event;
-    epevent.data.ptr = fd_ctx;
+    if (m_backend == IO_URING) {
+        // io_uring 的 POLL_ADD 本身就是一次性的，和这里事件触发一次就删除的语义一致
+        FdContext::EventContext &event_ctx = fd_ctx->getEventContext(event);
+        uint16_t seq = event_ctx.seq + 1;
+        io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode        = IORING_OP_POLL_ADD;
+        sqe.fd            = fd;
+        sqe.poll32_events = (event == READ ? POLLIN : POLLOUT);
+        sqe.user_data     = make_poll_data(fd_ctx, event == READ ? TAG_READ : TAG_WRITE, seq);
+        if (!submitSqe(&sqe, 1)) {
+            LOG_ERROR(g_logger) << "IOManager::addEvent io_uring poll add False, fd = " << fd;
+            return -1;
+        }
+        event_ctx.seq = seq;
+    } else if (m_persistent) {
+        // 常驻注册模式下只在第一次等待时注册，读写事件一起关注，之后不再修改
+        if (!fd_ctx->registered) {
+            epoll_event epevent;
+            epevent.events   = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+            epevent.data.ptr = fd_ctx;
+            int rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &epevent);
+            if (rt && errno == EEXIST) {
+                rt = epoll_ctl(m_epfd, EPOLL_CTL_MOD, fd, &epevent);
+            }
+            if (rt) {
+                LOG_ERROR(g_logger) << "IOManager::addEvent epoll_ctl add event False, fd = " << fd << " error=" << strerror(errno);
+                return -1;
+            }
+            fd_ctx->registered = true;
+            fd_ctx->ready      = NONE;
+        }
+    } else {
+        // 将新的事件加入epoll_wait，使用epoll_event的私有指针存储FdContext的位置
+        // 如果该 fd 此前没有感兴趣的事件，则直接增加就可以，如果此前 events 中有
+        // 其它事件，是修改，而不是增加。
+        int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        epoll_event epevent;
+        epevent.events   = EPOLLET | fd_ctx->events | event;
+        epevent.data.ptr = fd_ctx;
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if (rt) {
-        LOG_ERROR(g_logger) << "IOManager::addEvent epoll_ctl add event False, fd = " << fd << " error=" << strerror(errno);
-        return -1;
+        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+        if (rt) {
+            LOG_ERROR(g_logger) << "IOManager::addEvent epoll_ctl add event False, fd = " << fd << " error=" << strerror(errno);
+            return -1;
+        }
     }
     // setnonblocking(fd);
 
@@ -127,6 +222,16 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
         //创建协程，或获取当前协程
         event_ctx.fiber = Fiber::GetThis();
         assert(event_ctx.fiber->getState() == Fiber::RUNNING);
+        // 绑定了线程的协程被唤醒时仍然回到原来的线程
+        event_ctx.thread = Scheduler::GetTaskThread();
+    }
+
+    if (m_persistent && (fd_ctx->ready & event)) {
+        // 事件在开始等待之前就已经就绪了，不会再有新的边沿，直接唤醒。
+        // 协程此时还没有 yield，调度器会等它 yield 之后再 resume
+        fd_ctx->ready &= ~event;
+        fd_ctx->triggerEvent(event);
+        --m_pendingEventCount;
     }
 
     LOG_DEBUG(g_logger) << "Add event fd = " << fd_ctx->fd;
@@ -151,21 +256,27 @@ bool IOManager::delEvent(int fd, Event event) {
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
     if (!(fd_ctx->events & event)) {
-        fd_ctx->mutex.unlock();
         return false;
     }
 
     // 先从该fd的上下文FdContext中的时间集合中删除
     Event new_events = (Event)(fd_ctx->events & ~event);
-    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events   = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
-    // 删除后要将剩下的重新注册上去
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if (rt) {
-        LOG_WARN(g_logger) << "IOManager::delEvent false, fd = " << fd << ", event = " << event;
-        return false;
+    if (m_backend == IO_URING) {
+        if (!removePoll(fd_ctx, event)) {
+            LOG_WARN(g_logger) << "IOManager::delEvent false, fd = " << fd << ", event = " << event;
+            return false;
+        }
+    } else if (!m_persistent) {
+        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events   = EPOLLET | new_events;
+        epevent.data.ptr = fd_ctx;
+        // 删除后要将剩下的重新注册上去
+        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+        if (rt) {
+            LOG_WARN(g_logger) << "IOManager::delEvent false, fd = " << fd << ", event = " << event;
+            return false;
+        }
     }
 
     // 待执行事件数减1
@@ -194,22 +305,32 @@ bool IOManager::cancelEvent(int fd, Event event) {
     lock.unlock();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+    // io_uring 后端下等待的也可能是完成式操作，取消后协程在收到完成事件时被唤醒
+    if (m_backend == IO_URING && cancelOp(fd_ctx, event)) {
+        return true;
+    }
     if (!(fd_ctx->events & event)) {
         LOG_WARN(g_logger) << "IOManager::cancelEvent false, fd = " << fd;
-        fd_ctx->mutex.unlock();
         return false;
     }
 
-    // 将剩下的事件重新注册回epoll
-    Event new_events = (Event)(fd_ctx->events & ~event);
-    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events   = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if (rt) {
-        LOG_WARN(g_logger) << "IOManager::cancelEvent false, fd = " << fd << ", event = " << event;
-        return false;
+    if (m_backend == IO_URING) {
+        if (!removePoll(fd_ctx, event)) {
+            LOG_WARN(g_logger) << "IOManager::cancelEvent false, fd = " << fd << ", event = " << event;
+            return false;
+        }
+    } else if (!m_persistent) {
+        // 将剩下的事件重新注册回epoll
+        Event new_events = (Event)(fd_ctx->events & ~event);
+        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events   = EPOLLET | new_events;
+        epevent.data.ptr = fd_ctx;
+        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+        if (rt) {
+            LOG_WARN(g_logger) << "IOManager::cancelEvent false, fd = " << fd << ", event = " << event;
+            return false;
+        }
     }
 
     // 删除之前触发一次事件
@@ -234,19 +355,32 @@ bool IOManager::cancelAll(int fd) {
     lock.unlock();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+    bool op_cancelled = false;
+    if (m_backend == IO_URING) {
+        op_cancelled |= cancelOp(fd_ctx, READ);
+        op_cancelled |= cancelOp(fd_ctx, WRITE);
+    }
     if (!fd_ctx->events) {
-        return false;
+        return op_cancelled;
     }
 
-    int op = EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events   = 0;
-    epevent.data.ptr = fd_ctx;
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if (rt) {
-        LOG_WARN(g_logger) << "IOManager::cancelAll false, fd = " << fd;
-        fd_ctx->mutex.unlock();
-        return false;
+    if (m_backend == IO_URING) {
+        if (fd_ctx->events & READ) {
+            removePoll(fd_ctx, READ);
+        }
+        if (fd_ctx->events & WRITE) {
+            removePoll(fd_ctx, WRITE);
+        }
+    } else if (!m_persistent) {
+        int op = EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events   = 0;
+        epevent.data.ptr = fd_ctx;
+        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+        if (rt) {
+            LOG_WARN(g_logger) << "IOManager::cancelAll false, fd = " << fd;
+            return false;
+        }
     }
 
     // 触发全部已注册的事件
@@ -263,6 +397,34 @@ bool IOManager::cancelAll(int fd) {
     return true;
 }
 
+/**
+* @brief fd 关闭前调用，常驻注册模式下把 fd 从 epoll 中删除并清空记录的就绪状态
+* @param[in] fd 描述符
+*/
+void IOManager::delFd(int fd) {
+    if (!m_persistent) {
+        return;
+    }
+    RWMutexType::ReadLock lock(m_mutex);
+    if ((int)m_fdContexts.size() <= fd) {
+        return;
+    }
+    FdContext *fd_ctx = m_fdContexts[fd];
+    lock.unlock();
+
+    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+    if (fd_ctx->registered) {
+        epoll_event epevent;
+        epevent.events   = 0;
+        epevent.data.ptr = fd_ctx;
+        if (epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, &epevent)) {
+            LOG_WARN(g_logger) << "IOManager::delFd false, fd = " << fd << ", error = " << strerror(errno);
+        }
+        fd_ctx->registered = false;
+    }
+    fd_ctx->ready = NONE;
+}
+
 /**
 * @brief 返回当前的IOManager
 * @return IOManager* 
@@ -384,6 +546,7 @@ void IOManager::FdContext::resetEventContext(EventContext &ctx) {
     ctx.scheduler = nullptr;
     ctx.fiber.reset();
     ctx.cb = nullptr;
+    ctx.thread = -1;
 }
 
 /**
@@ -404,7 +567,7 @@ void IOManager::FdContext::triggerEvent(IOManager::Event event) {
         ctx.scheduler->schedule(ctx.cb);
     } 
     else {
-        ctx.scheduler->schedule(ctx.fiber);
+        ctx.scheduler->schedule(ctx.fiber, ctx.thread);
     }
     resetEventContext(ctx);
     return;
@@ -415,6 +578,17 @@ void IOManager::FdContext::triggerEvent(IOManager::Event event) {
 * 的时机是epoll_wait返回，对应的操作是tickle或注册的IO事件发生
 */
 void IOManager::idle() {
+    if (m_backend == IO_URING) {
+        idleUring();
+    } else {
+        idleEpoll();
+    }
+}
+
+/**
+* @brief epoll 后端的 idle
+*/
+void IOManager::idleEpoll() {
     
     // idle状态应该关注两件事，一是有没有新的调度任务，对应Schduler::schedule()，
     // 如果有新的调度任务，那应该立即退出idle状态，并执行对应的任务；二是关注当前
@@ -434,9 +608,12 @@ void IOManager::idle() {
     while (true) {
         // 获取下一个定时器的超时时间，顺便判断调度器是否停止
         uint64_t next_timeout = 0;
-        if (stopping()) {
+        if (stopping(next_timeout)) {
             // 当前调度器停止，且当前等待执行的IO事件数量为0
             LOG_WARN(g_logger) << "IOManager::idle name = " << getName().c_str() << ", idle stopping exit";
+            // stop() 的 tickle 可能在最后一个任务结束之前就被别的线程消费掉了，那些线程又回到
+            // epoll_wait 里，要等到超时才能发现可以停止；这里再 tickle 一次，让它们依次退出
+            tickle();
             break;
         }
         int rt = 0;
@@ -452,7 +629,8 @@ void IOManager::idle() {
             } else {
                 next_timeout = MAX_TIMEOUT;
             }
-            int rt = epoll_wait(m_epfd, events, MAX_EVNETS, (int)MAX_TIMEOUT);
+            // 注意这里不能重新定义 rt，否则外层的 rt 一直为 0，就绪事件永远不会被处理
+            rt = epoll_wait(m_epfd, events, MAX_EVNETS, (int)next_timeout);
             if(rt < 0) {
                 if(errno == EINTR) {
                     continue;
@@ -499,6 +677,16 @@ void IOManager::idle() {
                 // 要重新把fd_ctx中原有的事件注册上去。
                 event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
             }
+            if (m_persistent) {
+                // 常驻注册模式下出错或对端关闭之后不会再有新的边沿，先记为就绪，
+                // 之后等待的协程直接被唤醒，由 read/write 返回具体结果
+                if (event.events & (EPOLLERR | EPOLLHUP)) {
+                    event.events |= EPOLLIN | EPOLLOUT;
+                }
+                if (event.events & EPOLLRDHUP) {
+                    event.events |= EPOLLIN;
+                }
+            }
             int real_events = NONE;
             if (event.events & EPOLLIN) {
                 real_events |= READ;
@@ -507,23 +695,32 @@ void IOManager::idle() {
                 real_events |= WRITE;
             }
 
-            // 这里是看该fd的感兴趣事件中是否包含real_events，如果都不是fd
-            // 感兴趣的事件，即使发生了肯定也没必要处理，所以这里要判断一下。
-            if ((fd_ctx->events & real_events) == NONE) {
-                continue;
-            }
+            if (m_persistent) {
+                // 没有协程在等的就绪事件记下来，注册一直保留，不需要 epoll_ctl
+                fd_ctx->ready |= real_events & ~fd_ctx->events;
+                real_events &= fd_ctx->events;
+                if (real_events == NONE) {
+                    continue;
+                }
+            } else {
+                // 这里是看该fd的感兴趣事件中是否包含real_events，如果都不是fd
+                // 感兴趣的事件，即使发生了肯定也没必要处理，所以这里要判断一下。
+                if ((fd_ctx->events & real_events) == NONE) {
+                    continue;
+                }
 
-            // 剔除已经发生的事件，将剩下的事件重新加入epoll_wait
-            int left_events = (fd_ctx->events & ~real_events);
-            // 如果留下来的事件都为空了，则没必要在监听了，直接从m_epfd中删除，
-            int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-            event.events = EPOLLET | left_events;
+                // 剔除已经发生的事件，将剩下的事件重新加入epoll_wait
+                int left_events = (fd_ctx->events & ~real_events);
+                // 如果留下来的事件都为空了，则没必要在监听了，直接从m_epfd中删除，
+                int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+                event.events = EPOLLET | left_events;
 
-            // 重新注册进去
-            int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
-            if (rt2) {
-                LOG_WARN(g_logger) << "IOManager::idle left_events false, epfd = " << m_epfd << "fd = " << fd_ctx->fd << ", error = " << strerror(errno);
-                continue;
+                // 重新注册进去
+                int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
+                if (rt2) {
+                    LOG_WARN(g_logger) << "IOManager::idle left_events false, epfd = " << m_epfd << "fd = " << fd_ctx->fd << ", error = " << strerror(errno);
+                    continue;
+                }
             }
 
             // 将对应的事件加入到调度器等待处理，即触发事件加入到调度器中。
@@ -550,3 +747,311 @@ void IOManager::idle() {
         raw_ptr->yield();
     }  // end while(true)
 }
+
+/**
+* @brief io_uring 后端的 idle，一次 io_uring_enter 同时提交本轮积攒的 sqe 并等待完成
+*/
+void IOManager::idleUring() {
+    // 一次最多收割256个完成事件，剩下的下一轮继续处理
+    const uint64_t MAX_EVNETS = 256;
+    std::unique_ptr<io_uring_cqe[]> cqes(new io_uring_cqe[MAX_EVNETS]);
+
+    while (true) {
+        uint64_t next_timeout = 0;
+        if (stopping(next_timeout)) {
+            LOG_WARN(g_logger) << "IOManager::idle name = " << getName().c_str() << ", idle stopping exit";
+            // 同 idleEpoll，让阻塞在 io_uring_enter 里的其它线程也依次退出
+            tickle();
+            break;
+        }
+
+        static const int MAX_TIMEOUT = 5000;
+        if(next_timeout != ~0ull) {
+            next_timeout = std::min((int)next_timeout, MAX_TIMEOUT);
+        } else {
+            next_timeout = MAX_TIMEOUT;
+        }
+        // 超时(ETIME)和被信号打断(EINTR)都是正常情况，直接往下处理定时器
+        if (m_uring->wait(next_timeout) && errno != ETIME && errno != EINTR) {
+            LOG_WARN(g_logger) << "IOManager::idle, io_uring_enter error = " << strerror(errno);
+        }
+
+        // 收集所有已超时的定时器，执行回调函数
+        std::vector<std::function<void()>> cbs;
+        listExpiredCb(cbs);
+        for(const auto &cb : cbs) {
+            schedule(cb);
+        }
+
+        size_t n = m_uring->reap(cqes.get(), MAX_EVNETS);
+        for (size_t i = 0; i < n; ++i) {
+            onCompletion(cqes[i]);
+        }
+
+        Fiber::ptr cur = Fiber::GetThis();
+        auto raw_ptr   = cur.get();
+        cur.reset();
+
+        raw_ptr->yield();
+    }
+}
+
+/**
+* @brief 处理一个 io_uring 完成事件
+* @param[in] cqe 完成事件
+*/
+void IOManager::onCompletion(const io_uring_cqe &cqe) {
+    uint64_t tag = cqe.user_data & TAG_MASK;
+    if (tag == TAG_OP) {
+        FdContext::IoOp *op = (FdContext::IoOp *)(uintptr_t)cqe.user_data;
+        FdContext *fd_ctx = op->fd_ctx;
+        FdContext::MutexType::Lock lock(fd_ctx->mutex);
+        FdContext::IoOp *&slot = (op->event == READ ? fd_ctx->readOp : fd_ctx->writeOp);
+        slot = nullptr;
+        op->res = cqe.res;
+        Scheduler *scheduler = op->scheduler;
+        int thread = op->thread;
+        Fiber::ptr fiber;
+        fiber.swap(op->fiber);
+        --m_pendingEventCount;
+        // 协程被调度后随时可能在别的线程返回，op 所在的栈随之失效，之后不能再访问 op
+        scheduler->schedule(fiber, thread);
+    } else if (tag == TAG_READ || tag == TAG_WRITE) {
+        FdContext *fd_ctx = (FdContext *)(uintptr_t)(cqe.user_data & PTR_MASK);
+        uint16_t seq = (uint16_t)(cqe.user_data >> 48);
+        Event event = (tag == TAG_READ ? READ : WRITE);
+        FdContext::MutexType::Lock lock(fd_ctx->mutex);
+        // 事件已经被 delEvent/cancelEvent 删除，或者已经重新注册过，这是旧的 POLL_ADD
+        if (!(fd_ctx->events & event) || fd_ctx->getEventContext(event).seq != seq) {
+            return;
+        }
+        fd_ctx->triggerEvent(event);
+        --m_pendingEventCount;
+    } else if (tag == TAG_TICKLE) {
+        uint8_t dummy[256];
+        while (read(m_tickleFds[0], dummy, sizeof(dummy)) > 0) ;
+        armTickle();
+    }
+}
+
+/**
+* @brief 重新注册 tickle 管道的 POLL_ADD
+* @details 必须立即提交，否则阻塞在 io_uring_enter 的线程收不到后续的 tickle
+*/
+void IOManager::armTickle() {
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode        = IORING_OP_POLL_ADD;
+    sqe.fd            = m_tickleFds[0];
+    sqe.poll32_events = POLLIN;
+    sqe.user_data     = TAG_TICKLE;
+    if (!m_uring->push(&sqe, 1, true)) {
+        LOG_ERROR(g_logger) << "IOManager::armTickle io_uring poll add False";
+    }
+}
+
+/**
+* @brief 向 io_uring 提交 sqe
+* @param[in] sqes sqe 数组
+* @param[in] count sqe 个数
+* @param[in] flush 是否必须立即提交
+* @return bool 是否成功
+*/
+bool IOManager::submitSqe(const io_uring_sqe *sqes, unsigned count, bool flush) {
+    // 当前线程马上会回到 idle 里提交，只有别的线程空闲等待，或者不在本调度器的线程里时才立即提交
+    flush = flush || Scheduler::GetThis() != this || hasIdleThreads();
+    return m_uring->push(sqes, count, flush);
+}
+
+/**
+* @brief io_uring 后端删除一个 fd 上已注册的 POLL_ADD，调用时需持有 fd_ctx->mutex
+* @param[in] fd_ctx fd 上下文
+* @param[in] event 事件
+* @return bool 是否成功
+*/
+bool IOManager::removePoll(FdContext *fd_ctx, Event event) {
+    FdContext::EventContext &event_ctx = fd_ctx->getEventContext(event);
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode    = IORING_OP_POLL_REMOVE;
+    sqe.fd        = -1;
+    sqe.addr      = make_poll_data(fd_ctx, event == READ ? TAG_READ : TAG_WRITE, event_ctx.seq);
+    sqe.user_data = TAG_IGNORE;
+    // 被删除的 POLL_ADD 即使之后还有完成事件，也会因为 seq 或 events 不匹配而被忽略
+    return submitSqe(&sqe, 1);
+}
+
+/**
+* @brief io_uring 后端取消一个 fd 上正在进行的完成式操作，调用时需持有 fd_ctx->mutex
+* @param[in] fd_ctx fd 上下文
+* @param[in] event 操作方向
+* @return bool 是否有操作被取消
+*/
+bool IOManager::cancelOp(FdContext *fd_ctx, Event event) {
+    FdContext::IoOp *op = (event == READ ? fd_ctx->readOp : fd_ctx->writeOp);
+    if (!op) {
+        return false;
+    }
+    if (op->cancelled) {
+        return true;
+    }
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe.fd        = -1;
+    sqe.addr      = (uint64_t)(uintptr_t)op;
+    sqe.user_data = TAG_IGNORE;
+    // 立即提交：持有 fd_ctx->mutex 期间 op 不会完成，保证取消的一定是这个 op，
+    // 而不是协程栈上同一地址的下一个操作
+    if (!submitSqe(&sqe, 1, true)) {
+        return false;
+    }
+    op->cancelled = true;
+    return true;
+}
+
+/**
+* @brief 提交一个完成式 IO 操作并挂起当前协程，完成后返回结果
+* @param[in] fd 句柄
+* @param[in] event 操作的方向，READ 或 WRITE
+* @param[in] sqe 已经填好操作的 sqe，user_data 在这里设置
+* @param[in] timeout_ms 超时时间(毫秒)，-1 表示不超时
+* @return ssize_t 操作结果，失败返回 -1 并设置 errno
+*/
+ssize_t IOManager::submitOp(int fd, Event event, io_uring_sqe &sqe, uint64_t timeout_ms) {
+    if (m_backend != IO_URING || Scheduler::GetThis() != this) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    FdContext *fd_ctx = nullptr;
+    RWMutexType::ReadLock lock(m_mutex);
+    if ((int)m_fdContexts.size() > fd) {
+        fd_ctx = m_fdContexts[fd];
+        lock.unlock();
+    } else {
+        lock.unlock();
+        RWMutexType::WriteLock lock2(m_mutex);
+        contextResize(fd * 1.5);
+        fd_ctx = m_fdContexts[fd];
+    }
+
+    FdContext::IoOp op;
+    op.fd_ctx    = fd_ctx;
+    op.event     = event;
+    op.scheduler = this;
+    op.fiber     = Fiber::GetThis();
+    op.thread    = Scheduler::GetTaskThread();
+
+    io_uring_sqe sqes[2];
+    unsigned count = 1;
+    sqes[0] = sqe;
+    sqes[0].user_data = (uint64_t)(uintptr_t)&op;
+    if (timeout_ms != (uint64_t)-1) {
+        // 链接一个超时，超时后操作以 -ECANCELED 完成
+        op.timeout.tv_sec  = timeout_ms / 1000;
+        op.timeout.tv_nsec = (timeout_ms % 1000) * 1000 * 1000;
+        sqes[0].flags |= IOSQE_IO_LINK;
+        memset(&sqes[1], 0, sizeof(sqes[1]));
+        sqes[1].opcode    = IORING_OP_LINK_TIMEOUT;
+        sqes[1].fd        = -1;
+        sqes[1].addr      = (uint64_t)(uintptr_t)&op.timeout;
+        sqes[1].len       = 1;
+        sqes[1].user_data = TAG_IGNORE;
+        count = 2;
+    }
+
+    {
+        FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+        FdContext::IoOp *&slot = (event == READ ? fd_ctx->readOp : fd_ctx->writeOp);
+        if (slot) {
+            errno = EBUSY;
+            return -1;
+        }
+        if (!submitSqe(sqes, count)) {
+            errno = EIO;
+            return -1;
+        }
+        slot = &op;
+        ++m_pendingEventCount;
+    }
+
+    Fiber::GetThis()->yield();
+
+    if (op.res < 0) {
+        // 没有被主动取消却收到 ECANCELED，说明是链接的超时到了
+        errno = (op.res == -ECANCELED && !op.cancelled) ? ETIMEDOUT : -op.res;
+        return -1;
+    }
+    return op.res;
+}
+
+/**
+* @brief 以完成方式接收数据(IORING_OP_RECV)，当前协程挂起直到完成或超时
+*/
+ssize_t IOManager::submitRecv(int fd, void *buf, size_t len, int flags, uint64_t timeout_ms) {
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode    = IORING_OP_RECV;
+    sqe.fd        = fd;
+    sqe.addr      = (uint64_t)(uintptr_t)buf;
+    sqe.len       = len;
+    sqe.msg_flags = flags;
+    return submitOp(fd, READ, sqe, timeout_ms);
+}
+
+/**
+* @brief 以完成方式发送数据(IORING_OP_SEND)
+*/
+ssize_t IOManager::submitSend(int fd, const void *buf, size_t len, int flags, uint64_t timeout_ms) {
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode    = IORING_OP_SEND;
+    sqe.fd        = fd;
+    sqe.addr      = (uint64_t)(uintptr_t)buf;
+    sqe.len       = len;
+    sqe.msg_flags = flags;
+    return submitOp(fd, WRITE, sqe, timeout_ms);
+}
+
+/**
+* @brief 以完成方式接收数据到 msghdr(IORING_OP_RECVMSG)
+*/
+ssize_t IOManager::submitRecvmsg(int fd, msghdr *msg, int flags, uint64_t timeout_ms) {
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode    = IORING_OP_RECVMSG;
+    sqe.fd        = fd;
+    sqe.addr      = (uint64_t)(uintptr_t)msg;
+    sqe.len       = 1;
+    sqe.msg_flags = flags;
+    return submitOp(fd, READ, sqe, timeout_ms);
+}
+
+/**
+* @brief 以完成方式发送 msghdr 中的数据(IORING_OP_SENDMSG)
+*/
+ssize_t IOManager::submitSendmsg(int fd, const msghdr *msg, int flags, uint64_t timeout_ms) {
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode    = IORING_OP_SENDMSG;
+    sqe.fd        = fd;
+    sqe.addr      = (uint64_t)(uintptr_t)msg;
+    sqe.len       = 1;
+    sqe.msg_flags = flags;
+    return submitOp(fd, WRITE, sqe, timeout_ms);
+}
+
+/**
+* @brief 以完成方式接受连接(IORING_OP_ACCEPT)
+*/
+int IOManager::submitAccept(int fd, sockaddr *addr, socklen_t *addrlen, int flags, uint64_t timeout_ms) {
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode       = IORING_OP_ACCEPT;
+    sqe.fd           = fd;
+    sqe.addr         = (uint64_t)(uintptr_t)addr;
+    sqe.addr2        = (uint64_t)(uintptr_t)addrlen;
+    sqe.accept_flags = flags;
+    return (int)submitOp(fd, READ, sqe, timeout_ms);
+}
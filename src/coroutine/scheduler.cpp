@@ -2,14 +2,23 @@
 
 #include "coroutine/scheduler.h"
 #include "base/util.h"
+#include "base/hook.h"
+#include "base/config.h"
 
 // 当前线程的调度器，同一个调度器下的所有线程共享同一个实例
 static thread_local Scheduler *t_scheduler = nullptr;
 // 当前线程的调度协程，每个线程都独有一份
 static thread_local Fiber *t_scheduler_fiber = nullptr;
+// 当前线程正在执行的任务绑定的线程 id，-1 表示没有绑定
+static thread_local int t_task_thread = -1;
+// 当前线程在调度器任务队列数组中的下标，-1 表示不是调度线程
+static thread_local int t_worker = -1;
 
 static zch::Logger::ptr g_logger = LOG_NAME("system");
 
+static zch::ConfigVar<uint32_t>::ptr g_fiber_task_pool_size =
+    zch::Config::Lookup("fiber.task_pool_size", (uint32_t)32, "max finished callback fibers kept per scheduler thread, 0 to disable");
+
 /**
 * @brief Construct a new Scheduler object
 * @param threads 线程数
@@ -48,6 +57,16 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name) {
         m_rootThread = -1;
     }
     m_threadCount = threads;
+    m_sharedStack = Fiber::SharedStackEnabled();
+    m_fiberPoolSize = g_fiber_task_pool_size->GetValue();
+
+    // 每个调度线程一个任务队列，use_caller 的主线程排在最后
+    for (size_t i = 0; i < threads + (use_caller ? 1 : 0); i++) {
+        m_workQueues.emplace_back(new WorkQueue);
+    }
+    if (use_caller) {
+        m_workerIndex[m_rootThread] = threads;
+    }
 }
 
 /**
@@ -68,6 +87,14 @@ Fiber *Scheduler::GetMainFiber() {
     return t_scheduler_fiber;
 }
 
+/**
+* @brief 获取当前正在执行的任务所绑定的线程
+* @return int 
+*/
+int Scheduler::GetTaskThread() {
+    return t_task_thread;
+}
+
 /**
 * @brief 设置当前的协程调度器
 */
@@ -102,7 +129,22 @@ void Scheduler::start() {
         m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this),
                                       m_name + "_" + std::to_string(i)));
         m_threadIds.push_back(m_threads[i]->getId());
+        // 线程已经开始执行 run()，但 run() 要先拿到 m_mutex 才能查到自己的下标
+        m_workerIndex[m_threads[i]->getId()] = i;
+    }
+}
+
+/**
+* @brief 获取调度器创建的工作线程 id，不包含 use_caller 的主线程
+* @return std::vector<int> 
+*/
+std::vector<int> Scheduler::getWorkerThreadIds() {
+    MutexType::Lock lock(m_mutex);
+    std::vector<int> ids;
+    for (auto &i : m_threads) {
+        ids.push_back(i->getId());
     }
+    return ids;
 }
 
 /**
@@ -111,8 +153,7 @@ void Scheduler::start() {
 * @return false 
 */
 bool Scheduler::stopping() {
-    MutexType::Lock lock(m_mutex);
-    return m_stopping && m_tasks.empty() && m_activeThreadCount == 0;
+    return m_stopping && m_taskCount == 0 && m_activeThreadCount == 0 && m_parkedFiberCount == 0;
 }
 
 /**
@@ -182,6 +223,229 @@ void Scheduler::stop() {
     }
 }
 
+/**
+* @brief 挂起的协程已经重新加入调度
+* @details 被唤醒的协程可能在这里减计数之前就执行完了，调度线程那时看到计数不为 0 又回去 idle，
+*          计数减到 0 时正在停止的话再 tickle 一次
+*/
+void Scheduler::removeParkedFiber() {
+    if (--m_parkedFiberCount == 0 && m_stopping) {
+        tickle();
+    }
+}
+
+/**
+* @brief 根据线程 id 找到该线程的任务队列
+* @param[in] thread 线程 id
+* @return WorkQueue* 找不到返回 nullptr
+*/
+Scheduler::WorkQueue *Scheduler::getWorkQueue(int thread) {
+    auto it = m_workerIndex.find(thread);
+    return it == m_workerIndex.end() ? nullptr : m_workQueues[it->second].get();
+}
+
+/**
+* @brief 添加调度任务
+* @param[in] task 调度任务，调用后被移走
+* @return bool 是否需要 tickle
+*/
+bool Scheduler::pushTask(ScheduleTask &task) {
+    // 先计数再入队，stopping() 不会在任务入队的途中误判为没有任务
+    ++m_taskCount;
+    if (task.fiber && task.fiber->isSharedStack()) {
+        // 共享栈协程的栈内容只在所属线程的共享栈上有效，只能放回所属线程
+        task.thread = task.fiber->getThread();
+    }
+    WorkQueue *self = (t_scheduler == this && t_worker >= 0) ? m_workQueues[t_worker].get() : nullptr;
+
+    if (task.thread != -1) {
+        WorkQueue *q = getWorkQueue(task.thread);
+        if (q) {
+            {
+                WorkQueue::MutexType::Lock lock(q->mailboxMutex);
+                q->mailbox.push_back(std::move(task));
+                ++q->mailboxCount;
+            }
+            // 指定给当前线程的任务，当前线程回到 run() 后自己就会取到
+            return q != self && hasIdleThreads();
+        }
+        // 不是本调度器的线程(例如 start() 之前)，放进全局队列，由对应线程扫描时取走
+    } else if (self) {
+        {
+            WorkQueue::MutexType::Lock lock(self->mutex);
+            self->tasks.push_back(std::move(task));
+            ++self->taskCount;
+        }
+        // 本线程自己会执行，只有还有别的线程在 idle 时才需要唤醒它来窃取
+        return m_idleThreadCount > (self->idle ? 1u : 0u);
+    }
+
+    MutexType::Lock lock(m_mutex);
+    m_tasks.push_back(std::move(task));
+    return hasIdleThreads();
+}
+
+/**
+* @brief 从队列中取出第一个可以执行的任务
+*/
+bool Scheduler::TakeRunnable(std::deque<ScheduleTask> &queue, ScheduleTask &task) {
+    for (auto it = queue.begin(); it != queue.end(); ++it) {
+        // [BUG FIX]: hook IO相关的系统调用时，在检测到IO未就绪的情况下，会先添加对应的读写事件，再yield当前协程，等IO就绪后再resume当前协程
+        // 多线程高并发情境下，有可能发生刚添加事件就被触发的情况，如果此时当前协程还未来得及yield，则这里就有可能出现协程状态仍为RUNNING的情况
+        // 这里简单地跳过这种情况，以损失一点性能为代价，否则整个协程框架都要大改
+        if (it->fiber && it->fiber->getState() == Fiber::RUNNING) {
+            continue;
+        }
+        task = std::move(*it);
+        queue.erase(it);
+        return true;
+    }
+    return false;
+}
+
+/**
+* @brief 为当前线程取一个任务，取到时活跃线程数加1
+* @param[out] task 取到的任务
+* @return bool 是否取到
+*/
+bool Scheduler::popTask(ScheduleTask &task) {
+    WorkQueue *q = m_workQueues[t_worker].get();
+    bool found = false;
+    // 指定在本线程的任务大多是 IO 就绪后恢复的协程，优先执行
+    if (q->mailboxCount > 0) {
+        WorkQueue::MutexType::Lock lock(q->mailboxMutex);
+        if (TakeRunnable(q->mailbox, task)) {
+            // 先增加活跃线程数再减少任务数，stopping() 不会看到两者同时为 0
+            ++m_activeThreadCount;
+            --q->mailboxCount;
+            found = true;
+        }
+    }
+    if (!found && q->taskCount > 0) {
+        WorkQueue::MutexType::Lock lock(q->mutex);
+        if (TakeRunnable(q->tasks, task)) {
+            ++m_activeThreadCount;
+            --q->taskCount;
+            found = true;
+        }
+    }
+    if (!found) {
+        found = popGlobalTask(task) || stealTask(task);
+    }
+    if (found) {
+        --m_taskCount;
+    }
+    return found;
+}
+
+/**
+* @brief 从全局队列取一个任务，跳过指定给其它线程的任务
+*/
+bool Scheduler::popGlobalTask(ScheduleTask &task) {
+    MutexType::Lock lock(m_mutex);
+    for (auto it = m_tasks.begin(); it != m_tasks.end(); ++it) {
+        if (it->thread != -1 && it->thread != GetThreadId()) {
+            continue;
+        }
+        if (it->fiber && it->fiber->getState() == Fiber::RUNNING) {
+            continue;
+        }
+        task = std::move(*it);
+        m_tasks.erase(it);
+        ++m_activeThreadCount;
+        return true;
+    }
+    return false;
+}
+
+/**
+* @brief 从其它线程的队列窃取一半任务，第一个返回，其余放进本线程的队列
+*/
+bool Scheduler::stealTask(ScheduleTask &task) {
+    size_t n = m_workQueues.size();
+    WorkQueue *self = m_workQueues[t_worker].get();
+    std::vector<ScheduleTask> stolen;
+    for (size_t i = 1; i < n && stolen.empty(); i++) {
+        WorkQueue *victim = m_workQueues[(t_worker + i) % n].get();
+        if (victim->taskCount == 0) {
+            continue;
+        }
+        WorkQueue::MutexType::Lock lock(victim->mutex);
+        // 从队头拿走一半，被窃取的线程不会因为这次窃取饿死最早入队的任务
+        size_t count = (victim->tasks.size() + 1) / 2;
+        for (size_t j = 0; j < count; j++) {
+            stolen.push_back(std::move(victim->tasks.front()));
+            victim->tasks.pop_front();
+        }
+        victim->taskCount -= count;
+    }
+    if (stolen.empty()) {
+        return false;
+    }
+
+    WorkQueue::MutexType::Lock lock(self->mutex);
+    for (auto &i : stolen) {
+        self->tasks.push_back(std::move(i));
+    }
+    self->taskCount += stolen.size();
+    if (TakeRunnable(self->tasks, task)) {
+        ++m_activeThreadCount;
+        --self->taskCount;
+        return true;
+    }
+    return false;
+}
+
+/**
+* @brief 当前线程是否还有可以执行的任务
+*/
+bool Scheduler::hasWork() {
+    WorkQueue *self = m_workQueues[t_worker].get();
+    if (self->mailboxCount > 0) {
+        return true;
+    }
+    for (auto &i : m_workQueues) {
+        if (i->taskCount > 0) {
+            return true;
+        }
+    }
+    MutexType::Lock lock(m_mutex);
+    for (auto &i : m_tasks) {
+        if (i.thread == -1 || i.thread == GetThreadId()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+* @brief 是否有处于 idle 的线程的 mailbox 里有任务
+*/
+bool Scheduler::hasIdleMail() {
+    for (auto &i : m_workQueues) {
+        if (i->idle && i->mailboxCount > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+* @brief 把执行完的协程放回本线程的协程池
+* @param[in] fiber 刚刚 resume 返回的协程
+* @param[in] pool 本线程的协程池
+*/
+void Scheduler::RecycleFiber(Fiber::ptr &fiber, std::vector<Fiber::ptr> &pool) const {
+    // 只回收调度器里创建的、没有别人持有、栈大小为默认值的协程，其它协程照常析构；
+    // 不参与调度器调度的协程 yield 时切回线程主协程，拿来执行回调会切错上下文
+    if (fiber->getState() != Fiber::TERM || fiber.use_count() != 1 || !fiber->isRunInScheduler()
+            || fiber->getStackSize() != Fiber::GetDefaultStackSize()
+            || pool.size() >= m_fiberPoolSize) {
+        return;
+    }
+    pool.push_back(std::move(fiber));
+}
+
 /**
 * @brief 协程调度函数
 */
@@ -189,6 +453,8 @@ void Scheduler::run() {
     LOG_DEBUG(g_logger) << "Scheduler::run begin";
     // 运行到本调度器，设置当前线程的调度器。
     setThis();
+    // 调度线程上运行的协程都使用 hook 版本的系统调用，IO 未就绪时只让出协程，不阻塞线程
+    set_hook_enable(true);
     if (GetThreadId() != m_rootThread) {
         // 这里相当于初始化t_scheduler_fiber，除了 main 线程的，
         // 其它的都要初始化，main 的已经在构造的时候已经初始化完成，
@@ -197,50 +463,26 @@ void Scheduler::run() {
     }
 
     Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
-    Fiber::ptr cb_fiber;
+    // 本线程执行完的回调协程，复用来执行之后的回调任务
+    std::vector<Fiber::ptr> fiber_pool;
+
+    {
+        // start() 在持有 m_mutex 时创建线程并登记下标，这里拿到锁时已经登记完了
+        MutexType::Lock lock(m_mutex);
+        t_worker = (int)m_workerIndex[GetThreadId()];
+    }
+    WorkQueue *queue = m_workQueues[t_worker].get();
 
     ScheduleTask task;
     while (true) {
         task.reset();
         bool tickle_me = false;
-        {
-            MutexType::Lock lock(m_mutex);
-            auto it = m_tasks.begin();
-            // 遍历所有调度任务
-            while (it != m_tasks.end()) {
-                if (it->thread != -1 && it->thread != GetThreadId()) {
-                    // 任务队列中的任务指定了调度线程，但不是当前线程，跳过这个任务，继续下一个,因为在初始化时
-                    // 会指定哪个线程调度，如果 it->thread == -1，说明这个任务没有指定线程。这时也要通知其他
-                    // 线程进行调度，直到那个线程来了与 GetThreadId() 相等。
-                    ++it;
-                    tickle_me = true;
-                    continue;
-                }
-
-                // // 找到一个未指定线程，或是指定了当前线程的任务
-                // assert(it->fiber || it->cb);
-                // if (it->fiber) {
-                //     // 任务队列时的协程一定是READY状态，谁会把
-                //     // RUNNING或TERM状态的协程加入调度呢？
-                //     assert(it->fiber->getState() == Fiber::READY);
-                // }
-                // [BUG FIX]: hook IO相关的系统调用时，在检测到IO未就绪的情况下，会先添加对应的读写事件，再yield当前协程，等IO就绪后再resume当前协程
-                // 多线程高并发情境下，有可能发生刚添加事件就被触发的情况，如果此时当前协程还未来得及yield，则这里就有可能出现协程状态仍为RUNNING的情况
-                // 这里简单地跳过这种情况，以损失一点性能为代价，否则整个协程框架都要大改
-                if(it->fiber && it->fiber->getState() == Fiber::RUNNING) {
-                    ++it;
-                    continue;
-                }
-
-                // 当前调度线程找到一个任务，准备开始调度，将其从任务队列中剔除，活动线程数加1
-                task = *it;
-                m_tasks.erase(it++);
-                ++m_activeThreadCount;
-                break;
-            }
-            // 当前线程拿完一个任务后，发现任务队列还有剩余，那么tickle一下其他线程
-            tickle_me |= (it != m_tasks.end());
+        if (popTask(task)) {
+            // 当前线程拿完一个任务后，发现本线程队列还有剩余，那么tickle一下其他线程来窃取
+            tickle_me = queue->taskCount > 0;
         }
+        // 指定给某个 idle 线程的任务，tickle 唤醒的可能不是它，需要继续传递下去
+        tickle_me = tickle_me || hasIdleMail();
         if (tickle_me) {
             tickle();
         }
@@ -249,23 +491,35 @@ void Scheduler::run() {
             // resume协程，resume返回时，协程要么执行完了，要么半路yield了，
             // 总之这个任务就算完成了，活跃线程数减一
             LOG_DEBUG(g_logger) << "run fiber in scheduler";
+            t_task_thread = task.thread;
             task.fiber->resume();
+            t_task_thread = -1;
             --m_activeThreadCount;
+            // 半路yield之后在这里执行完的回调协程，同样放回协程池
+            RecycleFiber(task.fiber, fiber_pool);
             task.reset();
         } else if (task.cb) {
-            // task 为回调函数，则创建新的协程，执行回调函数
-            if (cb_fiber) {
-                // 因为任务 task 是以函数的形式传过来的，所以要创建成协程来执行，
-                // 又cb_fiber这个临时协程已经创建过了，所以复用一下这个协程。
-                cb_fiber->reset(task.cb);
+            // task 为回调函数，要创建成协程来执行，协程池里有执行完的协程就复用它的栈，
+            // 只需要重新绑定回调函数
+            Fiber::ptr cb_fiber;
+            if (!fiber_pool.empty()) {
+                cb_fiber.swap(fiber_pool.back());
+                fiber_pool.pop_back();
+                cb_fiber->reset(std::move(task.cb));
             } else {
-                // 临时协程没有被创建过，那就创建它。
-                cb_fiber.reset(new Fiber(task.cb));
+                // 协程池空了，那就创建一个。
+                cb_fiber.reset(new Fiber(std::move(task.cb), 0, true, m_sharedStack));
             }
+            // 共享栈协程只能回到本线程执行，之后等待的 IO 事件、定时器都绑定到本线程
+            t_task_thread = cb_fiber->isSharedStack() ? GetThreadId() : task.thread;
             task.reset();
             LOG_DEBUG(g_logger) << "run fun in scheduler";
             cb_fiber->resume();
+            t_task_thread = -1;
             --m_activeThreadCount;
+            // 执行完的协程放回协程池；半路yield的协程由注册事件或定时器的一方持有，
+            // 这里只放弃引用，下一个回调换用协程池里的其它协程
+            RecycleFiber(cb_fiber, fiber_pool);
             cb_fiber.reset();
         } else {
             // 进到这个分支情况一定是任务队列空了，调度idle协程即可
@@ -277,9 +531,19 @@ void Scheduler::run() {
             // 不是 TERM 状态的话，就会一直 resume 到 idle_fiber 协程，然后又在
             // idle_fiber 协程中又 yield 回来，所以这里不需要再次判断 idle_fiber 的状态。
             ++m_idleThreadCount;
+            queue->idle = true;
+            // 标记 idle 之后再检查一次，添加任务的线程要么能看到这里的 idle 并 tickle，
+            // 要么它添加的任务能在这里被看到
+            if (hasWork()) {
+                queue->idle = false;
+                --m_idleThreadCount;
+                continue;
+            }
             idle_fiber->resume();
+            queue->idle = false;
             --m_idleThreadCount;
         }
     }
+    t_worker = -1;
     LOG_DEBUG(g_logger) << "Scheduler::run exit";
 }
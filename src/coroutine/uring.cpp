@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "coroutine/uring.h"
+#include "base/log.h"
+
+static zch::Logger::ptr g_logger = LOG_NAME("system");
+
+static int io_uring_setup(unsigned entries, io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                          void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+IoUring::IoUring()
+    : m_fd(-1)
+    , m_sqRing(MAP_FAILED)
+    , m_sqRingSize(0)
+    , m_cqRing(MAP_FAILED)
+    , m_cqRingSize(0)
+    , m_sqes((io_uring_sqe *)MAP_FAILED)
+    , m_sqHead(nullptr)
+    , m_sqTail(nullptr)
+    , m_sqMask(0)
+    , m_sqEntries(0)
+    , m_cqHead(nullptr)
+    , m_cqTail(nullptr)
+    , m_cqMask(0)
+    , m_cqes(nullptr) {
+}
+
+IoUring::~IoUring() {
+    if(m_sqes != MAP_FAILED) {
+        munmap(m_sqes, m_sqEntries * sizeof(io_uring_sqe));
+    }
+    if(m_cqRing != MAP_FAILED && m_cqRing != m_sqRing) {
+        munmap(m_cqRing, m_cqRingSize);
+    }
+    if(m_sqRing != MAP_FAILED) {
+        munmap(m_sqRing, m_sqRingSize);
+    }
+    if(m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+/**
+ * @brief 创建 ring 并映射 SQ/CQ
+ * @param[in] entries SQ 大小
+ * @return bool 是否成功
+ */
+bool IoUring::init(unsigned entries) {
+#ifdef IORING_ENTER_EXT_ARG
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = io_uring_setup(entries, &params);
+    if(fd < 0) {
+        LOG_WARN(g_logger) << "io_uring_setup error: " << strerror(errno);
+        return false;
+    }
+    // 等待时需要带超时(EXT_ARG)，CQ 溢出时不能丢 cqe(NODROP)
+    if(!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+        LOG_WARN(g_logger) << "io_uring features not supported, features = " << params.features;
+        close(fd);
+        return false;
+    }
+    m_fd = fd;
+
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    }
+
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    m_fd, IORING_OFF_SQ_RING);
+    if(m_sqRing == MAP_FAILED) {
+        LOG_WARN(g_logger) << "io_uring mmap sq ring error: " << strerror(errno);
+        return false;
+    }
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        m_cqRing = m_sqRing;
+    } else {
+        m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        m_fd, IORING_OFF_CQ_RING);
+        if(m_cqRing == MAP_FAILED) {
+            LOG_WARN(g_logger) << "io_uring mmap cq ring error: " << strerror(errno);
+            return false;
+        }
+    }
+
+    m_sqEntries = params.sq_entries;
+    m_sqes = (io_uring_sqe *)mmap(nullptr, m_sqEntries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if(m_sqes == MAP_FAILED) {
+        LOG_WARN(g_logger) << "io_uring mmap sqes error: " << strerror(errno);
+        return false;
+    }
+
+    char *sq = (char *)m_sqRing;
+    m_sqHead = (unsigned *)(sq + params.sq_off.head);
+    m_sqTail = (unsigned *)(sq + params.sq_off.tail);
+    m_sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    // SQ 数组与 sqe 一一对应，之后直接按 tail 的位置填写 sqe
+    unsigned *array = (unsigned *)(sq + params.sq_off.array);
+    for(unsigned i = 0; i < m_sqEntries; ++i) {
+        array[i] = i;
+    }
+
+    char *cq = (char *)m_cqRing;
+    m_cqHead = (unsigned *)(cq + params.cq_off.head);
+    m_cqTail = (unsigned *)(cq + params.cq_off.tail);
+    m_cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    m_cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    LOG_INFO(g_logger) << "io_uring init sq_entries = " << params.sq_entries
+                       << ", cq_entries = " << params.cq_entries;
+    return true;
+#else
+    (void)entries;
+    LOG_WARN(g_logger) << "io_uring headers too old, IORING_ENTER_EXT_ARG missing";
+    return false;
+#endif
+}
+
+/**
+ * @brief 调用 io_uring_enter 提交 SQ 中所有已发布的 sqe
+ * @details to_submit 直接传 SQ 大小，内核只会提交 head 到 tail 之间已经发布的部分，
+ *          多个线程并发调用时也不需要额外记录各自放了多少个
+ */
+int IoUring::enter(unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+    return io_uring_enter(m_fd, m_sqEntries, min_complete, flags, arg, argsz);
+}
+
+/**
+ * @brief 把 sqe 放进 SQ
+ * @param[in] sqes 待提交的 sqe 数组
+ * @param[in] count sqe 个数
+ * @param[in] flush 是否立即调用 io_uring_enter 提交
+ * @return bool 是否成功
+ */
+bool IoUring::push(const io_uring_sqe *sqes, unsigned count, bool flush) {
+    {
+        MutexType::Lock lock(m_sqMutex);
+        unsigned tail = *m_sqTail;
+        if(tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) + count > m_sqEntries) {
+            // SQ 满了，先把已有的交给内核腾出位置
+            if(enter(0, 0, nullptr, 0) < 0) {
+                LOG_ERROR(g_logger) << "io_uring_enter submit error: " << strerror(errno);
+                return false;
+            }
+            if(tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) + count > m_sqEntries) {
+                LOG_ERROR(g_logger) << "io_uring sq full, count = " << count;
+                return false;
+            }
+        }
+        for(unsigned i = 0; i < count; ++i) {
+            m_sqes[(tail + i) & m_sqMask] = sqes[i];
+        }
+        // sqe 写完之后再发布 tail，内核看到的一定是完整的 sqe
+        __atomic_store_n(m_sqTail, tail + count, __ATOMIC_RELEASE);
+    }
+    if(flush) {
+        return this->flush() >= 0;
+    }
+    return true;
+}
+
+/**
+ * @brief 把 SQ 中还未提交的 sqe 全部交给内核，不等待完成
+ * @return int 提交的个数，失败返回 -1
+ */
+int IoUring::flush() {
+    if(__atomic_load_n(m_sqTail, __ATOMIC_ACQUIRE) == __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    int rt = enter(0, 0, nullptr, 0);
+    if(rt < 0) {
+        LOG_ERROR(g_logger) << "io_uring_enter submit error: " << strerror(errno);
+    }
+    return rt;
+}
+
+/**
+ * @brief 提交未提交的 sqe，并等待至少一个 cqe 或者超时
+ * @param[in] timeout_ms 超时时间(毫秒)
+ * @return int 成功返回 0，超时或被信号打断返回 -1 并设置 errno
+ */
+int IoUring::wait(uint64_t timeout_ms) {
+#ifdef IORING_ENTER_EXT_ARG
+    __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000 * 1000;
+
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+
+    int rt = enter(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    return rt < 0 ? -1 : 0;
+#else
+    (void)timeout_ms;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * @brief 从 CQ 中取出已完成的 cqe
+ * @param[out] cqes 保存 cqe 的数组
+ * @param[in] max 最多取出的个数
+ * @return size_t 取出的个数
+ */
+size_t IoUring::reap(io_uring_cqe *cqes, size_t max) {
+    MutexType::Lock lock(m_cqMutex);
+    unsigned head = *m_cqHead;
+    unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    size_t n = 0;
+    while(head != tail && n < max) {
+        cqes[n++] = m_cqes[head & m_cqMask];
+        ++head;
+    }
+    // 拷贝完再移动 head，之后内核才能复用这些位置
+    __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+    return n;
+}
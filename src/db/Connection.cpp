@@ -1,9 +1,12 @@
 // 说明：
-// - 封装 MySQL 基本连接与执行能力，提供 Connect / Update / Query 三类接口
+// - 封装 MySQL 基本连接与执行能力，提供 Connect / Update / Query 三类接口，以及缓存的预处理语句 Prepare
 // - 维护连接活跃时间，供连接池回收策略参考
 // - 采用 RAII 管理连接生命周期，避免资源泄漏
 
 #include "db/Connection.h"
+#include "coroutine/iomanager.h"
+#include "base/fd_manager.h"
+#include "base/hook.h"
 
 static zch::Logger::ptr g_logger = LOG_NAME("system");
 
@@ -11,7 +14,8 @@ static zch::Logger::ptr g_logger = LOG_NAME("system");
  * @brief 构造函数
  * 初始化 MySQL 连接句柄，并设置字符集为 UTF-8
  */
-Connection::Connection() {
+Connection::Connection()
+    : m_fd(-1) {
     // 初始化连接句柄；若传入非空指针则复用，否则新建
     m_conn = mysql_init(nullptr);
     // 设置字符集编码，确保写入/读取中文等字符不乱码
@@ -24,6 +28,13 @@ Connection::Connection() {
  */
 Connection::~Connection() {
     if (m_conn != nullptr) {
+        // 调度线程上的 close 会被 hook，顺带清理 FdCtx；普通线程(如扫描线程)上需要
+        // 在 close 之前手动删掉，否则 fd 复用时会拿到这条连接的 FdCtx
+        if (m_fd >= 0 && !is_hook_enable()) {
+            FdMgr::GetInstance()->del(m_fd);
+        }
+        // 预处理语句依赖连接句柄，先于连接关闭
+        m_stmts.clear();
         // 析构阶段关闭连接，释放服务器端与客户端资源
         mysql_close(m_conn);
     }
@@ -42,12 +53,15 @@ Connection::~Connection() {
  */
 bool Connection::Connect(const std::string &ip, const uint16_t port, const std::string &user, const std::string &pwd,
                          const std::string &db) {
-    // 建立到 MySQL 的真实连接；成功则返回非空连接句柄
-    m_conn = mysql_real_connect(m_conn, ip.c_str(), user.c_str(), pwd.c_str(), db.c_str(), port, nullptr, 0);
-    if (m_conn == nullptr) {
+    // 建立到 MySQL 的真实连接；失败时句柄仍然有效，用来取错误信息
+    if (mysql_real_connect(m_conn, ip.c_str(), user.c_str(), pwd.c_str(), db.c_str(), port, nullptr, 0) == nullptr) {
         LOG_ERROR(g_logger) << "MySQL Connect Error: " << mysql_error(m_conn);
         return false;
     }
+    // 登记 socket，FdCtx 会把它设置成系统层面的非阻塞，之后在协程里读写时
+    // hook 遇到 EAGAIN 就注册事件并让出协程；在调度线程上连接时 hook 的 socket() 已经登记过
+    m_fd = m_conn->net.fd;
+    FdMgr::GetInstance()->get(m_fd, true);
     return true;
 }
 
@@ -88,6 +102,23 @@ MYSQL_RES *Connection::Query(const std::string &sql) {
     return mysql_use_result(m_conn);
 }
 
+/**
+ * @brief 获取预处理语句，按 SQL 文本缓存
+ * @param[in] sql 带 ? 占位符的 SQL
+ * @return    失败返回 nullptr（并打印错误日志），失败的 SQL 不缓存，下次会重新预处理
+ */
+PreparedStatement::ptr Connection::Prepare(const std::string &sql) {
+    auto it = m_stmts.find(sql);
+    if (it != m_stmts.end()) {
+        return it->second;
+    }
+    PreparedStatement::ptr stmt = PreparedStatement::Create(m_conn, sql);
+    if (stmt) {
+        m_stmts[sql] = stmt;
+    }
+    return stmt;
+}
+
 /**
  * @brief 刷新连接的存活时间戳为当前时间
  * 调用方用完连接后，通过智能指针的自定义析构把连接
@@ -111,3 +142,13 @@ long long Connection::GetAliveTime() const {
     // 返回自上次刷新以来的时间差（微秒）
     return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_aliveTime).count();
 }
+
+/**
+ * @brief 连接归还连接池前调用，把 socket 从当前 IOManager 中注销
+ */
+void Connection::ReleaseEvents() {
+    IOManager *iom = IOManager::GetThis();
+    if (m_fd >= 0 && iom) {
+        iom->delFd(m_fd);
+    }
+}
@@ -1,10 +1,13 @@
 // 文件说明：
 // - 提供连接池的单例获取、连接获取（带自定义析构归还）、连接生产与空闲回收
-// - 通过 JSON 文件加载数据库与池参数，初始化最小连接数，并启动后台守护线程
-// - 关键并发原语：std::mutex + std::condition_variable 保护队列与线程协作
+// - 通过 JSON 文件加载数据库与池参数，并发预热最小连接数，并启动后台守护线程
+// - 关键并发原语：每个分片一把 FiberMutex 保护队列，FiberWaiter 排队等待连接
 #include <fstream>
+#include <sstream>
 
 #include "db/ConnectionPool.h"
+#include "coroutine/iomanager.h"
+#include "base/util.h"
 
 static zch::Logger::ptr g_logger = LOG_NAME("system");
 
@@ -33,7 +36,101 @@ static zch::ConfigVar<size_t>::ptr g_db_max_idle_time =
     zch::Config::Lookup("database.maxidletime", (size_t)(5000), "connectPool max idle time");
 
 static zch::ConfigVar<size_t>::ptr g_db_timeout =
-    zch::Config::Lookup("database.timeout", (size_t)(1000), "connectPool timeout"); 
+    zch::Config::Lookup("database.timeout", (size_t)(1000), "connectPool max wait time(ms) to get a connection");
+
+static zch::ConfigVar<size_t>::ptr g_db_shards =
+    zch::Config::Lookup("database.shards", (size_t)(0),
+            "connectPool shard count, 0 or 1 means no sharding, set to server.thread_num for one shard per thread");
+
+static zch::ConfigVar<size_t>::ptr g_db_warmup_size =
+    zch::Config::Lookup("database.warmup_size", (size_t)(0),
+            "connections ready before serving, the rest warm up in background, 0 means all minsize connections");
+
+static zch::ConfigVar<size_t>::ptr g_db_warmup_concurrency =
+    zch::Config::Lookup("database.warmup_concurrency", (size_t)(16),
+            "connections opened concurrently during warm-up, 1 means one by one");
+
+const uint64_t ConnectionPool::WAIT_BUCKET_LIMITS[WAIT_BUCKETS - 1] = {
+    1, 2, 5, 10, 20, 50, 100, 500, 1000
+};
+
+// 生产者建立连接失败后的退避时间(毫秒)，连续失败时加倍，不超过上限
+static const uint64_t PRODUCE_BACKOFF_MIN_MS = 100;
+static const uint64_t PRODUCE_BACKOFF_MAX_MS = 5000;
+
+/**
+ * @brief 统计信息格式化成一行，用于日志
+ */
+std::string ConnectionPool::Stats::toString() const {
+    std::stringstream ss;
+    ss << "idle=" << idle << " in_use=" << inUse << " total=" << total
+       << " acquired=" << acquired << " exhausted=" << exhausted << " timeouts=" << timeouts
+       << " stolen=" << stolen << " connect_failures=" << connectFailures
+       << " shards=" << shards << " warming=" << warming
+       << " wait_ms={";
+    for (size_t i = 0; i < WAIT_BUCKETS; ++i) {
+        if (i) {
+            ss << ",";
+        }
+        if (i < WAIT_BUCKETS - 1) {
+            ss << "<" << WAIT_BUCKET_LIMITS[i];
+        } else {
+            ss << ">=" << WAIT_BUCKET_LIMITS[WAIT_BUCKETS - 2];
+        }
+        ss << ":" << waitHistogram[i];
+    }
+    ss << "}";
+    return ss.str();
+}
+
+/**
+ * @brief 连接池的一个分片
+ * @details 不分片时整个连接池就是一个分片。count 和 inUse 在其它分片归还、偷取连接时
+ *          也会修改，用原子变量；其余字段都在 mtx 内访问
+ */
+struct ConnectionPool::Shard {
+    Shard()
+        : count(0)
+        , inUse(0)
+        , acquired(0)
+        , exhausted(0)
+        , timeouts(0)
+        , stolen(0) {
+        for (size_t i = 0; i < WAIT_BUCKETS; ++i) {
+            waitHistogram[i] = 0;
+        }
+    }
+
+    /**
+     * @brief 记录一次取连接的等待时间
+     */
+    void recordWait(uint64_t ms) {
+        size_t i = 0;
+        while (i < WAIT_BUCKETS - 1 && ms >= WAIT_BUCKET_LIMITS[i]) {
+            ++i;
+        }
+        ++waitHistogram[i];
+    }
+
+    FiberMutex mtx;
+    // 存储连接的队列（原始指针）；归还时入队，回收/析构时逐一删除
+    std::queue<Connection *> queue;
+    // 取连接的等待者，按到达顺序排队
+    std::deque<AcquireWaiter::ptr> waiters;
+    // 本分片创建的连接总数（随创建/回收变化），生产者创建前先占位
+    std::atomic_int count;
+    // 本分片的连接中正在使用的个数
+    std::atomic_int inUse;
+    // 在本分片上取连接的统计
+    uint64_t acquired;
+    uint64_t exhausted;
+    uint64_t timeouts;
+    uint64_t stolen;
+    uint64_t waitHistogram[WAIT_BUCKETS];
+};
+
+// 当前线程使用的分片
+static thread_local int t_shard = -1;
 
 /**
  * @brief 获取连接池单例
@@ -46,41 +143,251 @@ ConnectionPool &ConnectionPool::GetConnectionPool() {
 }
 
 /**
- * @brief 获取一个可用连接（阻塞式）
- * - 当队列为空时，等待 m_connectionTimeout 时间；若超时仍为空则继续等待（重试）
- * - 返回值为 shared_ptr，析构时通过自定义删除器归还连接到队列，并刷新活跃时间
+ * @brief 获取一个可用连接，最多等待配置的 database.timeout 毫秒
  */
 std::shared_ptr<Connection> ConnectionPool::GetConnection() {
-    // 消费者：获取连接
-    // - 当队列为空时，等待 m_connectionTimeout（微秒）；若超时仍为空则继续等待（重试）
-    // - 返回 shared_ptr<Connection>，自定义删除器在智能指针析构时归还连接并刷新活跃时间
-    std::unique_lock<std::mutex> lock(m_mtx);
-    while (m_connectionQueue.empty()) {  // 连接为空，就阻塞等待m_connectionTimeout时间，如果时间过了，还没唤醒
-        if (std::cv_status::timeout == m_cv.wait_for(lock, std::chrono::microseconds(m_connectionTimeout))) {
-            if (m_connectionQueue.empty()) { //就可能还是为空
-                continue;
+    return GetConnection(m_connectionTimeout);
+}
+
+/**
+ * @brief 获取一个可用连接
+ * - 先取本线程分片的空闲连接，没有再去其它分片偷，都没有时唤醒生产者并在本分片排队等待，
+ *   在协程里调用时只挂起当前协程，不阻塞调度线程
+ * - 归还的连接由 PutConnection 直接交到等待者手上，醒来时不需要再和别人抢
+ * @param[in] timeout_ms 最长等待时间(毫秒)，0 表示不等待，~0ull 表示一直等待
+ */
+std::shared_ptr<Connection> ConnectionPool::GetConnection(uint64_t timeout_ms) {
+    size_t idx = GetShardIndex();
+    Shard *shard = m_shards[idx].get();
+    FiberMutex::Lock lock(shard->mtx);
+    if (!shard->queue.empty()) {
+        Connection *conn = shard->queue.front();
+        shard->queue.pop();
+        ++shard->inUse;
+        ++shard->acquired;
+        shard->recordWait(0);
+        if (shard->queue.size() < m_shardMinSize) {
+            RequestProduce();
+        }
+        lock.unlock();
+        return WrapConnection(conn, idx);
+    }
+
+    size_t owner = idx;
+    Connection *conn = StealConnection(idx, owner);
+    if (conn) {
+        ++shard->acquired;
+        ++shard->stolen;
+        shard->recordWait(0);
+        // 本分片空了，请生产者补上，之后不用再去偷
+        RequestProduce();
+        lock.unlock();
+        return WrapConnection(conn, owner);
+    }
+
+    ++shard->exhausted;
+    uint64_t begin = GetElapsedMS();
+    if (timeout_ms != 0) {
+        // 等待者放在堆上，共享栈协程挂起后栈会被换出，移交连接时不能写到它的栈上
+        AcquireWaiter::ptr w = std::make_shared<AcquireWaiter>();
+        w->waiter = std::make_shared<FiberWaiter>();
+        w->conn = nullptr;
+        w->shard = idx;
+        shard->waiters.push_back(w);
+        ++m_waiterCount;
+        RequestProduce();
+        lock.unlock();
+        bool rt = w->waiter->wait(timeout_ms);
+        lock.lock();
+        if (rt) {
+            ++shard->acquired;
+            shard->recordWait(GetElapsedMS() - begin);
+            lock.unlock();
+            return WrapConnection(w->conn, w->shard);
+        }
+        // 超时后可能已经被 PutConnection 取出队列，只是没能把连接交过来
+        for (auto it = shard->waiters.begin(); it != shard->waiters.end(); ++it) {
+            if (*it == w) {
+                shard->waiters.erase(it);
+                --m_waiterCount;
+                break;
             }
         }
     }
+    ++shard->timeouts;
+    shard->recordWait(GetElapsedMS() - begin);
+    lock.unlock();
+    LOG_WARN(g_logger) << "ConnectionPool get connection timeout, timeout_ms = " << timeout_ms
+                       << ", " << GetStats().toString();
+    return nullptr;
+}
+
+/**
+ * @brief 获取统计信息，各个分片的统计相加
+ */
+ConnectionPool::Stats ConnectionPool::GetStats() {
+    Stats stats;
+    stats.idle = stats.inUse = stats.total = 0;
+    stats.acquired = stats.exhausted = stats.timeouts = stats.stolen = 0;
+    for (size_t i = 0; i < WAIT_BUCKETS; ++i) {
+        stats.waitHistogram[i] = 0;
+    }
+    stats.connectFailures = m_connectFailures;
+    stats.shards = m_shards.size();
+    stats.warming = m_warmupPending;
+    for (auto &shard : m_shards) {
+        FiberMutex::Lock lock(shard->mtx);
+        stats.idle += shard->queue.size();
+        stats.inUse += shard->inUse;
+        stats.total += shard->count;
+        stats.acquired += shard->acquired;
+        stats.exhausted += shard->exhausted;
+        stats.timeouts += shard->timeouts;
+        stats.stolen += shard->stolen;
+        for (size_t i = 0; i < WAIT_BUCKETS; ++i) {
+            stats.waitHistogram[i] += shard->waitHistogram[i];
+        }
+    }
+    return stats;
+}
+
+/**
+ * @brief 当前线程使用的分片，线程第一次取连接时轮流分配
+ */
+size_t ConnectionPool::GetShardIndex() {
+    if (t_shard < 0) {
+        t_shard = (int)(m_nextShard++ % m_shards.size());
+    }
+    return (size_t)t_shard;
+}
+
+/**
+ * @brief 本分片为空时从其它分片取一个空闲连接
+ * @details 只 tryLock，繁忙的分片直接跳过；调用时持有本分片的锁，只 tryLock 不会死锁
+ */
+Connection *ConnectionPool::StealConnection(size_t self, size_t &shard) {
+    size_t n = m_shards.size();
+    for (size_t i = 1; i < n; ++i) {
+        size_t idx = (self + i) % n;
+        Shard *s = m_shards[idx].get();
+        if (!s->mtx.tryLock()) {
+            continue;
+        }
+        Connection *conn = nullptr;
+        if (!s->queue.empty()) {
+            conn = s->queue.front();
+            s->queue.pop();
+            ++s->inUse;
+        }
+        s->mtx.unlock();
+        if (conn) {
+            shard = idx;
+            return conn;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * @brief 用归还时调用 ReleaseConnection 的智能指针包装连接
+ */
+std::shared_ptr<Connection> ConnectionPool::WrapConnection(Connection *conn, size_t shard) {
     // 对于使用完成的连接，不能直接销毁该连接，而是需要将该连接归还给连接池的队列，供之后的其他消费者使用，
     // 于是我们使用智能指针，自定义其析构函数，完成放回的操作：
-    std::shared_ptr<Connection> res(m_connectionQueue.front(), [&](Connection *conn) {
-        std::unique_lock<std::mutex> locker(m_mtx);
-        // 归还前刷新活跃时间，使得该连接在池中的空闲计时从“当前时刻”重新开始
-        conn->RefreshAliveTime();
-        m_connectionQueue.push(conn);
+    return std::shared_ptr<Connection>(conn, [this, shard](Connection *conn) {
+        ReleaseConnection(conn, shard);
     });
-    m_connectionQueue.pop();
-    m_cv.notify_all();
-    return res;
+}
+
+/**
+ * @brief 归还连接
+ * - 先把 socket 从当前 IOManager 注销，空闲期间可能在扫描线程里被关闭
+ * - 刷新活跃时间，使得该连接在池中的空闲计时从“当前时刻”重新开始
+ * - 连接总是回到它所属的分片，被偷走的连接也会回去，分片的大小保持不变
+ */
+void ConnectionPool::ReleaseConnection(Connection *conn, size_t shard) {
+    conn->ReleaseEvents();
+    conn->RefreshAliveTime();
+    --m_shards[shard]->inUse;
+    PutConnection(conn, shard);
+}
+
+/**
+ * @brief 把连接交给等待最久的等待者，本分片没有等待者时交给其它分片的等待者，
+ *        都没有时放回所属分片的队列
+ */
+void ConnectionPool::PutConnection(Connection *conn, size_t shard) {
+    Shard *home = m_shards[shard].get();
+    {
+        FiberMutex::Lock lock(home->mtx);
+        if (HandOff(home, conn, shard)) {
+            return;
+        }
+    }
+    if (m_waiterCount > 0) {
+        size_t n = m_shards.size();
+        for (size_t i = 1; i < n; ++i) {
+            Shard *s = m_shards[(shard + i) % n].get();
+            FiberMutex::Lock lock(s->mtx);
+            if (HandOff(s, conn, shard)) {
+                return;
+            }
+        }
+    }
+    FiberMutex::Lock lock(home->mtx);
+    // 去其它分片转了一圈，期间本分片可能来了新的等待者
+    if (HandOff(home, conn, shard)) {
+        return;
+    }
+    home->queue.push(conn);
+}
+
+/**
+ * @brief 把连接交给 s 上等待最久的等待者
+ * @details 在 s->mtx 内完成移交，超时的等待者要先拿到 s->mtx 才能出队返回；
+ *          AcquireWaiter 由队列和等待者共同持有，移交时等待者的栈可能已经换出
+ */
+bool ConnectionPool::HandOff(Shard *s, Connection *conn, size_t shard) {
+    while (!s->waiters.empty()) {
+        AcquireWaiter::ptr w = s->waiters.front();
+        s->waiters.pop_front();
+        --m_waiterCount;
+        w->conn = conn;
+        w->shard = shard;
+        if (w->waiter->notify()) {
+            ++m_shards[shard]->inUse;
+            return true;
+        }
+        // 这个等待者已经超时，交给下一个
+        w->conn = nullptr;
+    }
+    return false;
+}
+
+/**
+ * @brief 唤醒生产者补充连接
+ */
+void ConnectionPool::RequestProduce() {
+    if (!m_produceRequested.exchange(true)) {
+        m_produceSem.notify();
+    }
 }
 
 /**
  * @brief 构造函数
- * - 加载配置，初始化最小数量的连接
+ * - 加载配置，按分片并发预热最小数量的连接，前 m_warmupSize 个建好后就返回，其余的在后台继续
  * - 启动生产者线程与扫描回收线程（均为守护线程）
  */
-ConnectionPool::ConnectionPool() {
+ConnectionPool::ConnectionPool()
+    : m_nextShard(0)
+    , m_waiterCount(0)
+    , m_warmupNext(0)
+    , m_warmupPending(0)
+    , m_warmupReady(0)
+    , m_warmupBegin(0)
+    , m_connectFailures(0)
+    , m_produceRequested(false)
+    , m_isShutdown(false) {
 
     m_ip = g_db_ip->GetValue();
     m_port = g_db_port->GetValue();
@@ -91,14 +398,42 @@ ConnectionPool::ConnectionPool() {
     m_maxSize = g_db_max_size->GetValue();
     m_maxIdleTime = g_db_max_idle_time->GetValue();
     m_connectionTimeout = g_db_timeout->GetValue();
+    m_warmupSize = g_db_warmup_size->GetValue();
+    m_warmupConcurrency = g_db_warmup_concurrency->GetValue();
 
-    // 创建初始数量的连接（维持不低于 _minSize）
-    for (size_t i = 0; i < m_minSize; ++i) {
-        AddConnection();
+    // 连接池的大小按分片平均分配，最小值向上取整，最大值至少为 1 且不小于最小值
+    size_t shards = std::max(g_db_shards->GetValue(), (size_t)1);
+    m_shardMinSize = (m_minSize + shards - 1) / shards;
+    m_shardMaxSize = std::max(std::max(m_maxSize / shards, (size_t)1), m_shardMinSize);
+    for (size_t i = 0; i < shards; ++i) {
+        m_shards.emplace_back(new Shard);
     }
-    
-    // 初始化退出标志
-    m_isShutdown = false;
+    LOG_INFO(g_logger) << "ConnectionPool shards = " << shards << ", shard min size = " << m_shardMinSize
+                       << ", shard max size = " << m_shardMaxSize;
+
+    // 预热初始数量的连接（每个分片维持不低于 m_shardMinSize）
+    size_t total = m_shardMinSize * shards;
+    if (m_warmupSize == 0 || m_warmupSize > total) {
+        m_warmupSize = total;
+    }
+    m_warmupPending = total;
+    m_warmupBegin = GetElapsedMS();
+    IOManager *iom = IOManager::GetThis();
+    if (iom && m_warmupConcurrency > 1 && total > 1) {
+        // 建立连接走 hook 后的 connect/read/write，同时调度多个预热协程就能并发建立
+        size_t workers = std::min(m_warmupConcurrency, total);
+        for (size_t i = 0; i < workers; ++i) {
+            iom->schedule(std::bind(&ConnectionPool::WarmUpTask, this));
+        }
+        if (m_warmupSize > 0) {
+            m_warmupSem.wait();
+        }
+    } else {
+        // 不在 IOManager 里时只能逐个阻塞建立
+        WarmUpTask();
+    }
+    LOG_INFO(g_logger) << "ConnectionPool ready, " << m_warmupReady << "/" << total << " connections in "
+                       << GetElapsedMS() - m_warmupBegin << "ms, connect failures = " << m_connectFailures;
 
     // 启动一个新的线程，作为连接的生产者
     m_produceThread = std::thread(std::bind(&ConnectionPool::ProduceConnectionTask, this));
@@ -108,9 +443,13 @@ ConnectionPool::ConnectionPool() {
 }
 
 ConnectionPool::~ConnectionPool() {
-    // 设置退出标志并通知所有线程
-    m_isShutdown = true;
-    m_cv.notify_all();
+    // 设置退出标志并通知所有线程，持有锁再设置，避免扫描线程检查完标志还没睡下时错过通知
+    {
+        FiberMutex::Lock lock(m_mtx);
+        m_isShutdown = true;
+        m_scanCond.notifyAll();
+    }
+    m_produceSem.notify();
 
     // 等待线程安全退出
     if (m_produceThread.joinable()) {
@@ -121,43 +460,70 @@ ConnectionPool::~ConnectionPool() {
     }
 
     // 析构时释放队列中的连接（raw pointer），避免资源泄漏
-    while (!m_connectionQueue.empty()) {
-        Connection *ptr = m_connectionQueue.front();
-        m_connectionQueue.pop();
-        delete ptr;
+    for (auto &shard : m_shards) {
+        while (!shard->queue.empty()) {
+            Connection *ptr = shard->queue.front();
+            shard->queue.pop();
+            delete ptr;
+        }
     }
 }
 
 /**
  * @brief 连接生产者任务（独立线程）
- * - 当队列大小小于 m_minSize 且总连接数未达到 m_maxSize 时创建新连接
- * - 与消费者通过条件变量协作，避免忙等
+ * - 分片的空闲连接少于 m_shardMinSize 或者有等待者，并且分片连接数未达到 m_shardMaxSize 时创建新连接
+ * - 创建连接时不持有锁，没有需要补充的分片时等待补充请求，避免忙等
+ * - 建立失败时退还占位并退避重试，失败的连接不放入分片
  */
 void ConnectionPool::ProduceConnectionTask() {
     // 生产者：在连接不足时创建新连接
+    uint64_t backoff = 0;
     while (!m_isShutdown) {
-        std::unique_lock<std::mutex> lock(m_mtx);
-        // 当队列大小达到（或超过）_minSize 时，进入等待，避免无意义生产
-        while (!m_isShutdown && m_connectionQueue.size() >= m_minSize) {
-            m_cv.wait(lock);
-        }
-        
-        // 如果是由于 shutdown 唤醒，则退出
-        if (m_isShutdown) {
-            break;
-        }
-
-        // 容量未达上限则创建新连接
-        if (m_connectionCount < (int)m_maxSize) {
-            AddConnection();
+        m_produceSem.wait();
+        // 先清掉请求标志再检查，检查之后的新请求会再 notify 一次
+        m_produceRequested = false;
+        bool produced = true;
+        while (produced && !m_isShutdown) {
+            produced = false;
+            bool failed = false;
+            for (size_t i = 0; i < m_shards.size() && !m_isShutdown; ++i) {
+                Shard *shard = m_shards[i].get();
+                {
+                    FiberMutex::Lock lock(shard->mtx);
+                    if ((shard->queue.size() >= m_shardMinSize && shard->waiters.empty())
+                            || shard->count >= (int)m_shardMaxSize) {
+                        continue;
+                    }
+                    // 先占位再在锁外建立连接，连接期间消费者仍然可以取、还连接
+                    ++shard->count;
+                }
+                Connection *conn = CreateConnection();
+                if (!conn) {
+                    --shard->count;
+                    failed = true;
+                    break;
+                }
+                backoff = 0;
+                PutConnection(conn, i);
+                produced = true;
+            }
+            if (failed) {
+                // 数据库不可用时不要反复重连，等一段时间再试，析构时会被唤醒
+                backoff = backoff ? std::min(backoff * 2, PRODUCE_BACKOFF_MAX_MS) : PRODUCE_BACKOFF_MIN_MS;
+                LOG_WARN(g_logger) << "ConnectionPool create connection failed, retry in " << backoff << "ms";
+                FiberMutex::Lock lock(m_mtx);
+                if (!m_isShutdown) {
+                    m_scanCond.waitFor(lock, backoff);
+                }
+                produced = true;
+            }
         }
-        m_cv.notify_all();
     }
 }
 
 /**
  * @brief 空闲连接扫描回收任务（独立线程）
- * - 每隔 m_maxIdleTime 秒检查队头连接的闲置时长，超过阈值则回收
+ * - 每隔 m_maxIdleTime 秒检查各个分片队头连接的闲置时长，超过阈值则回收
  * - 队列按归还时间近似从旧到新；队头不超阈值时后续更“新”的连接也不会超
  * - 注意：GetAliveTime 返回微秒，这里比较使用 m_maxIdleTime * 1000 的单位（毫秒），
  *         如需严格一致可统一为同一单位（比如全部按微秒）
@@ -165,42 +531,98 @@ void ConnectionPool::ProduceConnectionTask() {
 void ConnectionPool::ScannerConnectionTask() {
     // 回收者：定时检查空闲连接并回收超时的连接
     while (!m_isShutdown) {
-        // 以 _maxIdleTime 为周期进行扫描（单位：秒）
-        // 使用 wait_for 替代 sleep，支持被 notify 唤醒以快速退出
-        std::unique_lock<std::mutex> lock(m_mtx);
-        m_cv.wait_for(lock, std::chrono::seconds(m_maxIdleTime), [this]{ return m_isShutdown.load(); });
-        
-        if (m_isShutdown) {
-            break;
+        {
+            // 以 _maxIdleTime 为周期进行扫描（单位：秒）
+            // 使用条件变量的超时等待替代 sleep，支持被 notify 唤醒以快速退出
+            FiberMutex::Lock lock(m_mtx);
+            if (!m_isShutdown) {
+                m_scanCond.waitFor(lock, m_maxIdleTime * 1000);
+            }
+            if (m_isShutdown) {
+                break;
+            }
         }
 
-        // 仅在当前连接总数大于最小容量时尝试回收
-        while (m_connectionCount > (int)m_minSize) {
-            // 队列近似按归还时间排序：队头最“老”，若它未超时，后续更“新”的也不会超时
-            Connection *ptr = m_connectionQueue.front();
-            // 说明：GetAliveTime 返回微秒；此处比较阈值使用 _maxIdleTime * 1000（毫秒），
-            // 若需要严格一致，可将比较统一为同单位
-            size_t aliveTime = ptr->GetAliveTime();
-            if (aliveTime >= m_maxIdleTime * 1000) {
-                m_connectionQueue.pop();
-                --m_connectionCount;
-                delete ptr;
-            } else {
-                break;
+        std::vector<Connection *> expired;
+        for (auto &shard : m_shards) {
+            FiberMutex::Lock lock(shard->mtx);
+            // 仅在分片连接总数大于最小容量时尝试回收
+            while (shard->count > (int)m_shardMinSize && !shard->queue.empty()) {
+                // 队列近似按归还时间排序：队头最“老”，若它未超时，后续更“新”的也不会超时
+                Connection *ptr = shard->queue.front();
+                // 说明：GetAliveTime 返回微秒；此处比较阈值使用 _maxIdleTime * 1000（毫秒），
+                // 若需要严格一致，可将比较统一为同单位
+                size_t aliveTime = ptr->GetAliveTime();
+                if (aliveTime >= m_maxIdleTime * 1000) {
+                    shard->queue.pop();
+                    --shard->count;
+                    expired.push_back(ptr);
+                } else {
+                    break;
+                }
             }
         }
+        // 关闭连接要和服务器交互，放在锁外面
+        for (auto ptr : expired) {
+            delete ptr;
+        }
     }
 }
 
 /**
- * @brief 创建并入队一个新连接
- * - 连接成功后刷新活跃时间并推入队列，增加 m_connectionCount
+ * @brief 预热任务，领取预热名额逐个建立连接
+ * - 名额按分片轮流分配，建好的连接通过 PutConnection 放入分片，已经有人在等时直接交给等待者
+ * - 建立失败的名额退还分片的占位，不放入分片，名额处理完后由生产者补上
+ * - 成功建好第 m_warmupSize 个连接时通知构造函数返回；失败太多凑不够时，
+ *   所有名额处理完再通知，数据库不可用时构造函数也不会一直等下去
  */
-void ConnectionPool::AddConnection() {
-    // 新建连接并入队；刷新活跃时间作为闲置起点
+void ConnectionPool::WarmUpTask() {
+    size_t total = m_shardMinSize * m_shards.size();
+    while (!m_isShutdown) {
+        size_t slot = m_warmupNext++;
+        if (slot >= total) {
+            break;
+        }
+        size_t idx = slot % m_shards.size();
+        // 和生产者一样先占位，生产者和扫描线程看到的连接数包含正在建立的连接
+        ++m_shards[idx]->count;
+        Connection *conn = CreateConnection();
+        if (conn) {
+            PutConnection(conn, idx);
+            if (++m_warmupReady == m_warmupSize) {
+                m_warmupSem.notify();
+            }
+        } else {
+            --m_shards[idx]->count;
+        }
+        // 各个任务先更新 m_warmupReady 再减 m_warmupPending，减到 0 时 m_warmupReady 不会再变
+        if (--m_warmupPending == 0) {
+            size_t ready = m_warmupReady;
+            LOG_INFO(g_logger) << "ConnectionPool warm-up finished, " << ready << "/" << total
+                               << " connections in " << GetElapsedMS() - m_warmupBegin << "ms";
+            if (ready < m_warmupSize) {
+                m_warmupSem.notify();
+            }
+            if (ready < total) {
+                RequestProduce();
+            }
+        }
+    }
+}
+
+/**
+ * @brief 创建一个新连接并刷新活跃时间，不入队，建立失败时返回 nullptr
+ */
+Connection *ConnectionPool::CreateConnection() {
+    // 新建连接；刷新活跃时间作为闲置起点
     Connection *conn = new Connection();
-    conn->Connect(m_ip, m_port, m_user, m_pwd, m_db);
+    if (!conn->Connect(m_ip, m_port, m_user, m_pwd, m_db)) {
+        ++m_connectFailures;
+        delete conn;
+        return nullptr;
+    }
+    // 在协程里建立连接时 socket 注册到了当前 IOManager，放入池中前注销
+    conn->ReleaseEvents();
     conn->RefreshAliveTime();
-    m_connectionQueue.push(conn);
-    ++m_connectionCount;
+    return conn;
 }
@@ -0,0 +1,205 @@
+// 说明：
+// - 封装 mysql_stmt_* 预处理语句：预处理、参数绑定、执行与结果读取
+// - 参数与结果都通过 MYSQL_BIND 按二进制协议传输，结果集一次缓存到客户端
+
+#include <string.h>
+#include <algorithm>
+
+#include "db/PreparedStatement.h"
+#include "base/log.h"
+
+static zch::Logger::ptr g_logger = LOG_NAME("system");
+
+/**
+ * @brief 在连接上预处理一条 SQL
+ * @param[in] conn MySQL 连接句柄
+ * @param[in] sql 带 ? 占位符的 SQL
+ * @return 失败返回 nullptr（并打印错误日志）
+ */
+PreparedStatement::ptr PreparedStatement::Create(MYSQL *conn, const std::string &sql) {
+    MYSQL_STMT *stmt = mysql_stmt_init(conn);
+    if (stmt == nullptr) {
+        LOG_ERROR(g_logger) << "mysql_stmt_init error: " << mysql_error(conn);
+        return nullptr;
+    }
+    if (mysql_stmt_prepare(stmt, sql.c_str(), sql.size()) != 0) {
+        LOG_ERROR(g_logger) << "SQL " << sql << " 预处理失败：" << mysql_stmt_error(stmt);
+        mysql_stmt_close(stmt);
+        return nullptr;
+    }
+    // 缓存结果集时计算每列的最大长度，用来准备结果缓冲区
+    BindBool updateMaxLength = 1;
+    mysql_stmt_attr_set(stmt, STMT_ATTR_UPDATE_MAX_LENGTH, &updateMaxLength);
+    return ptr(new PreparedStatement(stmt, sql));
+}
+
+PreparedStatement::PreparedStatement(MYSQL_STMT *stmt, const std::string &sql)
+    : m_stmt(stmt)
+    , m_sql(sql)
+    , m_meta(nullptr) {
+    size_t params = mysql_stmt_param_count(m_stmt);
+    m_params.resize(params);
+    memset(m_params.data(), 0, sizeof(MYSQL_BIND) * params);
+    m_paramStrs.resize(params);
+    m_paramInts.resize(params);
+    m_paramLens.resize(params);
+    for (size_t i = 0; i < params; ++i) {
+        m_params[i].buffer_type = MYSQL_TYPE_NULL;
+    }
+
+    m_meta = mysql_stmt_result_metadata(m_stmt);
+    if (m_meta) {
+        size_t fields = mysql_num_fields(m_meta);
+        m_results.resize(fields);
+        memset(m_results.data(), 0, sizeof(MYSQL_BIND) * fields);
+        m_buffers.resize(fields);
+        m_lengths.resize(fields);
+        m_nulls.reset(new BindBool[fields]());
+    }
+}
+
+PreparedStatement::~PreparedStatement() {
+    if (m_meta) {
+        mysql_free_result(m_meta);
+    }
+    mysql_stmt_close(m_stmt);
+}
+
+bool PreparedStatement::BindString(size_t idx, const std::string &v) {
+    if (idx >= m_params.size()) {
+        LOG_ERROR(g_logger) << "SQL " << m_sql << " 参数下标越界：" << idx;
+        return false;
+    }
+    m_paramStrs[idx] = v;
+    m_paramLens[idx] = v.size();
+    MYSQL_BIND &bind = m_params[idx];
+    bind.buffer_type = MYSQL_TYPE_STRING;
+    bind.buffer = (void *)m_paramStrs[idx].data();
+    bind.buffer_length = v.size();
+    bind.length = &m_paramLens[idx];
+    return true;
+}
+
+bool PreparedStatement::BindInt64(size_t idx, int64_t v) {
+    if (idx >= m_params.size()) {
+        LOG_ERROR(g_logger) << "SQL " << m_sql << " 参数下标越界：" << idx;
+        return false;
+    }
+    m_paramInts[idx] = v;
+    MYSQL_BIND &bind = m_params[idx];
+    bind.buffer_type = MYSQL_TYPE_LONGLONG;
+    bind.buffer = &m_paramInts[idx];
+    bind.buffer_length = sizeof(int64_t);
+    bind.length = nullptr;
+    return true;
+}
+
+bool PreparedStatement::BindNull(size_t idx) {
+    if (idx >= m_params.size()) {
+        LOG_ERROR(g_logger) << "SQL " << m_sql << " 参数下标越界：" << idx;
+        return false;
+    }
+    MYSQL_BIND &bind = m_params[idx];
+    bind.buffer_type = MYSQL_TYPE_NULL;
+    bind.buffer = nullptr;
+    bind.buffer_length = 0;
+    bind.length = nullptr;
+    return true;
+}
+
+/**
+ * @brief 绑定参数并执行
+ * @details 上一次查询没读完的结果集先释放掉，否则连接仍处于忙状态
+ */
+bool PreparedStatement::DoExecute() {
+    mysql_stmt_free_result(m_stmt);
+    if (!m_params.empty() && mysql_stmt_bind_param(m_stmt, m_params.data()) != 0) {
+        LOG_WARN(g_logger) << "SQL " << m_sql << " 绑定参数失败：" << mysql_stmt_error(m_stmt);
+        return false;
+    }
+    if (mysql_stmt_execute(m_stmt) != 0) {
+        LOG_WARN(g_logger) << "SQL " << m_sql << " 执行失败：" << mysql_stmt_error(m_stmt);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief 执行写操作（INSERT/UPDATE/DELETE 等）
+ */
+bool PreparedStatement::Execute() {
+    return DoExecute();
+}
+
+/**
+ * @brief 执行查询，并把结果集缓存到客户端
+ * @details 缓存后各列的 max_length 已知，按它扩容结果缓冲区，Fetch 时不会被截断
+ */
+bool PreparedStatement::Query() {
+    if (!m_meta) {
+        LOG_WARN(g_logger) << "SQL " << m_sql << " 没有结果集";
+        return false;
+    }
+    if (!DoExecute()) {
+        return false;
+    }
+    if (mysql_stmt_store_result(m_stmt) != 0) {
+        LOG_WARN(g_logger) << "SQL " << m_sql << " 读取结果失败：" << mysql_stmt_error(m_stmt);
+        return false;
+    }
+
+    MYSQL_FIELD *fields = mysql_fetch_fields(m_meta);
+    for (size_t i = 0; i < m_results.size(); ++i) {
+        // 多留一个字节，空列也有可用的缓冲区
+        size_t len = fields[i].max_length + 1;
+        if (m_buffers[i].size() < len) {
+            m_buffers[i].resize(len);
+        }
+        MYSQL_BIND &bind = m_results[i];
+        bind.buffer_type = MYSQL_TYPE_STRING;
+        bind.buffer = m_buffers[i].data();
+        bind.buffer_length = m_buffers[i].size();
+        bind.length = &m_lengths[i];
+        bind.is_null = &m_nulls[i];
+    }
+    if (mysql_stmt_bind_result(m_stmt, m_results.data()) != 0) {
+        LOG_WARN(g_logger) << "SQL " << m_sql << " 绑定结果失败：" << mysql_stmt_error(m_stmt);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief 取下一行
+ * @return 没有更多行或者出错返回 false
+ */
+bool PreparedStatement::Fetch() {
+    int rt = mysql_stmt_fetch(m_stmt);
+    if (rt == 0 || rt == MYSQL_DATA_TRUNCATED) {
+        return true;
+    }
+    if (rt != MYSQL_NO_DATA) {
+        LOG_WARN(g_logger) << "SQL " << m_sql << " 取结果失败：" << mysql_stmt_error(m_stmt);
+    }
+    return false;
+}
+
+std::string PreparedStatement::GetString(size_t idx) const {
+    if (idx >= m_results.size() || m_nulls[idx]) {
+        return "";
+    }
+    // 截断时 length 是完整长度，只取缓冲区里的部分
+    return std::string(m_buffers[idx].data(), std::min<size_t>(m_lengths[idx], m_buffers[idx].size()));
+}
+
+bool PreparedStatement::IsNull(size_t idx) const {
+    return idx >= m_results.size() || m_nulls[idx];
+}
+
+uint64_t PreparedStatement::GetAffectedRows() {
+    return mysql_stmt_affected_rows(m_stmt);
+}
+
+unsigned int PreparedStatement::GetErrno() {
+    return mysql_stmt_errno(m_stmt);
+}
@@ -0,0 +1,276 @@
+// 说明：
+// - 注册请求的批量写入：按批大小或等待窗口把排队的注册合并成一个事务
+// - 事务内查重 + 多行 INSERT，失败时回滚并逐条插入，逐个唤醒等待的协程
+
+#include <mysql/mysqld_error.h>
+#include <algorithm>
+#include <functional>
+#include <unordered_set>
+
+#include "db/RegisterBatcher.h"
+#include "db/ConnectionPool.h"
+#include "db/UserCache.h"
+#include "coroutine/iomanager.h"
+#include "base/config.h"
+#include "base/log.h"
+
+static zch::Logger::ptr g_logger = LOG_NAME("system");
+
+static zch::ConfigVar<size_t>::ptr g_register_batch_size =
+    zch::Config::Lookup("register.batch_size", (size_t)(32), "max registrations written in one transaction, 1 disables batching");
+
+static zch::ConfigVar<uint64_t>::ptr g_register_batch_window =
+    zch::Config::Lookup("register.batch_window", (uint64_t)(2), "time(ms) to collect a registration batch");
+
+// 批量 SQL 只按这几档行数生成，每条连接上最多缓存 2 * 4 条预处理语句，与 batch_size 无关；
+// 按批大小各生成一条的话，连接数乘上语句数很容易超过服务器的 max_prepared_stmt_count
+static const size_t STMT_ROWS[] = {1, 4, 16, 32};
+static const size_t STMT_ROWS_NUM = sizeof(STMT_ROWS) / sizeof(STMT_ROWS[0]);
+
+/**
+ * @brief 能放下 n 行的最小档位，n 超过最大档位时返回最大档位
+ */
+static size_t StmtRowsAtLeast(size_t n) {
+    for (size_t i = 0; i < STMT_ROWS_NUM; ++i) {
+        if (STMT_ROWS[i] >= n) {
+            return STMT_ROWS[i];
+        }
+    }
+    return STMT_ROWS[STMT_ROWS_NUM - 1];
+}
+
+/**
+ * @brief 不超过 n 行的最大档位，n 不能为 0
+ */
+static size_t StmtRowsAtMost(size_t n) {
+    size_t rows = STMT_ROWS[0];
+    for (size_t i = 0; i < STMT_ROWS_NUM && STMT_ROWS[i] <= n; ++i) {
+        rows = STMT_ROWS[i];
+    }
+    return rows;
+}
+
+/**
+ * @brief 查 n 个用户名的 SELECT ... IN (...) FOR UPDATE
+ */
+static std::string SelectSql(size_t n) {
+    // FOR UPDATE 锁住这些用户名，提交前其它事务不能插入同名用户
+    std::string sql = "SELECT username FROM user WHERE username IN (?";
+    for (size_t i = 1; i < n; ++i) {
+        sql += ", ?";
+    }
+    sql += ") FOR UPDATE";
+    return sql;
+}
+
+/**
+ * @brief 写 n 行的多行 INSERT
+ */
+static std::string InsertSql(size_t n) {
+    std::string sql = "INSERT INTO user(username, password) VALUES(?, ?)";
+    for (size_t i = 1; i < n; ++i) {
+        sql += ", (?, ?)";
+    }
+    return sql;
+}
+
+RegisterBatcher::RegisterBatcher() {
+    m_maxBatch = std::max(g_register_batch_size->GetValue(), (size_t)1);
+    m_window = g_register_batch_window->GetValue();
+}
+
+/**
+ * @brief 注册用户，等到所在的批写入完成后返回
+ * - 排队的第一个请求启动等待窗口的定时器，窗口到期时写入
+ * - 凑满 m_maxBatch 个时取消定时器，马上调度一个协程写入
+ */
+RegisterBatcher::Result RegisterBatcher::Register(const std::string &name, const std::string &pwd) {
+    // 请求放在堆上，共享栈协程挂起后栈会被换出，写入时不能访问它的栈
+    Request::ptr req = std::make_shared<Request>();
+    req->name = name;
+    req->password = pwd;
+    req->result = FAILED;
+
+    IOManager *iom = IOManager::GetThis();
+    if (!iom || m_maxBatch <= 1) {
+        std::vector<Request::ptr> batch(1, req);
+        Commit(batch, false);
+        return req->result;
+    }
+
+    req->waiter = std::make_shared<FiberWaiter>();
+    std::vector<Request::ptr> full;
+    {
+        MutexType::Lock lock(m_mutex);
+        m_pending.push_back(req);
+        if (m_pending.size() >= m_maxBatch) {
+            full.swap(m_pending);
+            if (m_timer) {
+                m_timer->cancel();
+                m_timer.reset();
+            }
+        } else if (m_pending.size() == 1) {
+            m_timer = iom->addTimer(m_window, std::bind(&RegisterBatcher::OnTimer, this));
+        }
+    }
+    if (!full.empty()) {
+        iom->schedule(std::bind(&RegisterBatcher::Commit, this, full, true));
+    }
+    // 写入不会丢下排队的请求，这里不需要超时
+    req->waiter->wait();
+    return req->result;
+}
+
+/**
+ * @brief 等待窗口到期，写入当前排队的请求
+ */
+void RegisterBatcher::OnTimer() {
+    std::vector<Request::ptr> batch;
+    {
+        MutexType::Lock lock(m_mutex);
+        batch.swap(m_pending);
+        m_timer.reset();
+    }
+    if (!batch.empty()) {
+        Commit(batch, true);
+    }
+}
+
+/**
+ * @brief 写入一批请求
+ * @details 批内重名的请求只保留第一个
+ */
+void RegisterBatcher::Commit(std::vector<Request::ptr> batch, bool notify) {
+    {
+        std::shared_ptr<Connection> conn = ConnectionPool::GetConnectionPool().GetConnection();
+        if (!conn) {
+            LOG_ERROR(g_logger) << "RegisterBatcher get database connection failed, batch = " << batch.size();
+            for (auto r : batch) {
+                r->result = UNAVAILABLE;
+            }
+        } else {
+            std::unordered_set<std::string> names;
+            std::vector<Request::ptr> rows;
+            for (auto r : batch) {
+                if (names.insert(r->name).second) {
+                    rows.push_back(r);
+                } else {
+                    r->result = DUPLICATE;
+                }
+            }
+            if (!InsertBatch(conn.get(), rows)) {
+                LOG_WARN(g_logger) << "RegisterBatcher batch insert failed, insert one by one, rows = " << rows.size();
+                InsertOneByOne(conn.get(), rows);
+            }
+        }
+    }
+    LOG_DEBUG(g_logger) << "RegisterBatcher commit batch = " << batch.size();
+
+    if (notify) {
+        for (auto r : batch) {
+            r->waiter->notify();
+        }
+    }
+}
+
+/**
+ * @brief 在事务里查重并用多行 INSERT 写入
+ * @details SQL 只按 STMT_ROWS 的几档行数生成：查重时参数不够一档的用最后一个用户名补齐，
+ *          IN 里重复的值不影响结果；INSERT 不能补行，按档位拆成几条，在同一个事务里执行。
+ *          查出已存在的用户名之后再失败的，这些请求直接判定为重名，rows 只留下需要逐条插入的
+ */
+bool RegisterBatcher::InsertBatch(Connection *conn, std::vector<Request::ptr> &rows) {
+    if (rows.empty()) {
+        return true;
+    }
+    if (!conn->Update("START TRANSACTION")) {
+        return false;
+    }
+
+    // Bloom 过滤器判定一定不存在的用户名不用查
+    UserCache *cache = UserCacheMgr::GetInstance();
+    std::vector<Request::ptr> check;
+    for (auto r : rows) {
+        if (cache->MayExist(r->name)) {
+            check.push_back(r);
+        }
+    }
+    std::unordered_set<std::string> taken;
+    for (size_t off = 0; off < check.size();) {
+        size_t n = std::min(check.size() - off, STMT_ROWS[STMT_ROWS_NUM - 1]);
+        size_t params = StmtRowsAtLeast(n);
+        PreparedStatement::ptr stmt = conn->Prepare(SelectSql(params));
+        bool ok = stmt != nullptr;
+        for (size_t i = 0; ok && i < params; ++i) {
+            ok = stmt->BindString(i, check[off + std::min(i, n - 1)]->name);
+        }
+        if (!ok || !stmt->Query()) {
+            conn->Update("ROLLBACK");
+            return false;
+        }
+        while (stmt->Fetch()) {
+            taken.insert(stmt->GetString(0));
+        }
+        off += n;
+    }
+
+    std::vector<Request::ptr> inserts;
+    for (auto r : rows) {
+        if (!taken.count(r->name)) {
+            inserts.push_back(r);
+        }
+    }
+    for (size_t off = 0; off < inserts.size();) {
+        size_t n = StmtRowsAtMost(inserts.size() - off);
+        PreparedStatement::ptr stmt = conn->Prepare(InsertSql(n));
+        bool ok = stmt != nullptr;
+        for (size_t i = 0; ok && i < n; ++i) {
+            Request::ptr r = inserts[off + i];
+            ok = stmt->BindString(2 * i, r->name) && stmt->BindString(2 * i + 1, r->password);
+        }
+        if (!ok || !stmt->Execute()) {
+            conn->Update("ROLLBACK");
+            KeepInserts(rows, inserts);
+            return false;
+        }
+        off += n;
+    }
+    if (!conn->Update("COMMIT")) {
+        conn->Update("ROLLBACK");
+        KeepInserts(rows, inserts);
+        return false;
+    }
+
+    for (auto r : rows) {
+        r->result = taken.count(r->name) ? DUPLICATE : SUCCESS;
+    }
+    return true;
+}
+
+/**
+ * @brief 查重之后写入失败，查到的重名请求直接判定，rows 只留下需要逐条插入的请求
+ */
+void RegisterBatcher::KeepInserts(std::vector<Request::ptr> &rows, std::vector<Request::ptr> &inserts) {
+    for (auto r : rows) {
+        r->result = DUPLICATE;
+    }
+    rows.swap(inserts);
+}
+
+/**
+ * @brief 逐条插入，根据错误码区分重名和失败
+ */
+void RegisterBatcher::InsertOneByOne(Connection *conn, std::vector<Request::ptr> &rows) {
+    for (auto r : rows) {
+        PreparedStatement::ptr stmt = conn->Prepare("INSERT INTO user(username, password) VALUES(?, ?)");
+        if (!stmt) {
+            r->result = FAILED;
+            continue;
+        }
+        if (stmt->BindString(0, r->name) && stmt->BindString(1, r->password) && stmt->Execute()) {
+            r->result = SUCCESS;
+        } else {
+            r->result = stmt->GetErrno() == ER_DUP_ENTRY ? DUPLICATE : FAILED;
+        }
+    }
+}
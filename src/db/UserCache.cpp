@@ -0,0 +1,257 @@
+// 说明：
+// - 用户表前的进程内缓存：分片 + LRU 的正向/负向条目，TTL 通过 TimerManager 过期
+// - Bloom 过滤器在后台从数据库加载所有用户名，注册时用来跳过查重
+
+#include <functional>
+
+#include "db/UserCache.h"
+#include "db/ConnectionPool.h"
+#include "coroutine/iomanager.h"
+#include "base/config.h"
+#include "base/log.h"
+#include "base/util.h"
+
+static zch::Logger::ptr g_logger = LOG_NAME("system");
+
+static zch::ConfigVar<bool>::ptr g_usercache_enable =
+    zch::Config::Lookup("usercache.enable", true, "user cache in front of the user table");
+
+static zch::ConfigVar<size_t>::ptr g_usercache_capacity =
+    zch::Config::Lookup("usercache.capacity", (size_t)(100000), "user cache max entries");
+
+static zch::ConfigVar<size_t>::ptr g_usercache_shards =
+    zch::Config::Lookup("usercache.shards", (size_t)(16), "user cache shard count");
+
+static zch::ConfigVar<uint64_t>::ptr g_usercache_ttl =
+    zch::Config::Lookup("usercache.ttl", (uint64_t)(60000), "user cache ttl(ms) of existing users");
+
+static zch::ConfigVar<uint64_t>::ptr g_usercache_negative_ttl =
+    zch::Config::Lookup("usercache.negative_ttl", (uint64_t)(5000), "user cache ttl(ms) of unknown users");
+
+static zch::ConfigVar<size_t>::ptr g_usercache_bloom_bits =
+    zch::Config::Lookup("usercache.bloom_bits", (size_t)(1 << 23), "bloom filter bits of taken usernames, 0 means disabled");
+
+static zch::ConfigVar<size_t>::ptr g_usercache_bloom_hashes =
+    zch::Config::Lookup("usercache.bloom_hashes", (size_t)(4), "bloom filter hash function count");
+
+UserCache::UserCache()
+    : m_bloomReady(false) {
+    m_enabled = g_usercache_enable->GetValue();
+    m_ttl = g_usercache_ttl->GetValue();
+    m_negativeTtl = g_usercache_negative_ttl->GetValue();
+    size_t shards = std::max(g_usercache_shards->GetValue(), (size_t)1);
+    m_shardCapacity = std::max(g_usercache_capacity->GetValue() / shards, (size_t)1);
+    for (size_t i = 0; i < shards; ++i) {
+        m_shards.emplace_back(new Shard);
+    }
+
+    // 位图按 64 位一个字向上取整
+    size_t words = (g_usercache_bloom_bits->GetValue() + 63) / 64;
+    if (m_enabled && words > 0) {
+        std::vector<std::atomic<uint64_t>> bloom(words);
+        for (auto &i : bloom) {
+            i = 0;
+        }
+        m_bloom.swap(bloom);
+    }
+    m_bloomHashes = std::max(g_usercache_bloom_hashes->GetValue(), (size_t)1);
+}
+
+UserCache::~UserCache() {
+    for (auto &shard : m_shards) {
+        MutexType::Lock lock(shard->mutex);
+        for (auto &i : shard->entries) {
+            if (i.second.timer) {
+                i.second.timer->cancel();
+            }
+        }
+    }
+}
+
+/**
+ * @brief 查询用户
+ * @details 命中时把条目移到 LRU 链表头部；已经过期但定时器还没删掉的条目按未命中处理
+ */
+UserCache::LookupResult UserCache::Lookup(const std::string &name, std::string &password) {
+    if (!m_enabled) {
+        return MISS;
+    }
+    Shard &shard = *m_shards[GetShardIndex(name)];
+    MutexType::Lock lock(shard.mutex);
+    auto it = shard.entries.find(name);
+    if (it == shard.entries.end()) {
+        return MISS;
+    }
+    if (it->second.expire <= GetElapsedMS()) {
+        Erase(shard, it);
+        return MISS;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru);
+    if (!it->second.exists) {
+        return NOT_FOUND;
+    }
+    password = it->second.password;
+    return FOUND;
+}
+
+void UserCache::PutUser(const std::string &name, const std::string &password) {
+    Put(name, true, password, m_ttl);
+}
+
+void UserCache::PutMissing(const std::string &name) {
+    Put(name, false, "", m_negativeTtl);
+}
+
+/**
+ * @brief 注册成功，删除该用户名的条目并加入 Bloom 过滤器
+ */
+void UserCache::OnRegistered(const std::string &name) {
+    if (!m_enabled) {
+        return;
+    }
+    BloomAdd(name);
+    Shard &shard = *m_shards[GetShardIndex(name)];
+    MutexType::Lock lock(shard.mutex);
+    auto it = shard.entries.find(name);
+    if (it != shard.entries.end()) {
+        Erase(shard, it);
+    }
+}
+
+/**
+ * @brief 用户名是否可能已被占用
+ */
+bool UserCache::MayExist(const std::string &name) {
+    if (!m_enabled || m_bloom.empty() || !m_bloomReady) {
+        return true;
+    }
+    return BloomTest(name);
+}
+
+/**
+ * @brief 从数据库加载所有用户名到 Bloom 过滤器
+ * @details 加载期间注册成功的用户名由 OnRegistered 加入，加载完成后不会遗漏
+ */
+bool UserCache::LoadBloom() {
+    if (!m_enabled || m_bloom.empty()) {
+        return false;
+    }
+    uint64_t begin = GetElapsedMS();
+    std::shared_ptr<Connection> conn = ConnectionPool::GetConnectionPool().GetConnection();
+    if (!conn) {
+        LOG_ERROR(g_logger) << "UserCache load bloom filter failed, no database connection";
+        return false;
+    }
+    MYSQL_RES *res = conn->Query("SELECT username FROM user");
+    if (res == nullptr) {
+        LOG_ERROR(g_logger) << "UserCache load bloom filter failed";
+        return false;
+    }
+    size_t count = 0;
+    while (MYSQL_ROW row = mysql_fetch_row(res)) {
+        if (row[0]) {
+            BloomAdd(row[0]);
+            ++count;
+        }
+    }
+    mysql_free_result(res);
+    m_bloomReady = true;
+    LOG_INFO(g_logger) << "UserCache bloom filter loaded, " << count << " usernames in "
+                       << GetElapsedMS() - begin << "ms";
+    return true;
+}
+
+/**
+ * @brief 写入条目，分片满了时淘汰最久没有使用的条目
+ * @details 在 IOManager 里时加一个过期定时器，条目被覆盖或者淘汰时取消旧的定时器
+ */
+void UserCache::Put(const std::string &name, bool exists, const std::string &password, uint64_t ttl) {
+    if (!m_enabled || ttl == 0) {
+        return;
+    }
+    size_t idx = GetShardIndex(name);
+    Shard &shard = *m_shards[idx];
+    uint64_t expire = GetElapsedMS() + ttl;
+    Timer::ptr timer;
+    IOManager *iom = IOManager::GetThis();
+    if (iom) {
+        timer = iom->addTimer(ttl, std::bind(&UserCache::Expire, this, idx, name, expire));
+    }
+
+    MutexType::Lock lock(shard.mutex);
+    auto it = shard.entries.find(name);
+    if (it != shard.entries.end()) {
+        if (it->second.timer) {
+            it->second.timer->cancel();
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru);
+    } else {
+        if (shard.entries.size() >= m_shardCapacity) {
+            Erase(shard, shard.entries.find(shard.lru.back()));
+        }
+        shard.lru.push_front(name);
+        it = shard.entries.insert(std::make_pair(name, Entry())).first;
+        it->second.lru = shard.lru.begin();
+    }
+    it->second.exists = exists;
+    it->second.password = password;
+    it->second.expire = expire;
+    it->second.timer = timer;
+}
+
+/**
+ * @brief 定时器到期时删除条目，条目已经被刷新过时不删除
+ */
+void UserCache::Expire(size_t shard, const std::string &name, uint64_t expire) {
+    Shard &s = *m_shards[shard];
+    MutexType::Lock lock(s.mutex);
+    auto it = s.entries.find(name);
+    if (it != s.entries.end() && it->second.expire == expire) {
+        it->second.timer.reset();
+        Erase(s, it);
+    }
+}
+
+/**
+ * @brief 删除条目，调用时需持有分片的锁
+ */
+void UserCache::Erase(Shard &shard, std::unordered_map<std::string, Entry>::iterator it) {
+    if (it->second.timer) {
+        it->second.timer->cancel();
+    }
+    shard.lru.erase(it->second.lru);
+    shard.entries.erase(it);
+}
+
+size_t UserCache::GetShardIndex(const std::string &name) const {
+    return std::hash<std::string>()(name) % m_shards.size();
+}
+
+/**
+ * @brief 双重哈希：第 i 个哈希函数取 h1 + i * h2
+ */
+void UserCache::BloomAdd(const std::string &name) {
+    if (m_bloom.empty()) {
+        return;
+    }
+    uint64_t h1 = std::hash<std::string>()(name);
+    uint64_t h2 = ((h1 >> 32) | (h1 << 32)) * 0x9E3779B97F4A7C15ull | 1;
+    uint64_t bits = m_bloom.size() * 64;
+    for (size_t i = 0; i < m_bloomHashes; ++i) {
+        uint64_t bit = (h1 + i * h2) % bits;
+        m_bloom[bit / 64].fetch_or(1ull << (bit % 64), std::memory_order_relaxed);
+    }
+}
+
+bool UserCache::BloomTest(const std::string &name) const {
+    uint64_t h1 = std::hash<std::string>()(name);
+    uint64_t h2 = ((h1 >> 32) | (h1 << 32)) * 0x9E3779B97F4A7C15ull | 1;
+    uint64_t bits = m_bloom.size() * 64;
+    for (size_t i = 0; i < m_bloomHashes; ++i) {
+        uint64_t bit = (h1 + i * h2) % bits;
+        if (!(m_bloom[bit / 64].load(std::memory_order_relaxed) & (1ull << (bit % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,392 @@
+// 说明：
+// - 静态文件缓存：分片 + 读写锁，命中时直接返回文件内容和提前生成的响应头
+// - 容量按字节限制，CLOCK 淘汰；inotify 监视资源目录，文件变化时删除条目
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <functional>
+
+#include "http/filecache.h"
+#include "http/httpresponse.h"
+#include "coroutine/iomanager.h"
+#include "base/config.h"
+#include "base/log.h"
+
+static zch::Logger::ptr g_logger = LOG_NAME("system");
+
+static zch::ConfigVar<bool>::ptr g_file_cache_enable =
+    zch::Config::Lookup("file_cache.enable", true, "static file cache");
+
+static zch::ConfigVar<size_t>::ptr g_file_cache_capacity =
+    zch::Config::Lookup("file_cache.capacity", (size_t)(64 * 1024 * 1024), "static file cache max bytes");
+
+static zch::ConfigVar<size_t>::ptr g_file_cache_max_file_size =
+    zch::Config::Lookup("file_cache.max_file_size", (size_t)(1024 * 1024), "files larger than this are not cached");
+
+static zch::ConfigVar<size_t>::ptr g_file_cache_shards =
+    zch::Config::Lookup("file_cache.shards", (size_t)(16), "static file cache shard count");
+
+FileCache::FileCache()
+    : inotifyFd_(-1)
+    , iom_(nullptr)
+    , watching_(false) {
+    enabled_ = g_file_cache_enable->GetValue();
+    maxFileSize_ = g_file_cache_max_file_size->GetValue();
+    size_t shards = std::max(g_file_cache_shards->GetValue(), (size_t)1);
+    shardCapacity_ = g_file_cache_capacity->GetValue() / shards;
+    for (size_t i = 0; i < shards; ++i) {
+        shards_.emplace_back(new Shard);
+    }
+}
+
+FileCache::~FileCache() {
+    if (inotifyFd_ >= 0) {
+        close(inotifyFd_);
+    }
+}
+
+/**
+ * @brief 设置资源目录，在 IOManager 里调用时开始用 inotify 监视目录
+ * @details 监视失败时仍然缓存，命中时用 stat 检查文件有没有变化
+ */
+void FileCache::Init(const std::string& root) {
+    root_ = root;
+    while (root_.size() > 1 && root_.back() == '/') {
+        root_.pop_back();
+    }
+    Mutex::Lock lock(watchMutex_);
+    // Unwatch 时回调还没执行完的话，描述符由回调关闭，关闭之前不重新监视
+    if (!enabled_ || watching_ || inotifyFd_ >= 0) {
+        return;
+    }
+    iom_ = IOManager::GetThis();
+    if (!iom_) {
+        LOG_WARN(g_logger) << "FileCache not in IOManager, revalidate entries with stat";
+        return;
+    }
+    inotifyFd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd_ < 0) {
+        LOG_WARN(g_logger) << "FileCache inotify_init1 failed, revalidate entries with stat, errno=" << errno
+                           << " errstr=" << strerror(errno);
+        return;
+    }
+    AddWatch_("");
+    watching_ = true;
+    iom_->addEvent(inotifyFd_, IOManager::READ, std::bind(&FileCache::OnInotify_, this));
+    LOG_INFO(g_logger) << "FileCache watching " << root_ << ", " << watches_.size() << " directories";
+}
+
+/**
+ * @brief 停止 inotify 监视
+ * @details 读事件还注册着时直接关闭描述符；已经触发了说明回调正在执行或者等着执行，
+ *          由回调结束时看到 watching_ 为 false 再关闭
+ */
+void FileCache::Unwatch() {
+    Mutex::Lock lock(watchMutex_);
+    if (!watching_) {
+        return;
+    }
+    watching_ = false;
+    if (iom_->delEvent(inotifyFd_, IOManager::READ)) {
+        CloseInotify_();
+    }
+}
+
+/**
+ * @brief 关闭 inotify 描述符，调用时需持有 watchMutex_
+ */
+void FileCache::CloseInotify_() {
+    iom_->delFd(inotifyFd_);
+    close(inotifyFd_);
+    inotifyFd_ = -1;
+    watches_.clear();
+    iom_ = nullptr;
+}
+
+/**
+ * @brief 查询文件，没缓存时加载
+ * @details 命中只加分片的读锁并设置引用位；没有 inotify 时用 stat 比较 mtime 和大小，变化了重新加载
+ */
+FileCache::Entry::ptr FileCache::Get(const std::string& path) {
+    if (!enabled_ || root_.empty()) {
+        return nullptr;
+    }
+    std::string normalized;
+    if (path.find("//") != std::string::npos || path.find("/.") != std::string::npos) {
+        if (!Normalize_(path, normalized)) {
+            return nullptr;
+        }
+    }
+    const std::string& key = normalized.empty() ? path : normalized;
+
+    Shard& shard = GetShard_(key);
+    Entry::ptr entry;
+    uint64_t version;
+    {
+        RWMutexType::ReadLock lock(shard.mutex);
+        version = shard.version;
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end()) {
+            entry = it->second;
+        }
+    }
+    if (entry && !watching_) {
+        struct stat st;
+        if (stat((root_ + key).c_str(), &st) < 0 || st.st_size != entry->size
+                || st.st_mtim.tv_sec != entry->mtime.tv_sec || st.st_mtim.tv_nsec != entry->mtime.tv_nsec) {
+            Invalidate(key);
+            entry.reset();
+            ++version;
+        }
+    }
+    if (entry) {
+        entry->referenced = true;
+        return entry;
+    }
+
+    entry = Load_(key);
+    if (entry) {
+        Insert_(key, entry, version);
+    }
+    return entry;
+}
+
+void FileCache::Invalidate(const std::string& path) {
+    Shard& shard = GetShard_(path);
+    RWMutexType::WriteLock lock(shard.mutex);
+    auto it = shard.entries.find(path);
+    if (it != shard.entries.end()) {
+        shard.bytes -= it->second->content.size();
+        shard.entries.erase(it);
+    }
+    ++shard.version;
+}
+
+void FileCache::Clear() {
+    for (auto& i : shards_) {
+        RWMutexType::WriteLock lock(i->mutex);
+        i->entries.clear();
+        i->clock.clear();
+        i->bytes = 0;
+        ++i->version;
+    }
+}
+
+/**
+ * @brief 规范化请求路径，合并多余的 / 和 /./
+ */
+bool FileCache::Normalize_(const std::string& path, std::string& key) {
+    if (path.empty() || path[0] != '/') {
+        return false;
+    }
+    key.clear();
+    size_t i = 0;
+    while (i < path.size()) {
+        size_t end = path.find('/', i + 1);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+        // [i, end) 为 "/段"
+        size_t len = end - i - 1;
+        if (len == 2 && path.compare(i + 1, 2, "..") == 0) {
+            return false;
+        }
+        if (len > 0 && !(len == 1 && path[i + 1] == '.')) {
+            key.append(path, i, end - i);
+        }
+        i = end;
+    }
+    return !key.empty();
+}
+
+/**
+ * @brief 从磁盘加载文件
+ * @details 只缓存有读权限的普通文件，403、404 等仍然由 HttpResponse 处理
+ */
+FileCache::Entry::ptr FileCache::Load_(const std::string& key) {
+    std::string file = root_ + key;
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !(st.st_mode & S_IROTH)
+            || (size_t)st.st_size > maxFileSize_ || (size_t)st.st_size > shardCapacity_) {
+        close(fd);
+        return nullptr;
+    }
+
+    Entry::ptr entry = std::make_shared<Entry>();
+    entry->content.resize(st.st_size);
+    size_t off = 0;
+    while (off < entry->content.size()) {
+        ssize_t n = read(fd, &entry->content[off], entry->content.size() - off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        off += n;
+    }
+    close(fd);
+    if (off != entry->content.size()) {
+        LOG_WARN(g_logger) << "FileCache read " << file << " failed, " << off << "/" << st.st_size;
+        return nullptr;
+    }
+
+    entry->type = HttpResponse::GetFileType(key);
+    entry->headers[0] = HttpResponse::MakeHeader(200, false, entry->type, st.st_size);
+    entry->headers[1] = HttpResponse::MakeHeader(200, true, entry->type, st.st_size);
+    entry->mtime = st.st_mtim;
+    entry->size = st.st_size;
+    entry->referenced = false;
+    LOG_DEBUG(g_logger) << "FileCache load " << key << ", size=" << st.st_size;
+    return entry;
+}
+
+/**
+ * @brief 加入条目，分片超过容量时淘汰
+ */
+void FileCache::Insert_(const std::string& key, Entry::ptr entry, uint64_t version) {
+    Shard& shard = GetShard_(key);
+    RWMutexType::WriteLock lock(shard.mutex);
+    if (shard.version != version) {
+        // 加载期间文件可能变了，这次的内容不缓存，下次再加载
+        return;
+    }
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end()) {
+        // 其它协程同时加载过，用新的替换
+        shard.bytes -= it->second->content.size();
+        shard.entries.erase(it);
+    }
+    Evict_(shard, entry->content.size());
+    shard.entries[key] = entry;
+    shard.bytes += entry->content.size();
+    shard.clock.push_back(key);
+    // 失效、替换留下的旧路径太多时按现有条目重建
+    if (shard.clock.size() > shard.entries.size() * 2 + 16) {
+        std::deque<std::string> clock;
+        for (auto& i : shard.entries) {
+            clock.push_back(i.first);
+        }
+        shard.clock.swap(clock);
+    }
+}
+
+/**
+ * @brief 淘汰条目直到分片能放下 size 字节
+ * @details 被引用过的条目清掉引用位、放回队尾，再给一次机会
+ */
+void FileCache::Evict_(Shard& shard, size_t size) {
+    while (shard.bytes + size > shardCapacity_ && !shard.clock.empty()) {
+        std::string key = shard.clock.front();
+        shard.clock.pop_front();
+        auto it = shard.entries.find(key);
+        if (it == shard.entries.end()) {
+            continue;
+        }
+        if (it->second->referenced) {
+            it->second->referenced = false;
+            shard.clock.push_back(key);
+            continue;
+        }
+        LOG_DEBUG(g_logger) << "FileCache evict " << key;
+        shard.bytes -= it->second->content.size();
+        shard.entries.erase(it);
+    }
+}
+
+FileCache::Shard& FileCache::GetShard_(const std::string& key) {
+    return *shards_[std::hash<std::string>()(key) % shards_.size()];
+}
+
+/**
+ * @brief 监视目录及其子目录
+ */
+void FileCache::AddWatch_(const std::string& dir) {
+    std::string path = root_ + dir;
+    int wd = inotify_add_watch(inotifyFd_, path.c_str(),
+                               IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE
+                               | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd < 0) {
+        LOG_WARN(g_logger) << "FileCache inotify_add_watch " << path << " failed, errno=" << errno
+                           << " errstr=" << strerror(errno);
+        return;
+    }
+    watches_[wd] = dir;
+
+    DIR* d = opendir(path.c_str());
+    if (!d) {
+        return;
+    }
+    while (struct dirent* ent = readdir(d)) {
+        if (ent->d_type == DT_DIR && strcmp(ent->d_name, ".") && strcmp(ent->d_name, "..")) {
+            AddWatch_(dir + "/" + ent->d_name);
+        }
+    }
+    closedir(d);
+}
+
+/**
+ * @brief inotify 可读，处理所有事件后重新等待
+ * @details 文件的事件只删除对应条目；目录被创建时加入监视，目录被删除、移动或者事件队列
+ *          溢出时不知道影响了哪些文件，清空缓存
+ */
+void FileCache::OnInotify_() {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        ssize_t n = read(inotifyFd_, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        for (char* p = buf; p < buf + n; ) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                LOG_WARN(g_logger) << "FileCache inotify queue overflow, clear cache";
+                Clear();
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                watches_.erase(ev->wd);
+                continue;
+            }
+            auto it = watches_.find(ev->wd);
+            if (it == watches_.end()) {
+                continue;
+            }
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                Clear();
+                continue;
+            }
+            if (ev->len == 0) {
+                continue;
+            }
+            std::string key = it->second + "/" + ev->name;
+            if (ev->mask & IN_ISDIR) {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    AddWatch_(key);
+                } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    Clear();
+                }
+                continue;
+            }
+            LOG_DEBUG(g_logger) << "FileCache invalidate " << key;
+            Invalidate(key);
+        }
+    }
+    Mutex::Lock lock(watchMutex_);
+    if (watching_) {
+        iom_->addEvent(inotifyFd_, IOManager::READ, std::bind(&FileCache::OnInotify_, this));
+    } else {
+        CloseInotify_();
+    }
+}
@@ -1,3 +1,8 @@
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <algorithm>
+
 #include "http/httpconn.h"
 
 const char* HttpConn::srcDir;
@@ -11,6 +16,8 @@ HttpConn::HttpConn() {
     addr_ = { 0 };
     isClose_ = true;
     isServerKeepAlive_ = false;
+    isKeepAlive_ = false;
+    iovIdx_ = 0;
 };
 
 HttpConn::~HttpConn() { 
@@ -34,21 +41,25 @@ void HttpConn::init(int fd, const sockaddr_in& addr, bool isKeepAlive) {
     addr_ = addr;
     fd_ = fd;
     isServerKeepAlive_ = isKeepAlive;
-    writeBuff_.RetrieveAll();
+    isKeepAlive_ = false;
+    ClearPending_();
     readBuff_.RetrieveAll();
+    request_.Init();
     isClose_ = false;
     LOG_DEBUG(g_logger) << "Client[" << fd_ << "]" << " in, userCount:" << userCount;
 }
 
 /**
 * @brief 关闭连接
+* @note 只释放本对象持有的资源，fd 由 HttpServer 中对应的 Socket 负责关闭，
+*       这里再 close 一次的话，fd 可能已经被新连接复用，会误关别人的连接
 */
 void HttpConn::Close() {
     response_.UnmapFile();
+    ClearPending_();
     if(isClose_ == false){
         isClose_ = true; 
         userCount--;
-        close(fd_);
         LOG_DEBUG(g_logger) << "Client[" << fd_ << "]" << " quit, UserCount:" << userCount;
     }
 }
@@ -104,78 +115,187 @@ ssize_t HttpConn::read(int* saveErrno) {
 
 /**
  * @brief 制作好的响应报文写入客户端，即写进套接字
+ * @details 排队的所有响应用 writev 一起发出，遇到大文件时先发出前面的内存数据，再用
+ *          sendfile 发文件；写了一部分时从写到的位置继续，全部写完后解除文件映射、
+ *          关闭文件、清空写缓冲区
  * @param[in] saveErrno 错误码
- * @return ssize_t 写入的字节数
+ * @return ssize_t 最后一次写入的字节数，出错时小于 0
  */
 ssize_t HttpConn::write(int* saveErrno) {
-    ssize_t len = -1;
-    int remainLen;
-    do {
-        // 将iov的内容写到fd中
-        len = writev(fd_, iov_, iovCnt_);   
+    ssize_t len = 0;
+    while(iovIdx_ < iov_.size()) {
+        len = segs_[iovIdx_].fd >= 0 ? SendFile_() : WriteIov_();
         if(len <= 0) {
             *saveErrno = errno;
-            break;
+            return len;
         }
-        if(iov_[0].iov_len + iov_[1].iov_len  == 0) { 
-            /* 传输结束 */
-            break; 
-        } else if(static_cast<size_t>(len) > iov_[0].iov_len) {
-            //从iov_中写到fd的的内容大小多余iov[0]中存的，iov[0]中的内容已经写完。
-            //下一次循环要从iov[1]中的len-iov[0].iov_len开始写。
-            iov_[1].iov_base = (uint8_t*)iov_[1].iov_base + (len - iov_[0].iov_len);
-            iov_[1].iov_len -= (len - iov_[0].iov_len);
-            //iov[0]中的内容已经全部写进fd_中，所以要下标清零。
-            if(iov_[0].iov_len) {
-                writeBuff_.RetrieveAll();
-                iov_[0].iov_len = 0;
-            }
-        } else {
-            //因为写的内容大小都还没有iov[0]中存的多，所以只需要移动iov[0]的
-            //下标即可
-            iov_[0].iov_base = (uint8_t*)iov_[0].iov_base + len; 
-            iov_[0].iov_len -= len; 
-            writeBuff_.Retrieve(len);
-        }
-        remainLen = iov_[0].iov_len + iov_[1].iov_len;
+    }
+    ClearPending_();
+    return len;
+}
 
-    } while(remainLen > 0);
+/**
+ * @brief 写 iov_ 中到下一个文件段之前的内存数据
+ * @details 后面紧跟着文件段时用 sendmsg 加 MSG_MORE，让响应头和文件的开头合成满的报文段，
+ *          不会单独发出一个只有响应头的小包
+ * @return ssize_t 写入的字节数
+ */
+ssize_t HttpConn::WriteIov_() {
+    // 一次最多 IOV_MAX 个 iovec
+    size_t end = iovIdx_;
+    while(end < iov_.size() && segs_[end].fd < 0 && end - iovIdx_ < (size_t)IOV_MAX) {
+        ++end;
+    }
+    ssize_t len;
+    if(end < iov_.size() && segs_[end].fd >= 0) {
+        struct msghdr msg = { 0 };
+        msg.msg_iov = &iov_[iovIdx_];
+        msg.msg_iovlen = end - iovIdx_;
+        len = sendmsg(fd_, &msg, MSG_MORE);
+    } else {
+        len = writev(fd_, &iov_[iovIdx_], end - iovIdx_);
+    }
+    if(len <= 0) {
+        return len;
+    }
+    // 跳过已经写完的 iovec，写了一半的从写到的位置继续
+    size_t n = len;
+    while(iovIdx_ < end && n >= iov_[iovIdx_].iov_len) {
+        n -= iov_[iovIdx_].iov_len;
+        ++iovIdx_;
+    }
+    if(n > 0) {
+        iov_[iovIdx_].iov_base = (uint8_t*)iov_[iovIdx_].iov_base + n;
+        iov_[iovIdx_].iov_len -= n;
+    }
+    return len;
+}
+
+/**
+ * @brief 用 sendfile 写 iovIdx_ 处的文件段
+ * @details 套接字写满时 hook 的 sendfile 挂起当前协程，等可写后继续；一次没写完时
+ *          sendfile 已经更新了偏移，只扣掉剩下的长度
+ * @return ssize_t 写入的字节数
+ */
+ssize_t HttpConn::SendFile_() {
+    FileSegment& seg = segs_[iovIdx_];
+    struct iovec& iov = iov_[iovIdx_];
+    ssize_t len = sendfile(fd_, seg.fd, &seg.offset, iov.iov_len);
+    if(len == 0) {
+        // 文件在发送期间被截短，已经发出的 Content-length 对不上，只能关闭连接
+        LOG_WARN(g_logger) << "Client[" << fd_ << "] sendfile hit EOF, " << iov.iov_len << " bytes left";
+        errno = EIO;
+        return -1;
+    }
+    if(len < 0) {
+        return len;
+    }
+    iov.iov_len -= len;
+    if(iov.iov_len == 0) {
+        ++iovIdx_;
+    }
+    return len;
+}
 
+/**
+ * @brief 获取待写入的总长度
+ * @return size_t 待写入的总长度
+ */
+size_t HttpConn::ToWriteBytes() const {
+    size_t len = 0;
+    for(size_t i = iovIdx_; i < iov_.size(); ++i) {
+        len += iov_[i].iov_len;
+    }
     return len;
 }
 
 /**
- * @brief 处理 HTTP 请求
- * @return bool 处理是否成功
+ * @brief 处理读缓冲区中所有完整的 HTTP 请求
+ * @return bool 是否生成了响应，没有完整的请求时返回 false，需要继续读
  */
 bool HttpConn::process() {
-    request_.Init();
-    if(readBuff_.ReadableBytes() <= 0) {
-        LOG_WARN(g_logger) << "HTTP 请求中没有数据";
+    while(pending_.size() < MAX_PIPELINE && readBuff_.ReadableBytes() > 0) {
+        // 请求还没有收完整，解析状态保留在 request_ 里，读到更多数据后继续解析
+        HttpRequest::HTTP_CODE rt = request_.parse(readBuff_);
+        if(rt == HttpRequest::NO_REQUEST) {
+            LOG_DEBUG(g_logger) << "HTTP 请求不完整，等待更多数据";
+            break;
+        }
+
+        size_t headStart = writeBuff_.ReadableBytes();
+        if(rt == HttpRequest::GET_REQUEST) {    // 解析成功
+            LOG_INFO(g_logger) << "解析 HTTP 请求成功";
+            LOG_DEBUG(g_logger) << request_.path();
+            isKeepAlive_ = isServerKeepAlive_ && request_.IsKeepAlive();
+            response_.Init(srcDir, request_.path(), isKeepAlive_, request_.IsUnavailable() ? 503 : 200);
+        } else {
+            //解析失败，请求路径不可信，直接回复 400 页面并关闭连接
+            LOG_WARN(g_logger) << "解析 HTTP 请求失败";
+            isKeepAlive_ = false;
+            std::string path = "/400.html";
+            response_.Init(srcDir, path, false, 400);
+        }
+
+        // 生成响应报文，响应头追加到 writeBuff_ 中，缓存条目或者文件映射交给本对象，直到写完
+        response_.MakeResponse(writeBuff_);
+        Pending p;
+        p.headLen = writeBuff_.ReadableBytes() - headStart;
+        p.fileLen = response_.FileLen();
+        p.entry = response_.DetachEntry();
+        p.file = p.entry ? &p.entry->content[0] : response_.DetachFile();
+        p.fd = response_.DetachFd();
+        if(!p.file && p.fd < 0) {
+            p.fileLen = 0;
+        }
+        pending_.push_back(p);
+
+        // 不保持连接时发完这个响应就关闭，后面的请求不再处理
+        if(!isKeepAlive_) {
+            break;
+        }
+    }
+    if(pending_.empty()) {
         return false;
-    } else if(request_.parse(readBuff_)) {    // 解析成功
-        LOG_INFO(g_logger) << "解析 HTTP 请求成功";
-        LOG_DEBUG(g_logger) << request_.path();
-        response_.Init(srcDir, request_.path(), request_.IsKeepAlive(), 200);
-    } else {
-        //解析失败
-        LOG_WARN(g_logger) << "解析 HTTP 请求失败";
-        response_.Init(srcDir, request_.path(), false, 400);
     }
 
-    // 生成响应报文放入writeBuff_中
-    response_.MakeResponse(writeBuff_);
-    // 响应头
-    // 将写缓冲区中的内容放入类中的iov中。
-    iov_[0].iov_base = const_cast<char*>(writeBuff_.Peek());
-    iov_[0].iov_len = writeBuff_.ReadableBytes();
-    iovCnt_ = 1;
-
-    // 文件
-    if(response_.FileLen() > 0  && response_.File()) {
-        iov_[1].iov_base = response_.File();
-        iov_[1].iov_len = response_.FileLen();
-        iovCnt_ = 2;
+    // 响应头都生成完之后 writeBuff_ 不会再扩容，这时再取地址
+    iov_.clear();
+    segs_.clear();
+    iovIdx_ = 0;
+    const char* head = writeBuff_.Peek();
+    for(auto& p : pending_) {
+        struct iovec iov;
+        iov.iov_base = const_cast<char*>(head);
+        iov.iov_len = p.headLen;
+        iov_.push_back(iov);
+        segs_.push_back({ -1, 0 });
+        head += p.headLen;
+        if(p.fileLen > 0) {
+            iov.iov_base = p.file;
+            iov.iov_len = p.fileLen;
+            iov_.push_back(iov);
+            segs_.push_back({ p.fd, 0 });
+        }
     }
+    LOG_DEBUG(g_logger) << "Client[" << fd_ << "] " << pending_.size() << " responses queued";
     return true;
 }
+
+/**
+ * @brief 解除排队响应的文件映射，关闭 sendfile 的文件，清空待发送的数据
+ */
+void HttpConn::ClearPending_() {
+    for(auto& p : pending_) {
+        if(p.file && !p.entry) {
+            munmap(p.file, p.fileLen);
+        }
+        if(p.fd >= 0) {
+            close(p.fd);
+        }
+    }
+    pending_.clear();
+    iov_.clear();
+    segs_.clear();
+    iovIdx_ = 0;
+    writeBuff_.RetrieveAll();
+}
@@ -0,0 +1,244 @@
+#include <assert.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http/httpparser.h"
+#include "base/config.h"
+
+static zch::ConfigVar<uint32_t>::ptr g_http_max_header_size =
+    zch::Config::Lookup("http.max_header_size", (uint32_t)(8 * 1024), "max size of request line and headers");
+
+static zch::ConfigVar<uint64_t>::ptr g_http_max_body_size =
+    zch::Config::Lookup("http.max_body_size", (uint64_t)(1024 * 1024), "max size of request body");
+
+const http_parser_settings HttpParser::SETTINGS = {
+    nullptr,                        // on_message_begin
+    &HttpParser::OnUrl,
+    nullptr,                        // on_status，只解析请求
+    &HttpParser::OnHeaderField,
+    &HttpParser::OnHeaderValue,
+    &HttpParser::OnHeadersComplete,
+    &HttpParser::OnBody,
+    &HttpParser::OnMessageComplete,
+    nullptr,                        // on_chunk_header
+    nullptr,                        // on_chunk_complete
+};
+
+HttpParser::HttpParser() {
+    // http-parser 的请求头上限是全局的，只在第一次创建时设置
+    static bool s_init = (http_parser_set_max_header_size(g_http_max_header_size->GetValue()), true);
+    (void)s_init;
+    maxBody_ = g_http_max_body_size->GetValue();
+    maxRequest_ = g_http_max_header_size->GetValue() + maxBody_ + MAX_FRAMING;
+    Init();
+}
+
+/**
+ * @brief 重置解析状态，准备解析下一个请求
+ */
+void HttpParser::Init() {
+    http_parser_init(&parser_, HTTP_REQUEST);
+    parser_.data = this;
+    base_ = nullptr;
+    parsed_ = 0;
+    done_ = false;
+    error_ = nullptr;
+    headersDone_ = false;
+    bodyCb_ = nullptr;
+    url_.off = url_.len = 0;
+    body_.off = body_.len = 0;
+    chunkedBody_.clear();
+    headerCount_ = 0;
+    inValue_ = false;
+}
+
+/**
+ * @brief 继续解析请求
+ * @details 只把上次之后新读到的字节交给 http-parser；解析完一个请求时在 OnMessageComplete
+ *          里暂停，http-parser 停在请求的末尾，不会继续解析后面的数据。
+ *          解码后的请求体有上限，但 chunked 的分块长度行、扩展和 trailer 没有，
+ *          所以不流式处理请求体时还要限制已经解析的原始字节数
+ */
+HttpParser::PARSE_RESULT HttpParser::Execute(const char* data, size_t len) {
+    if(done_) {
+        return PARSE_DONE;
+    }
+    if(error_) {
+        return PARSE_ERROR;
+    }
+    // 长度为 0 时 http-parser 会当作连接已经关闭
+    if(len <= parsed_) {
+        return PARSE_AGAIN;
+    }
+
+    base_ = data;
+    size_t n = http_parser_execute(&parser_, &SETTINGS, data + parsed_, len - parsed_);
+    parsed_ += n;
+    base_ = nullptr;
+
+    if(!bodyCb_ && parsed_ > maxRequest_) {
+        // 这次可能刚好解析完整个请求，不能再当作解析完成
+        done_ = false;
+        error_ = "request too large";
+        return PARSE_ERROR;
+    }
+    if(done_) {
+        return PARSE_DONE;
+    }
+    enum http_errno err = HTTP_PARSER_ERRNO(&parser_);
+    if(err != HPE_OK) {
+        if(!error_) {
+            error_ = http_errno_description(err);
+        }
+        return PARSE_ERROR;
+    }
+    return PARSE_AGAIN;
+}
+
+/**
+ * @brief 调用方已经从缓冲区开头取走了 n 字节
+ * @details 之后的偏移都相对新的开头计算，之前记录的 Slice 不再有效
+ */
+void HttpParser::Consume(size_t n) {
+    assert(headersDone_ && n <= parsed_);
+    parsed_ -= n;
+}
+
+const char* HttpParser::BodyData(const char* data) const {
+    if(parser_.flags & F_CHUNKED) {
+        return chunkedBody_.data();
+    }
+    return data + body_.off;
+}
+
+size_t HttpParser::BodyLength() const {
+    if(parser_.flags & F_CHUNKED) {
+        return chunkedBody_.size();
+    }
+    return body_.len;
+}
+
+const char* HttpParser::Method() const {
+    return http_method_str((enum http_method)parser_.method);
+}
+
+bool HttpParser::IsKeepAlive() const {
+    return http_should_keep_alive(&parser_) != 0;
+}
+
+/**
+ * @brief 查找请求头，名字不区分大小写
+ * @details 请求头个数很少，线性查找即可；值去掉末尾的空白
+ */
+bool HttpParser::GetHeader(const char* data, const char* name, Slice& value) const {
+    size_t len = strlen(name);
+    for(size_t i = 0; i < headerCount_; ++i) {
+        const Header& h = headers_[i];
+        if(h.name.len == len && strncasecmp(data + h.name.off, name, len) == 0) {
+            value = h.value;
+            while(value.len > 0 && (data[value.off + value.len - 1] == ' ' || data[value.off + value.len - 1] == '\t')) {
+                --value.len;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief 把一个片段并入 slice
+ */
+void HttpParser::Append(Slice& slice, const char* at, size_t length) {
+    size_t off = at - base_;
+    if(slice.len == 0) {
+        slice.off = off;
+    }
+    slice.len = off + length - slice.off;
+}
+
+int HttpParser::OnUrl(http_parser* parser, const char* at, size_t length) {
+    HttpParser* self = static_cast<HttpParser*>(parser->data);
+    self->Append(self->url_, at, length);
+    return 0;
+}
+
+int HttpParser::OnHeaderField(http_parser* parser, const char* at, size_t length) {
+    HttpParser* self = static_cast<HttpParser*>(parser->data);
+    if(self->inValue_ || self->headerCount_ == 0) {
+        // 新的请求头
+        if(self->headerCount_ >= MAX_HEADERS) {
+            self->error_ = "too many headers";
+            return -1;
+        }
+        Header& h = self->headers_[self->headerCount_++];
+        h.name.off = h.name.len = 0;
+        h.value.off = h.value.len = 0;
+        self->inValue_ = false;
+    }
+    self->Append(self->headers_[self->headerCount_ - 1].name, at, length);
+    return 0;
+}
+
+int HttpParser::OnHeaderValue(http_parser* parser, const char* at, size_t length) {
+    HttpParser* self = static_cast<HttpParser*>(parser->data);
+    self->inValue_ = true;
+    self->Append(self->headers_[self->headerCount_ - 1].value, at, length);
+    return 0;
+}
+
+/**
+ * @brief 请求头解析完，交给 HeadersCallback，再检查请求体
+ * @details HeadersCallback 里设置了 BodyCallback 的请求体不在内存里累积，不检查大小
+ */
+int HttpParser::OnHeadersComplete(http_parser* parser) {
+    HttpParser* self = static_cast<HttpParser*>(parser->data);
+    self->headersDone_ = true;
+    // 不支持隧道；普通请求带的 Upgrade 头忽略，按普通请求处理
+    if(parser->method == HTTP_CONNECT) {
+        self->error_ = "CONNECT not supported";
+        return -1;
+    }
+    if(self->headersCb_ && !self->headersCb_(self->base_)) {
+        self->error_ = "request rejected";
+        return -1;
+    }
+    if(!self->bodyCb_ && parser->content_length != ULLONG_MAX && parser->content_length > self->maxBody_) {
+        self->error_ = "body too large";
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 一段请求体
+ * @details Content-Length 的请求体在缓冲区里是连续的，只记录偏移；chunked 的请求体各段之间
+ *          隔着 chunk 的长度行，解码到 chunkedBody_ 里
+ */
+int HttpParser::OnBody(http_parser* parser, const char* at, size_t length) {
+    HttpParser* self = static_cast<HttpParser*>(parser->data);
+    if(self->bodyCb_) {
+        if(!self->bodyCb_(at, length)) {
+            self->error_ = "body rejected";
+            return -1;
+        }
+        return 0;
+    }
+    if(parser->flags & F_CHUNKED) {
+        if(self->chunkedBody_.size() + length > self->maxBody_) {
+            self->error_ = "body too large";
+            return -1;
+        }
+        self->chunkedBody_.append(at, length);
+        return 0;
+    }
+    self->Append(self->body_, at, length);
+    return 0;
+}
+
+int HttpParser::OnMessageComplete(http_parser* parser) {
+    HttpParser* self = static_cast<HttpParser*>(parser->data);
+    self->done_ = true;
+    http_parser_pause(parser, 1);
+    return 0;
+}
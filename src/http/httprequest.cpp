@@ -1,3 +1,5 @@
+#include <strings.h>
+
 #include "http/httprequest.h"
 
 // 网页名称，和一般的前端跳转不同，这里需要将请求信息放到后
@@ -13,94 +15,124 @@ const std::unordered_map<std::string, int> HttpRequest::DEFAULT_HTML_TAG {
 
 static zch::Logger::ptr g_logger = LOG_NAME("system");
 
+std::unordered_map<std::string, HttpRequest::BodyConsumerFactory> HttpRequest::s_bodyConsumers;
+
+HttpRequest::HttpRequest() {
+    parser_.SetHeadersCallback(std::bind(&HttpRequest::OnHeaders_, this, std::placeholders::_1));
+    Init();
+}
+
+/**
+ * @brief 注册流式处理请求体的路径
+ * @details 服务器启动后只读，不加锁
+ */
+void HttpRequest::RegisterBodyConsumer(const std::string& path, BodyConsumerFactory factory) {
+    s_bodyConsumers[path] = factory;
+}
+
 /**
  * @brief 初始化 HttpRequest 对象
  */
 void HttpRequest::Init() {
-    state_ = REQUEST_LINE;  // 初始状态
-    method_ = path_ = version_= body_ = "";
-    header_.clear();
+    parser_.Init();
+    method_.clear();
+    path_.clear();
+    version_.clear();
+    body_.clear();
     post_.clear();
+    keepAlive_ = false;
+    isUrlencoded_ = false;
+    consumer_.reset();
+    unavailable_ = false;
 }
 
 /**
  * @brief 解析 HTTP 请求
+ * @details 解析器记录的是相对请求开头的偏移，请求没收完时数据留在 buff 里，
+ *          下次读到更多数据后从上次停下的地方继续解析；请求头解析完时（OnHeaders_）
+ *          只复制后面还要用的请求方法、路径、版本。请求体有 BodyConsumer 时，已经交给它的
+ *          数据马上从 buff 中取走，否则收完后 POST 才复制请求体
  * @param[in] buff 读缓冲区
- * @return bool 解析是否成功
+ * @return HTTP_CODE 解析结果
  */
-bool HttpRequest::parse(Buffer& buff) {
-    const char END[] = "\r\n";
+HttpRequest::HTTP_CODE HttpRequest::parse(Buffer& buff) {
+    if(parser_.IsDone()) {
+        // 上一个请求已经处理完，开始解析下一个
+        Init();
+    }
     if(buff.ReadableBytes() == 0) {
         LOG_WARN(g_logger) << "没有可读的字节";
-        return false;
+        return NO_REQUEST;
     }
-        
-    // 读取数据开始
-    while(buff.ReadableBytes() && state_ != FINISH) {
-        // 从buff中的读指针开始到读指针结束，这块区域是未读取得数据并去处"\r\n"。
-        // 第一，二个参数是查找范围，三，四个是要查找的序列,const char END[] = "\r\n";
-        // 查找成功返回指向查找到的子序列中的第一个元素
-        const char *lineend = std::search(buff.Peek(), buff.BeginWriteConst(), END, END+2);
-        std::string line(buff.Peek(), lineend);
-        switch (state_) {
-            case REQUEST_LINE:
-                // 解析错误
-                if(!ParseRequestLine_(line)) {
-                    return false;
-                }
-                // 解析路径
-                ParsePath_();   
-                break;
-            case HEADERS:
-                ParseHeader_(line);
-                if(buff.ReadableBytes() <= 2) { 
-                    //说明是空行，get请求，后面为\r\n 
-                    //可读数据已经没了，说明解析完头部就已经没了,是 GET 请求
-                    //请求数据不在GET方法中使用，提前结束
-                    state_ = FINISH; 
-                }
-                break;
-            case BODY:
-                ParseBody_(line);
-                break;
-            default:
-                break;
+
+    const char* data = buff.Peek();
+    HttpParser::PARSE_RESULT rt = parser_.Execute(data, buff.ReadableBytes());
+    if(rt == HttpParser::PARSE_AGAIN) {
+        if(consumer_ && parser_.IsHeadersDone()) {
+            size_t n = parser_.Length();
+            buff.Retrieve(n);
+            parser_.Consume(n);
         }
-        if(lineend == buff.BeginWrite()) {
-            //如果缓存中的数据读完了，就跳出循环，表示
-            //全部解析完。  
+        return NO_REQUEST;
+    }
+    if(rt == HttpParser::PARSE_ERROR) {
+        LOG_ERROR(g_logger) << "Parse request error: " << parser_.GetError();
+        // 解析失败后会关闭连接，剩下的数据不再需要
+        buff.RetrieveAll();
+        return BAD_REQUEST;
+    }
+
+    if(consumer_) {
+        if(!consumer_->OnFinish(*this)) {
+            LOG_WARN(g_logger) << "Body consumer failed, path: " << path_;
             buff.RetrieveAll();
-            break;
+            return BAD_REQUEST;
         }
-        // 跳过回车换行
-        buff.RetrieveUntil(lineend + 2);        
+    } else if(method_ == "POST") {
+        body_.assign(parser_.BodyData(data), parser_.BodyLength());
+        LOG_DEBUG(g_logger) << "Body:" << body_ << ", len:" << body_.size();
+        //因为有 body，所以是 post请求，会更改服务器中的数据，这里
+        //用另外一个函数来处理。
+        ParsePost_();
     }
 
-    return true;
+    buff.Retrieve(parser_.Length());
+    return GET_REQUEST;
 }
 
 /**
- * @brief 解析请求行
- * @param[in] line 请求行字符串
- * @return bool 解析是否成功
+ * @brief 请求头解析完，取出请求行和后面还要用的请求头，选择请求体的处理方式
+ * @param[in] data 请求的开头
  */
-bool HttpRequest::ParseRequestLine_(const std::string& line) {
-    //([^ ]*):表示任意除了空格外的元素
-    std::regex patten("^([^ ]*) ([^ ]*) HTTP/([^ ]*)$");
-    // 用来匹配patten得到结果
-    std::smatch Match;   
-    if(std::regex_match(line, Match, patten)) {  
-        // 匹配指定字符串整体是否符合
-        // 在匹配规则中，以括号()的方式来划分组别 一共三个括号 [0]表示整体
-        // 即Match[0]表示匹配的整个请求行。下标1，2，3分别表示对应的三种类别
-        method_ = Match[1];
-        path_ = Match[2];
-        version_ = Match[3];
-        state_ = HEADERS;
-        return true;
+bool HttpRequest::OnHeaders_(const char* data) {
+    method_ = parser_.Method();
+    HttpParser::Slice url = parser_.Url();
+    path_.assign(data + url.off, url.len);
+    version_.assign(1, '0' + parser_.VersionMajor());
+    version_ += '.';
+    version_ += '0' + parser_.VersionMinor();
+    keepAlive_ = parser_.IsKeepAlive();
+    ParsePath_();
+
+    if(method_ == "POST") {
+        static const char URLENCODED[] = "application/x-www-form-urlencoded";
+        HttpParser::Slice type;
+        isUrlencoded_ = parser_.GetHeader(data, "Content-Type", type)
+                        && type.len == sizeof(URLENCODED) - 1
+                        && strncasecmp(data + type.off, URLENCODED, type.len) == 0;
     }
-    LOG_ERROR(g_logger) << "RequestLine Error: " << line;
-    return false;
+
+    if(!s_bodyConsumers.empty()) {
+        auto it = s_bodyConsumers.find(path_);
+        if(it != s_bodyConsumers.end()) {
+            consumer_ = it->second(*this);
+        }
+        if(consumer_) {
+            parser_.SetBodyCallback(std::bind(&BodyConsumer::OnData, consumer_.get(),
+                                              std::placeholders::_1, std::placeholders::_2));
+        }
+    }
+    return true;
 }
 
 /**
@@ -117,27 +149,6 @@ void HttpRequest::ParsePath_() {
     }
 }
 
-/**
- * @brief 解析请求头
- * @param[in] line 请求头字符串
- */
-void HttpRequest::ParseHeader_(const std::string& line) {
-    //第一组([^:]*)：表示所有非冒号的字符，即类型
-    //然后后面紧跟一个冒号，
-    //然后一个空格和?，表示空格可有可无，即冒号后面可有可无空格
-    //(.*)$:末尾表示值，任意非\n，即换行的元素，值里面是可以有空格的。
-    std::regex patten("^([^:]*): ?(.*)$");
-    std::smatch Match;
-    if(std::regex_match(line, Match, patten)) {
-        //解析完一行，继续请求头部，因为头部可能
-        //有好几行。
-        header_[Match[1]] = Match[2];
-    } else { 
-        // 匹配失败说明首部行匹配完了，状态变化   
-        state_ = BODY;
-    }
-}
-
 /**
  * @brief 从 urlencoded 格式中解析参数
  */
@@ -191,7 +202,7 @@ void HttpRequest::ParseFromUrlencoded_() {
  * @brief 处理 Post 请求
  */
 void HttpRequest::ParsePost_() {
-    if(method_ == "POST" && header_["Content-Type"] == "application/x-www-form-urlencoded") {
+    if(method_ == "POST" && isUrlencoded_) {
         // 从url中解析编码
         ParseFromUrlencoded_();
         if(DEFAULT_HTML_TAG.count(path_)) { 
@@ -200,9 +211,14 @@ void HttpRequest::ParsePost_() {
             LOG_DEBUG(g_logger) << "Tag:" << tag;
             if(tag == 0 || tag == 1) {
                 bool isLogin = (tag == 1);  // 为1则是登录
-                if(UserVerify(post_["username"], post_["password"], isLogin)) {
+                VERIFY_RESULT rt = UserVerify(post_["username"], post_["password"], isLogin);
+                if(rt == VERIFY_SUCCESS) {
                     path_ = "/welcome.html";
                 } 
+                else if(rt == VERIFY_UNAVAILABLE) {
+                    // 取不到数据库连接时快速失败，由 HttpConn 回复 503
+                    unavailable_ = true;
+                }
                 else {
                     path_ = "/error.html";
                 }
@@ -211,19 +227,6 @@ void HttpRequest::ParsePost_() {
     }   
 }
 
-/**
- * @brief 解析请求体
- * @param[in] line 请求体字符串
- */
-void HttpRequest::ParseBody_(const std::string& line) {
-    body_ = line;
-    //因为有 body，所以是 post请求，会更改服务器中的数据，这里
-    //用另外一个函数来处理。
-    ParsePost_();
-    state_ = FINISH;    // 状态转换为下一个状态
-    LOG_DEBUG(g_logger) << "Body:" << line << ", len:" << line.size();
-}
-
 /**
  * @brief 16进制转换为10进制
  * @param[in] ch 16进制字符
@@ -242,74 +245,84 @@ int HttpRequest::ConverHex(char ch) {
  * @param[in] name 用户名
  * @param[in] pwd 密码
  * @param[in] isLogin 是否为登录操作
- * @return bool 验证是否通过
+ * @return VERIFY_RESULT 验证结果
  */
-bool HttpRequest::UserVerify(const std::string &name, const std::string &pwd, bool isLogin) {
+HttpRequest::VERIFY_RESULT HttpRequest::UserVerify(const std::string &name, const std::string &pwd, bool isLogin) {
     if(name.empty() || pwd.empty()) { 
-        return false; 
+        return VERIFY_FAILED; 
     }
 
     LOG_INFO(g_logger) << "Verify name:" << name << " pwd:" << pwd;
+
+    /* 先查缓存：登录直接比对密码，注册时用户名已被占用，都不用访问数据库 */
+    UserCache *cache = UserCacheMgr::GetInstance();
+    std::string cached;
+    UserCache::LookupResult cacheRt = cache->Lookup(name, cached);
+    if(cacheRt == UserCache::FOUND) {
+        if(isLogin && pwd == cached) {
+            return VERIFY_SUCCESS;
+        }
+        LOG_INFO(g_logger) << (isLogin ? "pwd error!" : "user used!");
+        return VERIFY_FAILED;
+    }
+    if(isLogin && cacheRt == UserCache::NOT_FOUND) {
+        LOG_INFO(g_logger) << "user not found!";
+        return VERIFY_FAILED;
+    }
+
+    /* 注册交给批量写入，和同一时间窗口内的其它注册合并成一个事务，查重也在事务里完成 */
+    if(!isLogin) {
+        LOG_DEBUG(g_logger) << "regirster!";
+        switch(RegisterBatcherMgr::GetInstance()->Register(name, pwd)) {
+            case RegisterBatcher::SUCCESS:
+                cache->OnRegistered(name);
+                LOG_INFO(g_logger) << "UserVerify success!!";
+                return VERIFY_SUCCESS;
+            case RegisterBatcher::DUPLICATE:
+                LOG_INFO(g_logger) << "user used!";
+                return VERIFY_FAILED;
+            case RegisterBatcher::UNAVAILABLE:
+                return VERIFY_UNAVAILABLE;
+            default:
+                LOG_ERROR(g_logger) << "Insert error!";
+                return VERIFY_FAILED;
+        }
+    }
     
     // 获取数据库连接
     std::shared_ptr<Connection> conn = ConnectionPool::GetConnectionPool().GetConnection();
     if (!conn) {
         LOG_ERROR(g_logger) << "Get database connection failed!";
-        return false;
+        return VERIFY_UNAVAILABLE;
     }
     
     bool flag = false;
-    // unsigned int j = 0;
-    char order[256] = { 0 };
-    // MYSQL_FIELD *fields = nullptr;
-    MYSQL_RES *res = nullptr;
-    
-    if(!isLogin) {
-        flag = true; 
-    }
 
-    /* 查询用户及密码 */
-    snprintf(order, 256, "SELECT username, password FROM user WHERE username='%s' LIMIT 1", name.c_str());
-    LOG_DEBUG(g_logger) << order;
-
-    res = conn->Query(order);
-    if(res == nullptr) { 
-        return false; 
+    /* 查询用户及密码，用户名作为参数绑定，不拼接进 SQL */
+    PreparedStatement::ptr stmt = conn->Prepare("SELECT username, password FROM user WHERE username = ? LIMIT 1");
+    if(!stmt || !stmt->BindString(0, name) || !stmt->Query()) { 
+        return VERIFY_FAILED; 
     }
 
-    while(MYSQL_ROW row = mysql_fetch_row(res)) {
-        LOG_DEBUG(g_logger) << "MYSQL ROW: " << row[0] << " " << row[1];
-        std::string password(row[1]);
-        /* 注册行为且用户名未被使用*/
-        if(isLogin) {
-            if(pwd == password) { 
-                flag = true; 
-            } else {
-                flag = false;
-                LOG_INFO(g_logger) << "pwd error!";
-            }
-        } else { 
-            flag = false; 
-            LOG_INFO(g_logger) << "user used!";
+    bool found = false;
+    while(stmt->Fetch()) {
+        found = true;
+        LOG_DEBUG(g_logger) << "MYSQL ROW: " << stmt->GetString(0) << " " << stmt->GetString(1);
+        std::string password = stmt->GetString(1);
+        cache->PutUser(name, password);
+        if(pwd == password) { 
+            flag = true; 
+        } else {
+            flag = false;
+            LOG_INFO(g_logger) << "pwd error!";
         }
     }
-    mysql_free_result(res);
-
-    /* 注册行为 且用户名未被使用*/
-    if(!isLogin && flag == true) {
-        LOG_DEBUG(g_logger) << "regirster!";
-        bzero(order, 256);
-        snprintf(order, 256,"INSERT INTO user(username, password) VALUES('%s','%s')", name.c_str(), pwd.c_str());
-        LOG_DEBUG(g_logger) << order;
-        if(!conn->Update(order)) { 
-            LOG_ERROR(g_logger) << "Insert error!";
-            flag = false; 
-        }
-        flag = true;
+    if(!found) {
+        cache->PutMissing(name);
     }
 
     LOG_INFO(g_logger) << "UserVerify success!!";
-    return flag;
+    return flag ? VERIFY_SUCCESS : VERIFY_FAILED;
 }
 
 /**
@@ -366,8 +379,7 @@ std::string HttpRequest::GetPost(const char* key) const {
  * @return bool 是否保持连接
  */
 bool HttpRequest::IsKeepAlive() const {
-    if(header_.count("Connection") == 1) {
-        return header_.find("Connection")->second == "keep-alive" && version_ == "1.1";
-    }
-    return false;
+    // HTTP/1.1 默认就是长连接，除非显式带上 Connection: close；
+    // HTTP/1.0 则要显式带上 Connection: keep-alive 才保持连接
+    return keepAlive_;
 }
@@ -1,7 +1,14 @@
 #include "http/httpresponse.h"
+#include "base/config.h"
 
 static zch::Logger::ptr g_logger = LOG_NAME("system");
 
+static zch::ConfigVar<size_t>::ptr g_http_sendfile_threshold =
+    zch::Config::Lookup("http.sendfile_threshold", (size_t)(64 * 1024), "files not smaller than this are sent with sendfile, 0 to disable");
+
+static const char KEEP_ALIVE_HEADER[] = "Connection: keep-alive\r\nkeep-alive: max=6, timeout=120\r\n";
+static const char CLOSE_HEADER[] = "Connection: close\r\n";
+
 const std::unordered_map<std::string, std::string> HttpResponse::SUFFIX_TYPE = {
     { ".html",  "text/html" },
     { ".xml",   "text/xml" },
@@ -29,12 +36,14 @@ const std::unordered_map<int, std::string> HttpResponse::CODE_STATUS = {
     { 400, "Bad Request" },
     { 403, "Forbidden" },
     { 404, "Not Found" },
+    { 503, "Service Unavailable" },
 };
 
 const std::unordered_map<int, std::string> HttpResponse::CODE_PATH = {
     { 400, "/400.html" },
     { 403, "/403.html" },
     { 404, "/404.html" },
+    { 503, "/503.html" },
 };
 
 HttpResponse::HttpResponse() {
@@ -42,7 +51,9 @@ HttpResponse::HttpResponse() {
     path_ = srcDir_ = "";
     isKeepAlive_ = false;
     mmFile_ = nullptr; 
+    fileFd_ = -1;
     mmFileStat_ = { 0 };
+    entry_.reset();
 };
 
 HttpResponse::~HttpResponse() {
@@ -58,13 +69,13 @@ HttpResponse::~HttpResponse() {
  */
 void HttpResponse::Init(const std::string& srcDir, std::string& path, bool isKeepAlive, int code){
     assert(srcDir != "");
-    if(mmFile_) { UnmapFile(); }
+    UnmapFile();
     code_ = code;
     isKeepAlive_ = isKeepAlive;
     path_ = path;
     srcDir_ = srcDir;
-    mmFile_ = nullptr; 
     mmFileStat_ = { 0 };
+    entry_.reset();
 }
 
 /**
@@ -72,6 +83,10 @@ void HttpResponse::Init(const std::string& srcDir, std::string& path, bool isKee
  * @param[in] buff 写入缓冲区
  */
 void HttpResponse::MakeResponse(Buffer& buff) {
+    if(MakeCachedResponse_(buff)) {
+        return;
+    }
+
     /* 判断请求的资源文件 */
     LOG_DEBUG(g_logger) << "file path " << (srcDir_ + path_);
     int ret = stat(((srcDir_ + path_).data()), &mmFileStat_);
@@ -93,6 +108,59 @@ void HttpResponse::MakeResponse(Buffer& buff) {
     AddContent_(buff);
 }
 
+/**
+ * @brief 用静态文件缓存生成响应
+ * @details 错误码先换成对应的错误页面（同 ErrorHtml_）；200 直接用条目里提前生成的响应头，
+ *          其它状态码（如 503）只生成响应头，文件内容仍然来自缓存。没有命中的（文件不存在、
+ *          没有读权限、太大等）按原来的方式 stat、mmap，由那边决定 403、404
+ */
+bool HttpResponse::MakeCachedResponse_(Buffer& buff) {
+    auto it = CODE_PATH.find(code_);
+    const std::string& path = it != CODE_PATH.end() ? it->second : path_;
+    FileCache::Entry::ptr entry = FileCacheMgr::GetInstance()->Get(path);
+    if(!entry) {
+        return false;
+    }
+    if(code_ == -1) {
+        code_ = 200;
+    }
+    if(code_ == 200) {
+        buff.Append(entry->headers[isKeepAlive_ ? 1 : 0]);
+    } else {
+        buff.Append(MakeHeader(code_, isKeepAlive_, entry->type, entry->content.size()));
+    }
+    path_ = path;
+    mmFileStat_.st_size = entry->content.size();
+    entry_ = entry;
+    return true;
+}
+
+/**
+ * @brief 生成完整的响应头
+ */
+std::string HttpResponse::MakeHeader(int code, bool isKeepAlive, const std::string& type, size_t len) {
+    auto it = CODE_STATUS.find(code);
+    if(it == CODE_STATUS.end()) {
+        code = 400;
+        it = CODE_STATUS.find(400);
+    }
+    std::string header = "HTTP/1.1 " + std::to_string(code) + " " + it->second + "\r\n";
+    header += isKeepAlive ? KEEP_ALIVE_HEADER : CLOSE_HEADER;
+    header += "Content-type: " + type + "\r\n";
+    header += "Content-length: " + std::to_string(len) + "\r\n\r\n";
+    return header;
+}
+
+/**
+ * @brief 交出缓存的文件
+ * @return FileCache::Entry::ptr 没有命中时返回 nullptr
+ */
+FileCache::Entry::ptr HttpResponse::DetachEntry() {
+    FileCache::Entry::ptr entry;
+    entry.swap(entry_);
+    return entry;
+}
+
 /**
  * @brief 获取映射内存的起始地址
  * @return char* 映射内存的起始地址
@@ -101,6 +169,26 @@ char* HttpResponse::File() {
     return mmFile_;
 }
 
+/**
+ * @brief 交出文件映射，之后由调用方负责解除映射
+ * @return char* 映射内存的起始地址，没有映射时返回 nullptr
+ */
+char* HttpResponse::DetachFile() {
+    char* file = mmFile_;
+    mmFile_ = nullptr;
+    return file;
+}
+
+/**
+ * @brief 交出用 sendfile 发送的文件描述符，之后由调用方负责关闭
+ * @return int 文件描述符，没有时返回 -1
+ */
+int HttpResponse::DetachFd() {
+    int fd = fileFd_;
+    fileFd_ = -1;
+    return fd;
+}
+
 /**
  * @brief 获取文件长度
  * @return size_t 文件长度
@@ -140,12 +228,10 @@ void HttpResponse::AddStateLine_(Buffer& buff) {
  * @param[in] buff 写入缓冲区
  */
 void HttpResponse::AddHeader_(Buffer& buff) {
-    buff.Append("Connection: ");
     if(isKeepAlive_) {
-        buff.Append("keep-alive\r\n");
-        buff.Append("keep-alive: max=6, timeout=120\r\n");
+        buff.Append(KEEP_ALIVE_HEADER);
     } else{
-        buff.Append("close\r\n");
+        buff.Append(CLOSE_HEADER);
     }
     buff.Append("Content-type: " + GetFileType_() + "\r\n");
 }
@@ -168,11 +254,21 @@ void HttpResponse::AddContent_(Buffer& buff) {
         return;
     }
 
+    // 大文件不映射，由 HttpConn 从描述符 sendfile 到套接字，文件内容不经过用户态
+    size_t threshold = g_http_sendfile_threshold->GetValue();
+    if(threshold > 0 && (size_t)mmFileStat_.st_size >= threshold) {
+        LOG_DEBUG(g_logger) << "sendfile path " << (srcDir_ + path_);
+        fileFd_ = srcFd;
+        buff.Append("Content-length: " + std::to_string(mmFileStat_.st_size) + "\r\n\r\n");
+        return;
+    }
+
     // 将文件映射到内存提高文件的访问速度  MAP_PRIVATE 建立一个写入时拷贝的私有映射
     LOG_DEBUG(g_logger) << "file path " << (srcDir_ + path_);
     int* mmRet = (int*)mmap(0, mmFileStat_.st_size, PROT_READ, MAP_PRIVATE, srcFd, 0);
     if(mmRet == (int*)MAP_FAILED) {
         LOG_ERROR(g_logger) << "mmap error: " << strerror(errno) << " path=" << (srcDir_ + path_);
+        close(srcFd);
         ErrorContent(buff, "File NotFound!");
         return; 
     }
@@ -182,13 +278,17 @@ void HttpResponse::AddContent_(Buffer& buff) {
 }
 
 /**
- * @brief 解除文件映射
+ * @brief 解除文件映射，关闭 sendfile 用的文件描述符
  */
 void HttpResponse::UnmapFile() {
     if(mmFile_) {
         munmap(mmFile_, mmFileStat_.st_size);
         mmFile_ = nullptr;
     }
+    if(fileFd_ >= 0) {
+        close(fileFd_);
+        fileFd_ = -1;
+    }
 }
 
 /**
@@ -196,11 +296,20 @@ void HttpResponse::UnmapFile() {
  * @return std::string 文件类型
  */
 std::string HttpResponse::GetFileType_() {
-    std::string::size_type idx = path_.find_last_of('.');
+    return GetFileType(path_);
+}
+
+/**
+ * @brief 按文件后缀取 MIME 类型
+ * @param[in] path 文件路径
+ * @return std::string MIME 类型
+ */
+std::string HttpResponse::GetFileType(const std::string& path) {
+    std::string::size_type idx = path.find_last_of('.');
     if(idx == std::string::npos) {   // 最大值 find函数在找不到指定值得情况下会返回string::npos
         return "text/plain";
     }
-    std::string suffix = path_.substr(idx);
+    std::string suffix = path.substr(idx);
     if(SUFFIX_TYPE.count(suffix) == 1) {
         return SUFFIX_TYPE.find(suffix)->second;
     }
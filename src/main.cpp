@@ -6,6 +6,8 @@
 #include "base/http_server.h"
 #include "http/httprequest.h"
 #include "base/config.h"
+#include "db/ConnectionPool.h"
+#include "db/UserCache.h"
 
 static zch::Logger::ptr g_logger = LOG_NAME("system");
 
@@ -18,6 +20,9 @@ static zch::ConfigVar<std::string>::ptr g_ip =
 static zch::ConfigVar<int>::ptr g_port =
     zch::Config::Lookup("server.port", (int)8000, "port");
 
+static zch::ConfigVar<std::string>::ptr g_io_backend =
+    zch::Config::Lookup("server.io_backend", std::string("epoll"), "io backend, epoll or io_uring");
+
 void run() {
     
     LOG_INFO(g_logger) << "Server starting...";
@@ -40,6 +45,16 @@ void run() {
         sleep(2);
     }
     
+    // 开始接收请求前先创建连接池，连接池构造时建立连接会让出协程，
+    // 在请求里第一次创建的话同一线程上的其它请求会阻塞在静态变量的初始化上
+    ConnectionPool::GetConnectionPool();
+
+    // 用户名较多时加载 Bloom 过滤器比较慢，放到后台，加载完成前注册照常查库
+    UserCache *cache = UserCacheMgr::GetInstance();
+    if(cache->IsBloomEnabled()) {
+        IOManager::GetThis()->schedule(std::bind(&UserCache::LoadBloom, cache));
+    }
+
     // 启动服务器
     LOG_INFO(g_logger) << "Bind success " << *addr;
     server->start();
@@ -53,7 +68,8 @@ int main() {
     // 启动 IOManager
     size_t thread_num = g_thread_num->GetValue();
     LOG_INFO(g_logger) << "线程数量为：" << thread_num;
-    IOManager::ptr manager = std::make_shared<IOManager>(thread_num, true);
+    IOManager::Backend backend = g_io_backend->GetValue() == "io_uring" ? IOManager::IO_URING : IOManager::EPOLL;
+    IOManager::ptr manager = std::make_shared<IOManager>(thread_num, true, "IOManager", backend);
     manager->schedule(run);
     
     // IOManager 析构时会调用 stop()，等待所有任务完成
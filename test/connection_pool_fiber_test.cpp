@@ -0,0 +1,345 @@
+#include <unistd.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "fake_mysql_server.h"
+#include "db/ConnectionPool.h"
+#include "coroutine/iomanager.h"
+#include "base/config.h"
+#include "base/log.h"
+#include "base/util.h"
+
+static zch::Logger::ptr g_logger = LOG_ROOT();
+
+// 节拍协程每 10ms 加一次，IOManager 线程被阻塞时就不会增长
+static std::atomic<bool> s_stop(false);
+static std::atomic<uint64_t> s_ticks(0);
+static std::atomic<bool> s_holding(false);
+static std::atomic<int> s_finished(0);
+static bool s_failed = false;
+
+static void ticker() {
+    while(!s_stop) {
+        usleep(10 * 1000);
+        ++s_ticks;
+    }
+}
+
+static void check(bool ok, const std::string &what) {
+    LOG_INFO(g_logger) << (ok ? "ok: " : "FAILED: ") << what;
+    if(!ok) {
+        s_failed = true;
+    }
+}
+
+/**
+ * @brief 拿走唯一的连接执行一条 200ms 的慢查询，查询期间节拍协程应该照常运行
+ */
+static void slow_query() {
+    std::shared_ptr<Connection> conn = ConnectionPool::GetConnectionPool().GetConnection();
+    check(conn != nullptr, "holder got a connection");
+    if(!conn) {
+        s_holding = true;
+        ++s_finished;
+        return;
+    }
+    s_holding = true;
+    uint64_t ticks = s_ticks;
+    uint64_t begin = GetElapsedMS();
+    MYSQL_RES *res = conn->Query("SELECT SLEEP(0.2)");
+    uint64_t elapsed = GetElapsedMS() - begin;
+    ticks = s_ticks - ticks;
+    check(res != nullptr, "slow query returned a result set");
+    if(res) {
+        MYSQL_ROW row = mysql_fetch_row(res);
+        check(row && row[0] && std::string(row[0]) == "1", "slow query row is 1");
+        while(mysql_fetch_row(res)) {
+        }
+        mysql_free_result(res);
+    }
+    LOG_INFO(g_logger) << "slow query took " << elapsed << "ms, ticks meanwhile " << ticks;
+    check(elapsed >= 180, "hooked query waited for the server");
+    check(ticks >= 10, "hooked query did not block the IOManager thread");
+    ++s_finished;
+}
+
+/**
+ * @brief 连接被 slow_query 占着时取连接，等待期间节拍协程应该照常运行，连接归还后拿到它
+ */
+static void wait_connection() {
+    while(!s_holding) {
+        usleep(1000);
+    }
+    uint64_t ticks = s_ticks;
+    uint64_t begin = GetElapsedMS();
+    std::shared_ptr<Connection> conn = ConnectionPool::GetConnectionPool().GetConnection(2000);
+    uint64_t elapsed = GetElapsedMS() - begin;
+    ticks = s_ticks - ticks;
+    LOG_INFO(g_logger) << "waited " << elapsed << "ms for a connection, ticks meanwhile " << ticks;
+    check(conn != nullptr, "waiter got the connection after it was returned");
+    check(elapsed >= 100, "waiter parked until the holder returned the connection");
+    check(ticks >= 10, "waiting in GetConnection did not block the IOManager thread");
+    if(conn) {
+        MYSQL_RES *res = conn->Query("SELECT 1");
+        check(res != nullptr, "handed-off connection still works");
+        if(res) {
+            while(mysql_fetch_row(res)) {
+            }
+            mysql_free_result(res);
+        }
+    }
+    ++s_finished;
+}
+
+/**
+ * @brief 单分片只有一个连接：预热和生产者第一次建立连接都被拒绝，慢查询和等连接都只挂起当前协程
+ */
+static void run_basic() {
+    // 预热的连接被拒绝，构造函数照样返回，失败的连接不放进连接池
+    ConnectionPool &pool = ConnectionPool::GetConnectionPool();
+    ConnectionPool::Stats stats = pool.GetStats();
+    LOG_INFO(g_logger) << stats.toString();
+    check(stats.connectFailures == 1, "warm-up counted the rejected connection");
+    // total 包含生产者正在建立的连接的占位，这时生产者可能正在重试，只看 idle 和 in_use
+    check(stats.idle == 0 && stats.inUse == 0, "rejected warm-up connection was not pooled");
+
+    IOManager *iom = IOManager::GetThis();
+    iom->schedule(&ticker);
+    iom->schedule(&slow_query);
+    iom->schedule(&wait_connection);
+    // 两个测试协程都结束后停掉节拍协程
+    while(s_finished < 2) {
+        usleep(10 * 1000);
+    }
+    stats = pool.GetStats();
+    LOG_INFO(g_logger) << stats.toString();
+    check(stats.exhausted >= 1, "pool recorded the exhausted acquire");
+    check(stats.connectFailures == 2 && stats.total == 1, "producer backed off and retried after a rejection");
+    s_stop = true;
+}
+
+static std::vector<Connection *> s_handed;
+
+/**
+ * @brief 不等待地取连接
+ * @details 去别的分片偷时只 tryLock，生产者恰好拿着那个分片的锁时偷不到，重试几次
+ */
+static std::shared_ptr<Connection> acquire_now(ConnectionPool &pool) {
+    for(int i = 0; i < 10; ++i) {
+        std::shared_ptr<Connection> conn = pool.GetConnection(0);
+        if(conn) {
+            return conn;
+        }
+        usleep(1000);
+    }
+    return nullptr;
+}
+
+/**
+ * @brief 在本线程的分片上排队等连接，按拿到连接的顺序记下拿到的是哪个连接
+ */
+static void wait_handoff() {
+    std::shared_ptr<Connection> conn = ConnectionPool::GetConnectionPool().GetConnection(2000);
+    s_handed.push_back(conn.get());
+    if(conn) {
+        MYSQL_RES *res = conn->Query("SELECT 1");
+        check(res != nullptr, "connection handed off across shards still works");
+        if(res) {
+            while(mysql_fetch_row(res)) {
+            }
+            mysql_free_result(res);
+        }
+    }
+    ++s_finished;
+}
+
+/**
+ * @brief 两个分片各一个连接，单线程 IOManager 只用到分片 0
+ * @details 第二次取连接时分片 0 已经空了，从分片 1 偷；两个分片都空时在分片 0 排队的两个等待者，
+ *          分片 1 的连接归还时按排队顺序交给第一个，分片 0 的连接交给第二个；
+ *          被偷走的连接归还后回到分片 1，再取两次仍然要偷一次
+ */
+static void run_shards() {
+    ConnectionPool &pool = ConnectionPool::GetConnectionPool();
+    ConnectionPool::Stats stats = pool.GetStats();
+    LOG_INFO(g_logger) << stats.toString();
+    check(stats.shards == 2 && stats.idle == 2, "each of the two shards was warmed up with one connection");
+
+    std::shared_ptr<Connection> own = acquire_now(pool);
+    check(own != nullptr && pool.GetStats().stolen == 0, "first acquire took the connection of its own shard");
+    std::shared_ptr<Connection> stolen = acquire_now(pool);
+    check(stolen != nullptr && pool.GetStats().stolen == 1, "acquire on the drained shard stole from the other shard");
+    check(pool.GetConnection(0) == nullptr, "acquire without waiting fails when both shards are drained");
+
+    IOManager *iom = IOManager::GetThis();
+    iom->schedule(&wait_handoff);
+    iom->schedule(&wait_handoff);
+    // 两个等待者都在分片 0 上排好队
+    usleep(50 * 1000);
+    check(s_handed.empty(), "both waiters are parked");
+
+    Connection *own_conn = own.get();
+    Connection *stolen_conn = stolen.get();
+    // 被偷走的连接属于分片 1，分片 1 上没有等待者，交给分片 0 上排在最前面的等待者
+    stolen.reset();
+    own.reset();
+    for(int i = 0; i < 200 && s_finished < 2; ++i) {
+        usleep(10 * 1000);
+    }
+    check(s_handed.size() == 2 && s_handed[0] == stolen_conn && s_handed[1] == own_conn,
+          "connections returned to either shard are handed to the waiters in FIFO order");
+
+    stats = pool.GetStats();
+    LOG_INFO(g_logger) << stats.toString();
+    check(stats.idle == 2 && stats.inUse == 0 && stats.total == 2, "both connections went back to the pool");
+    // 不等待而失败的取连接 exhausted 和 timeouts 各加一，等到连接的只加 exhausted
+    check(stats.exhausted - stats.timeouts == 2, "two acquires waited for a hand-off");
+
+    // 被偷走的连接回到了分片 1，本线程再取第二个连接时还要去偷
+    own = acquire_now(pool);
+    stolen = acquire_now(pool);
+    check(own.get() == own_conn && stolen.get() == stolen_conn && pool.GetStats().stolen == 2,
+          "stolen connection was returned to the shard it belongs to");
+}
+
+static FakeMysqlServer *s_server = nullptr;
+
+/**
+ * @brief 4 个协程并发预热 6 个连接，前 2 个被拒绝，建好 3 个后构造函数返回
+ * @details 假服务器每个连接 100ms 后才握手，逐个建立的话凑够 3 个要 500ms，并发时两轮就够了；
+ *          单线程 IOManager 上构造函数在 m_warmupSem 上等待时只挂起当前协程，预热协程和节拍协程
+ *          照常运行。预热结束后生产者补上被拒绝的名额
+ */
+static void run_warmup() {
+    IOManager::GetThis()->schedule(&ticker);
+    uint64_t ticks = s_ticks;
+    uint64_t begin = GetElapsedMS();
+    ConnectionPool &pool = ConnectionPool::GetConnectionPool();
+    uint64_t elapsed = GetElapsedMS() - begin;
+    ticks = s_ticks - ticks;
+    ConnectionPool::Stats stats = pool.GetStats();
+    LOG_INFO(g_logger) << "pool constructed in " << elapsed << "ms, ticks meanwhile " << ticks << ", "
+                       << stats.toString();
+    check(elapsed < 400, "warm-up connections were established concurrently");
+    check(ticks >= 10, "waiting for warm-up did not block the IOManager thread");
+    check(stats.connectFailures == 2, "both rejected warm-up connections were counted");
+    check(stats.idle >= 3, "constructor returned once warmup_size connections were ready");
+
+    for(int i = 0; i < 300; ++i) {
+        stats = pool.GetStats();
+        if(stats.warming == 0 && stats.idle == 6) {
+            break;
+        }
+        usleep(10 * 1000);
+    }
+    LOG_INFO(g_logger) << stats.toString();
+    check(stats.warming == 0 && stats.idle == 6 && stats.total == 6,
+          "remaining warm-up slots finished and the producer replaced the rejected ones");
+    check(stats.connectFailures == 2 && s_server->connections() == 8, "every slot connected once after the rejections");
+    s_stop = true;
+}
+
+/**
+ * @brief 一个测试场景：配置连接池，在单线程 IOManager 里运行
+ * @details 连接池是单例，第一次使用时读取配置，每个场景在自己的子进程里运行
+ */
+struct Case {
+    const char *name;
+    void (*config)(FakeMysqlServer &server);
+    void (*run)();
+};
+
+static void config_basic(FakeMysqlServer &server) {
+    // 预热和生产者第一次建立连接都被拒绝
+    server.rejectConnections(2);
+    // 只有一个连接，第二个取连接的协程必须等第一个归还
+    zch::Config::Lookup<size_t>("database.minsize")->SetValue(1);
+    zch::Config::Lookup<size_t>("database.maxsize")->SetValue(1);
+    zch::Config::Lookup<size_t>("database.shards")->SetValue(1);
+    zch::Config::Lookup<size_t>("database.warmup_size")->SetValue(1);
+    zch::Config::Lookup<size_t>("database.warmup_concurrency")->SetValue(1);
+}
+
+static void config_shards(FakeMysqlServer &server) {
+    // 每个分片最少最多都是一个连接，生产者不会再补
+    zch::Config::Lookup<size_t>("database.minsize")->SetValue(2);
+    zch::Config::Lookup<size_t>("database.maxsize")->SetValue(2);
+    zch::Config::Lookup<size_t>("database.shards")->SetValue(2);
+    zch::Config::Lookup<size_t>("database.warmup_size")->SetValue(2);
+    zch::Config::Lookup<size_t>("database.warmup_concurrency")->SetValue(1);
+}
+
+static void config_warmup(FakeMysqlServer &server) {
+    server.rejectConnections(2);
+    server.delayHandshake(100);
+    zch::Config::Lookup<size_t>("database.minsize")->SetValue(6);
+    zch::Config::Lookup<size_t>("database.maxsize")->SetValue(6);
+    zch::Config::Lookup<size_t>("database.shards")->SetValue(1);
+    zch::Config::Lookup<size_t>("database.warmup_size")->SetValue(3);
+    zch::Config::Lookup<size_t>("database.warmup_concurrency")->SetValue(4);
+}
+
+static const Case s_cases[] = {
+    {"basic", &config_basic, &run_basic},
+    {"shards", &config_shards, &run_shards},
+    {"warmup", &config_warmup, &run_warmup},
+};
+
+static int run_case(const Case &c) {
+    FakeMysqlServer server;
+    if(!server.start()) {
+        return 1;
+    }
+    s_server = &server;
+    zch::Config::Lookup<std::string>("database.ip")->SetValue("127.0.0.1");
+    zch::Config::Lookup<uint16_t>("database.port")->SetValue(server.port());
+    zch::Config::Lookup<std::string>("database.user")->SetValue("test");
+    c.config(server);
+
+    {
+        IOManager iom(1, false, "pool");
+        iom.schedule(c.run);
+    }
+
+    LOG_INFO(g_logger) << c.name << ": fake server connections=" << server.connections()
+                       << " queries=" << server.queries();
+    LOG_INFO(g_logger) << c.name << ": " << (s_failed ? "FAILED" : "PASSED");
+    return s_failed ? 1 : 0;
+}
+
+/**
+ * @brief 在单线程 IOManager 里用协程版 GetConnection 和 hook 过的查询访问假 MySQL 服务器
+ * @details
+ * - basic：慢查询和等连接都只挂起当前协程，不阻塞 IOManager 线程；前两次认证被拒绝，
+ *   失败的连接不进连接池，生产者退避后重试
+ * - shards：多分片时从其它分片偷连接，归还的连接跨分片按 FIFO 交给等待者
+ * - warmup：多个协程并发预热，部分连接被拒绝，构造函数等够 warmup_size 个连接后返回
+ * 带场景名参数时只运行这个场景；不带参数时每个场景重新执行自己，在单独的进程里运行
+ */
+int main(int argc, char *argv[]) {
+    size_t n = sizeof(s_cases) / sizeof(s_cases[0]);
+    if(argc > 1) {
+        for(size_t i = 0; i < n; ++i) {
+            if(std::string(argv[1]) == s_cases[i].name) {
+                return run_case(s_cases[i]);
+            }
+        }
+        LOG_ERROR(g_logger) << "unknown case " << argv[1];
+        return 1;
+    }
+
+    for(size_t i = 0; i < n; ++i) {
+        pid_t pid = fork();
+        if(pid == 0) {
+            execl("/proc/self/exe", argv[0], s_cases[i].name, (char *)nullptr);
+            _exit(127);
+        }
+        int status = 0;
+        bool ok = pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        check(ok, std::string("case ") + s_cases[i].name);
+    }
+    LOG_INFO(g_logger) << (s_failed ? "FAILED" : "PASSED");
+    return s_failed ? 1 : 0;
+}
@@ -0,0 +1,486 @@
+// 说明：
+// 测试用的假 MySQL 服务器，只实现连接池、预处理语句用得到的那部分协议，
+// 不需要真实的数据库就能测试经过 libmysqlclient 的代码
+//
+// 设计要点：
+// - 跑在普通线程里(不 hook)，每个连接一个线程
+// - 握手只声明 mysql_native_password，不校验密码，直接回 OK；
+//   rejectConnections 设置了拒绝次数时回 ERR，模拟数据库暂时不可用；
+//   delayHandshake 让每个连接先等一会再发握手包，模拟建立连接慢
+// - COM_QUERY 和 COM_STMT_EXECUTE 的 SQL 交给 Handler 执行，结果集只支持一列；
+//   预处理时以 SELECT 开头的语句声明一列结果，其它语句没有结果集
+// - 默认的 Handler：SELECT SLEEP(n) 先睡 n 秒再返回一行 "1"，其它 SELECT 立即返回一行 "1"，
+//   非 SELECT 回 OK
+// - COM_PING 回 OK，COM_QUIT 关闭连接，COM_STMT_CLOSE 不回包，其它命令回 ERR
+//
+
+#ifndef FAKE_MYSQL_SERVER_H__
+#define FAKE_MYSQL_SERVER_H__
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/fd_manager.h"
+#include "base/log.h"
+
+class FakeMysqlServer {
+public:
+    /**
+     * @brief 一条 SQL 的执行结果
+     */
+    struct Result {
+        Result() : error(0), affectedRows(0), resultSet(false) {}
+
+        static Result Ok(uint64_t affected = 0) {
+            Result r;
+            r.affectedRows = affected;
+            return r;
+        }
+
+        static Result Error(uint16_t code, const std::string &msg) {
+            Result r;
+            r.error = code;
+            r.message = msg;
+            return r;
+        }
+
+        static Result Rows(const std::vector<std::string> &rows) {
+            Result r;
+            r.resultSet = true;
+            r.rows = rows;
+            return r;
+        }
+
+        // 非 0 时回 ERR
+        uint16_t error;
+        std::string message;
+        uint64_t affectedRows;
+        // 为 true 时返回一列的结果集，每行一个值
+        bool resultSet;
+        std::vector<std::string> rows;
+    };
+
+    /**
+     * @brief 执行一条 SQL，在连接各自的线程里调用
+     * @param[in] sql SQL 文本
+     * @param[in] params 预处理语句的参数，NULL 为空字符串；COM_QUERY 时为空
+     */
+    typedef std::function<Result(const std::string &sql, const std::vector<std::string> &params)> Handler;
+
+    FakeMysqlServer()
+        : m_listenFd(-1), m_port(0), m_connections(0), m_queries(0), m_prepares(0), m_rejects(0)
+        , m_handshakeDelay(0), m_handler(&FakeMysqlServer::defaultHandler) {
+    }
+
+    ~FakeMysqlServer() {
+        if(m_listenFd >= 0) {
+            // shutdown 让阻塞在 accept 的线程返回
+            shutdown(m_listenFd, SHUT_RDWR);
+            m_acceptThread.join();
+            close(m_listenFd);
+        }
+    }
+
+    /**
+     * @brief 监听 127.0.0.1 上的随机端口并开始接受连接
+     */
+    bool start() {
+        m_listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if(bind(m_listenFd, (sockaddr *)&addr, len) || listen(m_listenFd, 128)
+                || getsockname(m_listenFd, (sockaddr *)&addr, &len)) {
+            LOG_ERROR(LOG_ROOT()) << "fake mysql listen failed, errno=" << errno << " errstr=" << strerror(errno);
+            close(m_listenFd);
+            m_listenFd = -1;
+            return false;
+        }
+        m_port = ntohs(addr.sin_port);
+        m_acceptThread = std::thread(std::bind(&FakeMysqlServer::acceptLoop, this));
+        return true;
+    }
+
+    /**
+     * @brief 替换执行 SQL 的 Handler，需要在 start 之前设置
+     */
+    void setHandler(Handler handler) { m_handler = handler; }
+
+    uint16_t port() const { return m_port; }
+    void rejectConnections(int n) { m_rejects = n; }
+    void delayHandshake(uint64_t ms) { m_handshakeDelay = ms; }
+    uint64_t connections() const { return m_connections; }
+    // 执行过的 COM_QUERY 和 COM_STMT_EXECUTE 数
+    uint64_t queries() const { return m_queries; }
+    // 预处理过的语句数
+    uint64_t prepares() const { return m_prepares; }
+
+private:
+    /**
+     * @brief 一条预处理语句
+     */
+    struct Statement {
+        std::string sql;
+        size_t params;
+        bool resultSet;
+        // 参数类型，客户端只在重新绑定参数后发送
+        std::vector<uint8_t> types;
+    };
+
+    typedef std::map<uint32_t, Statement> StatementMap;
+
+    static Result defaultHandler(const std::string &sql, const std::vector<std::string> &params) {
+        std::string upper = toUpper(sql);
+        if(upper.compare(0, 6, "SELECT") != 0) {
+            return Result::Ok();
+        }
+        size_t pos = upper.find("SLEEP(");
+        if(pos != std::string::npos) {
+            usleep(atof(sql.c_str() + pos + 6) * 1000 * 1000);
+        }
+        return Result::Rows(std::vector<std::string>(1, "1"));
+    }
+
+    void acceptLoop() {
+        while(true) {
+            int fd = accept(m_listenFd, nullptr, nullptr);
+            if(fd < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            ++m_connections;
+            std::thread(std::bind(&FakeMysqlServer::session, this, fd)).detach();
+        }
+    }
+
+    void session(int fd) {
+        uint8_t seq = 0;
+        std::string pkt;
+        StatementMap stmts;
+        if(m_handshakeDelay > 0) {
+            usleep(m_handshakeDelay * 1000);
+        }
+        if(sendPacket(fd, seq, handshake()) && readPacket(fd, seq, pkt)) {
+            // 多个连接同时认证时，每次拒绝都要恰好消耗一次拒绝次数
+            int rejects = m_rejects;
+            while(rejects > 0 && !m_rejects.compare_exchange_weak(rejects, rejects - 1)) {
+            }
+            if(rejects > 0) {
+                sendPacket(fd, seq, err(1045, "access denied"));
+            } else {
+                // 不管客户端用哪种认证插件都直接认证通过
+                sendPacket(fd, seq, ok());
+                while(readPacket(fd, seq, pkt) && !pkt.empty() && command(fd, pkt, stmts)) {
+                }
+            }
+        }
+        // hook 的 accept 登记过这个 fd，不 hook 的线程里 close 不会注销，
+        // 不注销的话编号被新 socket 复用时会拿到旧的 FdCtx
+        FdMgr::GetInstance()->del(fd);
+        close(fd);
+    }
+
+    /**
+     * @brief 处理一条命令
+     * @return 连接是否继续
+     */
+    bool command(int fd, const std::string &pkt, StatementMap &stmts) {
+        uint8_t seq = 1;
+        switch((uint8_t)pkt[0]) {
+            case 0x01:  // COM_QUIT
+                return false;
+            case 0x0e:  // COM_PING
+                return sendPacket(fd, seq, ok());
+            case 0x03:  // COM_QUERY
+                ++m_queries;
+                return sendResult(fd, seq, m_handler(pkt.substr(1), std::vector<std::string>()), false);
+            case 0x16:  // COM_STMT_PREPARE
+                return prepare(fd, seq, pkt.substr(1), stmts);
+            case 0x17:  // COM_STMT_EXECUTE
+                return execute(fd, seq, pkt, stmts);
+            case 0x19:  // COM_STMT_CLOSE，不回包
+                if(pkt.size() >= 5) {
+                    stmts.erase(readInt(pkt, 1, 4));
+                }
+                return true;
+            case 0x1a:  // COM_STMT_RESET
+                return sendPacket(fd, seq, ok());
+            default:
+                return sendPacket(fd, seq, err(1047, "command not supported"));
+        }
+    }
+
+    /**
+     * @brief 回 COM_STMT_PREPARE_OK，后面跟参数和列的定义
+     */
+    bool prepare(int fd, uint8_t &seq, const std::string &sql, StatementMap &stmts) {
+        ++m_prepares;
+        uint32_t id = stmts.empty() ? 1 : stmts.rbegin()->first + 1;
+        Statement &stmt = stmts[id];
+        stmt.sql = sql;
+        stmt.params = 0;
+        for(char c : sql) {
+            stmt.params += c == '?';
+        }
+        stmt.resultSet = toUpper(sql).compare(0, 6, "SELECT") == 0;
+
+        std::string p(1, '\x00');
+        p += int2(id & 0xffff) + int2(id >> 16);
+        p += int2(stmt.resultSet ? 1 : 0);
+        p += int2(stmt.params);
+        p += std::string("\x00\x00\x00", 3);  // filler + warning_count
+        if(!sendPacket(fd, seq, p)) {
+            return false;
+        }
+        if(stmt.params > 0) {
+            for(size_t i = 0; i < stmt.params; ++i) {
+                if(!sendPacket(fd, seq, column("?"))) {
+                    return false;
+                }
+            }
+            if(!sendPacket(fd, seq, eof())) {
+                return false;
+            }
+        }
+        if(stmt.resultSet) {
+            return sendPacket(fd, seq, column("v")) && sendPacket(fd, seq, eof());
+        }
+        return true;
+    }
+
+    /**
+     * @brief 解析 COM_STMT_EXECUTE 的参数并执行
+     * @details 只支持 NULL、LONGLONG 和按长度编码的字符串类参数
+     */
+    bool execute(int fd, uint8_t &seq, const std::string &pkt, StatementMap &stmts) {
+        StatementMap::iterator it = pkt.size() >= 10 ? stmts.find(readInt(pkt, 1, 4)) : stmts.end();
+        if(it == stmts.end()) {
+            return sendPacket(fd, seq, err(1243, "unknown statement"));
+        }
+        ++m_queries;
+        Statement &stmt = it->second;
+        // stmt_id(4) flags(1) iteration_count(4)
+        size_t pos = 10;
+        std::vector<std::string> params(stmt.params);
+        if(stmt.params > 0) {
+            size_t nullBytes = (stmt.params + 7) / 8;
+            std::string nulls = pkt.substr(pos, nullBytes);
+            pos += nullBytes;
+            if(pos < pkt.size() && pkt[pos++] == 1) {
+                stmt.types.clear();
+                for(size_t i = 0; i < stmt.params && pos + 2 <= pkt.size(); ++i, pos += 2) {
+                    stmt.types.push_back((uint8_t)pkt[pos]);
+                }
+            }
+            for(size_t i = 0; i < stmt.params; ++i) {
+                if(((uint8_t)nulls[i / 8] >> (i % 8)) & 1) {
+                    continue;
+                }
+                uint8_t type = i < stmt.types.size() ? stmt.types[i] : 0xfe;
+                if(type == 0x06) {
+                    continue;
+                } else if(type == 0x08) {
+                    params[i] = std::to_string((int64_t)readInt(pkt, pos, 8));
+                    pos += 8;
+                } else {
+                    uint64_t len = readLenenc(pkt, pos);
+                    params[i] = pkt.substr(pos, len);
+                    pos += len;
+                }
+            }
+        }
+        return sendResult(fd, seq, m_handler(stmt.sql, params), true);
+    }
+
+    /**
+     * @brief 回 OK、ERR 或者一列的结果集
+     * @param[in] binary 预处理语句的结果集按二进制协议编码行
+     */
+    bool sendResult(int fd, uint8_t &seq, const Result &result, bool binary) {
+        if(result.error) {
+            return sendPacket(fd, seq, err(result.error, result.message));
+        }
+        if(!result.resultSet) {
+            return sendPacket(fd, seq, ok(result.affectedRows));
+        }
+        // 列数、列定义、EOF、各行、EOF
+        if(!sendPacket(fd, seq, std::string(1, '\x01'))
+                || !sendPacket(fd, seq, column("v"))
+                || !sendPacket(fd, seq, eof())) {
+            return false;
+        }
+        for(auto &v : result.rows) {
+            // 二进制行：包头 0x00，一字节的 NULL 位图(从第 2 位开始)，再是各列的值
+            std::string row = binary ? std::string(2, '\x00') : std::string();
+            if(!sendPacket(fd, seq, row + lenenc(v))) {
+                return false;
+            }
+        }
+        return sendPacket(fd, seq, eof());
+    }
+
+    static std::string handshake() {
+        // LONG_PASSWORD | CONNECT_WITH_DB | PROTOCOL_41 | TRANSACTIONS | SECURE_CONNECTION | PLUGIN_AUTH
+        uint32_t caps = 0x1 | 0x8 | 0x200 | 0x2000 | 0x8000 | 0x80000;
+        std::string p(1, '\x0a');
+        p += std::string("5.7.99-fake", 12);
+        p += std::string("\x01\x00\x00\x00", 4);  // connection id
+        p += std::string("abcdefgh\x00", 9);      // auth-plugin-data part 1 + filler
+        p += (char)(caps & 0xff);
+        p += (char)((caps >> 8) & 0xff);
+        p += '\x21';                               // utf8_general_ci
+        p += std::string("\x02\x00", 2);           // SERVER_STATUS_AUTOCOMMIT
+        p += (char)((caps >> 16) & 0xff);
+        p += (char)((caps >> 24) & 0xff);
+        p += '\x15';                               // auth-plugin-data 总长 21
+        p += std::string(10, '\x00');
+        p += std::string("ijklmnopqrst\x00", 13);  // auth-plugin-data part 2
+        p += std::string("mysql_native_password", 22);
+        return p;
+    }
+
+    /**
+     * @brief 一个 VAR_STRING 列的定义
+     */
+    static std::string column(const std::string &name) {
+        std::string p;
+        for(const char *s : {"def", "", "", ""}) {
+            p += lenenc(s);
+        }
+        p += lenenc(name) + lenenc("");
+        p += std::string("\x0c\x21\x00\x15\x00\x00\x00\xfd\x00\x00\x00\x00\x00", 13);
+        return p;
+    }
+
+    static std::string ok(uint64_t affected = 0) {
+        // 影响行数按长度编码，这里都小于 251
+        return std::string(1, '\x00') + (char)affected + std::string("\x00\x02\x00\x00\x00", 5);
+    }
+
+    static std::string eof() {
+        return std::string("\xfe\x00\x00\x02\x00", 5);
+    }
+
+    static std::string err(uint16_t code, const std::string &msg) {
+        return std::string(1, '\xff') + int2(code) + "#HY000" + msg;
+    }
+
+    static std::string int2(uint16_t v) {
+        return std::string(1, (char)(v & 0xff)) + (char)(v >> 8);
+    }
+
+    static std::string lenenc(const std::string &s) {
+        // 这里的字符串都短于 251 字节，长度用一个字节
+        return std::string(1, (char)s.size()) + s;
+    }
+
+    static uint64_t readInt(const std::string &s, size_t pos, size_t len) {
+        uint64_t v = 0;
+        for(size_t i = 0; i < len && pos + i < s.size(); ++i) {
+            v |= (uint64_t)(uint8_t)s[pos + i] << (8 * i);
+        }
+        return v;
+    }
+
+    static uint64_t readLenenc(const std::string &s, size_t &pos) {
+        uint8_t first = pos < s.size() ? (uint8_t)s[pos] : 0;
+        ++pos;
+        size_t len = first == 0xfc ? 2 : first == 0xfd ? 3 : first == 0xfe ? 8 : 0;
+        if(len == 0) {
+            return first;
+        }
+        uint64_t v = readInt(s, pos, len);
+        pos += len;
+        return v;
+    }
+
+    static std::string toUpper(const std::string &s) {
+        std::string upper(s);
+        for(auto &c : upper) {
+            c = toupper(c);
+        }
+        return upper;
+    }
+
+    /**
+     * @brief hook 过的 accept 会把新连接登记到 FdMgr，顺带设成了非阻塞，读写碰到 EAGAIN 时用 poll 等
+     */
+    static bool waitFd(int fd, short events) {
+        if(errno != EAGAIN) {
+            return false;
+        }
+        pollfd pfd = {fd, events, 0};
+        return poll(&pfd, 1, -1) > 0;
+    }
+
+    static bool readFull(int fd, char *buf, size_t len) {
+        size_t off = 0;
+        while(off < len) {
+            ssize_t n = read(fd, buf + off, len - off);
+            if(n == 0 || (n < 0 && !waitFd(fd, POLLIN))) {
+                return false;
+            }
+            off += n > 0 ? n : 0;
+        }
+        return true;
+    }
+
+    static bool writeFull(int fd, const char *buf, size_t len) {
+        size_t off = 0;
+        while(off < len) {
+            ssize_t n = write(fd, buf + off, len - off);
+            if(n < 0 && !waitFd(fd, POLLOUT)) {
+                return false;
+            }
+            off += n > 0 ? n : 0;
+        }
+        return true;
+    }
+
+    static bool readPacket(int fd, uint8_t &seq, std::string &payload) {
+        unsigned char header[4];
+        if(!readFull(fd, (char *)header, sizeof(header))) {
+            return false;
+        }
+        size_t len = header[0] | (header[1] << 8) | (header[2] << 16);
+        seq = header[3] + 1;
+        payload.resize(len);
+        return len == 0 || readFull(fd, &payload[0], len);
+    }
+
+    static bool sendPacket(int fd, uint8_t &seq, const std::string &payload) {
+        std::string pkt;
+        pkt += (char)(payload.size() & 0xff);
+        pkt += (char)((payload.size() >> 8) & 0xff);
+        pkt += (char)((payload.size() >> 16) & 0xff);
+        pkt += (char)seq++;
+        pkt += payload;
+        return writeFull(fd, pkt.data(), pkt.size());
+    }
+
+private:
+    int m_listenFd;
+    uint16_t m_port;
+    std::atomic<uint64_t> m_connections;
+    std::atomic<uint64_t> m_queries;
+    std::atomic<uint64_t> m_prepares;
+    std::atomic<int> m_rejects;
+    std::atomic<uint64_t> m_handshakeDelay;
+    Handler m_handler;
+    std::thread m_acceptThread;
+};
+
+#endif
@@ -0,0 +1,243 @@
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "coroutine/fiber_sync.h"
+#include "coroutine/iomanager.h"
+#include "base/log.h"
+#include "base/util.h"
+
+static zch::Logger::ptr g_logger = LOG_ROOT();
+
+static bool s_failed = false;
+
+static void check(bool ok, const std::string &what) {
+    LOG_INFO(g_logger) << (ok ? "ok: " : "FAILED: ") << what;
+    if(!ok) {
+        s_failed = true;
+    }
+}
+
+static FiberMutex s_mutex;
+static int s_count = 0;
+
+/**
+ * @brief 多个协程抢同一把锁，持锁期间 sleep(被 hook 成让出协程)，最后计数应该正好是总次数
+ */
+void test_mutex() {
+    for(int i = 0; i < 100; ++i) {
+        FiberMutex::Lock lock(s_mutex);
+        int v = s_count;
+        if(i % 10 == 0) {
+            usleep(1000);
+        }
+        s_count = v + 1;
+    }
+}
+
+static Channel<int> s_chan(8);
+static std::atomic<int> s_sum(0);
+
+void test_producer(int base) {
+    for(int i = 1; i <= 1000; ++i) {
+        s_chan.push(base + i);
+    }
+}
+
+void test_consumer() {
+    int v;
+    while(s_chan.pop(v)) {
+        s_sum += v;
+    }
+}
+
+/**
+ * @brief 信号量超时，没有人 notify 时 100ms 后返回 false；有人 notify 时提前返回 true
+ */
+void test_semaphore_timeout() {
+    FiberSemaphore sem;
+    uint64_t begin = GetElapsedMS();
+    bool rt = sem.waitFor(100);
+    uint64_t elapsed = GetElapsedMS() - begin;
+    LOG_INFO(g_logger) << "semaphore waitFor rt = " << rt << ", elapsed = " << elapsed << "ms";
+    check(!rt && elapsed >= 100, "semaphore waitFor times out after 100ms");
+
+    IOManager::GetThis()->schedule([&sem]() {
+        usleep(20 * 1000);
+        sem.notify();
+    });
+    begin = GetElapsedMS();
+    rt = sem.waitFor(1000);
+    elapsed = GetElapsedMS() - begin;
+    check(rt && elapsed < 1000, "semaphore waitFor returns true when notified before the timeout");
+}
+
+/**
+ * @brief 条件变量超时：没有人 notify 时 waitFor 100ms 后返回 false，返回时重新持有锁；
+ *        超时的等待者被移出队列，之后的 notifyOne 唤醒的是新的等待者
+ */
+void test_condition_timeout() {
+    FiberMutex mutex;
+    FiberCondition cond;
+    bool ready = false;
+    std::atomic<bool> locked_by_other(false);
+
+    FiberMutex::Lock lock(mutex);
+    uint64_t begin = GetElapsedMS();
+    bool rt = cond.waitFor(lock, 100);
+    uint64_t elapsed = GetElapsedMS() - begin;
+    LOG_INFO(g_logger) << "condition waitFor rt = " << rt << ", elapsed = " << elapsed << "ms";
+    check(!rt && elapsed >= 100, "condition waitFor times out after 100ms");
+    check(!mutex.tryLock(), "condition waitFor holds the mutex again after the timeout");
+
+    // 持锁期间另一个协程拿不到锁，等这边 waitFor 释放锁之后才能设置 ready 并 notify
+    IOManager::GetThis()->schedule([&]() {
+        if(mutex.tryLock()) {
+            mutex.unlock();
+        } else {
+            locked_by_other = true;
+        }
+        FiberMutex::Lock l(mutex);
+        ready = true;
+        cond.notifyOne();
+    });
+    usleep(20 * 1000);
+    check(locked_by_other, "another fiber cannot take the mutex while waitFor holds it");
+    begin = GetElapsedMS();
+    while(!ready) {
+        if(!cond.waitFor(lock, 1000)) {
+            break;
+        }
+    }
+    elapsed = GetElapsedMS() - begin;
+    check(ready && elapsed < 1000, "notifyOne after a timed-out waiter wakes the next waiter");
+}
+
+/**
+ * @brief Channel close 唤醒挂起的发送者和接收者
+ * @details 容量为 1 的 channel 先放满，3 个发送者挂在 push 上；另一个空 channel 上 3 个接收者
+ *          挂在 pop 上。close 之后发送者都返回 false，接收者都返回 false；close 之前放进去的
+ *          元素仍然能取出来
+ */
+void test_channel_close() {
+    Channel<int> full(1);
+    Channel<int> empty(1);
+    std::atomic<int> push_false(0);
+    std::atomic<int> pop_false(0);
+    std::atomic<int> finished(0);
+    IOManager *iom = IOManager::GetThis();
+
+    full.push(42);
+    for(int i = 0; i < 3; ++i) {
+        iom->schedule([&]() {
+            if(!full.push(1)) {
+                ++push_false;
+            }
+            ++finished;
+        });
+        iom->schedule([&]() {
+            int v;
+            if(!empty.pop(v)) {
+                ++pop_false;
+            }
+            ++finished;
+        });
+    }
+    usleep(50 * 1000);
+    check(finished == 0, "senders on a full channel and receivers on an empty channel are parked");
+
+    full.close();
+    empty.close();
+    for(int i = 0; i < 100 && finished < 6; ++i) {
+        usleep(10 * 1000);
+    }
+    check(push_false == 3, "close wakes every parked sender and push returns false");
+    check(pop_false == 3, "close wakes every parked receiver and pop returns false");
+
+    int v = 0;
+    check(full.pop(v) && v == 42, "the element pushed before close can still be popped");
+    check(!full.pop(v), "pop on a closed and drained channel returns false");
+    check(!full.push(1) && !full.tryPush(1), "push on a closed channel returns false");
+}
+
+/**
+ * @brief 协程挂起在信号量上时 IOManager 开始停止，普通线程 100ms 后才 notify
+ * @details 挂起的协程不在任务队列里也不占线程，停止时要等它被唤醒执行完，不能把它丢下
+ */
+static void test_stop_with_parked_fiber() {
+    FiberSemaphore sem;
+    std::atomic<bool> resumed(false);
+    std::thread notifier;
+    {
+        IOManager iom(1, false);
+        iom.schedule([&]() {
+            sem.wait();
+            resumed = true;
+        });
+        notifier = std::thread([&sem]() {
+            usleep(100 * 1000);
+            sem.notify();
+        });
+    }
+    check(resumed, "IOManager stop waits for a fiber parked on a semaphore");
+    notifier.join();
+}
+
+/**
+ * @brief 检查协程同步原语：互斥锁计数、多生产者多消费者 channel、信号量和条件变量的超时、
+ *        channel close 唤醒等待者、普通线程等待协程 notify 的信号量、
+ *        停止时等待挂起的协程
+ */
+int main(int argc, char *argv[]) {
+    {
+        IOManager iom(4, false);
+        for(int i = 0; i < 8; ++i) {
+            iom.schedule(&test_mutex);
+        }
+    }
+    check(s_count == 800, "mutex count = " + std::to_string(s_count) + ", expect 800");
+
+    {
+        IOManager iom(4, false);
+        for(int i = 0; i < 4; ++i) {
+            iom.schedule(&test_consumer);
+        }
+        std::atomic<int> done(0);
+        for(int i = 0; i < 4; ++i) {
+            iom.schedule([i, &done]() {
+                test_producer(i * 1000);
+                if(++done == 4) {
+                    s_chan.close();
+                }
+            });
+        }
+    }
+    int expect = 4 * 500500 + 6000 * 1000;
+    check(s_sum == expect, "channel sum = " + std::to_string(s_sum) + ", expect " + std::to_string(expect));
+
+    {
+        IOManager iom(2, false);
+        iom.schedule(&test_semaphore_timeout);
+        iom.schedule(&test_condition_timeout);
+        iom.schedule(&test_channel_close);
+    }
+
+    // 普通线程和协程混用
+    FiberSemaphore sem;
+    bool notified = false;
+    {
+        IOManager iom(2, false);
+        iom.schedule([&sem]() {
+            usleep(50 * 1000);
+            sem.notify();
+        });
+        notified = sem.waitFor(1000);
+    }
+    check(notified, "thread wait semaphore notified by fiber");
+
+    test_stop_with_parked_fiber();
+
+    LOG_INFO(g_logger) << (s_failed ? "FAILED" : "PASSED");
+    return s_failed ? 1 : 0;
+}
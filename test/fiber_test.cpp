@@ -1,68 +1,69 @@
+#include <ucontext.h>
+#include <chrono>
 #include <string>
 #include <vector>
 
 #include "coroutine/fiber.h"
+#include "coroutine/context.h"
 #include "base/thread.h"
-#include "zchlog.h"
+#include "base/log.h"
+
+static zch::Logger::ptr g_logger = LOG_ROOT();
 
 void run_in_fiber2() {
-    LOG_INFO() << "run_in_fiber2 begin";
-    LOG_INFO() << "run_in_fiber2 end";
+    LOG_INFO(g_logger) << "run_in_fiber2 begin";
+    LOG_INFO(g_logger) << "run_in_fiber2 end";
 }
 
 void run_in_fiber() {
-    LOG_INFO() << "run_in_fiber begin";
+    LOG_INFO(g_logger) << "run_in_fiber begin";
 
-    LOG_INFO() << "before run_in_fiber yield";
+    LOG_INFO(g_logger) << "before run_in_fiber yield";
     Fiber::GetThis()->yield();
-    LOG_INFO() << "after run_in_fiber yield";
+    LOG_INFO(g_logger) << "after run_in_fiber yield";
 
-    LOG_INFO() << "run_in_fiber end";
+    LOG_INFO(g_logger) << "run_in_fiber end";
     // fiber结束之后会自动返回主协程运行
 }
 
 void test_fiber() {
-    LOG_INFO() << "test_fiber begin";
+    LOG_INFO(g_logger) << "test_fiber begin";
 
     // 初始化线程主协程
     Fiber::GetThis();
 
     Fiber::ptr fiber(new Fiber(run_in_fiber, 0, false));
-    LOG_INFO() << "use_count:" << fiber.use_count(); // 1
+    LOG_INFO(g_logger) << "use_count:" << fiber.use_count(); // 1
 
-    LOG_INFO() << "before test_fiber resume";
+    LOG_INFO(g_logger) << "before test_fiber resume";
     fiber->resume();
-    LOG_INFO() << "after test_fiber resume";
+    LOG_INFO(g_logger) << "after test_fiber resume";
 
     /** 
      * 关于fiber智能指针的引用计数为3的说明：
      * 一份在当前函数的fiber指针，一份在MainFunc的cur指针
      * 还有一份在在run_in_fiber的GetThis()结果的临时变量里
      */
-    LOG_INFO() << "use_count:" << fiber.use_count(); // 3
+    LOG_INFO(g_logger) << "use_count:" << fiber.use_count(); // 3
 
-    LOG_INFO() << "fiber status: " << fiber->getState(); // READY
+    LOG_INFO(g_logger) << "fiber status: " << fiber->getState(); // READY
 
-    LOG_INFO() << "before test_fiber resume again";
+    LOG_INFO(g_logger) << "before test_fiber resume again";
     fiber->resume();
-    LOG_INFO() << "after test_fiber resume again";
+    LOG_INFO(g_logger) << "after test_fiber resume again";
 
-    LOG_INFO() << "use_count:" << fiber.use_count(); // 1
-    LOG_INFO() << "fiber status: " << fiber->getState(); // TERM
+    LOG_INFO(g_logger) << "use_count:" << fiber.use_count(); // 1
+    LOG_INFO(g_logger) << "fiber status: " << fiber->getState(); // TERM
 
     fiber->reset(run_in_fiber2); // 上一个协程结束之后，复用其栈空间再创建一个新协程
     fiber->resume();
 
-    LOG_INFO() << "use_count:" << fiber.use_count(); // 1
-    LOG_INFO() << "test_fiber end";
+    LOG_INFO(g_logger) << "use_count:" << fiber.use_count(); // 1
+    LOG_INFO(g_logger) << "test_fiber end";
 }
 
-int main(int argc, char *argv[]) {
-
-    // 初始化日志系统 (加载配置文件)
-    zch::InitLogFromJson("/home/zch/Project/TinyWebserver/config/log_config.json");
-
-    LOG_INFO() << "main begin";
+void test_threads() {
+    LOG_INFO(g_logger) << "main begin";
 
     std::vector<Thread::ptr> thrs;
     for (int i = 0; i < 2; i++) {
@@ -74,6 +75,104 @@ int main(int argc, char *argv[]) {
         i->join();
     }
 
-    LOG_INFO() << "main end";
+    LOG_INFO(g_logger) << "main end";
+}
+
+static int s_rounds = 0;
+
+/**
+ * @brief 乒乓协程，每轮 yield 一次回到主协程
+ */
+static void ping_pong() {
+    for(int i = 0; i < s_rounds; ++i) {
+        Fiber::GetThis()->yield();
+    }
+}
+
+/**
+ * @brief 通过 Fiber 的 resume/yield 乒乓，测的是编译时选中的上下文切换实现
+ */
+static void bench_fiber_ping_pong(int rounds) {
+    Fiber::GetThis();
+    s_rounds = rounds;
+    Fiber::ptr fiber(new Fiber(&ping_pong, 0, false));
+    auto begin = std::chrono::steady_clock::now();
+    for(int i = 0; i <= rounds; ++i) {
+        fiber->resume();
+    }
+    double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+#ifdef FIBER_USE_UCONTEXT
+    const char *impl = "ucontext";
+#else
+    const char *impl = "asm";
+#endif
+    // 每轮一次 resume 一次 yield
+    LOG_INFO(g_logger) << "Fiber ping-pong (" << impl << "), " << rounds << " rounds, ns/switch="
+                       << elapsed / (2.0 * rounds);
+}
+
+// 直接测两种切换原语，不经过 Fiber
+static const size_t BENCH_STACK_SIZE = 64 * 1024;
+static char s_bench_stack[BENCH_STACK_SIZE] __attribute__((aligned(16)));
+
+static ucontext_t s_main_ctx;
+static ucontext_t s_co_ctx;
+
+static void ucontext_pong() {
+    while(true) {
+        swapcontext(&s_co_ctx, &s_main_ctx);
+    }
+}
+
+/**
+ * @brief swapcontext 乒乓，每次切换都有一次 rt_sigprocmask 系统调用
+ */
+static void bench_ucontext(int rounds) {
+    getcontext(&s_co_ctx);
+    s_co_ctx.uc_stack.ss_sp = s_bench_stack;
+    s_co_ctx.uc_stack.ss_size = BENCH_STACK_SIZE;
+    s_co_ctx.uc_link = nullptr;
+    makecontext(&s_co_ctx, &ucontext_pong, 0);
+    auto begin = std::chrono::steady_clock::now();
+    for(int i = 0; i < rounds; ++i) {
+        swapcontext(&s_main_ctx, &s_co_ctx);
+    }
+    double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+    LOG_INFO(g_logger) << "swapcontext ping-pong, " << rounds << " rounds, ns/switch=" << elapsed / (2.0 * rounds);
+}
+
+#ifndef FIBER_USE_UCONTEXT
+static void *s_main_sp = nullptr;
+static void *s_co_sp = nullptr;
+
+static void asm_pong() {
+    while(true) {
+        fiber_switch_context(&s_co_sp, s_main_sp);
+    }
+}
+
+/**
+ * @brief fiber_switch_context 乒乓，只保存被调用者保存的寄存器，不进内核
+ */
+static void bench_asm(int rounds) {
+    s_co_sp = fiber_make_context(s_bench_stack, BENCH_STACK_SIZE, &asm_pong);
+    auto begin = std::chrono::steady_clock::now();
+    for(int i = 0; i < rounds; ++i) {
+        fiber_switch_context(&s_main_sp, s_co_sp);
+    }
+    double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+    LOG_INFO(g_logger) << "fiber_switch_context ping-pong, " << rounds << " rounds, ns/switch=" << elapsed / (2.0 * rounds);
+}
+#endif
+
+int main(int argc, char *argv[]) {
+    test_threads();
+
+    int rounds = argc > 1 ? atoi(argv[1]) : 1000000;
+    bench_fiber_ping_pong(rounds);
+    bench_ucontext(rounds);
+#ifndef FIBER_USE_UCONTEXT
+    bench_asm(rounds);
+#endif
     return 0;
 }
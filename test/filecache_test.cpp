@@ -0,0 +1,262 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <functional>
+#include <string>
+
+#include "http/filecache.h"
+#include "base/http_server.h"
+#include "coroutine/iomanager.h"
+#include "base/config.h"
+#include "base/log.h"
+
+static zch::Logger::ptr g_logger = LOG_ROOT();
+
+static bool s_failed = false;
+
+static void check(bool ok, const std::string &what) {
+    LOG_INFO(g_logger) << (ok ? "ok: " : "FAILED: ") << what;
+    if(!ok) {
+        s_failed = true;
+    }
+}
+
+static std::string s_root;
+
+static bool write_file(const std::string &path, const std::string &content) {
+    int fd = open((s_root + path).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        return false;
+    }
+    bool ok = ::write(fd, content.data(), content.size()) == (ssize_t)content.size();
+    close(fd);
+    return ok;
+}
+
+/**
+ * @brief 在 FileCache 加载完文件、还没加入分片时删除这个路径的条目
+ * @details 加载结束时 FileCache 在 system 日志器上打 "FileCache load <path>, size=..." 的调试日志，
+ *          此时已经读过分片版本、还没调用 Insert_，在这里调用 Invalidate 就相当于加载期间文件被改了
+ */
+class InvalidateOnLoadAppender : public zch::LogAppender {
+public:
+    typedef std::shared_ptr<InvalidateOnLoadAppender> ptr;
+
+    InvalidateOnLoadAppender()
+        : LogAppender(zch::LogFormatter::ptr(new zch::LogFormatter))
+        , m_cache(nullptr) {}
+
+    void arm(FileCache *cache, const std::string &path) {
+        m_cache = cache;
+        m_path = path;
+    }
+
+    void Log(zch::LogEvent::ptr event) override {
+        std::string prefix = "FileCache load " + m_path + ",";
+        if(m_cache && event->GetContent().compare(0, prefix.size(), prefix) == 0) {
+            FileCache *cache = m_cache;
+            m_cache = nullptr;
+            cache->Invalidate(m_path);
+        }
+    }
+
+    std::string ToYamlString() override { return ""; }
+
+private:
+    FileCache *m_cache;
+    std::string m_path;
+};
+
+/**
+ * @brief 多余的 / 和 /./ 规范化后命中同一个条目，含有 .. 的路径不缓存
+ */
+static void test_normalize() {
+    FileCache cache;
+    cache.Init(s_root);
+    FileCache::Entry::ptr a = cache.Get("/a.html");
+    FileCache::Entry::ptr b = cache.Get("/sub/b.html");
+    check(a && a->content == "aaa" && b && b->content == "bbb", "plain paths are loaded");
+    check(cache.Get("//a.html") == a, "//a.html hits /a.html");
+    check(cache.Get("/./a.html") == a, "/./a.html hits /a.html");
+    check(cache.Get("/sub//b.html") == b, "/sub//b.html hits /sub/b.html");
+    check(cache.Get("/sub/./b.html") == b, "/sub/./b.html hits /sub/b.html");
+    check(cache.Get("/.//sub/.//b.html") == b, "/.//sub/.//b.html hits /sub/b.html");
+    check(!cache.Get("/sub/../a.html"), "/sub/../a.html is rejected");
+    check(!cache.Get("/../a.html"), "/../a.html is rejected");
+    check(!cache.Get("/sub/.."), "/sub/.. is rejected");
+}
+
+/**
+ * @brief 一个分片放三个文件，第四个文件加入时淘汰没有被引用过的条目，被引用过的再给一次机会
+ */
+static void test_clock() {
+    zch::Config::Lookup<size_t>("file_cache.shards")->SetValue(1);
+    zch::Config::Lookup<size_t>("file_cache.capacity")->SetValue(3000);
+    FileCache cache;
+    zch::Config::Lookup<size_t>("file_cache.capacity")->SetValue(64 * 1024 * 1024);
+    cache.Init(s_root);
+
+    FileCache::Entry::ptr f0 = cache.Get("/f0.html");
+    FileCache::Entry::ptr f1 = cache.Get("/f1.html");
+    FileCache::Entry::ptr f2 = cache.Get("/f2.html");
+    check(f0 && f1 && f2, "three 1000-byte files fill the 3000-byte shard");
+    // 命中设置 f0 的引用位，f1、f2 加载后没有再命中过
+    check(cache.Get("/f0.html") == f0, "f0 is a hit");
+
+    FileCache::Entry::ptr f3 = cache.Get("/f3.html");
+    check(f3 != nullptr, "f3 is loaded");
+    check(cache.Get("/f3.html") == f3, "f3 was inserted");
+    check(cache.Get("/f0.html") == f0, "referenced f0 survived eviction");
+    check(cache.Get("/f2.html") == f2, "f2 survived eviction");
+    check(cache.Get("/f1.html") != f1, "unreferenced f1 was evicted and reloaded");
+
+    check(!cache.Get("/big.html"), "file larger than the shard capacity is not cached");
+}
+
+/**
+ * @brief 加载期间路径被 Invalidate，加载出的内容照常返回，但不加入缓存
+ */
+static void test_invalidate_during_load() {
+    FileCache cache;
+    cache.Init(s_root);
+    InvalidateOnLoadAppender::ptr appender(new InvalidateOnLoadAppender);
+    zch::Logger::ptr system = LOG_NAME("system");
+    zch::LogLevel::Level level = system->GetLevel();
+    system->SetLevel(zch::LogLevel::DEBUG);
+    system->AddAppender(appender);
+
+    appender->arm(&cache, "/a.html");
+    FileCache::Entry::ptr racing = cache.Get("/a.html");
+    FileCache::Entry::ptr next = cache.Get("/a.html");
+    FileCache::Entry::ptr hit = cache.Get("/a.html");
+
+    system->DelAppender(appender);
+    system->SetLevel(level);
+
+    check(racing && racing->content == "aaa", "racing load still returns the file");
+    check(next && next != racing, "racing load was not inserted after Invalidate");
+    check(hit == next, "the next load was inserted");
+}
+
+static bool s_inotify_done = false;
+
+/**
+ * @brief 反复查询直到 pred 成立，每次之间让出协程给 inotify 的回调，最多等 2 秒
+ */
+static bool wait_for(std::function<bool()> pred) {
+    for(int i = 0; i < 200; ++i) {
+        if(pred()) {
+            return true;
+        }
+        usleep(10 * 1000);
+    }
+    return pred();
+}
+
+/**
+ * @brief 在 IOManager 里 Init 时用 inotify 失效条目：修改、删除文件，以及之后新建的子目录里的文件
+ */
+static void test_inotify() {
+    FileCache *cache = new FileCache;
+    cache->Init(s_root);
+
+    FileCache::Entry::ptr a = cache->Get("/a.html");
+    check(a && a->content == "aaa", "a.html is loaded");
+    check(cache->Get("/a.html") == a, "a.html is a hit");
+
+    write_file("/a.html", "modified");
+    check(wait_for([cache]() {
+        FileCache::Entry::ptr e = cache->Get("/a.html");
+        return e && e->content == "modified";
+    }), "modified a.html is reloaded after the inotify event");
+
+    FileCache::Entry::ptr f0 = cache->Get("/f0.html");
+    unlink((s_root + "/f0.html").c_str());
+    check(f0 && wait_for([cache]() { return !cache->Get("/f0.html"); }),
+          "deleted f0.html is dropped after the inotify event");
+
+    mkdir((s_root + "/new").c_str(), 0755);
+    // 等 IN_CREATE 把新目录加入监视
+    usleep(100 * 1000);
+    write_file("/new/c.html", "ccc");
+    FileCache::Entry::ptr c = cache->Get("/new/c.html");
+    check(c && c->content == "ccc", "file in a new directory is loaded");
+    write_file("/new/c.html", "cccc");
+    check(wait_for([cache]() {
+        FileCache::Entry::ptr e = cache->Get("/new/c.html");
+        return e && e->content == "cccc";
+    }), "file in a new directory is reloaded after the inotify event");
+
+    cache->Unwatch();
+    delete cache;
+    s_inotify_done = true;
+}
+
+static bool s_server_stopped = false;
+
+/**
+ * @brief HttpServer 构造时 FileCache 单例开始监视资源目录，stop 时停止监视，之后 IOManager 才能停止
+ * @details stop 之前改一个文件，inotify 的回调可能正在执行，这时描述符由回调关闭
+ */
+static void test_server_stop() {
+    zch::Config::Lookup<std::string>("server.resources_dir")->SetValue(s_root);
+    HttpServer::ptr server = std::make_shared<HttpServer>(true);
+    FileCache::Entry::ptr a = FileCacheMgr::GetInstance()->Get("/a.html");
+    check(a != nullptr, "server's file cache serves the resources dir");
+    write_file("/a.html", "stopping");
+    server->stop();
+    s_server_stopped = true;
+}
+
+static bool make_files() {
+    char dir[] = "/tmp/filecache_test.XXXXXX";
+    if(!mkdtemp(dir)) {
+        return false;
+    }
+    s_root = dir;
+    if(mkdir((s_root + "/sub").c_str(), 0755) < 0) {
+        return false;
+    }
+    bool ok = write_file("/a.html", "aaa") && write_file("/sub/b.html", "bbb")
+              && write_file("/big.html", std::string(4000, 'x'));
+    for(int i = 0; i < 4; ++i) {
+        ok = ok && write_file("/f" + std::to_string(i) + ".html", std::string(1000, '0' + i));
+    }
+    return ok;
+}
+
+static void remove_files() {
+    std::string cmd = "rm -rf " + s_root;
+    system(cmd.c_str());
+}
+
+/**
+ * @brief 检查静态文件缓存：路径规范化、分片容量下的 CLOCK 淘汰、加载期间被失效的内容不加入缓存、
+ *        inotify 失效、HttpServer 停止时停止监视
+ * @details 前三项在 IOManager 外面，命中时用 stat 检查；inotify 在单线程 IOManager 的协程里
+ */
+int main(int argc, char *argv[]) {
+    if(!make_files()) {
+        LOG_ERROR(g_logger) << "create test files failed";
+        return 1;
+    }
+
+    test_normalize();
+    test_clock();
+    test_invalidate_during_load();
+    {
+        IOManager iom(1, false, "filecache");
+        iom.schedule(&test_inotify);
+    }
+    check(s_inotify_done, "inotify test finished and the IOManager stopped");
+    {
+        IOManager iom(2, false, "server");
+        iom.schedule(&test_server_stop);
+    }
+    check(s_server_stopped, "IOManager stopped after HttpServer::stop unwatched the resources dir");
+
+    remove_files();
+    LOG_INFO(g_logger) << (s_failed ? "FAILED" : "PASSED");
+    return s_failed ? 1 : 0;
+}
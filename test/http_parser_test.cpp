@@ -0,0 +1,427 @@
+#include <stdio.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "http/httpparser.h"
+#include "http/httprequest.h"
+#include "base/buffer.h"
+#include "base/config.h"
+#include "base/log.h"
+
+static zch::Logger::ptr g_logger = LOG_ROOT();
+
+// 测试用的小上限，需要在创建第一个 HttpParser 之前设置
+static const uint32_t MAX_HEADER_SIZE = 1024;
+static const uint64_t MAX_BODY_SIZE = 4096;
+
+static const std::string GET_REQUEST =
+    "GET /index.html?a=1 HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static const std::string POST_BODY = "username=zch&password=123456";
+static const std::string POST_REQUEST =
+    "POST /comment HTTP/1.0\r\n"
+    "Host: localhost\r\n"
+    "Content-Type: application/x-www-form-urlencoded \r\n"
+    "Content-Length: " + std::to_string(POST_BODY.size()) + "\r\n"
+    "\r\n" + POST_BODY;
+
+static const std::string CHUNKED_BODY = "hello world";
+static const std::string CHUNKED_REQUEST =
+    "POST /comment HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "\r\n"
+    "5\r\nhello\r\n"
+    "6;name=value\r\n world\r\n"
+    "0\r\n"
+    "X-Checksum: 42\r\n"
+    "\r\n";
+
+static bool s_failed = false;
+
+static void check(bool ok, const std::string &what) {
+    if(!ok) {
+        LOG_ERROR(g_logger) << "FAILED: " << what;
+        s_failed = true;
+    }
+}
+
+static const char *result_str(HttpParser::PARSE_RESULT rt) {
+    switch(rt) {
+        case HttpParser::PARSE_AGAIN:
+            return "PARSE_AGAIN";
+        case HttpParser::PARSE_DONE:
+            return "PARSE_DONE";
+        default:
+            return "PARSE_ERROR";
+    }
+}
+
+/**
+ * @brief 模拟分几次读到请求：每次把从请求开头到切分点的数据交给解析器
+ * @details 每次都复制到新的缓冲区里，和读缓冲区扩容时数据会移动一样，解析器只能依赖偏移
+ * @param[in] cuts 递增的切分点，最后一个之后是整个请求
+ * @return 最后一次的解析结果，中途出现 PARSE_AGAIN 以外的结果时直接返回
+ */
+static HttpParser::PARSE_RESULT feed(HttpParser &parser, const std::string &req,
+                                     const std::vector<size_t> &cuts, std::string &data) {
+    for(size_t cut : cuts) {
+        data = req.substr(0, cut);
+        HttpParser::PARSE_RESULT rt = parser.Execute(data.data(), data.size());
+        if(rt != HttpParser::PARSE_AGAIN) {
+            return rt;
+        }
+    }
+    data = req;
+    return parser.Execute(data.data(), data.size());
+}
+
+static std::string slice(const std::string &data, HttpParser::Slice s) {
+    return data.substr(s.off, s.len);
+}
+
+static std::string header(const HttpParser &parser, const std::string &data, const char *name) {
+    HttpParser::Slice value;
+    if(!parser.GetHeader(data.data(), name, value)) {
+        return "<none>";
+    }
+    return slice(data, value);
+}
+
+static bool verify_get(const HttpParser &parser, const std::string &data) {
+    return std::string(parser.Method()) == "GET"
+        && slice(data, parser.Url()) == "/index.html?a=1"
+        && parser.VersionMajor() == 1 && parser.VersionMinor() == 1
+        && parser.IsKeepAlive()
+        && header(parser, data, "host") == "localhost"
+        && parser.BodyLength() == 0
+        && parser.Length() == GET_REQUEST.size();
+}
+
+static bool verify_post(const HttpParser &parser, const std::string &data) {
+    return std::string(parser.Method()) == "POST"
+        && slice(data, parser.Url()) == "/comment"
+        && parser.VersionMajor() == 1 && parser.VersionMinor() == 0
+        && !parser.IsKeepAlive()
+        && header(parser, data, "Content-Type") == "application/x-www-form-urlencoded"
+        && std::string(parser.BodyData(data.data()), parser.BodyLength()) == POST_BODY
+        && parser.Length() == POST_REQUEST.size();
+}
+
+static bool verify_chunked(const HttpParser &parser, const std::string &data) {
+    return std::string(parser.Method()) == "POST"
+        && parser.IsKeepAlive()
+        && header(parser, data, "Transfer-Encoding") == "chunked"
+        && std::string(parser.BodyData(data.data()), parser.BodyLength()) == CHUNKED_BODY
+        && parser.Length() == CHUNKED_REQUEST.size();
+}
+
+/**
+ * @brief 请求逐字节读到，以及在每个位置切成两次读到，都要先返回 PARSE_AGAIN，最后解析出同样的结果
+ */
+static void test_split(const std::string &name, const std::string &req,
+                       bool (*verify)(const HttpParser &, const std::string &)) {
+    HttpParser parser;
+    std::string data;
+    std::vector<size_t> cuts;
+    for(size_t i = 1; i < req.size(); ++i) {
+        cuts.push_back(i);
+    }
+    HttpParser::PARSE_RESULT rt = feed(parser, req, cuts, data);
+    check(rt == HttpParser::PARSE_DONE && verify(parser, data), name + " byte by byte: " + result_str(rt));
+
+    for(size_t i = 1; i < req.size(); ++i) {
+        parser.Init();
+        rt = feed(parser, req, std::vector<size_t>(1, i), data);
+        check(rt == HttpParser::PARSE_DONE && verify(parser, data),
+              name + " split at " + std::to_string(i) + ": " + result_str(rt));
+    }
+
+    // 解析完成后不再解析后面的数据，再调用也还是 PARSE_DONE
+    parser.Init();
+    data = req + req;
+    rt = parser.Execute(data.data(), data.size());
+    check(rt == HttpParser::PARSE_DONE && parser.Length() == req.size(), name + " stops at the request end");
+    check(parser.Execute(data.data(), data.size()) == HttpParser::PARSE_DONE, name + " done is sticky");
+}
+
+/**
+ * @brief 整个请求一次读到，以及每次读 step 字节，都要得到 expect
+ */
+static void expect_result(const std::string &name, const std::string &req, HttpParser::PARSE_RESULT expect,
+                          const char *error = nullptr, size_t step = 100) {
+    HttpParser parser;
+    std::string data = req;
+    HttpParser::PARSE_RESULT rt = parser.Execute(data.data(), data.size());
+    check(rt == expect, name + ": " + result_str(rt));
+
+    parser.Init();
+    std::vector<size_t> cuts;
+    for(size_t i = step; i < req.size(); i += step) {
+        cuts.push_back(i);
+    }
+    rt = feed(parser, req, cuts, data);
+    check(rt == expect, name + " in " + std::to_string(step) + " byte reads: " + result_str(rt));
+    if(error) {
+        check(parser.GetError() && std::string(parser.GetError()) == error,
+              name + " error: " + (parser.GetError() ? parser.GetError() : "<none>"));
+    }
+    if(expect == HttpParser::PARSE_ERROR) {
+        // 出错之后再调用也还是 PARSE_ERROR
+        check(parser.Execute(data.data(), data.size()) == HttpParser::PARSE_ERROR, name + " error is sticky");
+    }
+}
+
+static std::string request_with_headers(size_t count, size_t value_size) {
+    std::string req = "GET / HTTP/1.1\r\n";
+    for(size_t i = 0; i < count; ++i) {
+        req += "X-" + std::to_string(i) + ": " + std::string(value_size, 'v') + "\r\n";
+    }
+    return req + "\r\n";
+}
+
+static std::string post_with_body(size_t size) {
+    return "POST /comment HTTP/1.1\r\nContent-Length: " + std::to_string(size) + "\r\n\r\n"
+        + std::string(size, 'b');
+}
+
+/**
+ * @brief 请求头大小、请求头个数、请求体大小的上限，超过时 PARSE_ERROR，不超过时正常解析
+ */
+static void test_limits() {
+    expect_result("headers within http.max_header_size", request_with_headers(1, MAX_HEADER_SIZE - 100),
+                  HttpParser::PARSE_DONE);
+    expect_result("headers over http.max_header_size", request_with_headers(1, MAX_HEADER_SIZE),
+                  HttpParser::PARSE_ERROR);
+
+    expect_result("MAX_HEADERS headers", request_with_headers(HttpParser::MAX_HEADERS, 1),
+                  HttpParser::PARSE_DONE);
+    expect_result("MAX_HEADERS + 1 headers", request_with_headers(HttpParser::MAX_HEADERS + 1, 1),
+                  HttpParser::PARSE_ERROR, "too many headers");
+
+    expect_result("body of http.max_body_size", post_with_body(MAX_BODY_SIZE), HttpParser::PARSE_DONE);
+    expect_result("body over http.max_body_size", post_with_body(MAX_BODY_SIZE + 1),
+                  HttpParser::PARSE_ERROR, "body too large");
+
+    // 请求头里的 Content-Length 超过上限时不用等请求体读完
+    HttpParser parser;
+    std::string req = post_with_body(MAX_BODY_SIZE + 1);
+    std::string data = req.substr(0, req.find("\r\n\r\n") + 4);
+    check(parser.Execute(data.data(), data.size()) == HttpParser::PARSE_ERROR,
+          "oversized Content-Length rejected before the body arrives");
+}
+
+/**
+ * @brief 请求没读完是 PARSE_AGAIN，格式错误和不支持的请求是 PARSE_ERROR
+ */
+static void test_errors() {
+    HttpParser parser;
+    std::string data = GET_REQUEST.substr(0, GET_REQUEST.size() - 2);
+    check(parser.Execute(data.data(), data.size()) == HttpParser::PARSE_AGAIN, "incomplete request needs more data");
+    check(parser.GetError() == nullptr, "incomplete request has no error");
+    check(parser.Execute(data.data(), data.size()) == HttpParser::PARSE_AGAIN, "no new data needs more data");
+
+    expect_result("CONNECT", "CONNECT example.com:443 HTTP/1.1\r\nHost: example.com:443\r\n\r\n",
+                  HttpParser::PARSE_ERROR, "CONNECT not supported", 10);
+    expect_result("bad method", "BREW /pot HTTP/1.1\r\n\r\n", HttpParser::PARSE_ERROR, nullptr, 3);
+    expect_result("bad version", "GET / HTTP/x.1\r\n\r\n", HttpParser::PARSE_ERROR, nullptr, 3);
+    expect_result("bad Content-Length", "POST / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n",
+                  HttpParser::PARSE_ERROR, nullptr, 7);
+}
+
+static std::string chunked_post(const std::string &path, const std::string &chunks) {
+    return "POST " + path + " HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n" + chunks;
+}
+
+/**
+ * @brief size 字节的请求体切成 chunk 字节一块，每块的长度行带上 ext 作为扩展
+ */
+static std::string chunks_of(size_t size, size_t chunk, const std::string &ext = "") {
+    std::string chunks;
+    char len[32];
+    for(size_t off = 0; off < size; off += chunk) {
+        size_t n = std::min(chunk, size - off);
+        snprintf(len, sizeof(len), "%zx", n);
+        chunks += len + ext + "\r\n" + std::string(n, 'c') + "\r\n";
+    }
+    return chunks + "0\r\n\r\n";
+}
+
+/**
+ * @brief chunked 解码后的请求体受 http.max_body_size 限制；分块长度行、扩展和 trailer 不算请求体，
+ *        由请求头上限和请求原始字节数上限兜住
+ */
+static void test_chunked_limits() {
+    expect_result("chunked body of http.max_body_size", chunked_post("/comment", chunks_of(MAX_BODY_SIZE, 512)),
+                  HttpParser::PARSE_DONE);
+    expect_result("chunked body over http.max_body_size",
+                  chunked_post("/comment", chunks_of(MAX_BODY_SIZE + 1, 512)),
+                  HttpParser::PARSE_ERROR, "body too large");
+
+    // 每个 1 字节的块带 1000 字节的扩展，请求体很小，原始字节数超过上限
+    size_t cap = MAX_HEADER_SIZE + MAX_BODY_SIZE + HttpParser::MAX_FRAMING;
+    std::string ext = ";x=" + std::string(1000, 'e');
+    std::string flood = chunked_post("/comment", chunks_of(cap / ext.size() + 2, 1, ext));
+    check(flood.size() > cap, "chunk extension flood exceeds the raw request cap");
+    expect_result("chunk extension flood", flood, HttpParser::PARSE_ERROR, "request too large", 4096);
+
+    std::string trailers = "0\r\nX-Trailer: " + std::string(MAX_HEADER_SIZE, 't') + "\r\n\r\n";
+    expect_result("trailer over http.max_header_size", chunked_post("/comment", trailers),
+                  HttpParser::PARSE_ERROR, nullptr, 256);
+}
+
+/**
+ * @brief 把收到的请求体存起来的 BodyConsumer
+ */
+class CollectConsumer : public HttpRequest::BodyConsumer {
+public:
+    static std::string s_body;
+    static size_t s_pieces;
+    static bool s_finished;
+
+    bool OnData(const char *data, size_t len) override {
+        s_body.append(data, len);
+        ++s_pieces;
+        return true;
+    }
+
+    bool OnFinish(HttpRequest &req) override {
+        s_finished = true;
+        return true;
+    }
+};
+
+std::string CollectConsumer::s_body;
+size_t CollectConsumer::s_pieces = 0;
+bool CollectConsumer::s_finished = false;
+
+/**
+ * @brief 注册了 BodyConsumer 的路径：解码后的请求体分段交给它，已经交出去的数据马上从读缓冲区取走，
+ *        不受请求体大小和请求原始字节数上限的限制
+ */
+static void test_body_consumer() {
+    HttpRequest::RegisterBodyConsumer("/upload", [](const HttpRequest &) {
+        return std::make_shared<CollectConsumer>();
+    });
+
+    size_t size = 3 * (MAX_HEADER_SIZE + MAX_BODY_SIZE + HttpParser::MAX_FRAMING);
+    std::string req = chunked_post("/upload", chunks_of(size, 1000, ";n=1"));
+    const size_t step = 512;
+
+    HttpRequest request;
+    Buffer buff;
+    size_t max_readable = 0;
+    HttpRequest::HTTP_CODE rt = HttpRequest::NO_REQUEST;
+    for(size_t off = 0; off < req.size() && rt == HttpRequest::NO_REQUEST; off += step) {
+        buff.Append(req.data() + off, std::min(step, req.size() - off));
+        rt = request.parse(buff);
+        max_readable = std::max(max_readable, buff.ReadableBytes());
+    }
+    LOG_INFO(g_logger) << "body consumer: " << size << " bytes in " << CollectConsumer::s_pieces
+                       << " pieces, max readable bytes " << max_readable;
+    check(rt == HttpRequest::GET_REQUEST, "streamed upload over the raw cap is accepted");
+    check(CollectConsumer::s_body == std::string(size, 'c'), "consumer received the decoded body");
+    check(CollectConsumer::s_pieces > 1, "consumer received the body in pieces");
+    check(CollectConsumer::s_finished, "consumer finished");
+    check(request.path() == "/upload", "streamed upload path");
+    check(max_readable < 2 * step, "read buffer stays flat while streaming");
+    check(buff.ReadableBytes() == 0, "streamed request fully retrieved");
+
+    // 同样的请求发到没有注册的路径，请求体要放进内存，超过上限
+    HttpRequest other;
+    Buffer all;
+    req = chunked_post("/comment", chunks_of(size, 1000, ";n=1"));
+    all.Append(req);
+    check(other.parse(all) == HttpRequest::BAD_REQUEST, "same upload without a consumer is rejected");
+}
+
+/**
+ * @brief 和 HttpConn::process 一样循环解析读缓冲区里的请求，请求不完整或者出错时停下
+ * @param[out] paths 每个解析成功的请求的路径，POST 的请求再加上参数 b 的值
+ */
+static std::vector<HttpRequest::HTTP_CODE> parse_batch(HttpRequest &request, Buffer &buff,
+                                                       std::vector<std::string> &paths) {
+    std::vector<HttpRequest::HTTP_CODE> codes;
+    while(buff.ReadableBytes() > 0) {
+        HttpRequest::HTTP_CODE rt = request.parse(buff);
+        codes.push_back(rt);
+        if(rt != HttpRequest::GET_REQUEST) {
+            break;
+        }
+        paths.push_back(request.path() + (request.method() == "POST" ? "?b=" + request.GetPost("b") : ""));
+        if(!request.IsKeepAlive()) {
+            break;
+        }
+    }
+    return codes;
+}
+
+/**
+ * @brief 一次读到多个请求（pipelining）：完整的请求逐个解析出来，不完整的留在读缓冲区里，
+ *        中间有格式错误的请求时停下，后面的数据丢掉
+ */
+static void test_pipeline() {
+    const std::string first = "GET /picture HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    const std::string second =
+        "POST /comment HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Content-Type: application/x-www-form-urlencoded\r\n"
+        "Content-Length: 7\r\n"
+        "\r\n"
+        "a=1&b=2";
+    const std::string third = "GET /video HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    const size_t partial = 20;
+
+    HttpRequest request;
+    Buffer buff;
+    std::vector<std::string> paths;
+    buff.Append(first + second + third.substr(0, partial));
+    std::vector<HttpRequest::HTTP_CODE> codes = parse_batch(request, buff, paths);
+    check(codes == std::vector<HttpRequest::HTTP_CODE>({HttpRequest::GET_REQUEST, HttpRequest::GET_REQUEST,
+                                                       HttpRequest::NO_REQUEST}),
+          "two full requests then NO_REQUEST");
+    check(paths == std::vector<std::string>({"/picture.html", "/comment?b=2"}), "pipelined requests in order");
+    check(std::string(buff.Peek(), buff.ReadableBytes()) == third.substr(0, partial),
+          "partial third request left in the buffer");
+
+    buff.Append(third.substr(partial));
+    paths.clear();
+    codes = parse_batch(request, buff, paths);
+    check(codes == std::vector<HttpRequest::HTTP_CODE>(1, HttpRequest::GET_REQUEST)
+          && paths == std::vector<std::string>(1, "/video.html"), "third request completes on the next read");
+    check(buff.ReadableBytes() == 0, "buffer empty after the third request");
+
+    HttpRequest bad;
+    buff.Append(first + "BROKEN\r\n\r\n" + third);
+    paths.clear();
+    codes = parse_batch(bad, buff, paths);
+    check(codes == std::vector<HttpRequest::HTTP_CODE>({HttpRequest::GET_REQUEST, HttpRequest::BAD_REQUEST}),
+          "bad request in the middle stops the batch");
+    check(paths == std::vector<std::string>(1, "/picture.html"), "request before the bad one is served");
+    check(buff.ReadableBytes() == 0, "requests after the bad one are dropped");
+}
+
+/**
+ * @brief HttpParser 不依赖服务器，直接喂数据检查增量解析、上限和出错
+ */
+int main(int argc, char *argv[]) {
+    zch::Config::Lookup<uint32_t>("http.max_header_size")->SetValue(MAX_HEADER_SIZE);
+    zch::Config::Lookup<uint64_t>("http.max_body_size")->SetValue(MAX_BODY_SIZE);
+
+    test_split("GET", GET_REQUEST, &verify_get);
+    test_split("urlencoded POST", POST_REQUEST, &verify_post);
+    test_split("chunked POST", CHUNKED_REQUEST, &verify_chunked);
+    test_limits();
+    test_chunked_limits();
+    test_errors();
+    test_body_consumer();
+    test_pipeline();
+
+    LOG_INFO(g_logger) << (s_failed ? "FAILED" : "PASSED");
+    return s_failed ? 1 : 0;
+}
@@ -1,46 +1,89 @@
 #include <unistd.h>
+#include <dlfcn.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <string>
+#include <vector>
 
 #include "coroutine/fiber.h"
 #include "base/thread.h"
 #include "coroutine/scheduler.h"
 #include "coroutine/iomanager.h"
-#include "zchlog.h"
+#include "base/config.h"
+#include "base/fd_manager.h"
+#include "base/log.h"
+
+static zch::Logger::ptr g_logger = LOG_ROOT();
+
+static bool s_failed = false;
+
+static void check(bool ok, const std::string &what) {
+    LOG_INFO(g_logger) << (ok ? "ok: " : "FAILED: ") << what;
+    if(!ok) {
+        s_failed = true;
+    }
+}
+
+// 统计库里的 epoll_ctl/epoll_wait 调用次数，可执行文件里的定义优先于 libc
+static std::atomic<uint64_t> s_epoll_ctl(0);
+static std::atomic<uint64_t> s_epoll_wait(0);
+
+extern "C" {
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) __THROW {
+    typedef int (*epoll_ctl_fun)(int, int, int, struct epoll_event *);
+    static epoll_ctl_fun real = (epoll_ctl_fun)dlsym(RTLD_NEXT, "epoll_ctl");
+    ++s_epoll_ctl;
+    return real(epfd, op, fd, event);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+    typedef int (*epoll_wait_fun)(int, struct epoll_event *, int, int);
+    static epoll_wait_fun real = (epoll_wait_fun)dlsym(RTLD_NEXT, "epoll_wait");
+    ++s_epoll_wait;
+    return real(epfd, events, maxevents, timeout);
+}
+
+}
 
 int sockfd;
 void watch_io_read();
 
 // 写事件回调，只执行一次，用于判断非阻塞套接字connect成功
 void do_io_write() {
-    LOG_INFO() << "write callback";
+    LOG_INFO(g_logger) << "write callback";
     int so_err;
     socklen_t len = size_t(so_err);
     getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &so_err, &len);
     if(so_err) {
-        LOG_INFO() << "connect fail";
+        LOG_INFO(g_logger) << "connect fail";
         return;
-    } 
-    LOG_INFO() << "connect success";
+    }
+    LOG_INFO(g_logger) << "connect success";
 }
 
 // 读事件回调，每次读取之后如果套接字未关闭，需要重新添加
 void do_io_read() {
-    LOG_INFO() << "read callback";
+    LOG_INFO(g_logger) << "read callback";
     char buf[1024] = {0};
     int readlen = 0;
     readlen = read(sockfd, buf, sizeof(buf));
     if(readlen > 0) {
         buf[readlen] = '\0';
-        LOG_INFO() << "read " << readlen << " bytes, read: " << buf;
+        LOG_INFO(g_logger) << "read " << readlen << " bytes, read: " << buf;
     } else if(readlen == 0) {
-        LOG_INFO() << "peer closed";
+        LOG_INFO(g_logger) << "peer closed";
         close(sockfd);
         return;
     } else {
-        LOG_ERROR() << "err, errno=" << errno << ", errstr=" << strerror(errno);
+        LOG_ERROR(g_logger) << "err, errno=" << errno << ", errstr=" << strerror(errno);
         close(sockfd);
         return;
     }
@@ -49,7 +92,7 @@ void do_io_read() {
 }
 
 void watch_io_read() {
-    LOG_INFO() << "watch_io_read";
+    LOG_INFO(g_logger) << "watch_io_read";
     IOManager::GetThis()->addEvent(sockfd, IOManager::READ, do_io_read);
 }
 
@@ -66,17 +109,17 @@ void test_io() {
     int rt = connect(sockfd, (const sockaddr*)&servaddr, sizeof(servaddr));
     if(rt != 0) {
         if(errno == EINPROGRESS) {
-            LOG_INFO() << "EINPROGRESS";
+            LOG_INFO(g_logger) << "EINPROGRESS";
             // 注册写事件回调，只用于判断connect是否成功
             // 非阻塞的TCP套接字connect一般无法立即建立连接，要通过套接字可写来判断connect是否已经成功
             IOManager::GetThis()->addEvent(sockfd, IOManager::WRITE, do_io_write);
             // 注册读事件回调，注意事件是一次性的
             IOManager::GetThis()->addEvent(sockfd, IOManager::READ, do_io_read);
         } else {
-            LOG_ERROR() << "connect error, errno:" << errno << ", errstr:" << strerror(errno);
+            LOG_ERROR(g_logger) << "connect error, errno:" << errno << ", errstr:" << strerror(errno);
         }
     } else {
-        LOG_ERROR() << "else, errno:" << errno << ", errstr:" << strerror(errno);
+        LOG_ERROR(g_logger) << "else, errno:" << errno << ", errstr:" << strerror(errno);
     }
 }
 
@@ -86,12 +129,455 @@ void test_iomanager() {
     iom.schedule(test_io);
 }
 
+static const char BENCH_REQUEST[] = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+static const char BENCH_RESPONSE[] = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+
+/**
+ * @brief 在 fd 上读满 len 字节，读到 EOF 或出错时返回 false
+ */
+static bool read_full(int fd, char *buf, size_t len) {
+    size_t off = 0;
+    while(off < len) {
+        ssize_t n = read(fd, buf + off, len - off);
+        if(n <= 0) {
+            return false;
+        }
+        off += n;
+    }
+    return true;
+}
+
+/**
+ * @brief 长连接服务端协程：每收到一个完整请求回一个响应，读写都经过 hook
+ */
+static void bench_server(std::promise<int> *port) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if(bind(listen_fd, (sockaddr *)&addr, len) || listen(listen_fd, 1)
+            || getsockname(listen_fd, (sockaddr *)&addr, &len)) {
+        LOG_ERROR(g_logger) << "bench listen failed, errno=" << errno << " errstr=" << strerror(errno);
+        port->set_value(-1);
+        return;
+    }
+    port->set_value(ntohs(addr.sin_port));
+
+    int fd = accept(listen_fd, nullptr, nullptr);
+    close(listen_fd);
+    char buf[sizeof(BENCH_REQUEST) - 1];
+    while(read_full(fd, buf, sizeof(buf))) {
+        write(fd, BENCH_RESPONSE, sizeof(BENCH_RESPONSE) - 1);
+    }
+    close(fd);
+}
+
+/**
+ * @brief 统计一个长连接上每个请求的 epoll_ctl/epoll_wait 次数
+ * @details 客户端在主线程里用阻塞套接字一问一答，服务端在单线程 IOManager 的协程里，
+ *          每个请求的读都会先 EAGAIN 再等读事件。一次性注册模式每次等待都要 epoll_ctl
+ *          重新注册，持久注册模式只在第一次 EPOLL_CTL_ADD
+ * @param[in] persistent 是否开启 server.epoll_persistent
+ * @param[in] requests 请求数
+ */
+static void bench_syscalls_per_request(bool persistent, int requests) {
+    zch::Config::Lookup<bool>("server.epoll_persistent")->SetValue(persistent);
+    IOManager iom(1, false, "bench");
+    std::promise<int> port;
+    std::future<int> port_future = port.get_future();
+    iom.schedule(std::bind(&bench_server, &port));
+    int server_port = port_future.get();
+    if(server_port < 0) {
+        return;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, (sockaddr *)&addr, sizeof(addr))) {
+        LOG_ERROR(g_logger) << "bench connect failed, errno=" << errno << " errstr=" << strerror(errno);
+        close(fd);
+        return;
+    }
+
+    char buf[sizeof(BENCH_RESPONSE) - 1];
+    // 第一个请求包含首次注册，不计入
+    write(fd, BENCH_REQUEST, sizeof(BENCH_REQUEST) - 1);
+    read_full(fd, buf, sizeof(buf));
+
+    uint64_t ctl = s_epoll_ctl;
+    uint64_t wait = s_epoll_wait;
+    auto begin = std::chrono::steady_clock::now();
+    for(int i = 0; i < requests; ++i) {
+        write(fd, BENCH_REQUEST, sizeof(BENCH_REQUEST) - 1);
+        if(!read_full(fd, buf, sizeof(buf))) {
+            LOG_ERROR(g_logger) << "bench read response failed";
+            break;
+        }
+    }
+    double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+    ctl = s_epoll_ctl - ctl;
+    wait = s_epoll_wait - wait;
+    close(fd);
+
+    LOG_INFO(g_logger) << "epoll_persistent=" << persistent << ", " << requests << " requests"
+                       << ", epoll_ctl/request=" << (double)ctl / requests
+                       << ", epoll_wait/request=" << (double)wait / requests
+                       << ", us/request=" << elapsed / requests;
+}
+
+static uint64_t elapsed_ms(std::chrono::steady_clock::time_point begin) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count();
+}
+
+static const char *backend_name(IOManager::Backend backend) {
+    return backend == IOManager::IO_URING ? "io_uring" : "epoll";
+}
+
+/**
+ * @brief 创建一对 unix 套接字并交给 hook 管理（设置为非阻塞，读写经过 hook）
+ */
+static bool make_pair(int sv[2]) {
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+        return false;
+    }
+    FdMgr::GetInstance()->get(sv[0], true);
+    FdMgr::GetInstance()->get(sv[1], true);
+    return true;
+}
+
+/**
+ * @brief 在 IOManager 外关闭，清掉 FdCtx，免得 fd 号复用时拿到旧的超时设置
+ */
+static void close_fd(int fd) {
+    FdMgr::GetInstance()->del(fd);
+    close(fd);
+}
+
+/**
+ * @brief 一端先等在 recv 上，另一端稍后发送，收到后原样回复
+ */
+static void test_echo(IOManager::Backend backend) {
+    std::string name = backend_name(backend);
+    int sv[2];
+    if(!make_pair(sv)) {
+        check(false, name + ": socketpair");
+        return;
+    }
+    std::string reply;
+    {
+        IOManager iom(2, false, "echo", backend);
+        iom.schedule([&sv]() {
+            char buf[16];
+            ssize_t n = recv(sv[0], buf, sizeof(buf), 0);
+            if(n > 0) {
+                send(sv[0], buf, n, 0);
+            }
+        });
+        iom.schedule([&sv, &reply]() {
+            usleep(20 * 1000);
+            send(sv[1], "ping", 4, 0);
+            char buf[16];
+            ssize_t n = recv(sv[1], buf, sizeof(buf), 0);
+            if(n > 0) {
+                reply.assign(buf, n);
+            }
+        });
+    }
+    close_fd(sv[0]);
+    close_fd(sv[1]);
+    check(reply == "ping", name + ": parked recv is woken and the echo comes back");
+}
+
+/**
+ * @brief 发送缓冲区很小，1MB 的数据要分多次 send，对端稍后才开始读
+ */
+static void test_partial_write(IOManager::Backend backend) {
+    std::string name = backend_name(backend);
+    int sv[2];
+    if(!make_pair(sv)) {
+        check(false, name + ": socketpair");
+        return;
+    }
+    int sndbuf = 4096;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    std::string data(1024 * 1024, 0);
+    for(size_t i = 0; i < data.size(); ++i) {
+        data[i] = 'a' + (i * 7) % 26;
+    }
+    std::string received;
+    int partial = 0;
+    bool send_failed = false;
+    {
+        IOManager iom(2, false, "partial", backend);
+        iom.schedule([&]() {
+            size_t off = 0;
+            while(off < data.size()) {
+                ssize_t n = send(sv[0], data.data() + off, data.size() - off, 0);
+                if(n <= 0) {
+                    send_failed = true;
+                    break;
+                }
+                if((size_t)n < data.size() - off) {
+                    ++partial;
+                }
+                off += n;
+            }
+        });
+        iom.schedule([&]() {
+            usleep(20 * 1000);
+            char buf[64 * 1024];
+            while(received.size() < data.size()) {
+                ssize_t n = recv(sv[1], buf, sizeof(buf), 0);
+                if(n <= 0) {
+                    break;
+                }
+                received.append(buf, n);
+            }
+        });
+    }
+    close_fd(sv[0]);
+    close_fd(sv[1]);
+    LOG_INFO(g_logger) << name << ": partial sends=" << partial;
+    check(!send_failed && partial > 0, name + ": send returned short counts and the writer resumed");
+    check(received == data, name + ": all 1MB arrived in order");
+}
+
+/**
+ * @brief SO_RCVTIMEO：没有数据时 recv 到时间返回 ETIMEDOUT，数据先到时正常返回
+ */
+static void test_recv_timeout(IOManager::Backend backend) {
+    std::string name = backend_name(backend);
+    int sv[2];
+    if(!make_pair(sv)) {
+        check(false, name + ": socketpair");
+        return;
+    }
+    ssize_t timeout_rt = 0;
+    int timeout_errno = 0;
+    uint64_t timeout_ms = 0;
+    ssize_t data_rt = 0;
+    uint64_t data_ms = 0;
+    {
+        IOManager iom(2, false, "timeout", backend);
+        iom.schedule([&]() {
+            timeval tv = {0, 100 * 1000};
+            setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            char buf[16];
+            auto begin = std::chrono::steady_clock::now();
+            timeout_rt = recv(sv[0], buf, sizeof(buf), 0);
+            timeout_errno = errno;
+            timeout_ms = elapsed_ms(begin);
+
+            // 再等一次，这次 20ms 后对端发来数据
+            IOManager::GetThis()->schedule([&sv]() {
+                usleep(20 * 1000);
+                send(sv[1], "x", 1, 0);
+            });
+            begin = std::chrono::steady_clock::now();
+            data_rt = recv(sv[0], buf, sizeof(buf), 0);
+            data_ms = elapsed_ms(begin);
+        });
+    }
+    close_fd(sv[0]);
+    close_fd(sv[1]);
+    LOG_INFO(g_logger) << name << ": timed out after " << timeout_ms << "ms, data after " << data_ms << "ms";
+    check(timeout_rt == -1 && timeout_errno == ETIMEDOUT, name + ": recv without data fails with ETIMEDOUT");
+    check(timeout_ms >= 100 && timeout_ms < 1000, name + ": recv timed out no earlier than SO_RCVTIMEO");
+    check(data_rt == 1 && data_ms < 100, name + ": data arriving before SO_RCVTIMEO is returned");
+}
+
+/**
+ * @brief 一个协程等在 recv 上，另一个协程 close 这个 fd，recv 返回 EBADF
+ */
+static void test_close_cancel(IOManager::Backend backend) {
+    std::string name = backend_name(backend);
+    int sv[2];
+    if(!make_pair(sv)) {
+        check(false, name + ": socketpair");
+        return;
+    }
+    ssize_t rt = 0;
+    int err = 0;
+    {
+        IOManager iom(2, false, "close", backend);
+        iom.schedule([&]() {
+            char buf[16];
+            rt = recv(sv[0], buf, sizeof(buf), 0);
+            err = errno;
+        });
+        iom.schedule([&sv]() {
+            usleep(20 * 1000);
+            close(sv[0]);
+        });
+    }
+    close_fd(sv[1]);
+    LOG_INFO(g_logger) << name << ": recv after close returned " << rt << ", errno=" << strerror(err);
+    check(rt == -1 && err == EBADF, name + ": recv parked when another fiber closes the fd fails with EBADF");
+}
+
+/**
+ * @brief 4 个线程上的 hook 读写：每个客户端协程轮流做 echo、SO_RCVTIMEO 超时和 usleep，
+ *        每次让出后检查栈上的局部变量没有被改掉，超时和睡眠不会提前返回
+ * @details 开启共享栈时每个线程上的协程轮流占用几块共享栈，让出时栈内容被换出，恢复时换回，
+ *          协程只能回到创建它的线程；不开启时协程可能被别的线程窃取，在别的线程上恢复
+ */
+static void test_hooked_load(bool shared_stack) {
+    const int clients = 128;
+    const int rounds = 3;
+    // 客户端等待期间一直来回收发的连接，让线程之间不停地互相窃取和唤醒
+    const int busy = 64;
+    std::string name = shared_stack ? "shared stack" : "separate stacks";
+    zch::ConfigVar<bool>::ptr shared = zch::Config::Lookup<bool>("fiber.shared_stack");
+    bool old_shared = shared->GetValue();
+    shared->SetValue(shared_stack);
+
+    std::vector<int> fds((clients + busy) * 2);
+    for(int i = 0; i < clients + busy; ++i) {
+        if(!make_pair(&fds[i * 2])) {
+            check(false, name + ": socketpair");
+            shared->SetValue(old_shared);
+            return;
+        }
+    }
+    std::atomic<int> echo_ok(0), timeout_ok(0), early_timeout(0), early_sleep(0), corrupted(0), moved(0);
+    std::atomic<int> running(clients);
+    {
+        IOManager iom(4, false, "load", IOManager::EPOLL);
+        for(int i = 0; i < clients + busy; ++i) {
+            int server = fds[i * 2];
+            int client = fds[i * 2 + 1];
+            iom.schedule([server]() {
+                char buf[64];
+                ssize_t n;
+                while((n = recv(server, buf, sizeof(buf), 0)) > 0) {
+                    send(server, buf, n, 0);
+                }
+            });
+            if(i >= clients) {
+                iom.schedule([&running, client]() {
+                    char buf[64];
+                    while(running > 0 && send(client, "ping", 4, 0) == 4 && recv(client, buf, sizeof(buf), 0) > 0) {
+                    }
+                    shutdown(client, SHUT_WR);
+                });
+                continue;
+            }
+            iom.schedule([&, i, client]() {
+                timeval tv = {0, 100 * 1000};
+                setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                // 栈上的标记，每次让出回来都要保持原样
+                int canary[64];
+                for(int k = 0; k < 64; ++k) {
+                    canary[k] = i * 1000 + k;
+                }
+                int thread = GetThreadId();
+                auto intact = [&canary, i]() {
+                    for(int k = 0; k < 64; ++k) {
+                        if(canary[k] != i * 1000 + k) {
+                            return false;
+                        }
+                    }
+                    return true;
+                };
+                auto after_yield = [&]() {
+                    corrupted += !intact();
+                    moved += GetThreadId() != thread;
+                };
+                if(Fiber::GetThis()->isSharedStack() != shared_stack) {
+                    ++corrupted;
+                }
+                for(int r = 0; r < rounds; ++r) {
+                    std::string msg = "client " + std::to_string(i) + " round " + std::to_string(r);
+                    char buf[64];
+                    send(client, msg.data(), msg.size(), 0);
+                    ssize_t n = recv(client, buf, sizeof(buf), 0);
+                    if(n == (ssize_t)msg.size() && std::string(buf, n) == msg) {
+                        ++echo_ok;
+                    }
+                    after_yield();
+
+                    auto begin = std::chrono::steady_clock::now();
+                    n = recv(client, buf, sizeof(buf), 0);
+                    early_timeout += elapsed_ms(begin) < 100;
+                    if(n == -1 && errno == ETIMEDOUT) {
+                        ++timeout_ok;
+                    }
+                    after_yield();
+
+                    begin = std::chrono::steady_clock::now();
+                    usleep(50 * 1000);
+                    early_sleep += elapsed_ms(begin) < 50;
+                    after_yield();
+                }
+                shutdown(client, SHUT_WR);
+                --running;
+            });
+        }
+    }
+    for(int fd : fds) {
+        close_fd(fd);
+    }
+    shared->SetValue(old_shared);
+    LOG_INFO(g_logger) << name << ": echo_ok=" << echo_ok << " timeout_ok=" << timeout_ok
+                       << " early_timeout=" << early_timeout << " early_sleep=" << early_sleep
+                       << " corrupted=" << corrupted << " moved=" << moved;
+    check(echo_ok == clients * rounds, name + ": every echo came back intact");
+    check(timeout_ok == clients * rounds && early_timeout == 0, name + ": recv timed out no earlier than SO_RCVTIMEO");
+    check(early_sleep == 0, name + ": usleep did not wake early");
+    check(corrupted == 0, name + ": stack-local values survived every yield");
+    if(shared_stack) {
+        check(moved == 0, name + ": fibers were always resumed on their own thread");
+    }
+}
+
+/**
+ * @brief 同一组用例在 epoll 和 io_uring 后端上各跑一次，行为要一致
+ */
+static void test_backend(IOManager::Backend backend) {
+    test_echo(backend);
+    test_partial_write(backend);
+    test_recv_timeout(backend);
+    test_close_cancel(backend);
+}
+
+/**
+ * @brief iomanager_test            运行 test_iomanager 演示，再在 epoll 和 io_uring 后端上检查
+ *                                  hook 的读写：等待后唤醒、部分写、SO_RCVTIMEO、等待时被 close，
+ *                                  最后在 4 个线程上分别用独立栈和共享栈跑 echo、超时和睡眠
+ *        iomanager_test bench [N]  运行 epoll 系统调用统计，N 为请求数，默认 20000
+ */
 int main(int argc, char *argv[]) {
+    if(argc > 1 && strcmp(argv[1], "bench") == 0) {
+        int requests = argc > 2 ? atoi(argv[2]) : 20000;
+        bench_syscalls_per_request(false, requests);
+        bench_syscalls_per_request(true, requests);
+        return 0;
+    }
 
-    // 初始化日志系统 (加载配置文件)
-    zch::InitLogFromJson("/home/zch/Project/TinyWebserver/config/log_config.json");
-    
     test_iomanager();
 
-    return 0;
+    test_backend(IOManager::EPOLL);
+    test_hooked_load(false);
+    test_hooked_load(true);
+    bool uring;
+    {
+        IOManager probe(1, false, "probe", IOManager::IO_URING);
+        uring = probe.getBackend() == IOManager::IO_URING;
+    }
+    if(uring) {
+        uint64_t waits = s_epoll_wait;
+        test_backend(IOManager::IO_URING);
+        check(s_epoll_wait == waits, "io_uring: no epoll_wait was made");
+    } else {
+        LOG_WARN(g_logger) << "io_uring not supported by the kernel, skip the io_uring cases";
+    }
+
+    LOG_INFO(g_logger) << (s_failed ? "FAILED" : "PASSED");
+    return s_failed ? 1 : 0;
 }
@@ -0,0 +1,276 @@
+#include <unistd.h>
+#include <atomic>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "fake_mysql_server.h"
+#include "db/RegisterBatcher.h"
+#include "coroutine/iomanager.h"
+#include "base/config.h"
+#include "base/log.h"
+#include "base/mutex.h"
+
+static zch::Logger::ptr g_logger = LOG_ROOT();
+
+static bool s_failed = false;
+
+static void check(bool ok, const std::string &what) {
+    LOG_INFO(g_logger) << (ok ? "ok: " : "FAILED: ") << what;
+    if(!ok) {
+        s_failed = true;
+    }
+}
+
+/**
+ * @brief 假服务器上的 user 表，只认 RegisterBatcher 发出的几种 SQL
+ * @details 连接池只有一条连接，同一时刻只有一个事务，事务状态不区分连接：
+ *          - START TRANSACTION 之后的 INSERT 先记在事务里，COMMIT 时写入，ROLLBACK 时丢弃
+ *          - INSERT 任何一行重名时整条语句回 ER_DUP_ENTRY，一行也不写
+ *          - raceName：事务里的 INSERT 带上这个用户名时，模拟另一个实例抢先提交了它
+ *          - failCommit：下一次 COMMIT 回死锁错误
+ */
+class FakeUserTable {
+public:
+    typedef Mutex MutexType;
+
+    FakeUserTable() : m_inTxn(false), m_failCommit(false), m_commits(0), m_rollbacks(0) {}
+
+    FakeMysqlServer::Result handle(const std::string &sql, const std::vector<std::string> &params) {
+        MutexType::Lock lock(m_mutex);
+        if(sql == "START TRANSACTION") {
+            m_inTxn = true;
+            m_txnUsers.clear();
+        } else if(sql == "COMMIT") {
+            if(m_failCommit) {
+                m_failCommit = false;
+                return FakeMysqlServer::Result::Error(1213, "Deadlock found when trying to get lock");
+            }
+            m_users.insert(m_txnUsers.begin(), m_txnUsers.end());
+            m_txnUsers.clear();
+            m_inTxn = false;
+            ++m_commits;
+        } else if(sql == "ROLLBACK") {
+            m_txnUsers.clear();
+            m_inTxn = false;
+            ++m_rollbacks;
+        } else if(sql.compare(0, 7, "SELECT ") == 0) {
+            m_selectSizes.insert(params.size());
+            // 服务器对 IN 里重复的值只返回一行
+            std::set<std::string> names(params.begin(), params.end());
+            std::vector<std::string> rows;
+            for(auto &n : names) {
+                if(m_users.count(n) || m_txnUsers.count(n)) {
+                    rows.push_back(n);
+                }
+            }
+            return FakeMysqlServer::Result::Rows(rows);
+        } else if(sql.compare(0, 7, "INSERT ") == 0) {
+            m_insertSizes.insert(params.size() / 2);
+            std::set<std::string> names;
+            for(size_t i = 0; i < params.size(); i += 2) {
+                if(m_inTxn && params[i] == m_raceName) {
+                    m_users.insert(m_raceName);
+                    m_raceName.clear();
+                }
+                if(m_users.count(params[i]) || m_txnUsers.count(params[i]) || !names.insert(params[i]).second) {
+                    return FakeMysqlServer::Result::Error(1062, "Duplicate entry '" + params[i] + "' for key 'PRIMARY'");
+                }
+            }
+            (m_inTxn ? m_txnUsers : m_users).insert(names.begin(), names.end());
+            return FakeMysqlServer::Result::Ok(names.size());
+        }
+        return FakeMysqlServer::Result::Ok();
+    }
+
+    void addUser(const std::string &name) {
+        MutexType::Lock lock(m_mutex);
+        m_users.insert(name);
+    }
+
+    bool hasUser(const std::string &name) {
+        MutexType::Lock lock(m_mutex);
+        return m_users.count(name) > 0;
+    }
+
+    void setRaceName(const std::string &name) {
+        MutexType::Lock lock(m_mutex);
+        m_raceName = name;
+    }
+
+    void failNextCommit() {
+        MutexType::Lock lock(m_mutex);
+        m_failCommit = true;
+    }
+
+    int commits() {
+        MutexType::Lock lock(m_mutex);
+        return m_commits;
+    }
+
+    int rollbacks() {
+        MutexType::Lock lock(m_mutex);
+        return m_rollbacks;
+    }
+
+    /**
+     * @brief 执行过的 SELECT 的参数个数、INSERT 的行数是否都在 1/4/16/32 这几档里
+     */
+    bool sizesBounded() {
+        MutexType::Lock lock(m_mutex);
+        std::set<size_t> allowed = {1, 4, 16, 32};
+        for(size_t n : m_selectSizes) {
+            if(!allowed.count(n)) {
+                return false;
+            }
+        }
+        for(size_t n : m_insertSizes) {
+            if(!allowed.count(n)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    MutexType m_mutex;
+    std::set<std::string> m_users;
+    std::set<std::string> m_txnUsers;
+    bool m_inTxn;
+    std::string m_raceName;
+    bool m_failCommit;
+    int m_commits;
+    int m_rollbacks;
+    std::set<size_t> m_selectSizes;
+    std::set<size_t> m_insertSizes;
+};
+
+static FakeUserTable s_table;
+
+static std::atomic<size_t> s_done(0);
+
+static void register_one(const std::string &name, RegisterBatcher::Result *result) {
+    *result = RegisterBatcherMgr::GetInstance()->Register(name, "pwd");
+    ++s_done;
+}
+
+/**
+ * @brief 每个用户名一个协程同时注册，等全部返回
+ * @details 协程按顺序进入单线程 IOManager 的队列，排队的顺序就是 names 的顺序
+ */
+static std::vector<RegisterBatcher::Result> register_all(const std::vector<std::string> &names) {
+    std::vector<RegisterBatcher::Result> results(names.size(), RegisterBatcher::FAILED);
+    s_done = 0;
+    for(size_t i = 0; i < names.size(); ++i) {
+        IOManager::GetThis()->schedule(std::bind(&register_one, names[i], &results[i]));
+    }
+    while(s_done < names.size()) {
+        usleep(1000);
+    }
+    return results;
+}
+
+/**
+ * @brief 一批里有表中已存在的用户名和批内重名，在一个事务里提交
+ */
+static void test_duplicates() {
+    s_table.addUser("alice");
+    int commits = s_table.commits();
+    std::vector<RegisterBatcher::Result> r = register_all({"alice", "bob", "bob", "carol"});
+    check(r[0] == RegisterBatcher::DUPLICATE, "name already in the table is DUPLICATE");
+    check(r[1] == RegisterBatcher::SUCCESS, "first of two same names in a batch is SUCCESS");
+    check(r[2] == RegisterBatcher::DUPLICATE, "second of two same names in a batch is DUPLICATE");
+    check(r[3] == RegisterBatcher::SUCCESS, "new name is SUCCESS");
+    check(s_table.hasUser("bob") && s_table.hasUser("carol"), "new users were inserted");
+    check(s_table.commits() == commits + 1 && s_table.rollbacks() == 0, "batch was written in one transaction");
+}
+
+/**
+ * @brief 事务里的 INSERT 因为另一个实例抢先注册而失败，回滚后逐条插入
+ */
+static void test_insert_race() {
+    s_table.setRaceName("erin");
+    int rollbacks = s_table.rollbacks();
+    std::vector<RegisterBatcher::Result> r = register_all({"alice", "dave", "erin", "frank", "gina", "hank"});
+    check(s_table.rollbacks() == rollbacks + 1, "failed batch INSERT was rolled back");
+    check(r[0] == RegisterBatcher::DUPLICATE, "name found by the duplicate check stays DUPLICATE after rollback");
+    check(r[1] == RegisterBatcher::SUCCESS && r[3] == RegisterBatcher::SUCCESS
+          && r[4] == RegisterBatcher::SUCCESS && r[5] == RegisterBatcher::SUCCESS,
+          "other names succeed one by one");
+    check(r[2] == RegisterBatcher::DUPLICATE, "name taken by the racing insert is DUPLICATE");
+    check(s_table.hasUser("dave") && s_table.hasUser("hank"), "one-by-one inserts were written");
+}
+
+/**
+ * @brief COMMIT 失败，回滚后逐条插入
+ */
+static void test_commit_failure() {
+    s_table.failNextCommit();
+    int rollbacks = s_table.rollbacks();
+    std::vector<RegisterBatcher::Result> r = register_all({"ivan", "bob", "judy"});
+    check(s_table.rollbacks() == rollbacks + 1, "failed COMMIT was rolled back");
+    check(r[0] == RegisterBatcher::SUCCESS && r[2] == RegisterBatcher::SUCCESS, "names succeed one by one after COMMIT failed");
+    check(r[1] == RegisterBatcher::DUPLICATE, "existing name is DUPLICATE after COMMIT failed");
+    check(s_table.hasUser("ivan") && s_table.hasUser("judy"), "one-by-one inserts after COMMIT failure were written");
+}
+
+/**
+ * @brief 一批凑满 batch_size 立即写入，剩下的等窗口到期；SQL 只用固定的几档行数
+ */
+static void test_batch_sizes(FakeMysqlServer *server) {
+    std::vector<std::string> names;
+    for(int i = 0; i < 40; ++i) {
+        names.push_back("user" + std::to_string(i));
+    }
+    std::vector<RegisterBatcher::Result> r = register_all(names);
+    size_t success = 0;
+    for(auto v : r) {
+        success += v == RegisterBatcher::SUCCESS;
+    }
+    check(success == names.size(), "all 40 new names are SUCCESS");
+    check(s_table.hasUser("user0") && s_table.hasUser("user39"), "both batches were written");
+    check(s_table.sizesBounded(), "batch SQL only uses 1/4/16/32 rows");
+    LOG_INFO(g_logger) << "prepared statements on the connection: " << server->prepares();
+    check(server->prepares() <= 8, "at most 8 statements prepared on the connection");
+}
+
+static void run(FakeMysqlServer *server) {
+    test_duplicates();
+    test_insert_race();
+    test_commit_failure();
+    test_batch_sizes(server);
+}
+
+/**
+ * @brief 在单线程 IOManager 里让多个协程同时注册，经假 MySQL 服务器检查 RegisterBatcher
+ *        给每个等待的协程返回自己的结果：批内重名、表中已存在、INSERT 或 COMMIT 失败后
+ *        回滚并逐条插入；以及批量 SQL 只按固定的几档行数预处理
+ */
+int main(int argc, char *argv[]) {
+    FakeMysqlServer server;
+    server.setHandler(std::bind(&FakeUserTable::handle, &s_table, std::placeholders::_1, std::placeholders::_2));
+    if(!server.start()) {
+        return 1;
+    }
+
+    // 只有一条连接，事务不会交错
+    zch::Config::Lookup<std::string>("database.ip")->SetValue("127.0.0.1");
+    zch::Config::Lookup<uint16_t>("database.port")->SetValue(server.port());
+    zch::Config::Lookup<std::string>("database.user")->SetValue("test");
+    zch::Config::Lookup<size_t>("database.minsize")->SetValue(1);
+    zch::Config::Lookup<size_t>("database.maxsize")->SetValue(1);
+    zch::Config::Lookup<size_t>("database.shards")->SetValue(1);
+    zch::Config::Lookup<size_t>("database.warmup_size")->SetValue(1);
+    zch::Config::Lookup<size_t>("register.batch_size")->SetValue(32);
+    // 窗口足够长，同一轮注册的协程都能进同一批
+    zch::Config::Lookup<uint64_t>("register.batch_window")->SetValue(20);
+
+    {
+        IOManager iom(1, false, "register");
+        iom.schedule(std::bind(&run, &server));
+    }
+
+    LOG_INFO(g_logger) << "fake server connections=" << server.connections() << " queries=" << server.queries();
+    LOG_INFO(g_logger) << (s_failed ? "FAILED" : "PASSED");
+    return s_failed ? 1 : 0;
+}
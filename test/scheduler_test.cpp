@@ -1,13 +1,33 @@
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <string>
+#include <thread>
+
 #include "coroutine/fiber.h"
 #include "base/thread.h"
 #include "coroutine/scheduler.h"
-#include "zchlog.h"
+#include "coroutine/iomanager.h"
+#include "base/config.h"
+#include "base/log.h"
+
+static zch::Logger::ptr g_logger = LOG_ROOT();
+
+static bool s_failed = false;
+
+static void check(bool ok, const std::string &what) {
+    LOG_INFO(g_logger) << (ok ? "ok: " : "FAILED: ") << what;
+    if(!ok) {
+        s_failed = true;
+    }
+}
 
 /**
  * @brief 演示协程主动yield情况下应该如何操作
  */
 void test_fiber1() {
-    LOG_INFO() << "test_fiber1 begin";
+    LOG_INFO(g_logger) << "test_fiber1 begin";
   
     /**
      * 协程主动让出执行权，在yield之前，协程必须再次将自己添加到调度器任务队列中，
@@ -15,18 +35,18 @@ void test_fiber1() {
      */
     Scheduler::GetThis()->schedule(Fiber::GetThis());
 
-    LOG_INFO() << "before test_fiber1 yield";
+    LOG_INFO(g_logger) << "before test_fiber1 yield";
     Fiber::GetThis()->yield();
-    LOG_INFO() << "after test_fiber1 yield";
+    LOG_INFO(g_logger) << "after test_fiber1 yield";
 
-    LOG_INFO() << "test_fiber1 end";
+    LOG_INFO(g_logger) << "test_fiber1 end";
 }
 
 /**
  * @brief 演示协程睡眠对主程序的影响
  */
 void test_fiber2() {
-    LOG_INFO() << "test_fiber2 begin";
+    LOG_INFO(g_logger) << "test_fiber2 begin";
 
     /**
      * 一个线程同一时间只能有一个协程在运行，线程调度协程的本质就是按顺序执行任务队列里的协程
@@ -35,19 +55,19 @@ void test_fiber2() {
      */
     sleep(3);
 
-    LOG_INFO() << "test_fiber2 end";
+    LOG_INFO(g_logger) << "test_fiber2 end";
 }
 
 void test_fiber3() {
-    LOG_INFO() << "test_fiber3 begin";
-    LOG_INFO() << "test_fiber3 end";
+    LOG_INFO(g_logger) << "test_fiber3 begin";
+    LOG_INFO(g_logger) << "test_fiber3 end";
 }
 
 void test_fiber5() {
     static int count = 0;
 
-    LOG_INFO() << "test_fiber5 begin, i = " << count;
-    LOG_INFO() << "test_fiber5 end i = " << count;
+    LOG_INFO(g_logger) << "test_fiber5 begin, i = " << count;
+    LOG_INFO(g_logger) << "test_fiber5 end i = " << count;
 
     count++;
 }
@@ -56,21 +76,17 @@ void test_fiber5() {
  * @brief 演示指定执行线程的情况
  */
 void test_fiber4() {
-    LOG_INFO() << "test_fiber4 begin";
+    LOG_INFO(g_logger) << "test_fiber4 begin";
     
     for (int i = 0; i < 3; i++) {
         Scheduler::GetThis()->schedule(test_fiber5, GetThreadId());
     }
 
-    LOG_INFO() << "test_fiber4 end";
+    LOG_INFO(g_logger) << "test_fiber4 end";
 }
 
-int main() {
-
-    // 初始化日志系统 (加载配置文件)
-    zch::InitLogFromJson("/home/zch/Project/TinyWebserver/config/log_config.json");
-
-    LOG_INFO() << "main begin";
+void test_scheduler() {
+    LOG_INFO(g_logger) << "main begin";
 
     /** 
      * 只使用main函数线程进行协程调度，相当于先攒下一波协程，然后切换到调度器的run方法将这些协程
@@ -104,6 +120,144 @@ int main() {
      */
     sc.stop();
 
-    LOG_INFO() << "main end";
-    return 0;
+    LOG_INFO(g_logger) << "main end";
+}
+
+static std::atomic<uint64_t> s_bench_done(0);
+static uint64_t s_bench_total = 0;
+// 最后一个任务执行完时设置
+static std::promise<void> *s_bench_finish = nullptr;
+
+/**
+ * @brief 空任务，只计数，最后一个执行完时通知主线程
+ */
+static void bench_noop() {
+    if(s_bench_done.fetch_add(1, std::memory_order_relaxed) + 1 == s_bench_total) {
+        s_bench_finish->set_value();
+    }
+}
+
+/**
+ * @brief 基准测试的任务，做一点计算，避免只测到调度本身
+ */
+static void bench_task() {
+    volatile uint64_t x = 0;
+    for(int i = 0; i < 256; ++i) {
+        x += i;
+    }
+    bench_noop();
+}
+
+/**
+ * @brief 种子任务，在调度线程里再派生 fanout 个任务，派生的任务进入本线程的队列，
+ *        其它线程空闲时从这里窃取
+ */
+static void bench_seed(void (*task)(), int fanout) {
+    Scheduler *sc = Scheduler::GetThis();
+    for(int i = 0; i < fanout; ++i) {
+        sc->schedule(task);
+    }
+}
+
+/**
+ * @brief 调度线程数从 1 到 max_threads 的吞吐量
+ * @details 用 IOManager 而不是 Scheduler，Scheduler::idle 是忙等，会和调度线程抢 CPU。
+ *          主线程投递 seeds 个种子任务（走全局队列），每个种子在调度线程里派生 fanout 个任务，
+ *          计时到最后一个任务执行完为止，不包括 stop() 等待各线程退出的时间
+ */
+static void bench_scaling(size_t max_threads, int seeds, int fanout) {
+    for(size_t n = 1; n <= max_threads; ++n) {
+        s_bench_done = 0;
+        s_bench_total = (uint64_t)seeds * fanout;
+        std::promise<void> finish;
+        s_bench_finish = &finish;
+        double elapsed;
+        {
+            IOManager iom(n, false, "bench");
+            auto begin = std::chrono::steady_clock::now();
+            for(int i = 0; i < seeds; ++i) {
+                iom.schedule(std::bind(&bench_seed, &bench_task, fanout));
+            }
+            finish.get_future().wait();
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        }
+        LOG_INFO(g_logger) << "scaling threads=" << n << ", tasks=" << s_bench_total
+                           << ", elapsed=" << elapsed * 1000 << "ms"
+                           << ", tasks/s=" << (uint64_t)(s_bench_total / elapsed);
+    }
+}
+
+static uint64_t s_task_fiber_id = 0;
+static uint64_t s_next_cb_fiber_id = 0;
+
+static void record_cb_fiber() {
+    s_next_cb_fiber_id = Fiber::GetFiberId();
+}
+
+static void task_fiber_body() {
+    s_task_fiber_id = Fiber::GetFiberId();
+    Scheduler::GetThis()->schedule(&record_cb_fiber);
+}
+
+/**
+ * @brief 作为任务调度的协程执行完后，下一个回调任务是否复用了它
+ * @details 在 start 之前添加任务并放弃引用，协程执行完时调度器持有唯一的引用
+ * @param[in] run_in_scheduler 任务协程是否参与调度器调度
+ */
+static bool next_callback_reuses_task_fiber(bool run_in_scheduler) {
+    s_task_fiber_id = 0;
+    s_next_cb_fiber_id = 0;
+    Scheduler sc(1, false, "recycle");
+    Fiber::ptr fiber(new Fiber(&task_fiber_body, 0, run_in_scheduler));
+    sc.schedule(fiber);
+    fiber.reset();
+    sc.start();
+    sc.stop();
+    return s_task_fiber_id != 0 && s_task_fiber_id == s_next_cb_fiber_id;
+}
+
+/**
+ * @brief 调度器只回收参与调度器调度的协程，其它协程原样交还
+ */
+static void test_recycle_fiber() {
+    check(next_callback_reuses_task_fiber(true), "finished scheduler fiber is reused by the next callback");
+    check(!next_callback_reuses_task_fiber(false), "fiber not run in the scheduler is not pooled");
+}
+
+/**
+ * @brief 单个调度线程上每个回调任务的开销，对比开启和关闭回调协程池
+ * @details 任务是空函数，耗时基本都是调度和创建/复用协程；关闭协程池时每个任务都要新建
+ *          Fiber（栈仍然来自 fiber.stack_pool_size 的栈缓存）
+ * @param[in] pool_size fiber.task_pool_size，0 为关闭
+ */
+static void bench_task_overhead(uint32_t pool_size, int tasks) {
+    zch::Config::Lookup<uint32_t>("fiber.task_pool_size")->SetValue(pool_size);
+    s_bench_done = 0;
+    s_bench_total = tasks;
+    std::promise<void> finish;
+    s_bench_finish = &finish;
+    double elapsed;
+    {
+        IOManager iom(1, false, "bench");
+        auto begin = std::chrono::steady_clock::now();
+        iom.schedule(std::bind(&bench_seed, &bench_noop, tasks));
+        finish.get_future().wait();
+        elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+    }
+    LOG_INFO(g_logger) << "task_pool_size=" << pool_size << ", tasks=" << tasks
+                       << ", ns/task=" << elapsed / tasks;
+}
+
+int main(int argc, char *argv[]) {
+    test_scheduler();
+    test_recycle_fiber();
+
+    size_t max_threads = argc > 1 ? atoi(argv[1]) : std::max(std::thread::hardware_concurrency(), 1u);
+    bench_scaling(max_threads, 1000, 200);
+
+    bench_task_overhead(32, 200000);
+    bench_task_overhead(0, 200000);
+
+    LOG_INFO(g_logger) << (s_failed ? "FAILED" : "PASSED");
+    return s_failed ? 1 : 0;
 }
@@ -0,0 +1,216 @@
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "base/timer.h"
+#include "base/util.h"
+#include "base/log.h"
+
+static zch::Logger::ptr g_logger = LOG_ROOT();
+
+static bool s_failed = false;
+
+static void check(bool ok, const std::string &what) {
+    LOG_INFO(g_logger) << (ok ? "ok: " : "FAILED: ") << what;
+    if(!ok) {
+        s_failed = true;
+    }
+}
+
+// 假时钟，可执行文件里的定义优先于库里的 GetElapsedMS，时间轮的刻度完全由测试推进
+static uint64_t s_now = 10000003;
+
+uint64_t GetElapsedMS() {
+    return s_now;
+}
+
+class TestTimerManager : public TimerManager {
+public:
+    int inserted_at_front = 0;
+
+protected:
+    void onTimerInsertedAtFront() override {
+        ++inserted_at_front;
+    }
+};
+
+// 定时器名 -> 触发时的时间
+static std::map<std::string, uint64_t> s_fired;
+// 定时器名 -> 触发次数
+static std::map<std::string, int> s_count;
+
+static std::function<void()> record(const std::string &name) {
+    return [name]() {
+        s_fired[name] = s_now;
+        ++s_count[name];
+    };
+}
+
+/**
+ * @brief 时钟拨到 t，执行到期的回调
+ */
+static void advance_to(TimerManager &mgr, uint64_t t) {
+    s_now = t;
+    std::vector<std::function<void()>> cbs;
+    mgr.listExpiredCb(cbs);
+    for(auto &cb : cbs) {
+        cb();
+    }
+}
+
+/**
+ * @brief 在 start + delay - 1 时还没触发，在 start + delay 时正好触发
+ */
+static void check_fires_at(TimerManager &mgr, const std::string &name, uint64_t at) {
+    advance_to(mgr, at - 1);
+    bool early = s_fired.count(name) > 0;
+    advance_to(mgr, at);
+    check(!early && s_fired.count(name) && s_fired[name] == at,
+          name + " fires exactly at its expiry");
+}
+
+/**
+ * @brief 各层的定时器经过逐层 cascade 后都在精确的时间触发，getNextTimer 不晚于到期时间
+ * @details 第 0 层 256ms，第 1 层到 2^14ms，第 2 层到 2^20ms，第 3 层到 2^26ms，第 4 层到 2^32ms
+ */
+static void test_cascade() {
+    TestTimerManager mgr;
+    uint64_t start = s_now;
+    const uint64_t delays[] = {1, 255, 256, 300, 16383, 16384, 20000,
+                               (1ull << 20) + 7, (1ull << 26) + 3};
+    for(uint64_t d : delays) {
+        mgr.addTimer(d, record("cascade " + std::to_string(d)));
+    }
+    for(uint64_t d : delays) {
+        uint64_t next = mgr.getNextTimer();
+        check(next <= d - (s_now - start), "getNextTimer is not later than the " + std::to_string(d) + "ms timer");
+        check_fires_at(mgr, "cascade " + std::to_string(d), start + d);
+    }
+    check(!mgr.hasTimer(), "wheel is empty after all cascaded timers fired");
+}
+
+/**
+ * @brief 定时器在高层格子里时 cancel、reset、refresh
+ */
+static void test_cancel_reset_refresh() {
+    TestTimerManager mgr;
+    uint64_t start = s_now;
+
+    Timer::ptr cancelled = mgr.addTimer(20000, record("cancelled"));
+    Timer::ptr reset_now = mgr.addTimer(20000, record("reset from now"));
+    Timer::ptr reset_start = mgr.addTimer(20000, record("reset from start"));
+    Timer::ptr refreshed = mgr.addTimer(16500, record("refreshed"));
+
+    advance_to(mgr, start + 5000);
+    check(cancelled->cancel(), "cancel a level-2 timer");
+    check(!cancelled->cancel(), "second cancel returns false");
+    check(reset_now->reset(500, true), "reset a level-2 timer to 500ms from now");
+    check(reset_start->reset(30000, false), "reset a level-2 timer to 30000ms from its start");
+    check(refreshed->refresh(), "refresh a level-2 timer");
+
+    check_fires_at(mgr, "reset from now", start + 5500);
+    check_fires_at(mgr, "refreshed", start + 5000 + 16500);
+    check_fires_at(mgr, "reset from start", start + 30000);
+    advance_to(mgr, start + 40000);
+    check(s_count["cancelled"] == 0, "cancelled timer never fires");
+    check(!mgr.hasTimer(), "wheel is empty");
+    check(!reset_now->refresh() && !reset_now->reset(100, true), "fired one-shot timer cannot be refreshed or reset");
+}
+
+/**
+ * @brief 循环定时器每次从触发时间重新计时，第 1 层的循环定时器每一轮都要 cascade
+ */
+static void test_recurring() {
+    TestTimerManager mgr;
+    uint64_t start = s_now;
+    Timer::ptr fast = mgr.addTimer(100, record("recurring 100"), true);
+    Timer::ptr slow = mgr.addTimer(1000, record("recurring 1000"), true);
+
+    bool exact = true;
+    for(int i = 1; i <= 30; ++i) {
+        advance_to(mgr, start + i * 100);
+        exact = exact && s_count["recurring 100"] == i && s_fired["recurring 100"] == start + i * 100;
+    }
+    check(exact, "100ms recurring timer fired at every 100ms for 30 rounds");
+    check(s_count["recurring 1000"] == 3 && s_fired["recurring 1000"] == start + 3000,
+          "1000ms recurring timer fired at 1000/2000/3000ms");
+
+    check(slow->cancel(), "cancel the recurring timer");
+    for(int i = 31; i <= 50; ++i) {
+        advance_to(mgr, start + i * 100);
+    }
+    check(s_count["recurring 1000"] == 3, "cancelled recurring timer stops");
+    check(s_count["recurring 100"] == 50, "other recurring timer keeps going");
+    fast->cancel();
+    check(!mgr.hasTimer(), "wheel is empty");
+}
+
+/**
+ * @brief 时钟回退超过一小时，所有定时器都当作超时，之后新加的定时器正常工作
+ */
+static void test_clock_rollover() {
+    TestTimerManager mgr;
+    mgr.addTimer(10000, record("before rollover"));
+    mgr.addTimer(50000, record("before rollover far"));
+    uint64_t back = s_now - 2 * 60 * 60 * 1000;
+    advance_to(mgr, back);
+    check(s_fired.count("before rollover") && s_fired.count("before rollover far"),
+          "all timers fire when the clock goes back by two hours");
+    check(!mgr.hasTimer(), "wheel is empty after the rollover");
+
+    mgr.addTimer(50, record("after rollover"));
+    check_fires_at(mgr, "after rollover", back + 50);
+}
+
+/**
+ * @brief 超出时间轮范围(2^32ms)的定时器挂在最远的格子里，不会提前触发，可以取消
+ * @details 2^32 + 2^27 不截断的话会绕回到 2^27 附近的格子；真正到期要推进 2^32 个刻度，
+ *          这里不驱动到那一步
+ */
+static void test_overflow_clamp() {
+    TestTimerManager mgr;
+    uint64_t start = s_now;
+    Timer::ptr far = mgr.addTimer((1ull << 32) + (1ull << 27), record("far"));
+    uint64_t next = mgr.getNextTimer();
+    check(next >= (1ull << 32) - (1ull << 26) && next <= (1ull << 32),
+          "clamped timer waits in the last slot of the wheel, next=" + std::to_string(next));
+    mgr.addTimer((1ull << 26) + 11, record("level 4"));
+    check_fires_at(mgr, "level 4", start + (1ull << 26) + 11);
+    check(s_count["far"] == 0 && mgr.hasTimer(), "clamped timer has not fired after 2^26ms");
+    check(far->cancel() && !mgr.hasTimer(), "clamped timer can be cancelled");
+}
+
+/**
+ * @brief 比空闲线程等待的时间还早到期的定时器通知一次，getNextTimer 之前不重复通知
+ */
+static void test_inserted_at_front() {
+    TestTimerManager mgr;
+    mgr.addTimer(1000, record("front 1000"));
+    check(mgr.inserted_at_front == 1, "first timer notifies");
+    mgr.getNextTimer();
+    mgr.addTimer(2000, record("front 2000"));
+    check(mgr.inserted_at_front == 1, "later timer does not notify");
+    mgr.addTimer(500, record("front 500"));
+    mgr.addTimer(200, record("front 200"));
+    check(mgr.inserted_at_front == 2, "earlier timers notify once until getNextTimer");
+    mgr.getNextTimer();
+    mgr.addTimer(100, record("front 100"));
+    check(mgr.inserted_at_front == 3, "earlier timer notifies again after getNextTimer");
+}
+
+/**
+ * @brief 用假时钟检查分层时间轮：逐层 cascade 后精确触发，高层格子里的 cancel/reset/refresh，
+ *        循环定时器，时钟回退，超出范围的定时器，以及插到最前面时的通知
+ */
+int main(int argc, char *argv[]) {
+    test_cascade();
+    test_cancel_reset_refresh();
+    test_recurring();
+    test_clock_rollover();
+    test_overflow_clamp();
+    test_inserted_at_front();
+
+    LOG_INFO(g_logger) << (s_failed ? "FAILED" : "PASSED");
+    return s_failed ? 1 : 0;
+}
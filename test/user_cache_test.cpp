@@ -0,0 +1,235 @@
+#include <unistd.h>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "fake_mysql_server.h"
+#include "db/UserCache.h"
+#include "coroutine/iomanager.h"
+#include "base/config.h"
+#include "base/log.h"
+
+static zch::Logger::ptr g_logger = LOG_ROOT();
+
+static bool s_failed = false;
+
+static void check(bool ok, const std::string &what) {
+    LOG_INFO(g_logger) << (ok ? "ok: " : "FAILED: ") << what;
+    if(!ok) {
+        s_failed = true;
+    }
+}
+
+// 假服务器上 user 表里的用户名，LoadBloom 的 SELECT 返回它们
+static const std::vector<std::string> s_users = {"alice", "bob"};
+static std::atomic<int> s_bloomLoads(0);
+
+static FakeMysqlServer::Result handle(const std::string &sql, const std::vector<std::string> &params) {
+    if(sql == "SELECT username FROM user") {
+        ++s_bloomLoads;
+        return FakeMysqlServer::Result::Rows(s_users);
+    }
+    return FakeMysqlServer::Result::Ok();
+}
+
+/**
+ * @brief 按配置创建缓存，其它配置项保持默认
+ */
+static void configure(size_t capacity, size_t shards, uint64_t ttl, uint64_t negative_ttl, size_t bloom_bits) {
+    zch::Config::Lookup<size_t>("usercache.capacity")->SetValue(capacity);
+    zch::Config::Lookup<size_t>("usercache.shards")->SetValue(shards);
+    zch::Config::Lookup<uint64_t>("usercache.ttl")->SetValue(ttl);
+    zch::Config::Lookup<uint64_t>("usercache.negative_ttl")->SetValue(negative_ttl);
+    zch::Config::Lookup<size_t>("usercache.bloom_bits")->SetValue(bloom_bits);
+}
+
+/**
+ * @brief 找 n 个落在指定分片的用户名，和 UserCache 一样按 std::hash 取模分片
+ */
+static std::vector<std::string> names_in_shard(size_t shard, size_t shards, size_t n, const std::string &prefix) {
+    std::vector<std::string> names;
+    for(int i = 0; names.size() < n; ++i) {
+        std::string name = prefix + std::to_string(i);
+        if(std::hash<std::string>()(name) % shards == shard) {
+            names.push_back(name);
+        }
+    }
+    return names;
+}
+
+static UserCache::LookupResult lookup(UserCache &cache, const std::string &name, std::string &password) {
+    password.clear();
+    return cache.Lookup(name, password);
+}
+
+/**
+ * @brief 两个分片各 3 个条目，分片 0 写满后再写入淘汰分片 0 里最久没用的条目，分片 1 不受影响
+ * @details 总共只有 4 个条目，没到总容量 6，淘汰按分片进行
+ */
+static void test_lru() {
+    configure(6, 2, 60000, 5000, 0);
+    UserCache cache;
+    std::vector<std::string> a = names_in_shard(0, 2, 4, "a");
+    std::vector<std::string> b = names_in_shard(1, 2, 1, "b");
+    std::string pwd;
+
+    cache.PutUser(b[0], "pb");
+    cache.PutUser(a[0], "p0");
+    cache.PutUser(a[1], "p1");
+    cache.PutUser(a[2], "p2");
+    // 命中 a[0]，最久没用的变成 a[1]
+    check(lookup(cache, a[0], pwd) == UserCache::FOUND && pwd == "p0", "cached user is FOUND with its password");
+    cache.PutUser(a[3], "p3");
+
+    check(lookup(cache, a[1], pwd) == UserCache::MISS, "least recently used entry of the full shard was evicted");
+    check(lookup(cache, a[0], pwd) == UserCache::FOUND && lookup(cache, a[2], pwd) == UserCache::FOUND
+          && lookup(cache, a[3], pwd) == UserCache::FOUND, "recently used entries of the shard survived");
+    check(lookup(cache, b[0], pwd) == UserCache::FOUND && pwd == "pb", "entry in the other shard was not evicted");
+
+    // 覆盖已有条目不淘汰别的条目
+    cache.PutUser(a[0], "new");
+    check(lookup(cache, a[0], pwd) == UserCache::FOUND && pwd == "new", "overwritten entry returns the new password");
+    check(lookup(cache, a[2], pwd) == UserCache::FOUND && lookup(cache, a[3], pwd) == UserCache::FOUND,
+          "overwriting an entry evicted nothing");
+}
+
+/**
+ * @brief 正向条目 100ms、负向条目 50ms 过期，过期定时器注册在当前 IOManager 上
+ * @details 测试协程 usleep 返回时它的定时器已经触发了，IOManager 上剩下的定时器都是缓存的；
+ *          条目过期后定时器全部触发，重新写入的条目取消旧的定时器，按新的时间过期
+ */
+static void test_ttl() {
+    configure(100, 1, 100, 50, 0);
+    UserCache cache;
+    IOManager *iom = IOManager::GetThis();
+    std::string pwd;
+
+    check(!iom->hasTimer(), "no timer before anything is cached");
+    cache.PutUser("tina", "pt");
+    cache.PutMissing("ghost");
+    check(iom->hasTimer(), "cached entries registered expiry timers");
+    check(lookup(cache, "tina", pwd) == UserCache::FOUND && lookup(cache, "ghost", pwd) == UserCache::NOT_FOUND,
+          "fresh entries are hits");
+
+    usleep(70 * 1000);
+    check(lookup(cache, "ghost", pwd) == UserCache::MISS, "negative entry expired after negative_ttl");
+    check(lookup(cache, "tina", pwd) == UserCache::FOUND, "user entry is still cached before ttl");
+
+    usleep(60 * 1000);
+    check(!iom->hasTimer(), "expiry timers fired");
+    check(lookup(cache, "tina", pwd) == UserCache::MISS, "user entry expired after ttl");
+
+    // 60ms 时重新写入，旧定时器在 100ms 时不能删掉新条目
+    cache.PutUser("tina", "pt");
+    usleep(60 * 1000);
+    cache.PutUser("tina", "pt2");
+    usleep(60 * 1000);
+    check(lookup(cache, "tina", pwd) == UserCache::FOUND && pwd == "pt2", "refreshed entry outlives the old expiry");
+    usleep(80 * 1000);
+    check(!iom->hasTimer() && lookup(cache, "tina", pwd) == UserCache::MISS, "refreshed entry expired on its own timer");
+}
+
+/**
+ * @brief 不存在的用户名缓存为 NOT_FOUND，之后查到的用户覆盖它；negative_ttl 为 0 时不缓存
+ */
+static void test_negative() {
+    configure(100, 1, 60000, 5000, 0);
+    UserCache cache;
+    std::string pwd = "untouched";
+    cache.PutMissing("nobody");
+    check(cache.Lookup("nobody", pwd) == UserCache::NOT_FOUND && pwd == "untouched",
+          "missing user is NOT_FOUND and the password is not written");
+    cache.PutUser("nobody", "pn");
+    check(lookup(cache, "nobody", pwd) == UserCache::FOUND && pwd == "pn", "user found later replaces the negative entry");
+
+    configure(100, 1, 60000, 0, 0);
+    UserCache no_negative;
+    no_negative.PutMissing("nobody");
+    check(lookup(no_negative, "nobody", pwd) == UserCache::MISS, "negative_ttl 0 disables negative entries");
+}
+
+/**
+ * @brief 注册成功后该用户名的正向、负向条目都被删掉，过期定时器一并取消
+ */
+static void test_invalidate() {
+    configure(100, 1, 60000, 5000, 0);
+    UserCache cache;
+    IOManager *iom = IOManager::GetThis();
+    std::string pwd;
+
+    cache.PutMissing("newbie");
+    cache.PutUser("oldie", "po");
+    check(lookup(cache, "newbie", pwd) == UserCache::NOT_FOUND, "unregistered name is a negative entry");
+    cache.OnRegistered("newbie");
+    check(lookup(cache, "newbie", pwd) == UserCache::MISS, "OnRegistered dropped the negative entry");
+    cache.OnRegistered("oldie");
+    check(lookup(cache, "oldie", pwd) == UserCache::MISS, "OnRegistered dropped the user entry");
+    check(!iom->hasTimer(), "expiry timers of invalidated entries were cancelled");
+}
+
+/**
+ * @brief 加载前 MayExist 总是 true；LoadBloom 从数据库读所有用户名，之后只有表里的和新注册的可能存在
+ */
+static void test_bloom() {
+    configure(100, 1, 60000, 5000, 1 << 16);
+    UserCache cache;
+    check(cache.IsBloomEnabled(), "bloom filter is enabled");
+    check(cache.MayExist("alice") && cache.MayExist("zoe"), "every name may exist before the filter is loaded");
+
+    int loads = s_bloomLoads;
+    check(cache.LoadBloom(), "LoadBloom succeeded");
+    check(s_bloomLoads == loads + 1, "LoadBloom read the usernames from the database");
+    check(cache.MayExist("alice") && cache.MayExist("bob"), "names in the table may exist");
+    // 2 个用户名、65536 位、4 个哈希函数，误判的概率可以忽略
+    int absent = 0;
+    for(int i = 0; i < 100; ++i) {
+        absent += !cache.MayExist("free" + std::to_string(i));
+    }
+    check(absent == 100, "names not in the table do not exist, absent=" + std::to_string(absent));
+    check(!cache.MayExist("carol"), "carol is free before she registers");
+    cache.OnRegistered("carol");
+    check(cache.MayExist("carol"), "registered name is added to the filter");
+
+    configure(100, 1, 60000, 5000, 0);
+    UserCache no_bloom;
+    check(!no_bloom.IsBloomEnabled() && !no_bloom.LoadBloom() && no_bloom.MayExist("zoe"),
+          "bloom_bits 0 disables the filter and every name may exist");
+}
+
+static void run() {
+    test_lru();
+    test_ttl();
+    test_negative();
+    test_invalidate();
+    test_bloom();
+}
+
+/**
+ * @brief 在单线程 IOManager 的协程里检查 UserCache：按分片的 LRU 淘汰、IOManager 定时器驱动的
+ *        TTL 过期、负向条目、注册成功后失效，以及经假 MySQL 服务器加载 Bloom 过滤器前后的 MayExist
+ */
+int main(int argc, char *argv[]) {
+    FakeMysqlServer server;
+    server.setHandler(&handle);
+    if(!server.start()) {
+        return 1;
+    }
+
+    zch::Config::Lookup<std::string>("database.ip")->SetValue("127.0.0.1");
+    zch::Config::Lookup<uint16_t>("database.port")->SetValue(server.port());
+    zch::Config::Lookup<std::string>("database.user")->SetValue("test");
+    zch::Config::Lookup<size_t>("database.minsize")->SetValue(1);
+    zch::Config::Lookup<size_t>("database.maxsize")->SetValue(1);
+    zch::Config::Lookup<size_t>("database.shards")->SetValue(1);
+    zch::Config::Lookup<size_t>("database.warmup_size")->SetValue(1);
+
+    {
+        IOManager iom(1, false, "usercache");
+        iom.schedule(&run);
+    }
+
+    LOG_INFO(g_logger) << "fake server connections=" << server.connections() << " queries=" << server.queries();
+    LOG_INFO(g_logger) << (s_failed ? "FAILED" : "PASSED");
+    return s_failed ? 1 : 0;
+}